@@ -2,9 +2,12 @@
 #define ANTENNASIM_H
 
 #include <list>
+#include <vector>
+#include <atomic>
 #include <unistd.h>
 #include "exceptions.h"
 #include "DronePlotDB.h"
+#include "SimClock.h"
 
 // Simulates an antenna receiving drone information and populates the DronePlotDB class as it "receives"
 // information. 
@@ -14,7 +17,7 @@
 class AntennaSim 
 {
 public:
-   AntennaSim(DronePlotDB &dpdb, const char *source_filename, float time_mult,
+   AntennaSim(DronePlotDB &dpdb, const char *source_filename, SimClock &clock,
                int verbosity);
    virtual ~AntennaSim();
 
@@ -32,22 +35,28 @@ public:
 
 private:
    
+   // Sim seconds on the antenna's clock, which is the shared sim clock
    double getAdjustedTime();
 
+   // Sleeps until the sim time reaches sim_time, waking regularly to check for exit
+   void sleepUntil(double sim_time);
+
+   // Adds the due plots from the cursor on, in batches. Returns the number injected.
+   size_t injectDue(double adjusted_time);
+
    // Simulation checks periodically to know when to exit the thread
-   bool _exiting;
+   std::atomic<bool> _exiting;
 
    DronePlotDB &_to_db;
    DronePlotDB _source_db;
 
-   float _time_mult;
+   // The source plots in time order once the sim starts, and the next one to inject
+   std::vector<DronePlot> _injects;
+   size_t _next;
+
+   SimClock &_clock;
    int _time_offset;
    int _verbosity;
- 
-   time_t _start_time;
-
-   //testing 
-   std::string filenameH;
 };
 
 
@@ -0,0 +1,61 @@
+#ifndef BATCHCODEC_H
+#define BATCHCODEC_H
+
+#include <vector>
+#include <stdint.h>
+
+// Generic compression codecs a connection can negotiate, as capability bits
+#define CODEC_CAP_LZ4   0x1
+#define CODEC_CAP_ZSTD  0x2
+
+/*******************************************************************************************
+ * BatchCodec - encoding for replication data on the wire, in two independent layers:
+ *
+ *    encodePlots/decodePlots - a compact encoding of a plot batch. Plots in a batch tend to
+ *          share drone and node IDs and have nearby timestamps and positions, so each field
+ *          is stored as a column of zigzag varint deltas (IDs, timestamps) or varints of the
+ *          XOR with the previous value's bits (lat/lon). Encoded batches are self-describing,
+ *          so decodePlots passes the original raw format through untouched.
+ *
+ *          A raw batch is a 32 bit count, the serialized DronePlots and, optionally, a column
+ *          of the wall-clock ns each plot was injected at its origin (int64, 0 if unknown),
+ *          which receivers use to measure end-to-end replication latency.
+ *
+ *    compressFrame/decompressFrame - an optional LZ4 or zstd pass over a whole message.
+ *          Which libraries are available depends on the build, so each connection
+ *          advertises localCaps() in its handshake and uses what both ends support.
+ *
+ *******************************************************************************************/
+class BatchCodec
+{
+public:
+   // Converts a raw batch (count followed by serialized DronePlots) to the compact encoding
+   static void encodePlots(const std::vector<uint8_t> &raw, std::vector<uint8_t> &encoded);
+
+   // Converts a compact batch back to the raw format. Raw batches are copied as-is.
+   static void decodePlots(const std::vector<uint8_t> &encoded, std::vector<uint8_t> &raw);
+
+   // True if the buffer holds a compact batch
+   static bool isEncoded(const std::vector<uint8_t> &buf);
+
+   // The optional inject time column of a raw batch. hasInjectTimes checks that the batch is
+   // exactly the size it would be with the column; getInjectTime requires that it is.
+   static bool hasInjectTimes(const std::vector<uint8_t> &raw);
+   static void appendInjectTimes(std::vector<uint8_t> &raw, const std::vector<int64_t> &times);
+   static int64_t getInjectTime(const std::vector<uint8_t> &raw, uint32_t index);
+
+   // Capability bits for the compression libraries compiled into this build
+   static uint8_t localCaps();
+
+   // Picks the codec to use given the capabilities both ends share (0 = none)
+   static uint8_t pickCodec(uint8_t common_caps);
+
+   // Compresses with the given codec (0 = none). Output starts with the codec byte.
+   static void compressFrame(uint8_t codec, const std::vector<uint8_t> &in,
+                                                      std::vector<uint8_t> &out);
+
+   // Reverses compressFrame. Throws runtime_error on a corrupt or unsupported frame.
+   static void decompressFrame(const std::vector<uint8_t> &in, std::vector<uint8_t> &out);
+};
+
+#endif
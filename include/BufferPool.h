@@ -0,0 +1,30 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <vector>
+#include <stdint.h>
+
+/*******************************************************************************************
+ * BufferPool - keeps byte buffers that are done with so the next message can reuse their
+ *              storage. A replication batch passes through a queue element, a connection's
+ *              output buffer and, on the far side, an input buffer every cycle, and batches
+ *              are about the same size from one cycle to the next, so recycling the storage
+ *              saves allocating (and touching) it fresh each time. Thread-safe. Only a limited
+ *              number of buffers are kept, and none over max_buffer_bytes.
+ *
+ *******************************************************************************************/
+class BufferPool
+{
+public:
+   // Replaces buf with an empty buffer holding at least min_capacity bytes of storage, from
+   // the pool if it has one
+   static void take(std::vector<uint8_t> &buf, size_t min_capacity = 0);
+
+   // Hands buf's storage to the pool. buf is left empty.
+   static void give(std::vector<uint8_t> &buf);
+
+   static const size_t max_buffers = 64;
+   static const size_t max_buffer_bytes = 4 * 1024 * 1024;
+};
+
+#endif
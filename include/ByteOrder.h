@@ -0,0 +1,26 @@
+#ifndef BYTEORDER_H
+#define BYTEORDER_H
+
+#include <vector>
+#include <stdint.h>
+
+/*******************************************************************************************
+ * putLE/getLE - little-endian integers of 1-8 bytes, for the on-disk formats (archives,
+ *               trace files) so they read the same on any host. Reads go through bytes
+ *               rather than casts since the data is usually a mapped file with no alignment
+ *               guarantees.
+ *
+ *******************************************************************************************/
+inline void putLE(std::vector<uint8_t> &buf, uint64_t val, unsigned int bytes) {
+   for (unsigned int i=0; i<bytes; i++)
+      buf.push_back(static_cast<uint8_t>(val >> (8 * i)));
+}
+
+inline uint64_t getLE(const uint8_t *buf, unsigned int bytes) {
+   uint64_t val = 0;
+   for (unsigned int i=0; i<bytes; i++)
+      val |= static_cast<uint64_t>(buf[i]) << (8 * i);
+   return val;
+}
+
+#endif
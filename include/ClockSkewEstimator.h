@@ -0,0 +1,82 @@
+#ifndef CLOCKSKEWESTIMATOR_H
+#define CLOCKSKEWESTIMATOR_H
+
+#include <map>
+#include <vector>
+#include <utility>
+#include <stdint.h>
+#include <time.h>
+
+/***************************************************************************************
+ * ClockSkewEstimator - keeps an online estimate of the clock offset between any number
+ *              of antenna nodes. Each time the same plot is seen by two different nodes,
+ *              the difference between their timestamps is fed in as a sample. Each pair of
+ *              nodes keeps a sliding window of samples and uses the median as its offset.
+ *
+ *              Node corrections are derived from the pairwise medians relative to a
+ *              reference node (the lowest node ID seen), so every server arrives at the
+ *              same corrections. Lookups are O(1) on a table indexed by node ID.
+ *
+ ***************************************************************************************/
+class ClockSkewEstimator
+{
+public:
+   ClockSkewEstimator(unsigned int window = 31);
+   virtual ~ClockSkewEstimator();
+
+   // Record that node_a stamped a plot at ts_a and node_b stamped the same plot at ts_b
+   void addSample(unsigned int node_a, time_t ts_a, unsigned int node_b, time_t ts_b);
+
+   // True if this node's offset to the reference node is known
+   bool hasCorrection(unsigned int node_id) const {
+      return (node_id < _known.size()) && _known[node_id]; };
+
+   // Seconds to add to a node's raw timestamp to put it on the reference clock (0 if unknown)
+   int getCorrection(unsigned int node_id) const {
+      return hasCorrection(node_id) ? _corrections[node_id] : 0; };
+
+   time_t correct(unsigned int node_id, time_t timestamp) const {
+      return timestamp + getCorrection(node_id); };
+
+   // Node all corrections are relative to, or 0 if no samples have arrived yet
+   unsigned int getRefNode() const { return _ref_node; };
+
+   // Incremented any time one or more node corrections change
+   unsigned long getGeneration() const { return _generation; };
+
+   // Number of nodes with a known correction (including the reference)
+   unsigned int getNumKnown() const;
+
+   // Writes the current pairwise and per-node estimates to stdout
+   void dumpEstimates() const;
+
+   // Sample windows to persist across restarts. loadState returns false if state is malformed.
+   void saveState(std::vector<uint8_t> &state) const;
+   bool loadState(const std::vector<uint8_t> &state);
+
+private:
+
+   // Walks the pair graph from the reference node, recomputing every node's correction
+   void recalcCorrections();
+
+   // Sliding window of offset samples for one pair of nodes (offset = ts_hi - ts_lo)
+   struct pair_stats {
+      std::vector<int> samples;
+      unsigned int next = 0;
+      int median = 0;
+   };
+
+   unsigned int _window;
+
+   // Keyed by (lower node ID, higher node ID)
+   std::map<std::pair<unsigned int, unsigned int>, pair_stats> _pairs;
+
+   // Indexed by node ID
+   std::vector<int> _corrections;
+   std::vector<bool> _known;
+
+   unsigned int _ref_node;
+   unsigned long _generation;
+};
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef DISSEMINATION_H
+#define DISSEMINATION_H
+
+#include <vector>
+#include <random>
+#include "NodeRegistry.h"
+
+// How replication batches spread through the cluster
+enum topology_type {topo_mesh, topo_tree, topo_gossip};
+
+/*******************************************************************************************
+ * Disseminator - decides which peers a node hands a replication batch to. QueueMgr calls
+ *                getTargets both when this node originates a batch (from == self) and the
+ *                first time it receives someone else's batch, so a topology can forward
+ *                batches on behalf of other nodes. Batches are never forwarded twice since
+ *                QueueMgr drops batches it has already seen.
+ *
+ *******************************************************************************************/
+class Disseminator
+{
+public:
+   virtual ~Disseminator();
+
+   // Fills targets with the nodes to pass this batch to
+   virtual void getTargets(node_handle self, node_handle origin, node_handle from,
+                           unsigned int num_nodes, std::vector<node_handle> &targets) = 0;
+
+   // True if the topology needs periodic digests exchanged to repair missed batches
+   virtual bool usesPull() { return false; };
+
+   // Picks the peer to send the next digest to (only asked when usesPull is true)
+   virtual node_handle getPullPeer(node_handle self, unsigned int num_nodes) {
+      return (self + 1) % num_nodes; };
+
+   // Creates the disseminator for a topology. A seed of 0 seeds any random choices from the
+   // clock, anything else makes them repeat from run to run.
+   static Disseminator *create(topology_type topology, unsigned int fanout,
+                               unsigned long seed = 0);
+
+   // Converts "mesh", "tree" or "gossip" to a topology, returning false if unknown
+   static bool parseTopology(const char *name, topology_type &topology);
+};
+
+// Full mesh - the origin sends to every other node, nobody forwards (original behavior)
+class MeshDisseminator : public Disseminator
+{
+public:
+   virtual void getTargets(node_handle self, node_handle origin, node_handle from,
+                           unsigned int num_nodes, std::vector<node_handle> &targets);
+};
+
+// Spanning tree - a fanout-ary tree rooted at the origin, over the nodes in handle order
+// rotated so the origin is first. Each node sends to at most fanout children.
+class TreeDisseminator : public Disseminator
+{
+public:
+   TreeDisseminator(unsigned int fanout);
+
+   virtual void getTargets(node_handle self, node_handle origin, node_handle from,
+                           unsigned int num_nodes, std::vector<node_handle> &targets);
+
+private:
+   unsigned int _fanout;
+};
+
+// Push-pull gossip - on first sight of a batch, push it to fanout random peers. Digests sent
+// to a random peer now and then pull in anything the pushes missed.
+class GossipDisseminator : public Disseminator
+{
+public:
+   GossipDisseminator(unsigned int fanout, unsigned long seed = 0);
+
+   virtual void getTargets(node_handle self, node_handle origin, node_handle from,
+                           unsigned int num_nodes, std::vector<node_handle> &targets);
+
+   virtual bool usesPull() { return true; };
+   virtual node_handle getPullPeer(node_handle self, unsigned int num_nodes);
+
+private:
+   unsigned int _fanout;
+
+   std::default_random_engine _rndgen;
+};
+
+#endif
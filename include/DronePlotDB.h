@@ -3,9 +3,17 @@
 
 #include <list>
 #include <vector>
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <limits>
+#include <memory>
 #include <unistd.h>
 #include <pthread.h>
 #include "exceptions.h"
+#include "WriteAheadLog.h"
+#include "GeoIndex.h"
+#include "PoolAllocator.h"
 
 
 // Flags for the DronePlot object. The first two are already coded in and
@@ -18,45 +26,62 @@
 #define DBFLAG_USER3    0x16  // Change as needed
 #define DBFLAG_USER4    0x32
 
-// Manages the drone plot database for a particular node.
+// Tags for the blobs kept with setMeta/getMeta
+#define DBMETA_QUEUE    1     // QueueMgr sequence and seen-batch state
+#define DBMETA_SKEW     2     // ClockSkewEstimator sample windows
+#define DBMETA_SIMCLOCK 3     // AntennaSim's clock offset
+
+// Manages the drone plot database for a particular node. Kept small and without a vtable
+// since the database holds millions of them: 24 bytes, 40 with its list node.
 class DronePlot
 {
 public:
    DronePlot();
    DronePlot(int in_droneid, int in_nodeid, int in_timestamp, float in_latitude, float in_longitude);
-   virtual ~DronePlot();
 
    // Function to serialize, or convert this data into a binary stream in a vector class and back
    void serialize(std::vector<uint8_t> &buf);
-   void deserialize(std::vector<uint8_t> &buf, unsigned int start_pt = 0);
+   void deserialize(const std::vector<uint8_t> &buf, unsigned int start_pt = 0);
+   void deserialize(const uint8_t *buf);   // buf must hold getDataSize() bytes
 
    // Reads and writes this plot to/from a buffer in comma-separated format
    int readCSV(std::string &buf);
+   int readCSV(const char *buf, size_t len);
    void writeCSV(std::string &buf);
+   char *writeCSV(char *buf);
+
+   // Most chars writeCSV(char *) can write for one plot
+   static const size_t max_csv_row = 128;
 
    static size_t getDataSize();   // Num of bytes required to store the data (for serialization)
+
+   // Whether a file or wire timestamp fits the 32 bits kept in memory
+   static bool fitsTimestamp(int64_t timestamp) {
+      return (timestamp >= std::numeric_limits<int32_t>::min()) &&
+             (timestamp <= std::numeric_limits<int32_t>::max()); };
   
    // Flag manipulation -- pass in a define above as in setFlags(DBFLAG_NEW); 
    void setFlags(unsigned short flags);
    void clrFlags(unsigned short flags);
    bool isFlagSet(unsigned short flags); 
+   unsigned short getFlags() const { return _flags; };
 
-   // attributes - freely accessible to modify as needed 
+   // attributes - freely accessible to modify as needed. timestamp is seconds, 32 bits wide
+   // in memory (simulation times or epoch times to 2038); files and the wire carry 64.
    unsigned int drone_id;
    unsigned int node_id;
-   time_t timestamp;
+   int32_t timestamp;
    float latitude;
    float longitude;
 
-   //tracker variables to used to searching database
-   bool adjusted = false;
-   bool checked = false;
-   
 private:
    unsigned short _flags;
 
 };
 
+// The database's storage. Nodes come from a pool since rows are added and evicted constantly.
+typedef std::list<DronePlot, PoolAllocator<DronePlot>> plot_list;
+
 
 /**************************************************************************************************
  * DronePlotDB - class to manage a database of DronePlot objects, which manage drone GPS plots that
@@ -69,42 +94,228 @@ public:
    DronePlotDB();
    virtual ~DronePlotDB();
 
-   // Add a plot to the database with the given attributes (mutex'd)
-   void addPlot(int drone_id, int node_id, time_t timestamp, float lattitude, float longitude);
+   // Add a plot to the database with the given attributes and flags (mutex'd). inject_ns is
+   // the wall-clock ns the plot arrived, if it should be tracked for replication latency.
+   // Throws plotdata_error if the timestamp won't fit in 32 bits.
+   void addPlot(int drone_id, int node_id, time_t timestamp, float lattitude, float longitude,
+                                          unsigned short flags = 0, int64_t inject_ns = 0);
 
-   // Load or write the database to/from a CSV file, 
-   int loadCSVFile(const char *filename);
+   // Adds count plots under one lock (mutex'd), each with the given flags and inject time
+   void addPlots(const DronePlot *plots, size_t count, unsigned short flags = 0,
+                                                                  int64_t inject_ns = 0);
+
+   // Hands over the inject times given to addPlot for rows and forgets them (mutex'd, once
+   // for all of them), appending one per row to times--0 where there was none. The times are
+   // kept beside the rows rather than in them, and only until taken, so rows should be taken
+   // once they've been picked up.
+   void takeInjectTimes(const std::vector<plot_list::iterator> &rows, std::vector<int64_t> &times);
+
+   // Load or write the database to/from a CSV file. Large files are parsed by num_threads
+   // threads (0 = one per core)
+   int loadCSVFile(const char *filename, unsigned int num_threads = 0);
    int writeCSVFile(const char *filename);
 
-   // Direct binary load/write to/from the specified file
-   int loadBinaryFile(const char *filename);
-   int writeBinaryFile(const char *filename);
+   // Direct binary load/write to/from the specified file. Large files are decoded by
+   // num_threads threads (0 = one per core). Files are written as an indexed PlotArchive
+   // unless legacy is set; either kind loads.
+   int loadBinaryFile(const char *filename, unsigned int num_threads = 0);
+   int writeBinaryFile(const char *filename, bool legacy = false);
+
+   // Loads only the plots with t0 <= timestamp <= t1 from a drone (any drone if -1). For an
+   // archive, only the blocks its index says can match are read.
+   int loadBinaryRange(const char *filename, time_t t0, time_t t1, int drone_id = -1);
    
    // Sort the database in order of timestamp 
    void sortByTime();
 
-   // Remove all plotpoints of a particular node (used to generate binary, not for student use)
+   // Remove all plotpoints of a particular node, or of every node but one (used to generate binary)
    void removeNodeID(unsigned int node_id);
+   void keepNodeID(unsigned int node_id);
 
    // Iterators for simple access to the database. Can use these to modify drone plot points
    // but won't be able to add/delete PlotObjects. Use erase (below) for that as it is mutex'd
-   std::list<DronePlot>::iterator begin() { return _dbdata.begin(); };
-   std::list<DronePlot>::iterator end() { return _dbdata.end(); };
+   plot_list::iterator begin() { return _dbdata.begin(); };
+   plot_list::iterator end() { return _dbdata.end(); };
    
    // Manipulate database entries (mutex'd functions)
    void popFront();
    void erase(unsigned int i);
-   std::list<DronePlot>::iterator erase(std::list<DronePlot>::iterator dptr);
+   plot_list::iterator erase(plot_list::iterator dptr);
 
 
    // Return the number of plot points stored
    size_t size() { return _dbdata.size(); };
 
+   // Indexed queries (mutex'd). The range queries return the matching rows in timestamp order
+   // as iterators into the database rather than copies--they stay valid until the row is
+   // erased, like any other iterator. The indexes are built on the first query and from then
+   // on kept up to date by the mutex'd functions, so rows must not be retimed directly
+   // through an iterator once a query has been made.
+   std::vector<plot_list::iterator> plotsInTimeRange(time_t t0, time_t t1);
+   std::vector<plot_list::iterator> plotsForDrone(unsigned int drone_id,
+                        time_t t0 = std::numeric_limits<time_t>::min(),
+                        time_t t1 = std::numeric_limits<time_t>::max());
+
+   // Each drone's latest plot, as a snapshot that is republished whenever a mutex'd change
+   // moves a drone's latest. Reading it doesn't take the mutex (except the very first time,
+   // to build the indexes), so it never waits on ingest, and a snapshot never changes once
+   // handed out. latestPlot copies out one drone's plot and returns false if there is none.
+   typedef std::unordered_map<unsigned int, DronePlot> latest_map;
+   std::shared_ptr<const latest_map> latestPositions();
+   bool latestPlot(unsigned int drone_id, DronePlot &plot);
+
+   // While a latest_batch is alive, single-row changes (addPlot, setTimestamp, erase...) only
+   // update the working table, and the snapshot is republished once when the last batch ends
+   // instead of copied for every row. Batches may nest.
+   class latest_batch {
+   public:
+      latest_batch(DronePlotDB &db):_db(db) { _db.holdLatest(); };
+      ~latest_batch() { _db.releaseLatest(); };
+   private:
+      DronePlotDB &_db;
+   };
+   void holdLatest();
+   void releaseLatest();
+
+   // Spatial queries over every plot in a time window (mutex'd), returned as iterators like the
+   // range queries. Boxes with lon0 > lon1 cross the antimeridian; radii are in meters. Only
+   // nearestPlots orders its results, nearest first.
+   std::vector<plot_list::iterator> plotsInBox(double lat0, double lon0, double lat1,
+                        double lon1, time_t t0 = std::numeric_limits<time_t>::min(),
+                        time_t t1 = std::numeric_limits<time_t>::max());
+   std::vector<plot_list::iterator> plotsInRadius(double lat, double lon,
+                        double radius_m, time_t t0 = std::numeric_limits<time_t>::min(),
+                        time_t t1 = std::numeric_limits<time_t>::max());
+   std::vector<plot_list::iterator> nearestPlots(double lat, double lon, size_t k,
+                        time_t t0 = std::numeric_limits<time_t>::min(),
+                        time_t t1 = std::numeric_limits<time_t>::max());
+
+   // The same over each drone's latest plot only--where the drones are now. These copy out
+   // the plots, like latestPlot.
+   std::vector<DronePlot> latestInBox(double lat0, double lon0, double lat1, double lon1);
+   std::vector<DronePlot> latestInRadius(double lat, double lon, double radius_m);
+   std::vector<DronePlot> nearestDrones(double lat, double lon, size_t k);
+
    // Wipe the database
    void clear();
 
+   // Bounded retention: enforceRetention evicts rows more than max_age seconds older than the
+   // newest row and, past max_rows, the oldest rows (0 = no limit for either). Rows are kept
+   // in time segments once a policy is set and evicted a whole segment at a time, so a row may
+   // outlive max_age by up to a segment and max_rows may leave up to a segment fewer. Rows
+   // still flagged DBFLAG_NEW are kept. If archive_dir is given, evicted rows are written there
+   // as a PlotArchive before they are dropped. Throws runtime_error if archive_dir can't be
+   // created.
+   void setRetention(time_t max_age, size_t max_rows, const char *archive_dir = NULL);
+
+   // Applies the retention policy (mutex'd, but the archive is written after unlocking).
+   // cutoff gets the timestamp rows were evicted below. Returns the number of rows evicted.
+   size_t enforceRetention(time_t &cutoff);
+
+   // Changes to a stored plot that must be logged when a write-ahead log is open (mutex'd).
+   // Editing through the iterators directly still works but won't survive a restart.
+   // setTimestamp throws plotdata_error if the timestamp won't fit in 32 bits.
+   void setTimestamp(plot_list::iterator dptr, time_t timestamp);
+   void clrFlags(plot_list::iterator dptr, unsigned short flags);
+
+   // Adds delta to the timestamp of every plot from node_id not flagged DBFLAG_NEW (mutex'd).
+   // getNodeShifts returns the total of all shifts applied to each node so far.
+   void shiftNodeTimes(unsigned int node_id, time_t delta);
+   std::map<unsigned int, time_t> getNodeShifts();
+
+   // Makes the database persistent: recovers it from the snapshot and log in dir, then logs
+   // every change made through the mutex'd functions. The database must be empty.
+   // Returns the number of plots recovered. Throws walfile_error on failure.
+   size_t openWAL(const char *dir);
+
+   // Writes a snapshot so the log can be trimmed. checkpointIfDue only does so once the log
+   // has outgrown the last snapshot.
+   void checkpoint();
+   bool checkpointIfDue();
+
+   // Waits until every change so far is on disk, rather than the next group commit
+   void syncWAL();
+
+   // Checkpoints and closes the log. Changes after this are no longer persisted.
+   void closeWAL();
+
+   bool hasWAL() { return _wal != nullptr; };
+
+   // Small blobs the owner wants persisted with the database, such as replication state.
+   // Kept in memory and logged like any other change.
+   void setMeta(uint8_t tag, const std::vector<uint8_t> &data);
+   bool getMeta(uint8_t tag, std::vector<uint8_t> &data);
+
 private:
-   std::list<DronePlot> _dbdata;
+   typedef std::multimap<time_t, plot_list::iterator> time_index;
+
+   // Splices loaded plots onto the end, logging them (caller holds _mutex)
+   void appendPlots(plot_list &plots);
+
+   // Query index upkeep (caller holds _mutex). Rows must be unindexed before their timestamp
+   // changes or they are erased, and indexed again after.
+   void buildIndexes();
+   void clearIndexes();
+
+   // Refreshes a drone's entry in the working latest table / publishes the table as the new
+   // snapshot if anything changed (caller holds _mutex)
+   void updateLatest(unsigned int drone_id);
+   void publishLatest();
+   void indexPlot(plot_list::iterator dptr);
+   void unindexPlot(plot_list::iterator dptr);
+
+   // Retention segment upkeep (caller holds _mutex). Rows must be unplaced before their
+   // timestamp or DBFLAG_NEW changes or they are erased, and placed again after.
+   void buildSegments();
+   void clearSegments();
+   void placeRow(plot_list::iterator dptr);
+   void unplaceRow(plot_list::iterator dptr);
+
+   // Log and snapshot encoding (caller holds _mutex)
+   void logRecord(std::vector<uint8_t> &rec);
+   void logPlot(uint8_t op, const DronePlot &plot, const uint8_t *extra = NULL, size_t extra_len = 0);
+   void buildSnapshot(std::vector<uint8_t> &body);
+   void loadSnapshot(const std::vector<uint8_t> &body);
+
+   plot_list _dbdata;
+
+   std::unique_ptr<WriteAheadLog> _wal;
+   std::map<uint8_t, std::vector<uint8_t>> _meta;
+   std::map<unsigned int, time_t> _node_shifts;
+
+   // Inject times of rows not yet taken, by row. Every path that removes a row drops its
+   // entry too (forgetInjectTime, caller holds _mutex), since the pool hands the address on
+   // to the next row allocated.
+   std::unordered_map<const DronePlot *, int64_t> _inject_times;
+   void forgetInjectTime(const DronePlot &plot) {
+      if (!_inject_times.empty()) _inject_times.erase(&plot); };
+
+   bool _indexed = false;
+   time_index _by_time;
+   std::unordered_map<unsigned int, time_index> _by_drone;
+   GeoIndex _geo;                // Every row
+   GeoIndex _latest_geo;         // Each drone's latest row
+
+   // Once a retention policy is set, rows are grouped into time segments, in time order, each
+   // a run of _dbdata starting at first. Rows still flagged DBFLAG_NEW haven't been placed and
+   // wait after every segment, from _first_new on.
+   struct time_segment {
+      plot_list::iterator first;
+      size_t rows;
+   };
+   bool _segmented = false;
+   std::map<time_t, time_segment> _segments;    // By segment start time
+   plot_list::iterator _first_new = _dbdata.end();
+   time_t _newest = std::numeric_limits<time_t>::min();    // Newest placed since the last build
+
+   latest_map _latest;
+   bool _latest_changed = false;
+   unsigned int _latest_holds = 0;
+   std::shared_ptr<const latest_map> _latest_view;    // Only touched with std::atomic_load/store
+
+   time_t _max_age = 0;
+   size_t _max_rows = 0;
+   std::string _archive_dir;
 
    pthread_mutex_t _mutex; 
 };
@@ -144,8 +144,8 @@ public:
    ~SocketFD();
 
    void bindFD(const char *ip_addr, unsigned short int port);
-   bool connectTo(const char *ip_addr, unsigned short port);
-   bool connectTo(unsigned long ip_addr, unsigned short port);
+   bool connectTo(const char *ip_addr, unsigned short port, long ms_timeout = 1000);
+   bool connectTo(unsigned long ip_addr, unsigned short port, long ms_timeout = 1000);
    void listenFD(int backlog = 5);
    bool acceptFD(SocketFD &server);
 
@@ -189,12 +189,22 @@ public:
    FileFD(const char *filename);
    ~FileFD();
 
-   enum fd_file_type {readfd, writefd, appendfd};
+   enum fd_file_type {readfd, writefd, appendfd};   // writefd truncates an existing file
 
    bool openFile(fd_file_type ftype, bool create = false);
 
+   // Maps the whole (open) file read-only into memory. The map lasts until unmapFile or
+   // destruction, even if the FD is closed. An empty file maps to NULL with size 0.
+   bool mapFile();
+   void unmapFile();
+   const uint8_t *getMap() { return _map; };
+   size_t getMapSize() { return _map_size; };
+
 private:
    std::string _filename; 
+
+   const uint8_t *_map = NULL;
+   size_t _map_size = 0;
 };
 
 
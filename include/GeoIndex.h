@@ -0,0 +1,76 @@
+#ifndef GEOINDEX_H
+#define GEOINDEX_H
+
+#include <list>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <limits>
+#include <stdint.h>
+#include <time.h>
+#include "PoolAllocator.h"
+
+class DronePlot;
+
+/*******************************************************************************************
+ * GeoIndex - a spatial index over rows of a DronePlotDB. Plots are binned into a fixed grid
+ *            of cell_deg x cell_deg latitude/longitude cells and each cell keeps its rows in
+ *            timestamp order, so a query only visits the cells that overlap its area and,
+ *            within those, only the rows in its time window. Only cells holding rows are
+ *            stored. Distances are great-circle, in meters.
+ *
+ *            The index holds iterators and reads the plot's position and timestamp through
+ *            them, so a row must be erased from the index before any of those change.
+ *
+ *******************************************************************************************/
+class GeoIndex
+{
+public:
+   typedef std::list<DronePlot, PoolAllocator<DronePlot>>::iterator plot_iter;
+
+   GeoIndex(double cell_deg = default_cell_deg);
+
+   void insert(plot_iter dptr);
+   void erase(plot_iter dptr);
+   void clear();
+
+   size_t size() const { return _count; };
+
+   // Rows inside a box, edges included, with t0 <= timestamp <= t1, in no particular order.
+   // If lon0 > lon1 the box crosses the antimeridian.
+   void findInBox(double lat0, double lon0, double lat1, double lon1, time_t t0, time_t t1,
+                                                   std::vector<plot_iter> &found) const;
+
+   // Rows within radius_m meters of a point, in no particular order
+   void findInRadius(double lat, double lon, double radius_m, time_t t0, time_t t1,
+                                                   std::vector<plot_iter> &found) const;
+
+   // The k rows nearest a point, nearest first
+   void findNearest(double lat, double lon, size_t k, time_t t0, time_t t1,
+                                                   std::vector<plot_iter> &found) const;
+
+   // Great-circle distance in meters
+   static double distance(double lat0, double lon0, double lat1, double lon1);
+
+   static constexpr double default_cell_deg = 0.01;    // About 1.1 km north-south
+
+private:
+   typedef std::multimap<time_t, plot_iter> cell;
+
+   uint32_t latCell(double lat) const;
+   uint32_t lonCell(double lon) const;
+   uint64_t cellKey(uint32_t lat_cell, uint32_t lon_cell) const {
+      return static_cast<uint64_t>(lat_cell) * _lon_cells + lon_cell; };
+
+   // Calls visit with each stored cell in the lat/lon cell ranges (lon ranges may wrap)
+   template <typename F> void forCells(uint32_t lat_lo, uint32_t lat_hi, uint32_t lon_lo,
+                                       uint32_t lon_hi, F visit) const;
+
+   double _cell_deg;
+   uint32_t _lat_cells;
+   uint32_t _lon_cells;
+   size_t _count = 0;
+   std::unordered_map<uint64_t, cell> _cells;
+};
+
+#endif
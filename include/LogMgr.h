@@ -2,11 +2,22 @@
 #define LOGMGR_H
 
 #include <string>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <stdio.h>
+#include <time.h>
 
 /********************************************************************************
  * LogMgr - Log file manager. Includes setting log levels and a function to write
- *          a log entry if it is below a specified log level. Opens for each write
- *          in append mode to help with thread conflicts (but no mutexing)
+ *          a log entry if it is below a specified log level. Entries are copied
+ *          into a lock-free ring and a background thread stamps them and writes
+ *          them out in batches, so writeLog never waits on the disk and is safe
+ *          to call from any thread. Entries longer than max_entry are cut short,
+ *          and if the ring fills up new entries are counted and dropped rather
+ *          than blocking the caller.
  ********************************************************************************/
 
 class LogMgr {
@@ -18,19 +29,56 @@ class LogMgr {
       void writeLog(std::string &str, unsigned int lvl=0);
       void strerrLog(const char *str, unsigned int lvl=0);
 
+      // Waits until every entry logged so far is in the file
+      void flush();
+
       void closeLog();
-      
+
       unsigned int getLogLvl() { return _log_lvl; }
 
       static void createTimestamp(std::string &buf);
 
       void changeFilename(const char *filename);
 
+      static const size_t max_entry = 480;     // Longest entry kept, in chars
+      static const size_t ring_slots = 1024;   // Must be a power of 2
+
    private:
+      struct slot {
+         std::atomic<size_t> seq;   // Ring position this slot is ready for (see push)
+         time_t when;
+         size_t len;
+         char text[max_entry];
+      };
+
+      bool push(const char *str);
+      void openLog();
+      void writerLoop();
+      void drain(std::string &batch);
+
       std::string _log_file;  // Path/name of the log to write to
       unsigned int _log_lvl;  // The verbosity level
-   
+
+      // Only touched with _file_mutex held
       FILE *_lfptr = NULL;
+      std::mutex _file_mutex;
+      std::atomic<bool> _opened{false};
+
+      std::unique_ptr<slot[]> _ring;
+      std::atomic<size_t> _push_pos{0};      // Next position a writeLog claims
+      size_t _pop_pos = 0;                   // Next position the writer reads (writer only)
+      std::atomic<size_t> _written_pos{0};   // Everything before this is in the file
+      std::atomic<size_t> _dropped{0};
+
+      // The writer's cached timestamp, redone when the second changes (writer only)
+      time_t _stamp_time = -1;
+      std::string _stamp;
+
+      std::mutex _wake_mutex;
+      std::condition_variable _wake;      // Tells the writer there is work
+      std::condition_variable _flushed;   // Tells flush the writer caught up
+      std::atomic<bool> _exiting{false};
+      std::thread _writer;
 };
 
 #endif // ALMGR_H
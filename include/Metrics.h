@@ -0,0 +1,103 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <stdint.h>
+
+// Running totals
+enum metric_counter : unsigned int {
+   mc_plots_injected,      // Plots the antenna put in the database
+   mc_plots_local,         // Local plots picked up for replication
+   mc_plots_replicated,    // Plots received from other servers
+   mc_batches_queued,      // Batch copies queued for a peer (one per target)
+   mc_batches_received,    // New batches received
+   mc_batches_dup,         // Batches received that we already had
+   mc_batches_delivered,   // Received batches popped off the queue by the server
+   mc_conns_launched,      // Outgoing data connections started
+   mc_handshakes,          // Handshakes completed, either side
+   mc_bytes_sent,          // Bytes written to sockets, handshakes included
+   mc_bytes_received,      // Bytes read from sockets
+   mc_count
+};
+
+// Distributions. Times are in ns, shown in us.
+enum metric_histogram : unsigned int {
+   mh_repl_pass,           // One pass of the replication loop, not counting its sleep
+   mh_queue_new,           // Finding, deconflicting and queueing new local plots
+   mh_add_repl,            // Deconflicting a replicated batch into the database
+   mh_correction,          // Shifting stored rows after a clock correction changed
+   mh_handshake,           // First SID to authenticated, either side
+   mh_queue_depth,         // Elements waiting whenever the queue is popped with any in it
+   mh_e2e_latency,         // Antenna inject on the origin to insert here, every origin
+   mh_count
+};
+
+// Latest values
+enum metric_gauge : unsigned int {
+   mg_queue_depth,         // Elements in the replication queue
+   mg_connections,         // Open connections (both directions)
+   mg_sim_pending,         // Plots the antenna has yet to inject
+   mg_count
+};
+
+/*******************************************************************************************
+ * Metrics - process-wide counters, gauges and latency histograms. Counters and histograms
+ *           are kept per thread, so updating one is a couple of uncontended stores, and the
+ *           threads' copies are added together when a snapshot is taken. Histograms are
+ *           log-linear (HDR-style): exact below 16, then 8 buckets per power of 2, so a
+ *           percentile is within about 12% of the true value.
+ *
+ *           snapshot formats everything as text. startReports prints a snapshot to stdout
+ *           every few seconds and serve answers each connection to a Unix socket with one
+ *           (e.g. "nc -U <path>"). Call stop before exiting if either was started.
+ *
+ *******************************************************************************************/
+class Metrics
+{
+public:
+   static void add(metric_counter counter, uint64_t n = 1);
+   static void observe(metric_histogram hist, uint64_t value);
+   static void set(metric_gauge gauge, int64_t value);
+
+   // End-to-end latency of a replicated plot, into mh_e2e_latency and a histogram for the
+   // node that injected it. Nodes at or past max_latency_nodes only count in the total.
+   static void observeLatency(unsigned int node_id, uint64_t ns);
+   static const unsigned int max_latency_nodes = 64;
+
+   // Monotonic clock in ns for timing things to observe, and the wall clock in ns for times
+   // compared between servers
+   static int64_t now();
+   static int64_t wallNow();
+
+   // Observes the ns from its construction to its destruction
+   class scoped_timer {
+   public:
+      scoped_timer(metric_histogram hist):_hist(hist),_start(now()) {};
+      ~scoped_timer() { observe(_hist, now() - _start); };
+   private:
+      metric_histogram _hist;
+      int64_t _start;
+   };
+
+   // Counter totals as of a snapshot, so the next one can show rates over the interval
+   struct interval {
+      int64_t when = 0;
+      uint64_t counts[mc_count] = {};
+   };
+
+   // Appends a text snapshot to out. Counter rates are per second since the snapshot last
+   // taken with since (which is updated), or since the process started if it's NULL.
+   static void snapshot(std::string &out, interval *since = NULL);
+
+   // Prints a snapshot to stdout every secs seconds (real time) from a background thread
+   static void startReports(unsigned int secs);
+
+   // Listens on a Unix socket at path and writes a snapshot to each connection
+   //    Throws: runtime_error if the socket can't be set up
+   static void serve(const char *path);
+
+   // Stops the report and socket threads and removes the socket
+   static void stop();
+};
+
+#endif
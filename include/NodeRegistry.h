@@ -0,0 +1,61 @@
+#ifndef NODEREGISTRY_H
+#define NODEREGISTRY_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// Integer handle for a node in the registry. Handles are assigned in the order nodes appear in
+// servers.txt, so every server loading the same file agrees on them
+typedef unsigned int node_handle;
+
+const node_handle invalid_node = static_cast<node_handle>(-1);
+
+/*******************************************************************************************
+ * NodeRegistry - the table of replication servers in the cluster. Each node gets a dense
+ *                integer handle that indexes straight into the table, and hashed lookups
+ *                turn a server ID string or an IP address/port pair into a handle in O(1).
+ *
+ *******************************************************************************************/
+class NodeRegistry
+{
+public:
+   NodeRegistry();
+   virtual ~NodeRegistry();
+
+   // Loads nodes from a file of <server_id>, <ip_addr>, <port> lines. Returns # loaded or -1
+   int loadFile(const char *filename);
+
+   // Adds a node (ip_addr and port in network format) and returns its handle
+   node_handle addNode(const char *server_id, unsigned long ip_addr, unsigned short port);
+
+   // Hashed lookups, returning invalid_node if the node is not registered
+   node_handle findByID(const char *server_id) const;
+   node_handle findByAddr(unsigned long ip_addr, unsigned short port) const;
+
+   // Direct access by handle (ip_addr and port in network format)
+   const std::string &getID(node_handle node) const { return _nodes.at(node).server_id; };
+   unsigned long getIPAddr(node_handle node) const { return _nodes.at(node).ip_addr; };
+   unsigned short getPort(node_handle node) const { return _nodes.at(node).port; };
+
+   // Number of nodes in the cluster, including this one
+   unsigned int size() const { return _nodes.size(); };
+
+private:
+
+   static unsigned long long addrKey(unsigned long ip_addr, unsigned short port) {
+      return (static_cast<unsigned long long>(ip_addr & 0xFFFFFFFF) << 16) | port; };
+
+   struct node_info {
+      std::string server_id;
+      unsigned long ip_addr;
+      unsigned short port;
+   };
+
+   std::vector<node_info> _nodes;
+
+   std::unordered_map<std::string, node_handle> _by_id;
+   std::unordered_map<unsigned long long, node_handle> _by_addr;
+};
+
+#endif
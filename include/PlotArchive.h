@@ -0,0 +1,96 @@
+#ifndef PLOTARCHIVE_H
+#define PLOTARCHIVE_H
+
+#include <list>
+#include <vector>
+#include <limits>
+#include <stdint.h>
+#include <time.h>
+#include "DronePlotDB.h"
+
+/*******************************************************************************************
+ * PlotArchive - the indexed, versioned binary format for plot files. Unlike the legacy
+ *               format (bare serialize() records, whose layout depends on the host), every
+ *               field has a fixed width and is stored little-endian:
+ *
+ *    header  - magic "DPAR", u16 version, u16 record size, u32 plots per block, u32 flags
+ *    blocks  - records of drone_id u32, node_id u32, timestamp i64, latitude f32,
+ *              longitude f32. Every block holds plots_per_block records but the last.
+ *    index   - per block: u64 offset, u32 count, u32 min and max drone_id, u32 reserved,
+ *              i64 min and max timestamp
+ *    trailer - u64 index offset, u64 plot count, u32 block count, u32 index checksum,
+ *              magic "DPIX", u32 version
+ *
+ *    The trailer sits at a fixed distance from the end of the file, so a reader goes
+ *    straight to the index and from there to just the blocks that can hold a time range
+ *    or drone.
+ *
+ *******************************************************************************************/
+class PlotArchive
+{
+public:
+   // One block's entry in the index
+   struct block_info {
+      uint64_t offset;
+      uint32_t count;
+      uint32_t min_drone;
+      uint32_t max_drone;
+      time_t min_time;
+      time_t max_time;
+   };
+
+   // Parses the header, trailer and index of an archive in memory (normally mapped).
+   // Throws runtime_error if they are malformed or don't fit the file.
+   PlotArchive(const uint8_t *data, size_t size);
+
+   // True if the data starts like an archive rather than a legacy file
+   static bool isArchive(const uint8_t *data, size_t size);
+
+   uint64_t getPlotCount() const { return _plot_count; };
+   const std::vector<block_info> &getBlocks() const { return _blocks; };
+
+   // Blocks whose time and drone bounds overlap the query, in file order. A drone_id of -1
+   // matches any drone.
+   std::vector<size_t> findBlocks(time_t t0, time_t t1, int drone_id = -1) const;
+
+   // Decodes a block onto the end of plots, optionally only the plots matching a query
+   void decodeBlock(size_t block, plot_list &plots,
+                    time_t t0 = std::numeric_limits<time_t>::min(),
+                    time_t t1 = std::numeric_limits<time_t>::max(), int drone_id = -1) const;
+
+   static const uint32_t default_block_plots = 4096;
+
+private:
+   const uint8_t *_data;
+   uint64_t _plot_count;
+   std::vector<block_info> _blocks;
+};
+
+/*******************************************************************************************
+ * PlotArchiveWriter - encodes an archive a plot at a time. Bytes are appended to a buffer
+ *                     the caller drains to the file as it likes, so the whole archive never
+ *                     has to sit in memory.
+ *
+ *******************************************************************************************/
+class PlotArchiveWriter
+{
+public:
+   PlotArchiveWriter(uint32_t block_plots = PlotArchive::default_block_plots);
+
+   // Appends the header (first call only) and the plot's record to out
+   void addPlot(const DronePlot &plot, std::vector<uint8_t> &out);
+
+   // Appends the index and trailer to out. The archive is complete after this.
+   void finish(std::vector<uint8_t> &out);
+
+private:
+   void putHeader(std::vector<uint8_t> &out);
+
+   uint32_t _block_plots;
+   uint64_t _written = 0;        // Bytes handed out so far
+   uint64_t _plot_count = 0;
+   bool _started = false;
+   std::vector<PlotArchive::block_info> _blocks;
+};
+
+#endif
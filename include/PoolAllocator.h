@@ -0,0 +1,177 @@
+#ifndef POOLALLOCATOR_H
+#define POOLALLOCATOR_H
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <type_traits>
+
+/*******************************************************************************************
+ * FixedPool - hands out blocks of one size carved from large slabs and recycles the freed
+ *             ones, so a container that adds and drops nodes all day (like the plot list)
+ *             doesn't go to malloc for each and doesn't fragment the heap. Each thread keeps
+ *             its own free list, so the usual path takes no lock. A thread's list is topped
+ *             up from a shared list (or a new slab) in batches, and spills back to it when it
+ *             gets long or the thread exits, so blocks freed on one thread are reused on
+ *             others. Slabs stay with the pool for the life of the process.
+ *
+ *******************************************************************************************/
+template <size_t Size, size_t Align>
+class FixedPool
+{
+public:
+   static void *allocate() {
+      thread_cache &cache = getCache();
+      if (cache.free == nullptr)
+         refill(cache);
+
+      block *blk = cache.free;
+      cache.free = blk->next;
+      cache.count--;
+      return blk;
+   }
+
+   static void deallocate(void *ptr) {
+      block *blk = static_cast<block *>(ptr);
+      thread_cache &cache = getCache();
+
+      // Past thread exit there is no cache to keep it in
+      if (cache.exited) {
+         std::lock_guard<std::mutex> lock(getShared().mutex);
+         blk->next = getShared().free;
+         getShared().free = blk;
+         return;
+      }
+
+      blk->next = cache.free;
+      cache.free = blk;
+      if (++cache.count > max_cached)
+         spill(cache, max_cached / 2);
+   }
+
+   static const size_t slab_bytes = 256 * 1024;
+   static const size_t batch = 256;          // Blocks moved per trip to the shared list
+   static const size_t max_cached = 4096;    // Most free blocks a thread holds on to
+
+private:
+   union block {
+      block *next;
+      alignas(Align) unsigned char bytes[Size];
+   };
+
+   struct shared_state {
+      std::mutex mutex;
+      block *free = nullptr;
+   };
+
+   // Trivially destructible so it is still safe to touch while the thread is exiting
+   struct thread_cache {
+      block *free;
+      size_t count;
+      bool registered;
+      bool exited;
+   };
+
+   // Returns the thread's blocks to the shared list when the thread exits
+   struct cache_flusher {
+      ~cache_flusher() {
+         thread_cache &cache = getCache();
+         spill(cache, 0);
+         cache.exited = true;
+      }
+   };
+
+   // Never destroyed--blocks may still be freed during static destruction
+   static shared_state &getShared() {
+      static shared_state *shared = new shared_state;
+      return *shared;
+   }
+
+   static thread_cache &getCache() {
+      static thread_local thread_cache cache = {nullptr, 0, false, false};
+      if (!cache.registered) {
+         cache.registered = true;
+         static thread_local cache_flusher flusher;
+         (void) flusher;
+      }
+      return cache;
+   }
+
+   // Takes a batch from the shared list, or carves a new slab if it is empty
+   static void refill(thread_cache &cache) {
+      shared_state &shared = getShared();
+      std::lock_guard<std::mutex> lock(shared.mutex);
+
+      if (shared.free != nullptr) {
+         for (size_t i = 0; (i < batch) && (shared.free != nullptr); i++) {
+            block *blk = shared.free;
+            shared.free = blk->next;
+            blk->next = cache.free;
+            cache.free = blk;
+            cache.count++;
+         }
+         return;
+      }
+
+      size_t num_blocks = (slab_bytes / sizeof(block) > 0) ? slab_bytes / sizeof(block) : 1;
+      block *slab = static_cast<block *>(::operator new(num_blocks * sizeof(block)));
+      for (size_t i = 0; i < num_blocks; i++) {
+         slab[i].next = cache.free;
+         cache.free = &slab[i];
+      }
+      cache.count += num_blocks;
+   }
+
+   // Moves all but keep of the thread's free blocks to the shared list
+   static void spill(thread_cache &cache, size_t keep) {
+      if (cache.count <= keep)
+         return;
+
+      block *first = cache.free, *last = first;
+      for (size_t i = 1; i < cache.count - keep; i++)
+         last = last->next;
+      cache.free = last->next;
+      cache.count = keep;
+
+      shared_state &shared = getShared();
+      std::lock_guard<std::mutex> lock(shared.mutex);
+      last->next = shared.free;
+      shared.free = first;
+   }
+};
+
+/*******************************************************************************************
+ * PoolAllocator - standard allocator over FixedPool for node-based containers. Single
+ *                 objects (nodes) come from the pool for their size; arrays go to operator
+ *                 new. Stateless, so all instances are interchangeable and containers using
+ *                 it can splice between each other.
+ *
+ *******************************************************************************************/
+template <typename T>
+class PoolAllocator
+{
+public:
+   typedef T value_type;
+   typedef std::true_type is_always_equal;
+
+   PoolAllocator() noexcept {}
+   template <typename U> PoolAllocator(const PoolAllocator<U> &) noexcept {}
+
+   T *allocate(size_t n) {
+      if (n != 1)
+         return static_cast<T *>(::operator new(n * sizeof(T)));
+      return static_cast<T *>(FixedPool<sizeof(T), alignof(T)>::allocate());
+   }
+
+   void deallocate(T *ptr, size_t n) noexcept {
+      if (n != 1)
+         ::operator delete(ptr);
+      else
+         FixedPool<sizeof(T), alignof(T)>::deallocate(ptr);
+   }
+
+   template <typename U> bool operator==(const PoolAllocator<U> &) const noexcept { return true; };
+   template <typename U> bool operator!=(const PoolAllocator<U> &) const noexcept { return false; };
+};
+
+#endif
@@ -2,15 +2,23 @@
 #define QUEUEMGR_H
 
 #include <queue>
+#include <deque>
+#include <set>
 #include <vector>
+#include <memory>
 #include <crypto++/secblock.h>
 #include "TCPServer.h"
+#include "NodeRegistry.h"
+#include "Dissemination.h"
 
 /*******************************************************************************************
  * QueueMgr - Child class of the TCPServer object, manages a Queue for a middleware/app
  *            server. Designed in a modular format. Messages are placed into the outgoing
  *            queue using sendToServer by Server ID or sendToAll to send to all servers in
- *            the list (Multicast flooding). 
+ *            the list. How sendToAll reaches the other servers depends on the topology:
+ *            full mesh flooding (default), a spanning tree or push-pull gossip. Every
+ *            batch carries its origin server and a sequence number so forwarding servers
+ *            can drop batches they have already seen.
  *             
  *            The handleQueue method is called by the management process, which looks for 
  *            new connections on the socket. These connections are accepted and authenticated,
@@ -38,16 +46,32 @@ public:
    // Loads replication information into the Queue to transmit to servers
    void sendToAll(std::vector<uint8_t> &data);
    void sendToServer(const char *server_id, std::vector<uint8_t> &data);
+   void sendToServer(node_handle node, std::vector<uint8_t> &data);
    
-   // Overload simply to remove this server from _server_list. Calls parent funct
+   // Picks how sendToAll batches spread through the cluster (full mesh by default)
+   void setTopology(topology_type topology, unsigned int fanout, unsigned long seed = 0);
+
+   // Compress outgoing connections when the other end supports a codec we have
+   void setCompression(bool compress) { _compress = compress; };
+
+   // Overload to find this server in the node registry. Calls parent funct
    void bindSvr(const char *ip_addr, unsigned short port);
 
+   // Sequence and seen-batch state to persist across restarts. loadState must follow
+   // bindSvr and returns false if the state doesn't fit this cluster.
+   void saveState(std::vector<uint8_t> &state);
+   bool loadState(const std::vector<uint8_t> &state);
+
 
    // Gets the ID of this particular server
    const char *getServerID() { return _server_ID.c_str(); };
+   node_handle getSelf() { return _self; };
 
    // Get the number of servers we are replicating to
-   unsigned int getNumServers() { return _server_list.size(); };
+   unsigned int getNumServers() { return _nodes.size() - 1; };
+
+   // The table of all servers in the cluster (including this one)
+   const NodeRegistry &getNodes() { return _nodes; };
 
    // Looks up another server based off IP address and port
    const char *getClientID(unsigned long ip_addr, unsigned short port);
@@ -58,29 +82,66 @@ public:
 private:
 
    // Launches a connection to the other server from queue data
-   void launchDataConn(const char *sid, std::vector<uint8_t> &data);
+   void launchDataConn(node_handle node, std::vector<uint8_t> &data);
+
+   // Every message between QueueMgrs starts with a header: type, origin handle and sequence #
+   enum msg_type {msg_batch = 1, msg_direct = 2, msg_digest = 3};
+
+   // Hands a batch to the peers the topology picks for it
+   void forwardBatch(node_handle origin, uint32_t seq, node_handle from,
+                                                   std::vector<uint8_t> &payload);
+
+   // Strips the header from a received message and acts on it. Returns true if the payload
+   // should be delivered to the application
+   bool handleIncoming(node_handle from, std::vector<uint8_t> &msg, std::vector<uint8_t> &payload);
+
+   // Anti-entropy for gossip: tell a peer what we've seen, and answer a peer's digest
+   void sendDigest(node_handle node);
+   void answerDigest(node_handle from, std::vector<uint8_t> &digest);
+
+   // Tracks which sequence numbers we've seen from each origin
+   struct seen_set {
+      uint32_t contiguous = 0;      // Every seq up to and including this one has been seen
+      std::set<uint32_t> above;     // Seen seqs past a gap
+
+      bool has(uint32_t seq) const { return (seq <= contiguous) || above.count(seq); };
+      bool add(uint32_t seq);
+   };
+   std::vector<seen_set> _seen;     // Indexed by origin handle
+
+   // Recent batches, kept so they can be re-sent in reply to a digest
+   struct cached_batch {
+      node_handle origin;
+      uint32_t seq;
+      std::vector<uint8_t> payload;
+   };
+   std::deque<cached_batch> _recent;
 
-   // Loads server information from servers.txt
-   int loadServerList(const char *filename);
+   std::unique_ptr<Disseminator> _dissem;
+   uint32_t _next_seq = 1;
+   time_t _next_pull = 0;
+   bool _compress = false;
 
    // Set up our types for managing our queue
    enum qe_type {send, recv};
    struct queue_element {
 
-      queue_element(qe_type in_type, const char *in_sid, std::vector<uint8_t> &in_data)
-                  : type(in_type), server_id(in_sid), data(in_data) {}
+      queue_element(qe_type in_type, node_handle in_node, std::vector<uint8_t> &&in_data)
+                  : type(in_type), node(in_node), data(std::move(in_data)) {}
 
       qe_type type;
-      std::string server_id;
+      node_handle node;
       std::vector<uint8_t> data;
    };
 
    std::string _server_ID;
+   node_handle _self = invalid_node;
 
    // The queue list
    std::queue<queue_element> _queue;
 
-   std::vector<std::tuple<std::string, unsigned long, unsigned short>> _server_list;  
+   // All servers listed in servers.txt, this one included
+   NodeRegistry _nodes;
 };
 
 
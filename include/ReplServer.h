@@ -3,8 +3,11 @@
 
 #include <map>
 #include <memory>
+#include <unordered_map>
 #include "QueueMgr.h"
 #include "DronePlotDB.h"
+#include "ClockSkewEstimator.h"
+#include "SimClock.h"
 
 /***************************************************************************************
  * ReplServer - class that manages replication between servers. The data is automatically
@@ -18,8 +21,8 @@ class ReplServer
 {
 public:
    ReplServer(DronePlotDB &plotdb, const char *ip_addr, unsigned short port,
-                              float _time_mult = 1.0, unsigned int verbosity = 1);
-   ReplServer(DronePlotDB &plotdb, float _time_mult = 1.0);
+                              SimClock &clock, unsigned int verbosity = 1);
+   ReplServer(DronePlotDB &plotdb, SimClock &clock);
    virtual ~ReplServer();
 
    // Main replication loop, continues until _shutdown is set
@@ -29,67 +32,93 @@ public:
    // Call this to shutdown the loop 
    void shutdown();
 
-   // An adjusted time that accounts for "time_mult", which speeds up the clock. Any
-   // attempts to check "simulator time" should use this function
-   time_t getAdjustedTime();
+   // How replicated batches spread through the cluster--call before replicate()
+   void setTopology(topology_type topology, unsigned int fanout, unsigned long seed = 0) {
+      _queue.setTopology(topology, fanout, seed); };
 
-private:
-
-   void addReplDronePlots(std::vector<uint8_t> &data);
-   void addSingleDronePlot(std::vector<uint8_t> &data);
+   // Send batches in the compact plot encoding and compress them on the wire where the other
+   // end supports it. Received batches are decoded either way.
+   void setCompression(bool compress) { _compress = compress; _queue.setCompression(compress); };
 
-   //functions in attempt to sync times
-   void dbTimeSync();
-   void dbTimeSync2();
+   // Sim seconds between pickups of new local plots for replication (default 20), which may
+   // be fractional--call before replicate()
+   void setReplInterval(double secs) {
+      _repl_interval = static_cast<int64_t>(secs * SimClock::ns_per_sec); };
 
-   std::list<DronePlot>::iterator getDBIterator(unsigned int index);
+   // Sim seconds since the sim clock started, which runs time_mult faster than real time.
+   // Any attempts to check "simulator time" should use this function
+   double getAdjustedTime() { return _clock.seconds(); };
 
-   void deleteDBduplicates(bool StartTimeFlag);
-   void deleteDBduplicatesFinal();
+   // The deconfliction passes: a batch replicated in from another server, and the plots the
+   // antenna has added since the last pass. replicate runs these itself; they're public so
+   // they can be driven without a network (benchmarks, replay).
+   void addReplDronePlots(std::vector<uint8_t> &data);
+   unsigned int ingestLocalPlots(std::vector<uint8_t> &marshall_data,
+                                 std::vector<int64_t> &inject_times);
 
-   int checkStartTimeRef(int referenceTime);
+   // A replication pass's pickup of the new local plots, returning the batch it would send
+   // to every peer (left empty if there were none) along with the number of plots in it
+   unsigned int makeReplBatch(std::vector<uint8_t> &marshall_data);
 
-   unsigned int queueNewPlots();
+   // Shifts stored rows of any node whose clock correction has changed since they were
+   // stored. Due after replicated batches have been added.
+   void applyCorrectionChanges();
 
-   bool startTimeCalcErrorCheck(int nodeId);
+private:
 
-   void syncDroneTimeSteps(int nodeId);
-   bool checkIfAlreadyFound(std::vector<int> inputVector, int value);
+   void addSingleDronePlot(std::vector<uint8_t> &data, int64_t inject_ns = 0);
 
-   void setStartTimeErrorCheckFlag(int nodeId);
+   unsigned int queueNewPlots();
 
-   int findOffsetCase(unsigned int Node1, unsigned int Node2);
-   
-   void adjustCaseOffset(int inputCase, int inputOffset);
+   // Deconflicts a plot as it enters the database, correcting its clock skew once. If
+   // row is not _plotdb.end(), the plot is already in the database (a local inject)
+   bool ingestPlot(DronePlot &plot, plot_list::iterator row);
 
-   int returnCaseOffset(int inputCase);
+   // Applies the database's retention policy and forgets the sightings of evicted plots
+   void enforceRetention();
 
-   void setStartTimeRef(int referenceTime);
+   // Forgets sightings (corrected time) older than cutoff, and the window kept behind the
+   // newest one so a copy from another node can still arrive
+   void pruneSightings(time_t cutoff);
+   time_t sightingWindow() const;
 
-   int cycles = 0;
+   // Persist replication state alongside a database that has a write-ahead log, and pick it
+   // back up after a restart so peers needn't resend anything
+   void saveState();
+   void restoreState();
 
-   unsigned int masterClockNode = 0;
-   int masterOffset = 0;
-   int masterStartTime = 0;
+   // Identifies a physical plot regardless of which node saw it or when
+   struct plot_key {
+      unsigned int drone_id;
+      float latitude;
+      float longitude;
 
-   bool startTimeWasSet = false;
-   int setStartTime = 0;
-   int storedRefTime = 0;
+      bool operator==(const plot_key &other) const {
+         return (drone_id == other.drone_id) && (latitude == other.latitude) &&
+                (longitude == other.longitude); }
+   };
 
-   bool node1StartTimeFlag = true;
-   bool node2StartTimeFlag = true;
-   bool node3StartTimeFlag = true;
+   struct plot_key_hash {
+      size_t operator()(const plot_key &key) const;
+   };
 
-   bool tempStartTimeSet = false;
+   // A node's raw (uncorrected) timestamp for a plot
+   struct sighting {
+      unsigned int node_id;
+      time_t timestamp;
+   };
 
+   // Recent sightings of every plot, used to match duplicates from different nodes. Only the
+   // last sightingWindow() seconds behind the newest (corrected) one are kept.
+   std::unordered_map<plot_key, std::vector<sighting>, plot_key_hash> _sightings;
+   time_t _newest_sighting = 0;
+   time_t _last_sweep = 0;
 
-   int masterOffset12 = 0;
-   int masterOffset13 = 0;
-   int masterOffset23 = 0;
+   ClockSkewEstimator _skew;
 
-   int debugFlag1 = 0;
-   int debugFlag2 = 0;
-   int debugFlag3 = 0;
+   // The correction currently applied to the stored rows of each node (indexed by node ID)
+   std::vector<int> _applied_corr;
+   unsigned long _applied_gen = 0;
 
    QueueMgr _queue;    
 
@@ -98,14 +127,22 @@ private:
 
    bool _shutdown;
 
-   // How fast to run the system clock - 1.0 = normal speed, 2.0 = 2x as fast
-   float _time_mult;
+   // Whether to send compact, compressed batches
+   bool _compress = false;
+
+   // The sim clock, shared with the antenna
+   SimClock &_clock;
+
+   // When the last replication happened (sim ns) so we can know when to do another one
+   int64_t _last_repl = 0;
+   int64_t _repl_interval;
 
-   // System clock time of when the server started
-   time_t _start_time;
+   // Replication state has changed since it was last saved, and when that was (real time)
+   bool _state_dirty = false;
+   time_t _last_save = 0;
 
-   // When the last replication happened so we can know when to do another one
-   time_t _last_repl;
+   // When retention was last applied (real time)
+   time_t _last_retention = 0;
 
    // How much to spam stdout with server status
    unsigned int _verbosity;
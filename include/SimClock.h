@@ -0,0 +1,70 @@
+#ifndef SIMCLOCK_H
+#define SIMCLOCK_H
+
+#include <atomic>
+#include <stdint.h>
+#include <time.h>
+
+/*******************************************************************************************
+ * SimClock - the simulation's clock, shared by everything that needs "sim time" so they all
+ *            agree on it. Sim time counts ns from start(), running time_mult times faster
+ *            than CLOCK_MONOTONIC, so it never jumps with the wall clock and keeps its
+ *            resolution at any multiplier. Set up before the threads that read it.
+ *
+ *            A virtual clock instead stands still until advanceTo moves it, so a driver can
+ *            jump from one event to the next and run a sim as fast as the CPU allows, with
+ *            the same results every time. Only a driver that runs everything from its own
+ *            event loop (replay) should use one, since nothing can sleep on it.
+ *
+ *******************************************************************************************/
+class SimClock
+{
+public:
+   SimClock(double time_mult = 1.0);
+
+   // Sim time 0 is now
+   void start();
+
+   // Sim ns since start, and the same in seconds
+   int64_t now();
+   double seconds() { return static_cast<double>(now()) / ns_per_sec; };
+
+   // Sleeps until sim time sim_ns or for max_real_ns of real time, whichever is sooner, so
+   // the caller can check for shutdown in between. Returns true once sim_ns has come. A
+   // virtual clock never sleeps, only reports whether it's there yet.
+   bool sleepUntil(int64_t sim_ns, int64_t max_real_ns = default_max_sleep);
+
+   // The wall clock in ns, for times compared between servers. A virtual clock gives sim time
+   // scaled back to real time, starting from 1 second so it is never 0 (0 means unknown).
+   int64_t wallNow();
+
+   // Switches to virtual time, stopped at the current sim time, and moves it forward (never
+   // back). Only whatever drives the events should advance it.
+   void makeVirtual();
+   bool isVirtual() const { return _virtual; };
+   void advanceTo(int64_t sim_ns);
+
+   double getTimeMult() const { return _time_mult; };
+
+   // Reads a POSIX clock in ns, and CLOCK_MONOTONIC in seconds for timing real runs
+   static int64_t clockNs(clockid_t clock) {
+      struct timespec ts;
+      clock_gettime(clock, &ts);
+      return static_cast<int64_t>(ts.tv_sec) * ns_per_sec + ts.tv_nsec;
+   };
+   static double realSecs() { return static_cast<double>(clockNs(CLOCK_MONOTONIC)) / ns_per_sec; };
+
+   static const int64_t ns_per_sec = 1000000000;
+   static const int64_t default_max_sleep = ns_per_sec / 10;
+
+private:
+   double _time_mult;
+
+   // CLOCK_MONOTONIC at sim time 0
+   int64_t _start_ns = 0;
+
+   bool _virtual = false;
+   std::atomic<int64_t> _virtual_ns{0};
+};
+
+#endif
@@ -7,6 +7,16 @@
 
 const int max_attempts = 2;
 
+// A command string that brackets data on the wire, such as <REP> ... </REP>
+struct cmd_tag {
+   const char *str;
+   size_t len;
+
+   const uint8_t *begin() const { return reinterpret_cast<const uint8_t *>(str); };
+   const uint8_t *end() const { return begin() + len; };
+   size_t size() const { return len; };
+};
+
 // Methods and attributes to manage a network connection, including tracking the username
 // and a buffer for user input. Status tracks what "phase" of login the user is currently in
 class TCPConn 
@@ -65,9 +75,16 @@ public:
    // When should we try to reconnect (prevents spam)
    time_t reconnect;
 
-   // Assign outgoing data and sets up the socket to manage the transmission
+   // Assign outgoing data and sets up the socket to manage the transmission. Takes the
+   // contents of data, leaving it empty.
    void assignOutgoingData(std::vector<uint8_t> &data);
 
+   // Compress outgoing data with the best codec both ends support (see BatchCodec)
+   void setCompression(bool compress) { _compress = compress; };
+
+   // Numbers connections in the order they were created so trace events can be grouped by one
+   uint32_t getTraceID() { return _trace_id; };
+
 protected:
    // Functions to execute various stages of a connection 
    void sendSID();
@@ -92,24 +109,34 @@ protected:
    void sendAuthenticationResp();
 
    // Looks for commands in the data stream
-   std::vector<uint8_t>::iterator findCmd(std::vector<uint8_t> &buf,
-                                                   std::vector<uint8_t> &cmd);
-   bool hasCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &cmd);
+   std::vector<uint8_t>::iterator findCmd(std::vector<uint8_t> &buf, const cmd_tag &cmd);
+   bool hasCmd(std::vector<uint8_t> &buf, const cmd_tag &cmd);
 
    // Gets the data between startcmd and endcmd strings and places in buf
-   bool getCmdData(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd,
-                                                    std::vector<uint8_t> &endcmd);
+   bool getCmdData(std::vector<uint8_t> &buf, const cmd_tag &startcmd, const cmd_tag &endcmd);
 
    // Places startcmd and endcmd strings around the data in buf and returns it in buf
-   void wrapCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd,
-                                                    std::vector<uint8_t> &endcmd);
+   void wrapCmd(std::vector<uint8_t> &buf, const cmd_tag &startcmd, const cmd_tag &endcmd);
+
+   // Adds our codec capabilities to a handshake message, or reads the other end's
+   void appendCaps(std::vector<uint8_t> &buf);
+   void readPeerCaps(std::vector<uint8_t> &buf);
+
+   // Counts a finished handshake and how long it took
+   void handshakeDone();
 
 
 private:
 
    bool _connected = false;
+   uint32_t _trace_id;
+   int64_t _handshake_start = 0;   // Metrics clock, when the SID went out or came in
 
-   std::vector<uint8_t> c_rep, c_endrep, c_auth, c_endauth, c_ack, c_sid, c_endsid;
+   static constexpr cmd_tag c_rep = {"<REP>", 5}, c_endrep = {"</REP>", 6};
+   static constexpr cmd_tag c_auth = {"<AUT>", 5}, c_endauth = {"</AUT>", 6};
+   static constexpr cmd_tag c_sid = {"<SID>", 5}, c_endsid = {"</SID>", 6};
+   static constexpr cmd_tag c_cap = {"<CAP>", 5}, c_endcap = {"</CAP>", 6};
+   static constexpr cmd_tag c_ack = {"<ACK>", 5};
 
    statustype _status = s_none;
 
@@ -125,6 +152,10 @@ private:
    // Store outgoing data to be sent over the network
    std::vector<uint8_t> _outputbuf;
 
+   // Codec capabilities the other end advertised in the handshake and whether we compress
+   uint8_t _peer_caps = 0;
+   bool _compress = false;
+
    //Stores generated authentication string
    std::vector<uint8_t> authString; 
    //Stores recieved authentication string
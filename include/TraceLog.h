@@ -0,0 +1,101 @@
+#ifndef TRACELOG_H
+#define TRACELOG_H
+
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+
+// Replication events the trace records. The meaning of each record's fields by type:
+//
+//    type                 node            a              b              c
+//    tr_plot_kept         plot's node     drone_id       raw timestamp  corrected timestamp
+//    tr_plot_merged       plot's node     drone_id       raw timestamp  node it matched
+//    tr_plot_repeat       plot's node     drone_id       raw timestamp  -
+//    tr_offset_change     node            -              delta (secs)   new correction
+//    tr_batch_queued      target          origin         sequence #     bytes
+//    tr_batch_received    sender          origin         sequence #     bytes
+//    tr_batch_dup         sender          origin         sequence #     -
+//    tr_conn_launch       target          connection id  -              -
+//    tr_handshake_start   -               connection id  0 client/1 server
+//    tr_handshake_end     -               connection id  0 client/1 server
+//    tr_data_sent         -               connection id  -              bytes on the wire
+//    tr_data_acked        -               connection id  -              -
+//
+// Node fields are node handles (see NodeRegistry); 0xFFFF where the node isn't known.
+enum trace_type : uint16_t {
+   tr_plot_kept = 1,
+   tr_plot_merged = 2,
+   tr_plot_repeat = 3,
+   tr_offset_change = 4,
+   tr_batch_queued = 5,
+   tr_batch_received = 6,
+   tr_batch_dup = 7,
+   tr_conn_launch = 8,
+   tr_handshake_start = 9,
+   tr_handshake_end = 10,
+   tr_data_sent = 11,
+   tr_data_acked = 12
+};
+
+/*******************************************************************************************
+ * TraceLog - a flight recorder of replication events for offline analysis. Each event is a
+ *            fixed 32-byte record stamped in nanoseconds off CLOCK_MONOTONIC, written into a
+ *            process-wide ring that keeps the most recent ones. Recording is a few stores,
+ *            and when tracing is off it is a single test, so the calls can stay in the hot
+ *            paths. dump writes the ring to a file that trcdump turns into CSV or JSON.
+ *
+ *    File format (little-endian): magic "DPTR", u16 version, u16 record size, u32 ring
+ *    slots, u64 record count, u64 records lost to the ring wrapping, i64 monotonic and i64
+ *    wall-clock ns at start(), then the records oldest first: u64 ns, u16 type, u16 node,
+ *    u32 a, i64 b, i64 c.
+ *
+ *******************************************************************************************/
+class TraceLog
+{
+public:
+   struct event {
+      uint64_t ns;
+      uint16_t type;
+      uint16_t node;
+      uint32_t a;
+      int64_t b;
+      int64_t c;
+   };
+
+   struct file_info {
+      uint32_t slots;
+      uint64_t lost;
+      int64_t start_mono_ns;
+      int64_t start_wall_ns;
+   };
+
+   // Turns tracing on with a ring of slots events (rounded up to a power of 2). Call once,
+   // before the threads that record start.
+   static void start(size_t slots = default_slots);
+   static bool enabled() { return _enabled.load(std::memory_order_relaxed); };
+
+   static void record(trace_type type, uint16_t node, uint32_t a, int64_t b = 0, int64_t c = 0) {
+      if (enabled())
+         add(type, node, a, b, c);
+   };
+
+   // Writes what the ring holds to a file. Events recorded while it runs may be left out.
+   // Returns the number of events written. Throws runtime_error if the file can't be written.
+   static size_t dump(const char *filename);
+
+   // Reads a dump back. Throws runtime_error if it isn't one or is truncated.
+   static void readFile(const char *filename, file_info &info, std::vector<event> &events);
+
+   // Name of an event type for display, "unknown" if not one of ours
+   static const char *typeName(uint16_t type);
+
+   static const size_t default_slots = 1 << 20;    // 32MB
+   static const uint16_t no_node = 0xFFFF;
+
+private:
+   static void add(trace_type type, uint16_t node, uint32_t a, int64_t b, int64_t c);
+
+   static inline std::atomic<bool> _enabled{false};
+};
+
+#endif
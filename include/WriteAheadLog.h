@@ -0,0 +1,105 @@
+#ifndef WRITEAHEADLOG_H
+#define WRITEAHEADLOG_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+#include "exceptions.h"
+
+/*******************************************************************************************
+ * WriteAheadLog - crash-recoverable storage as a snapshot plus a log of the records appended
+ *                 since. The owner decides what a record means; this class just keeps them in
+ *                 order and on disk. Files in the directory:
+ *
+ *                   snapshot    - the state as of the start of log epoch E (written atomically)
+ *                   wal.<epoch> - records appended during that epoch
+ *
+ *                 Appends only copy into a buffer. A background thread commits the buffer
+ *                 every commit interval with one write and one fdatasync, so any number of
+ *                 appends share each sync (group commit) and a crash loses at most the last
+ *                 interval. sync() forces a commit and waits for it.
+ *
+ *                 To checkpoint, the owner calls rotate() to start a new epoch at the same
+ *                 moment it captures its state, then writeSnapshot() with that state. Only
+ *                 then are the older logs deleted, so a crash at any point recovers correctly.
+ *
+ *******************************************************************************************/
+class WriteAheadLog
+{
+public:
+   WriteAheadLog(unsigned int commit_ms = 20);
+   virtual ~WriteAheadLog();
+
+   // Opens (creating if needed) the directory and recovers: snapshot gets the latest snapshot
+   // (empty if none) and replay is called with each later record in order. A torn record at
+   // the end of the log ends recovery. Returns the number of records replayed.
+   size_t open(const char *dir, std::vector<uint8_t> &snapshot,
+               const std::function<void(const uint8_t *rec, size_t len)> &replay);
+
+   // Buffers a record to be committed
+   void append(const uint8_t *rec, size_t len);
+   void append(const std::vector<uint8_t> &rec) { append(rec.data(), rec.size()); };
+
+   // Commits everything appended so far and waits until it is on disk
+   void sync();
+
+   // Starts a new log epoch and returns it. Records appended after this belong to it.
+   uint64_t rotate();
+
+   // Atomically replaces the snapshot with one taken at the start of epoch, then deletes
+   // the logs it makes obsolete
+   void writeSnapshot(const std::vector<uint8_t> &snapshot, uint64_t epoch);
+
+   // Bytes logged since the last snapshot, and the size of that snapshot
+   size_t getLogSize();
+   size_t getSnapshotSize() { return _snapshot_size; };
+
+   // Commits anything outstanding and closes the log
+   void close();
+
+   bool isOpen() { return _log_fd != -1; };
+
+private:
+
+   std::string logPath(uint64_t epoch);
+
+   // Reads one log file, calling replay per record. Returns false if it ended in a bad record
+   bool replayLog(uint64_t epoch, const std::function<void(const uint8_t *, size_t)> &replay,
+                                                         size_t &count, size_t &valid_end);
+
+   // Creates the log for an epoch and makes it the one being appended to
+   void startLog(uint64_t epoch);
+
+   // Background commit loop
+   void flusher();
+
+   // Writes and fsyncs the pending buffer (caller holds _io_mutex)
+   void commitPending();
+
+   std::string _dir;
+   unsigned int _commit_ms;
+
+   int _log_fd = -1;
+   uint64_t _epoch = 0;
+   size_t _log_size = 0;         // Bytes in logs newer than the snapshot
+   size_t _snapshot_size = 0;
+
+   // Records waiting for the next commit, plus counters so sync() knows when it's done
+   std::vector<uint8_t> _pending;
+   uint64_t _appended = 0;
+   uint64_t _committed = 0;
+   bool _failed = false;
+   bool _stopping = false;
+
+   std::mutex _buf_mutex;        // Guards the pending buffer and counters
+   std::mutex _io_mutex;         // Serializes writes to the log files
+   std::condition_variable _commit_cv;
+   std::condition_variable _synced_cv;
+   std::thread _flusher;
+};
+
+#endif
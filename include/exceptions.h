@@ -24,4 +24,18 @@ public:
    logfile_error(const char *what_arg):runtime_error(what_arg) {}   
 };
 
+// The write-ahead log or snapshot could not be read or written
+class walfile_error : public std::runtime_error {
+public:
+   walfile_error(const std::string &what_arg):runtime_error(what_arg) {}
+   walfile_error(const char *what_arg):runtime_error(what_arg) {}
+};
+
+// A plot read from a file or the wire can't be stored, such as a timestamp past 32 bits
+class plotdata_error : public std::runtime_error {
+public:
+   plotdata_error(const std::string &what_arg):runtime_error(what_arg) {}
+   plotdata_error(const char *what_arg):runtime_error(what_arg) {}
+};
+
 #endif
@@ -1,21 +1,32 @@
 #include <iostream>
+#include <algorithm>
+#include <cstring>
 #include "AntennaSim.h"
 #include "DronePlotDB.h"
+#include "Metrics.h"
+
+// Most plots added to the database per lock, so a burst doesn't hold off the other threads
+const size_t max_inject_batch = 4096;
+
+// Sim seconds the antenna waits before injecting, to let the servers come online
+const unsigned int startup_delay = 3;
+
 
 /*****************************************************************************************
  * AntennaSim (constructor) - takes in a reference to the accessible database that will be
  *            populated by the simulator
  *
  *    Params:  dpdb - a reference to the operational database to inject into
- *             time_mult - how fast to run the injects (2.0 = 2x faster)
+ *             clock - the sim clock, which sets how fast to run the injects
  *****************************************************************************************/
-AntennaSim::AntennaSim(DronePlotDB &dpdb, const char *source_filename, float time_mult, 
+AntennaSim::AntennaSim(DronePlotDB &dpdb, const char *source_filename, SimClock &clock,
                        int verbosity): 
+                                             _exiting(false),
                                              _to_db(dpdb),
-                                             _time_mult(time_mult),
+                                             _next(0),
+                                             _clock(clock),
                                              _time_offset(0),
-                                             _verbosity(verbosity),
-                                             _start_time(0)
+                                             _verbosity(verbosity)
 {
    if (_verbosity == 3)
       std::cout << "SIM: Loading source database: " << source_filename << "\n";
@@ -23,12 +34,10 @@ AntennaSim::AntennaSim(DronePlotDB &dpdb, const char *source_filename, float tim
    if (_source_db.loadBinaryFile(source_filename) <= 0)
       throw std::runtime_error("Source database could not be opened or was empty.");
 
-   //testing
-   this->filenameH = source_filename;
    if (_verbosity >= 2)
       std::cout << "SIM: Source database " << source_filename << " successfully loaded.\n";
    if (_verbosity >= 1)
-      std::cout << "SIM: simulation started, time multiplier: " << _time_mult << "\n";
+      std::cout << "SIM: simulation started, time multiplier: " << _clock.getTimeMult() << "\n";
 }
 
 // Constructor - no action right now
@@ -55,7 +64,46 @@ void AntennaSim::loadSourceDB(const char *filename) {
 }
 
 double AntennaSim::getAdjustedTime() {
-   return static_cast<time_t>(((double) time(NULL) - (double) _start_time) * _time_mult);
+   return static_cast<double>(_clock.now()) / SimClock::ns_per_sec;
+}
+
+void AntennaSim::sleepUntil(double sim_time) {
+   int64_t wake_ns = static_cast<int64_t>(sim_time * SimClock::ns_per_sec);
+   while (!_exiting && !_clock.sleepUntil(wake_ns))
+      ;
+}
+
+/*****************************************************************************************
+ * injectDue - adds every plot from the cursor on whose timestamp has come, a batch at a
+ *             time under one database lock each
+ *
+ *    Params:  adjusted_time - current sim time
+ *
+ *    Returns: number of plots injected
+ *****************************************************************************************/
+
+size_t AntennaSim::injectDue(double adjusted_time) {
+   size_t first = _next;
+
+   while ((_next < _injects.size()) && (_injects[_next].timestamp <= adjusted_time)) {
+      size_t batch_start = _next;
+      size_t batch_end = std::min(_injects.size(), batch_start + max_inject_batch);
+      while ((_next < batch_end) && (_injects[_next].timestamp <= adjusted_time))
+         _next++;
+
+      if (_verbosity == 3) {
+         for (size_t i=batch_start; i<_next; i++) {
+            const DronePlot &plot = _injects[i];
+            std::cout << "SIM: Injecting plot NodeID: " << plot.node_id << " DroneID: " <<
+                  plot.drone_id << ", Time: " << plot.timestamp << " Lat: " <<
+                  plot.latitude << ", Long: " << plot.longitude << "\n";
+         }
+      }
+
+      _to_db.addPlots(&_injects[batch_start], _next - batch_start, DBFLAG_NEW, _clock.wallNow());
+      Metrics::add(mc_plots_injected, _next - batch_start);
+   }
+   return _next - first;
 }
 
 /*****************************************************************************************
@@ -69,100 +117,62 @@ void AntennaSim::simulate() {
    // Sort the database by time   
    _source_db.sortByTime();
 
-   // Set up a random offset between 1 and 3 seconds from true
-   srand(time(NULL));
-   _time_offset = (rand() % 6) - 3;
-
-   std::cout << "filename: " << this->filenameH << std::endl;
-
-   //for Testing
-   if (this->filenameH == "./data/SingleDroneN1.bin"){
-      std::cout << "manual offset: 1" << std::endl;
-      _time_offset = 0;
-   }
-   else if (this->filenameH == "./data/SingleDroneN2.bin"){
-      std::cout << "manual offset: 3" << std::endl;
-      _time_offset = 3;
-   }
-   else if (this->filenameH == "./data/SingleDroneN3.bin"){
-      std::cout << "manual offset: -3" << std::endl;
-      _time_offset = -3;
+   // Set up a random offset between 1 and 3 seconds from true. A persistent database keeps
+   // the antenna's clock across restarts, as a real antenna's would be.
+   std::vector<uint8_t> saved;
+   if (_to_db.getMeta(DBMETA_SIMCLOCK, saved) && (saved.size() == sizeof(_time_offset))) {
+      memcpy(&_time_offset, saved.data(), sizeof(_time_offset));
+   } else {
+      srand(time(NULL));
+      _time_offset = (rand() % 6) - 3;
    }
 
+   if (_to_db.hasWAL())
+      _to_db.setMeta(DBMETA_SIMCLOCK, std::vector<uint8_t>((uint8_t *) &_time_offset,
+                                                   (uint8_t *) &_time_offset + sizeof(_time_offset)));
+
    if (_verbosity >= 2) 
       std::cout << "SIM: Simulator time offset: " << _time_offset << " secs\n";
 
    if (_verbosity >= 1)
-      std::cout << "SIM: Delaying 3 seconds before starting sim to let servers come online.\n";
+      std::cout << "SIM: Delaying " << startup_delay << " sim seconds before starting sim to let " <<
+                   "servers come online.\n";
 
-   // Provide a short 3 second delay before starting
-   for (unsigned int i=3; i>0; i--) {
+   // Provide a short delay before starting. It runs on the sim clock, so the antenna's time
+   // stays the same as everyone else's.
+   for (unsigned int i=0; (i<startup_delay) && !_exiting; i++) {
       if (_verbosity >= 2)
-         std::cout << i << "\n";
-      sleep(1);
+         std::cout << startup_delay - i << "\n";
+      sleepUntil(i + 1);
    }
 
-   // Initialize
-   _start_time = time(NULL);
-
-   timespec sleeptime;
-   std::list<DronePlot>::iterator diter;
+   // Move the source plots into an array in time order, with the offset applied
+   _injects.assign(_source_db.begin(), _source_db.end());
+   _source_db.clear();
+   for (auto &plot : _injects)
+      plot.timestamp += _time_offset;
+   _next = 0;
+   Metrics::set(mg_sim_pending, _injects.size());
 
-   // Change all the inject timestamps to the offset time
-   for (diter = _source_db.begin(); diter != _source_db.end(); diter++) {
-      diter->timestamp += _time_offset;
-   }
-   
-   // Loop through the injects, sending them as their time arrives
-   while (_source_db.size() > 0) {
+   // Sleep until the next plot is due, then inject everything that is
+   while (!_exiting && (_next < _injects.size())) {
+      sleepUntil(_injects[_next].timestamp);
+      if (_exiting)
+         break;
 
-      // Get the time until our next inject
-      diter = _source_db.begin();
       double adjusted_time = getAdjustedTime();
+      size_t injected = injectDue(adjusted_time);
 
-      // If the adjusted time is not past the timestamp on our next inject, sleep until it is
-      if (adjusted_time < (double) diter->timestamp) {
-
-         // We need a more precise adjusted time
-
-         // timespan = how long we need to sleep (add .55 secs to prevent rounding down issues
-         double timespan = ((double) diter->timestamp - adjusted_time) / _time_mult + .55;
-         sleeptime.tv_sec = (time_t) timespan;
-         sleeptime.tv_nsec = (long) (1000000000.0 * (timespan - (double) sleeptime.tv_sec));
-         
-         if (_verbosity == 3)
-            std::cout << "SIM: Sim sleeping for " << sleeptime.tv_sec << " secs, " << sleeptime.tv_nsec
-                                                                        << " nanosecs\n";
-         nanosleep(&sleeptime, NULL);
-      }
-      
-      // Now inject all that have a timestamp less than the current time
-      adjusted_time = getAdjustedTime();
-      diter = _source_db.begin();
-
-      if (_verbosity >= 2)
-            std::cout << "SIM: Cur systime: " << (time_t) getAdjustedTime() << "\n";
-
-      while ((_source_db.size() > 0) && (diter->timestamp <= adjusted_time)) {
-        
-         if (_verbosity >= 1)
-            std::cout << "SIM: Injecting plot NodeID: " << diter->node_id << " DroneID: " << 
-                  diter->drone_id << ", Time: " << diter->timestamp << " Lat: " << 
-                  diter->latitude << ", Long: " << diter->longitude << "\n";
-
-         _to_db.addPlot(diter->drone_id, diter->node_id, diter->timestamp, diter->latitude, diter->longitude);
-         diter = _to_db.end();
-         diter--;
-         diter->setFlags(DBFLAG_NEW);
-
-         _source_db.popFront();
-         diter = _source_db.begin();
-      }
+      if ((_verbosity >= 1) && (injected > 0))
+         std::cout << "SIM: Injected " << injected << " plots at time " << (time_t) adjusted_time
+                                                                                 << "\n";
+      Metrics::set(mg_sim_pending, _injects.size() - _next);
    }
-   
+
    if (_verbosity >= 2) {
-      std::cout << "SIM: Drone plot injections complete.\n";
+      if (_next < _injects.size())
+         std::cout << "SIM: Stopped with " << _injects.size() - _next << " plots not injected.\n";
+      else
+         std::cout << "SIM: Drone plot injections complete.\n";
    }
-
-
 }
@@ -0,0 +1,424 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <cstring>
+#include <stdexcept>
+#include "BatchCodec.h"
+#include "DronePlotDB.h"
+
+#ifdef HAVE_LZ4_H
+#include <lz4.h>
+#endif
+
+#ifdef HAVE_ZSTD_H
+#include <zstd.h>
+#endif
+
+// Leads off a compact plot batch. A raw batch would need ~22 million plots to start this way.
+const uint8_t plot_magic[4] = {0xFF, 'P', 'Z', 1};
+
+// Fields per plot in the compact encoding, each taking at least one byte
+const unsigned int plot_fields = 5;
+
+// Bytes per plot of the optional inject time column of a raw batch
+const size_t inject_time_size = sizeof(int64_t);
+
+/*********************************************************************************************
+ * Little-endian reads and writes of the raw inject time column
+ *********************************************************************************************/
+static void putI64(std::vector<uint8_t> &buf, int64_t val) {
+   for (unsigned int i=0; i<8; i++)
+      buf.push_back((static_cast<uint64_t>(val) >> (8 * i)) & 0xFF);
+}
+
+static int64_t getI64(const uint8_t *buf) {
+   uint64_t val = 0;
+   for (unsigned int i=0; i<8; i++)
+      val |= static_cast<uint64_t>(buf[i]) << (8 * i);
+   return static_cast<int64_t>(val);
+}
+
+// Refuse to inflate a frame past this, so a corrupt length cannot exhaust memory
+const uint32_t max_frame_size = 64 * 1024 * 1024;
+
+// zstd's fastest standard level--batches are small and latency matters more than ratio
+const int zstd_level = 1;
+
+/*********************************************************************************************
+ * Helpers for the varint encoding - 7 bits per byte, low bits first, high bit set on every
+ * byte but the last. Signed deltas are zigzagged first so small negatives stay small.
+ *********************************************************************************************/
+static void putVarint(std::vector<uint8_t> &buf, uint64_t val) {
+   while (val >= 0x80) {
+      buf.push_back(static_cast<uint8_t>(val) | 0x80);
+      val >>= 7;
+   }
+   buf.push_back(static_cast<uint8_t>(val));
+}
+
+static uint64_t getVarint(const std::vector<uint8_t> &buf, size_t &pos) {
+   uint64_t val = 0;
+   for (unsigned int shift = 0; shift < 64; shift += 7) {
+      if (pos >= buf.size())
+         throw std::runtime_error("Compact plot batch ended in the middle of a value");
+
+      uint8_t byte = buf[pos++];
+      val |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      if (!(byte & 0x80))
+         return val;
+   }
+   throw std::runtime_error("Compact plot batch has an overlong value");
+}
+
+static uint64_t zigzag(int64_t val) {
+   return (static_cast<uint64_t>(val) << 1) ^ static_cast<uint64_t>(val >> 63);
+}
+
+static int64_t unzigzag(uint64_t val) {
+   return static_cast<int64_t>(val >> 1) ^ -static_cast<int64_t>(val & 1);
+}
+
+static uint32_t floatBits(float val) {
+   uint32_t bits;
+   memcpy(&bits, &val, sizeof(bits));
+   return bits;
+}
+
+static float bitsFloat(uint32_t bits) {
+   float val;
+   memcpy(&val, &bits, sizeof(val));
+   return val;
+}
+
+/*********************************************************************************************
+ * encodePlots - converts a raw plot batch into the compact encoding:
+ *
+ *    magic (4 bytes), varint count, then one column per field:
+ *       drone_id, node_id, timestamp - zigzag varint of the difference from the previous plot
+ *       latitude, longitude - varint of the float's bits XORed with the previous plot's bits
+ *       inject time - zigzag varint deltas, only if the raw batch has the column
+ *
+ *    Nearby floats share their sign, exponent and high mantissa bits, so the XOR leaves only
+ *    low bits set and the varint stays short. Plot order is preserved.
+ *
+ *    Params:  raw - a 32 bit count followed by serialized DronePlots and, optionally, the
+ *                   plots' inject times, as ReplServer marshalls
+ *             encoded - cleared and loaded with the compact batch
+ *
+ *    Throws: runtime_error if raw is not a well-formed batch, plotdata_error if a timestamp
+ *            won't fit in 32 bits
+ *********************************************************************************************/
+void BatchCodec::encodePlots(const std::vector<uint8_t> &raw, std::vector<uint8_t> &encoded) {
+   uint32_t count;
+
+   if (raw.size() < sizeof(count))
+      throw std::runtime_error("Plot batch too short to hold a count");
+
+   memcpy(&count, raw.data(), sizeof(count));
+   bool has_times = hasInjectTimes(raw);
+   if (!has_times && (raw.size() != sizeof(count) + count * DronePlot::getDataSize()))
+      throw std::runtime_error("Plot batch size does not match its count");
+
+   std::vector<DronePlot> plots(count);
+   for (uint32_t i=0; i<count; i++)
+      plots[i].deserialize(raw, sizeof(count) + i * DronePlot::getDataSize());
+
+   encoded.clear();
+   encoded.reserve(sizeof(plot_magic) + count * plot_fields * 2);
+   encoded.insert(encoded.end(), plot_magic, plot_magic + sizeof(plot_magic));
+   putVarint(encoded, count);
+
+   int64_t prev = 0;
+   for (auto &plot : plots) {
+      putVarint(encoded, zigzag(static_cast<int64_t>(plot.drone_id) - prev));
+      prev = plot.drone_id;
+   }
+
+   prev = 0;
+   for (auto &plot : plots) {
+      putVarint(encoded, zigzag(static_cast<int64_t>(plot.node_id) - prev));
+      prev = plot.node_id;
+   }
+
+   prev = 0;
+   for (auto &plot : plots) {
+      putVarint(encoded, zigzag(static_cast<int64_t>(plot.timestamp) - prev));
+      prev = plot.timestamp;
+   }
+
+   uint32_t prevbits = 0;
+   for (auto &plot : plots) {
+      putVarint(encoded, floatBits(plot.latitude) ^ prevbits);
+      prevbits = floatBits(plot.latitude);
+   }
+
+   prevbits = 0;
+   for (auto &plot : plots) {
+      putVarint(encoded, floatBits(plot.longitude) ^ prevbits);
+      prevbits = floatBits(plot.longitude);
+   }
+
+   if (has_times) {
+      const uint8_t *tptr = raw.data() + sizeof(count) + count * DronePlot::getDataSize();
+      prev = 0;
+      for (uint32_t i=0; i<count; i++, tptr += inject_time_size) {
+         int64_t when = getI64(tptr);
+         putVarint(encoded, zigzag(when - prev));
+         prev = when;
+      }
+   }
+}
+
+/*********************************************************************************************
+ * decodePlots - reverses encodePlots, producing the raw batch format addReplDronePlots reads
+ *
+ *    Params:  encoded - a compact batch, or a raw batch which is copied as-is
+ *             raw - cleared and loaded with the raw batch
+ *
+ *    Throws: runtime_error if the compact batch is truncated or corrupt, plotdata_error if a
+ *            timestamp won't fit in 32 bits
+ *********************************************************************************************/
+void BatchCodec::decodePlots(const std::vector<uint8_t> &encoded, std::vector<uint8_t> &raw) {
+   if (!isEncoded(encoded)) {
+      raw = encoded;
+      return;
+   }
+
+   size_t pos = sizeof(plot_magic);
+   uint64_t count = getVarint(encoded, pos);
+
+   // Every field takes at least a byte, which bounds the count before we allocate for it
+   if (count > (encoded.size() - pos) / plot_fields)
+      throw std::runtime_error("Compact plot batch count exceeds its data");
+
+   std::vector<DronePlot> plots(count);
+
+   int64_t prev = 0;
+   for (auto &plot : plots) {
+      prev += unzigzag(getVarint(encoded, pos));
+      plot.drone_id = static_cast<unsigned int>(prev);
+   }
+
+   prev = 0;
+   for (auto &plot : plots) {
+      prev += unzigzag(getVarint(encoded, pos));
+      plot.node_id = static_cast<unsigned int>(prev);
+   }
+
+   prev = 0;
+   for (auto &plot : plots) {
+      prev += unzigzag(getVarint(encoded, pos));
+      if (!DronePlot::fitsTimestamp(prev))
+         throw plotdata_error("Compact plot batch timestamp " + std::to_string(prev) +
+                              " won't fit in 32 bits");
+      plot.timestamp = static_cast<int32_t>(prev);
+   }
+
+   uint32_t prevbits = 0;
+   for (auto &plot : plots) {
+      prevbits ^= static_cast<uint32_t>(getVarint(encoded, pos));
+      plot.latitude = bitsFloat(prevbits);
+   }
+
+   prevbits = 0;
+   for (auto &plot : plots) {
+      prevbits ^= static_cast<uint32_t>(getVarint(encoded, pos));
+      plot.longitude = bitsFloat(prevbits);
+   }
+
+   // Anything after the last column is the inject times
+   std::vector<int64_t> times;
+   if (pos != encoded.size()) {
+      times.resize(count);
+      prev = 0;
+      for (auto &when : times) {
+         prev += unzigzag(getVarint(encoded, pos));
+         when = prev;
+      }
+   }
+
+   if (pos != encoded.size())
+      throw std::runtime_error("Compact plot batch has trailing data");
+
+   uint32_t count32 = static_cast<uint32_t>(count);
+   raw.clear();
+   raw.reserve(sizeof(count32) + count * (DronePlot::getDataSize() + inject_time_size));
+   raw.insert(raw.end(), (uint8_t *) &count32, (uint8_t *) &count32 + sizeof(count32));
+   for (auto &plot : plots)
+      plot.serialize(raw);
+   for (int64_t when : times)
+      putI64(raw, when);
+}
+
+/*********************************************************************************************
+ * hasInjectTimes - checks whether a raw batch carries the inject time column
+ *
+ *    Returns: true if its size is the count's plots plus an inject time apiece
+ *********************************************************************************************/
+bool BatchCodec::hasInjectTimes(const std::vector<uint8_t> &raw) {
+   uint32_t count;
+   if (raw.size() < sizeof(count))
+      return false;
+
+   memcpy(&count, raw.data(), sizeof(count));
+   return raw.size() == sizeof(count) + static_cast<size_t>(count) *
+                                          (DronePlot::getDataSize() + inject_time_size);
+}
+
+/*********************************************************************************************
+ * appendInjectTimes / getInjectTime - write the inject time column onto a raw batch whose
+ *                                     plots are all in, and read a plot's time back out
+ *********************************************************************************************/
+void BatchCodec::appendInjectTimes(std::vector<uint8_t> &raw, const std::vector<int64_t> &times) {
+   for (int64_t when : times)
+      putI64(raw, when);
+}
+
+int64_t BatchCodec::getInjectTime(const std::vector<uint8_t> &raw, uint32_t index) {
+   uint32_t count;
+   memcpy(&count, raw.data(), sizeof(count));
+   return getI64(raw.data() + sizeof(count) + count * DronePlot::getDataSize() +
+                                                            index * inject_time_size);
+}
+
+/*********************************************************************************************
+ * isEncoded - checks for the compact batch magic
+ *********************************************************************************************/
+bool BatchCodec::isEncoded(const std::vector<uint8_t> &buf) {
+   return (buf.size() >= sizeof(plot_magic)) &&
+          (memcmp(buf.data(), plot_magic, sizeof(plot_magic)) == 0);
+}
+
+/*********************************************************************************************
+ * localCaps - the compression codecs this build can both compress and decompress
+ *********************************************************************************************/
+uint8_t BatchCodec::localCaps() {
+   uint8_t caps = 0;
+#ifdef HAVE_LZ4_H
+   caps |= CODEC_CAP_LZ4;
+#endif
+#ifdef HAVE_ZSTD_H
+   caps |= CODEC_CAP_ZSTD;
+#endif
+   return caps;
+}
+
+/*********************************************************************************************
+ * pickCodec - prefers zstd, which at its fastest level still compresses plot data noticeably
+ *             better than LZ4, then LZ4, then no compression
+ *********************************************************************************************/
+uint8_t BatchCodec::pickCodec(uint8_t common_caps) {
+   common_caps &= localCaps();
+   if (common_caps & CODEC_CAP_ZSTD)
+      return CODEC_CAP_ZSTD;
+   if (common_caps & CODEC_CAP_LZ4)
+      return CODEC_CAP_LZ4;
+   return 0;
+}
+
+/*********************************************************************************************
+ * compressFrame - compresses a message. The frame is the codec byte, then for a real codec
+ *                 the uncompressed length (32 bits, little-endian) and the compressed data.
+ *                 If compressing doesn't shrink the message, it is sent with codec 0.
+ *
+ *    Params:  codec - the codec from pickCodec
+ *             in - the message
+ *             out - cleared and loaded with the frame
+ *
+ *    Throws: runtime_error if the message is too large
+ *********************************************************************************************/
+void BatchCodec::compressFrame(uint8_t codec, const std::vector<uint8_t> &in,
+                                                               std::vector<uint8_t> &out) {
+   const size_t hdr_size = 5;
+
+   if (in.size() > max_frame_size)
+      throw std::runtime_error("Message too large to send");
+
+   out.clear();
+   size_t packed = 0;
+
+#ifdef HAVE_ZSTD_H
+   if (codec == CODEC_CAP_ZSTD) {
+      out.resize(hdr_size + ZSTD_compressBound(in.size()));
+      size_t result = ZSTD_compress(out.data() + hdr_size, out.size() - hdr_size,
+                                    in.data(), in.size(), zstd_level);
+      if (!ZSTD_isError(result))
+         packed = result;
+   }
+#endif
+
+#ifdef HAVE_LZ4_H
+   if (codec == CODEC_CAP_LZ4) {
+      out.resize(hdr_size + LZ4_compressBound(in.size()));
+      int result = LZ4_compress_default((const char *) in.data(), (char *) out.data() + hdr_size,
+                                        in.size(), out.size() - hdr_size);
+      if (result > 0)
+         packed = result;
+   }
+#endif
+
+   if ((packed == 0) || (packed + hdr_size > in.size())) {
+      out.assign(1, 0);
+      out.insert(out.end(), in.begin(), in.end());
+      return;
+   }
+
+   uint32_t len = in.size();
+   out[0] = codec;
+   for (unsigned int i=0; i<4; i++)
+      out[1 + i] = static_cast<uint8_t>(len >> (8 * i));
+   out.resize(hdr_size + packed);
+}
+
+/*********************************************************************************************
+ * decompressFrame - reverses compressFrame
+ *
+ *    Params:  in - the frame
+ *             out - cleared and loaded with the message
+ *
+ *    Throws: runtime_error if the frame is corrupt or uses a codec this build lacks
+ *********************************************************************************************/
+void BatchCodec::decompressFrame(const std::vector<uint8_t> &in, std::vector<uint8_t> &out) {
+   const size_t hdr_size = 5;
+
+   if (in.size() == 0)
+      throw std::runtime_error("Empty compressed frame");
+
+   uint8_t codec = in[0];
+   if (codec == 0) {
+      out.assign(in.begin() + 1, in.end());
+      return;
+   }
+
+   if (in.size() < hdr_size)
+      throw std::runtime_error("Compressed frame too short for its header");
+
+   uint32_t len = 0;
+   for (unsigned int i=0; i<4; i++)
+      len |= static_cast<uint32_t>(in[1 + i]) << (8 * i);
+
+   if (len > max_frame_size)
+      throw std::runtime_error("Compressed frame claims an oversized message");
+
+   out.resize(len);
+   bool ok = false;
+
+#ifdef HAVE_ZSTD_H
+   if (codec == CODEC_CAP_ZSTD) {
+      size_t result = ZSTD_decompress(out.data(), len, in.data() + hdr_size, in.size() - hdr_size);
+      ok = !ZSTD_isError(result) && (result == len);
+   }
+#endif
+
+#ifdef HAVE_LZ4_H
+   if (codec == CODEC_CAP_LZ4) {
+      int result = LZ4_decompress_safe((const char *) in.data() + hdr_size, (char *) out.data(),
+                                       in.size() - hdr_size, len);
+      ok = (result >= 0) && (static_cast<uint32_t>(result) == len);
+   }
+#endif
+
+   if (!ok)
+      throw std::runtime_error("Compressed frame is corrupt or uses an unsupported codec");
+}
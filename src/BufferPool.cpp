@@ -0,0 +1,59 @@
+#include <mutex>
+#include "BufferPool.h"
+
+struct pool_state {
+   std::mutex mutex;
+   std::vector<std::vector<uint8_t>> free;
+};
+
+// Never destroyed--connections may hand back their buffers during static destruction
+static pool_state &getPool() {
+   static pool_state *pool = new pool_state;
+   return *pool;
+}
+
+/*********************************************************************************************
+ * take - swaps a pooled buffer into buf. buf's own storage is kept if it is already big
+ *        enough, and otherwise released.
+ *
+ *    Params:  buf - gets the buffer, empty
+ *             min_capacity - bytes the caller expects to put in it
+ *
+ *********************************************************************************************/
+void BufferPool::take(std::vector<uint8_t> &buf, size_t min_capacity) {
+   buf.clear();
+   if ((buf.capacity() > 0) && (buf.capacity() >= min_capacity))
+      return;
+
+   std::vector<uint8_t> old;
+   old.swap(buf);
+   {
+      pool_state &pool = getPool();
+      std::lock_guard<std::mutex> lock(pool.mutex);
+      if (!pool.free.empty()) {
+         buf.swap(pool.free.back());
+         pool.free.pop_back();
+      }
+   }
+   buf.reserve(min_capacity);
+}
+
+/*********************************************************************************************
+ * give - returns a buffer's storage to the pool, unless it is empty, too big or the pool is
+ *        full, in which case it is just freed
+ *
+ *    Params:  buf - the buffer to recycle. Left empty with no storage.
+ *
+ *********************************************************************************************/
+void BufferPool::give(std::vector<uint8_t> &buf) {
+   std::vector<uint8_t> old;
+   old.swap(buf);
+   if ((old.capacity() == 0) || (old.capacity() > max_buffer_bytes))
+      return;
+
+   old.clear();
+   pool_state &pool = getPool();
+   std::lock_guard<std::mutex> lock(pool.mutex);
+   if (pool.free.size() < max_buffers)
+      pool.free.push_back(std::move(old));
+}
@@ -0,0 +1,216 @@
+#include <iostream>
+#include <algorithm>
+#include <queue>
+#include <cstring>
+#include "ClockSkewEstimator.h"
+
+/*********************************************************************************************
+ * ClockSkewEstimator (constructor) - Initializes an estimator with no nodes
+ *
+ *    Params:  window - how many of the most recent samples per node pair feed the median
+ *
+ *********************************************************************************************/
+ClockSkewEstimator::ClockSkewEstimator(unsigned int window)
+                              :_window(window),
+                               _ref_node(0),
+                               _generation(0)
+{
+   if (_window == 0)
+      _window = 1;
+}
+
+ClockSkewEstimator::~ClockSkewEstimator() {
+
+}
+
+/*********************************************************************************************
+ * addSample - records the timestamps two different nodes gave the same plot. Updates the
+ *             pair's median and, if it moved, recalculates the node corrections
+ *
+ *    Params:  node_a, ts_a - the first node and its timestamp for the plot
+ *             node_b, ts_b - the second node and its timestamp for the plot
+ *
+ *********************************************************************************************/
+void ClockSkewEstimator::addSample(unsigned int node_a, time_t ts_a, unsigned int node_b,
+                                                                           time_t ts_b) {
+   if (node_a == node_b)
+      return;
+
+   // Normalize so the pair is always stored as (low, high)
+   if (node_a > node_b) {
+      std::swap(node_a, node_b);
+      std::swap(ts_a, ts_b);
+   }
+
+   bool new_pair = (_pairs.find(std::make_pair(node_a, node_b)) == _pairs.end());
+   pair_stats &ps = _pairs[std::make_pair(node_a, node_b)];
+
+   // Store the sample, overwriting the oldest once the window is full
+   int offset = static_cast<int>(ts_b - ts_a);
+   if (ps.samples.size() < _window)
+      ps.samples.push_back(offset);
+   else
+      ps.samples[ps.next] = offset;
+   ps.next = (ps.next + 1) % _window;
+
+   // Window is small, so a partial sort on a copy is cheap
+   std::vector<int> sorted = ps.samples;
+   std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+   int median = sorted[sorted.size() / 2];
+
+   bool ref_changed = false;
+   if ((_ref_node == 0) || (node_a < _ref_node)) {
+      _ref_node = node_a;
+      ref_changed = true;
+   }
+
+   if (new_pair || ref_changed || (median != ps.median)) {
+      ps.median = median;
+      recalcCorrections();
+   }
+}
+
+/*********************************************************************************************
+ * recalcCorrections - breadth-first walk of the pair graph starting at the reference node.
+ *                     A node's correction is the sum of pair medians along the path back to
+ *                     the reference. Bumps the generation if anything changed.
+ *
+ *********************************************************************************************/
+void ClockSkewEstimator::recalcCorrections() {
+   unsigned int max_node = _ref_node;
+   for (auto &p : _pairs)
+      max_node = std::max(max_node, p.first.second);
+
+   std::vector<int> corrections(max_node + 1, 0);
+   std::vector<bool> known(max_node + 1, false);
+
+   std::queue<unsigned int> to_visit;
+   known[_ref_node] = true;
+   to_visit.push(_ref_node);
+
+   while (!to_visit.empty()) {
+      unsigned int cur = to_visit.front();
+      to_visit.pop();
+
+      for (auto &p : _pairs) {
+         unsigned int lo = p.first.first, hi = p.first.second;
+
+         // The high node's clock reads median seconds ahead of the low node's
+         if ((lo == cur) && !known[hi]) {
+            corrections[hi] = corrections[cur] - p.second.median;
+            known[hi] = true;
+            to_visit.push(hi);
+         } else if ((hi == cur) && !known[lo]) {
+            corrections[lo] = corrections[cur] + p.second.median;
+            known[lo] = true;
+            to_visit.push(lo);
+         }
+      }
+   }
+
+   if ((corrections != _corrections) || (known != _known)) {
+      _corrections = std::move(corrections);
+      _known = std::move(known);
+      _generation++;
+   }
+}
+
+/*********************************************************************************************
+ * saveState - captures the sample windows so a restarted server doesn't have to relearn
+ *             them. Format (host byte order): reference node, pair count, then per pair:
+ *             low node, high node, next slot, sample count and the samples
+ *
+ *    Params:  state - cleared and loaded with the state
+ *********************************************************************************************/
+void ClockSkewEstimator::saveState(std::vector<uint8_t> &state) const {
+   auto put = [&state](const void *val, size_t len) {
+      state.insert(state.end(), (const uint8_t *) val, (const uint8_t *) val + len);
+   };
+
+   state.clear();
+   uint32_t num_pairs = _pairs.size();
+   put(&_ref_node, 4);
+   put(&num_pairs, 4);
+   for (auto &p : _pairs) {
+      uint32_t num_samples = p.second.samples.size();
+      put(&p.first.first, 4);
+      put(&p.first.second, 4);
+      put(&p.second.next, 4);
+      put(&num_samples, 4);
+      put(p.second.samples.data(), num_samples * sizeof(int));
+   }
+}
+
+/*********************************************************************************************
+ * loadState - restores the sample windows from saveState and recomputes the medians and
+ *             corrections from them
+ *
+ *    Returns: false (and changes nothing) if the state is malformed
+ *********************************************************************************************/
+bool ClockSkewEstimator::loadState(const std::vector<uint8_t> &state) {
+   size_t pos = 0;
+   auto get = [&state, &pos](void *val, size_t len) {
+      if (len > state.size() - pos)
+         return false;
+      memcpy(val, state.data() + pos, len);
+      pos += len;
+      return true;
+   };
+
+   unsigned int ref_node;
+   uint32_t num_pairs;
+   std::map<std::pair<unsigned int, unsigned int>, pair_stats> pairs;
+
+   if (!get(&ref_node, 4) || !get(&num_pairs, 4))
+      return false;
+
+   for (uint32_t i=0; i<num_pairs; i++) {
+      unsigned int lo, hi;
+      uint32_t num_samples;
+      pair_stats ps;
+
+      if (!get(&lo, 4) || !get(&hi, 4) || !get(&ps.next, 4) || !get(&num_samples, 4))
+         return false;
+      if ((lo >= hi) || (num_samples == 0) || (num_samples > _window) ||
+                        (num_samples > (state.size() - pos) / sizeof(int)))
+         return false;
+
+      ps.samples.resize(num_samples);
+      get(ps.samples.data(), num_samples * sizeof(int));
+      ps.next %= _window;
+
+      std::vector<int> sorted = ps.samples;
+      std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+      ps.median = sorted[sorted.size() / 2];
+      pairs[std::make_pair(lo, hi)] = std::move(ps);
+   }
+   if (pos != state.size())
+      return false;
+
+   _pairs = std::move(pairs);
+   _ref_node = ref_node;
+   recalcCorrections();
+   return true;
+}
+
+/*********************************************************************************************
+ * getNumKnown - returns the number of nodes that currently have a usable correction
+ *********************************************************************************************/
+unsigned int ClockSkewEstimator::getNumKnown() const {
+   return std::count(_known.begin(), _known.end(), true);
+}
+
+/*********************************************************************************************
+ * dumpEstimates - prints out the pair medians and node corrections for debugging
+ *********************************************************************************************/
+void ClockSkewEstimator::dumpEstimates() const {
+   std::cout << "Clock reference node: " << _ref_node << "\n";
+   for (auto &p : _pairs) {
+      std::cout << "Offset " << p.first.first << "->" << p.first.second << ": " <<
+                   p.second.median << " (" << p.second.samples.size() << " samples)\n";
+   }
+   for (unsigned int i=0; i<_known.size(); i++) {
+      if (_known[i])
+         std::cout << "Node " << i << " correction: " << _corrections[i] << "\n";
+   }
+}
@@ -0,0 +1,124 @@
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include "Dissemination.h"
+
+Disseminator::~Disseminator() {
+
+}
+
+/*********************************************************************************************
+ * create - factory for the disseminator matching the topology
+ *
+ *    Params:  topology - which dissemination strategy to use
+ *             fanout - number of peers each node passes a batch to (tree and gossip only)
+ *             seed - seed for gossip's random picks, 0 to seed from the clock
+ *
+ *    Returns: a new disseminator, owned by the caller
+ *********************************************************************************************/
+Disseminator *Disseminator::create(topology_type topology, unsigned int fanout,
+                                   unsigned long seed) {
+   if (fanout == 0)
+      fanout = 1;
+
+   switch (topology) {
+   case topo_tree:
+      return new TreeDisseminator(fanout);
+   case topo_gossip:
+      return new GossipDisseminator(fanout, seed);
+   default:
+      return new MeshDisseminator();
+   }
+}
+
+/*********************************************************************************************
+ * parseTopology - turns a topology name into its enum value
+ *
+ *    Returns: false if the name is not a known topology
+ *********************************************************************************************/
+bool Disseminator::parseTopology(const char *name, topology_type &topology) {
+   if (!strcmp(name, "mesh"))
+      topology = topo_mesh;
+   else if (!strcmp(name, "tree"))
+      topology = topo_tree;
+   else if (!strcmp(name, "gossip"))
+      topology = topo_gossip;
+   else
+      return false;
+   return true;
+}
+
+/*********************************************************************************************
+ * MeshDisseminator::getTargets - the origin sends to everyone, receivers do not forward
+ *********************************************************************************************/
+void MeshDisseminator::getTargets(node_handle self, node_handle origin, node_handle from,
+                                  unsigned int num_nodes, std::vector<node_handle> &targets) {
+   (void) from;
+   targets.clear();
+   if (self != origin)
+      return;
+
+   for (node_handle node=0; node<num_nodes; node++) {
+      if (node != self)
+         targets.push_back(node);
+   }
+}
+
+TreeDisseminator::TreeDisseminator(unsigned int fanout):_fanout(fanout) {
+
+}
+
+/*********************************************************************************************
+ * TreeDisseminator::getTargets - finds this node's children in the origin's tree. With ranks
+ *                                rotated so the origin is rank 0, rank r's children are ranks
+ *                                r*fanout+1 through r*fanout+fanout.
+ *********************************************************************************************/
+void TreeDisseminator::getTargets(node_handle self, node_handle origin, node_handle from,
+                                  unsigned int num_nodes, std::vector<node_handle> &targets) {
+   (void) from;
+   targets.clear();
+
+   unsigned long rank = (self + num_nodes - origin) % num_nodes;
+   for (unsigned long child = rank * _fanout + 1; child <= rank * _fanout + _fanout; child++) {
+      if (child >= num_nodes)
+         break;
+      targets.push_back((child + origin) % num_nodes);
+   }
+}
+
+GossipDisseminator::GossipDisseminator(unsigned int fanout, unsigned long seed):
+                     _fanout(fanout),
+                     _rndgen(seed ? seed : std::chrono::system_clock::now().time_since_epoch().count())
+{
+
+}
+
+/*********************************************************************************************
+ * GossipDisseminator::getPullPeer - picks a random peer other than ourselves for a digest,
+ *                                   from the same engine as the pushes
+ *********************************************************************************************/
+node_handle GossipDisseminator::getPullPeer(node_handle self, unsigned int num_nodes) {
+   std::uniform_int_distribution<unsigned int> dist(1, num_nodes - 1);
+   return (self + dist(_rndgen)) % num_nodes;
+}
+
+/*********************************************************************************************
+ * GossipDisseminator::getTargets - picks up to fanout random peers, skipping ourselves, the
+ *                                  origin and the node we got the batch from
+ *********************************************************************************************/
+void GossipDisseminator::getTargets(node_handle self, node_handle origin, node_handle from,
+                                    unsigned int num_nodes, std::vector<node_handle> &targets) {
+   targets.clear();
+   for (node_handle node=0; node<num_nodes; node++) {
+      if ((node != self) && (node != origin) && (node != from))
+         targets.push_back(node);
+   }
+
+   // Partial Fisher-Yates shuffle, keeping the first fanout picks
+   unsigned int picks = std::min<unsigned int>(_fanout, targets.size());
+   for (unsigned int i=0; i<picks; i++) {
+      std::uniform_int_distribution<unsigned int> dist(i, targets.size() - 1);
+      std::swap(targets[i], targets[dist(_rndgen)]);
+   }
+   targets.resize(picks);
+}
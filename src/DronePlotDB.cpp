@@ -1,16 +1,50 @@
 #include <stdexcept>
 #include <strings.h>
 #include <cstring>
+#include <cerrno>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <iostream>
-#include <sstream>
-#include <fstream>
-#include <iomanip>
+#include <algorithm>
+#include <charconv>
+#include <thread>
+#include <unordered_map>
 
 #include "DronePlotDB.h"
+#include "PlotArchive.h"
 #include "strfuncts.h"
 #include "FileDesc.h"
 
+// Files with fewer plots than this are decoded on the calling thread--not worth the spin-up
+const size_t min_plots_per_thread = 256 * 1024;
+const size_t min_csv_bytes_per_thread = 8 * 1024 * 1024;
+
+// writeCSVFile and writeBinaryFile format into a buffer this size and write it out whenever
+// it fills
+const size_t write_buf_size = 1024 * 1024;
+
+// checkpointIfDue snapshots once the log is bigger than both this and the last snapshot
+const size_t min_checkpoint_log = 16 * 1024 * 1024;
+
+// Write-ahead log record types. Each record is the op byte followed by its fields.
+enum wal_op : uint8_t {
+   op_add = 1,          // plot
+   op_erase = 2,        // plot
+   op_retime = 3,       // plot, new timestamp (i64)
+   op_flags = 4,        // plot, new flags (u16)
+   op_shift = 5,        // node (u32), delta (i64)
+   op_remove_node = 6,  // node (u32)
+   op_keep_node = 7,    // node (u32)
+   op_clear = 8,        // nothing
+   op_meta = 9,         // tag (u8), data
+   op_evict = 10        // cutoff (i64)--every row older not flagged DBFLAG_NEW
+};
+
+// A plot in a record or snapshot: the serialize() layout followed by its flags
+const size_t wal_plot_size = 26;
+
+// Retention evicts whole segments of this many seconds
+const time_t retention_segment_secs = 10;
 
 // Short compare function for database sort by timestamp
 bool compare_plot(const DronePlot &pp1, const DronePlot &pp2) {
@@ -46,18 +80,14 @@ DronePlot::DronePlot(int in_droneid, int in_nodeid, int in_timestamp, float in_l
 
 }
 
-DronePlot::~DronePlot() {
-
-}
-
 /*****************************************************************************************
  * getDataSize - returns the total size in bytes of all data stored in this object, minus
  *               the flags data. Helpful when reserving space in the vector to improve
- *               serialization efficiency.
+ *               serialization efficiency. The timestamp is serialized as 64 bits.
  *****************************************************************************************/
 size_t DronePlot::getDataSize() {
 
-   return sizeof(drone_id) + sizeof(node_id) + sizeof(timestamp) + sizeof(latitude) +
+   return sizeof(drone_id) + sizeof(node_id) + sizeof(int64_t) + sizeof(latitude) +
                      sizeof(longitude);
 }
 
@@ -71,12 +101,13 @@ size_t DronePlot::getDataSize() {
  *****************************************************************************************/
 void DronePlot::serialize(std::vector<uint8_t> &buf) {
 
+   int64_t wide_time = timestamp;
    uint8_t *dataptrs[5] = { (uint8_t *) &drone_id,
                             (uint8_t *) &node_id,
-                            (uint8_t *) &timestamp,
+                            (uint8_t *) &wide_time,
                             (uint8_t *) &latitude,
                             (uint8_t *) &longitude };
-   uint8_t sizes[5] = {sizeof(drone_id), sizeof(node_id), sizeof(timestamp), 
+   uint8_t sizes[5] = {sizeof(drone_id), sizeof(node_id), sizeof(wide_time), 
                        sizeof(latitude), sizeof(longitude)};
 
    if (drone_id == 0)
@@ -100,27 +131,76 @@ void DronePlot::serialize(std::vector<uint8_t> &buf) {
  *             start_pt - the vector index to start reading data
  *
  *    Throws: runtime_error - vector is not large enough--ran out of data
+ *            plotdata_error - the timestamp won't fit in 32 bits
  *****************************************************************************************/
 
-void DronePlot::deserialize(std::vector<uint8_t> &buf, unsigned int start_pt) {
-   uint8_t *dataptrs[5] = { (uint8_t *) &drone_id,
-                            (uint8_t *) &node_id,
-                            (uint8_t *) &timestamp,
-                            (uint8_t *) &latitude,
-                            (uint8_t *) &longitude };
-   uint8_t sizes[5] = {sizeof(drone_id), sizeof(node_id), sizeof(timestamp),
-                       sizeof(latitude), sizeof(longitude)};
+void DronePlot::deserialize(const std::vector<uint8_t> &buf, unsigned int start_pt) {
+   if (start_pt + getDataSize() > buf.size())
+      throw std::runtime_error("DronePlot deserialize ran out of data in vector buffer prematurely");
 
-   // Loop through all our data variables and their sizes, and read in the data
-   unsigned int vpos = start_pt;
-   for (unsigned int i=0; i<5; i++) {
-      for (unsigned int j=0; j < sizes[i]; j++, dataptrs[i]++){
-         if (vpos > buf.size())
-            throw std::runtime_error("DronePlot deserialize ran out of data in vector buffer prematurely");
-         *dataptrs[i] = buf[vpos++];
-      }
-   }
+   deserialize(buf.data() + start_pt);
+}
+
+/*****************************************************************************************
+ * deserialize - same as above, but straight from raw memory such as a mapped file
+ *
+ *    Params:  buf - points to getDataSize() bytes in the order above
+ *
+ *    Throws: plotdata_error - the timestamp won't fit in 32 bits (the plot is unchanged)
+ *****************************************************************************************/
 
+void DronePlot::deserialize(const uint8_t *buf) {
+   int64_t wide_time;
+   memcpy(&wide_time, buf + sizeof(drone_id) + sizeof(node_id), sizeof(wide_time));
+   if (!fitsTimestamp(wide_time))
+      throw plotdata_error("Plot timestamp " + std::to_string(wide_time) + " won't fit in 32 bits");
+
+   memcpy(&drone_id, buf, sizeof(drone_id));
+   buf += sizeof(drone_id);
+   memcpy(&node_id, buf, sizeof(node_id));
+   buf += sizeof(node_id);
+   timestamp = static_cast<int32_t>(wide_time);
+   buf += sizeof(wide_time);
+   memcpy(&latitude, buf, sizeof(latitude));
+   buf += sizeof(latitude);
+   memcpy(&longitude, buf, sizeof(longitude));
+}
+
+/*****************************************************************************************
+ * parseCSVField - parses one number of a CSV row with from_chars--no temporary strings, no
+ *                 locale and no exceptions. Like stoi/stof, leading whitespace and a '+'
+ *                 are allowed. The number must be followed (after optional whitespace or a
+ *                 '\r') by a comma, or by the end of the row if it is the last field.
+ *
+ *    Params:  pos - where to start, moved past the field and its comma
+ *             end - the end of the row
+ *             val - where to store the number
+ *             last - true for the last field in the row
+ *
+ *    Returns: false if the field is malformed
+ *****************************************************************************************/
+template <typename T>
+static bool parseCSVField(const char *&pos, const char *end, T &val, bool last) {
+   while ((pos < end) && ((*pos == ' ') || (*pos == '\t')))
+      pos++;
+   if ((pos + 1 < end) && (*pos == '+') && (pos[1] != '-'))
+      pos++;
+
+   auto result = std::from_chars(pos, end, val);
+   if (result.ec != std::errc())
+      return false;
+
+   pos = result.ptr;
+   while ((pos < end) && ((*pos == ' ') || (*pos == '\t') || (*pos == '\r')))
+      pos++;
+
+   if (last)
+      return pos == end;
+
+   if ((pos == end) || (*pos != ','))
+      return false;
+   pos++;
+   return true;
 }
 
 /*****************************************************************************************
@@ -129,47 +209,34 @@ void DronePlot::deserialize(std::vector<uint8_t> &buf, unsigned int start_pt) {
  *    Returns: -1 for failure, 0 otherwise
  *****************************************************************************************/
 int DronePlot::readCSV(std::string &buf) {
-      std::string::size_type commapos;
-      std::string data;
-      unsigned int startpos = 0;
-
-      // Loop and get the first four data points
-      for (unsigned int i=0; i<4; i++) {
-
-         // Find the next comma
-         commapos = buf.find(",", startpos);
-         if (commapos == std::string::npos)
-            return -1;
-
-         // Get the substring of our target variable
-         data = buf.substr(startpos, commapos-startpos);
+   return readCSV(buf.data(), buf.size());
+}
 
-         // Now load the data
-         switch (i) {
-         case 0:
-            drone_id = std::stoi(data);
-            break;
-         case 1:
-            node_id = std::stoi(data);
-            break;
-         case 2:
-            timestamp = (time_t) std::stoi(data);
-            break;
-         case 3:
-            latitude = std::stof(data);
-            break;
-         default:
-            throw std::runtime_error("This should not have happened");
-            break;
-         }
-         startpos = commapos + 1;
-      }
+/*****************************************************************************************
+ * readCSV - same as above, but for a row in a raw buffer
+ *
+ *    Params:  buf - start of the row
+ *             len - length of the row, not including the newline
+ *
+ *    Returns: -1 for failure (including a timestamp that won't fit in 32 bits), 0 otherwise
+ *****************************************************************************************/
+int DronePlot::readCSV(const char *buf, size_t len) {
+   const char *end = buf + len;
+   int in_droneid, in_nodeid;
+   long long in_timestamp;
+
+   if (!parseCSVField(buf, end, in_droneid, false) || !parseCSVField(buf, end, in_nodeid, false) ||
+       !parseCSVField(buf, end, in_timestamp, false) || !parseCSVField(buf, end, latitude, false) ||
+       !parseCSVField(buf, end, longitude, true))
+      return -1;
 
-      // Now get the final float
-      data = buf.substr(startpos, buf.size());
-      longitude = std::stof(data);
+   if (!fitsTimestamp(in_timestamp))
+      return -1;
 
-      return 0;
+   drone_id = in_droneid;
+   node_id = in_nodeid;
+   timestamp = static_cast<int32_t>(in_timestamp);
+   return 0;
 }
 
 /*****************************************************************************************
@@ -177,11 +244,34 @@ int DronePlot::readCSV(std::string &buf) {
  *
  *****************************************************************************************/
 void DronePlot::writeCSV(std::string &buf) {
-   std::stringstream tmpbuf;
+   char row[max_csv_row];
+
+   buf.assign(row, writeCSV(row));
+}
 
-   tmpbuf << drone_id << "," << node_id << "," << timestamp << "," << std::setprecision(10) << latitude << "," <<
-                                                                      longitude << "\n";
-   buf = tmpbuf.str();
+/*****************************************************************************************
+ * writeCSV - same as above, but formats straight into a raw buffer with to_chars. Floats
+ *            get 10 significant digits in %g style, the same as the stream version always
+ *            wrote with setprecision(10), so output stays byte-identical.
+ *
+ *    Params:  buf - where to write, with room for at least max_csv_row chars
+ *
+ *    Returns: one past the last char written (the row ends in a newline)
+ *****************************************************************************************/
+char *DronePlot::writeCSV(char *buf) {
+   char *end = buf + max_csv_row;
+
+   buf = std::to_chars(buf, end, drone_id).ptr;
+   *buf++ = ',';
+   buf = std::to_chars(buf, end, node_id).ptr;
+   *buf++ = ',';
+   buf = std::to_chars(buf, end, static_cast<long long>(timestamp)).ptr;
+   *buf++ = ',';
+   buf = std::to_chars(buf, end, latitude, std::chars_format::general, 10).ptr;
+   *buf++ = ',';
+   buf = std::to_chars(buf, end, longitude, std::chars_format::general, 10).ptr;
+   *buf++ = '\n';
+   return buf;
 }
 
 /*****************************************************************************************
@@ -215,9 +305,9 @@ DronePlotDB::DronePlotDB() {
    pthread_mutex_init(&_mutex, NULL);
 }
 
-// No behavior for destructor yet
+// Closes the write-ahead log, if open, committing anything outstanding
 DronePlotDB::~DronePlotDB() {
-
+   _wal.reset();
 }
 
 
@@ -229,65 +319,227 @@ DronePlotDB::~DronePlotDB() {
  *             timestamp - the plot's time in seconds
  *             latitude - floating point latitude coordinate of this plot point
  *             longitude - floating point longitude coordinate of this plot point
+ *             flags - DBFLAG_ values to set on the new plot before any other thread can see it
+ *             inject_ns - wall-clock ns the plot arrived, held for takeInjectTimes (0 = none)
+ *
+ *    Throws: plotdata_error if the timestamp won't fit in 32 bits (nothing is added)
  *             
  *****************************************************************************************/
 
-void DronePlotDB::addPlot(int drone_id, int node_id, time_t timestamp, float latitude, float longitude) {
+void DronePlotDB::addPlot(int drone_id, int node_id, time_t timestamp, float latitude, float longitude,
+                                                   unsigned short flags, int64_t inject_ns) {
+   if (!DronePlot::fitsTimestamp(timestamp))
+      throw plotdata_error("Plot timestamp " + std::to_string(timestamp) + " won't fit in 32 bits");
+
    // First lock the mutex (blocking)
    pthread_mutex_lock(&_mutex);
 
    _dbdata.emplace_back(drone_id, node_id, timestamp, latitude, longitude);
+   auto row = std::prev(_dbdata.end());
+   row->setFlags(flags);
+   logPlot(op_add, *row);
+   if (_segmented)
+      placeRow(row);
+   if (_indexed) {
+      indexPlot(row);
+      publishLatest();
+   }
+
+   if (inject_ns != 0)
+      _inject_times[&*row] = inject_ns;
 
    // Unlock the mutex before we exit
    pthread_mutex_unlock(&_mutex);
 }
 
+/*****************************************************************************************
+ * addPlots - same as addPlot for a run of plots, taking the mutex and republishing the
+ *            latest positions once for all of them
+ *
+ *    Params:  plots - the plots to copy in
+ *             count - number of plots
+ *             flags - set on every added row (the plots' own flags are ignored)
+ *             inject_ns - wall-clock ns they arrived, or 0 to not track them
+ *
+ *****************************************************************************************/
+
+void DronePlotDB::addPlots(const DronePlot *plots, size_t count, unsigned short flags,
+                                                                  int64_t inject_ns) {
+   pthread_mutex_lock(&_mutex);
+
+   for (size_t i=0; i<count; i++) {
+      const DronePlot &plot = plots[i];
+      _dbdata.emplace_back(plot.drone_id, plot.node_id, plot.timestamp, plot.latitude,
+                                                                        plot.longitude);
+      auto row = std::prev(_dbdata.end());
+      row->setFlags(flags);
+      logPlot(op_add, *row);
+      if (_segmented)
+         placeRow(row);
+      if (_indexed)
+         indexPlot(row);
+
+      if (inject_ns != 0)
+         _inject_times[&*row] = inject_ns;
+   }
+   publishLatest();
+
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * takeInjectTimes - gets the inject times addPlot was given for rows and forgets them
+ *
+ *    Params:  rows - the rows, in the order wanted
+ *             times - one wall-clock ns is appended per row, 0 if the row had none or it
+ *                     was already taken
+ *
+ *****************************************************************************************/
+
+void DronePlotDB::takeInjectTimes(const std::vector<plot_list::iterator> &rows,
+                                  std::vector<int64_t> &times) {
+   pthread_mutex_lock(&_mutex);
+
+   times.reserve(times.size() + rows.size());
+   for (auto dptr : rows) {
+      int64_t inject_ns = 0;
+      auto found = _inject_times.find(&*dptr);
+      if (found != _inject_times.end()) {
+         inject_ns = found->second;
+         _inject_times.erase(found);
+      }
+      times.push_back(inject_ns);
+   }
+
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * parseCSVRows - parses every row between start and end into a list, skipping empty rows
+ *
+ *    Params:  start - the first byte of a row
+ *             end - one past the last row (a newline or the end of the file)
+ *             chunk - parsed plots are appended to chunk.plots, and chunk.ok is set false
+ *                     if a row is malformed
+ *
+ *****************************************************************************************/
+
+struct plot_chunk {
+   plot_list plots;
+   bool ok = true;
+};
+
+static void parseCSVRows(const char *start, const char *end, plot_chunk &chunk) {
+   plot_list &plots = chunk.plots;
+   while (start < end) {
+      const char *eol = static_cast<const char *>(memchr(start, '\n', end - start));
+      if (eol == NULL)
+         eol = end;
+
+      // Tolerate files with DOS line endings
+      const char *row_end = eol;
+      if ((row_end > start) && (row_end[-1] == '\r'))
+         row_end--;
+
+      if (row_end > start) {
+         plots.emplace_back();
+         if (plots.back().readCSV(start, row_end - start) == -1) {
+            chunk.ok = false;
+            return;
+         }
+      }
+      start = eol + 1;
+   }
+}
+
 /*****************************************************************************************
  * loadCSVFile - loads in a CSV file containing the plot entries in the right order. The
  *               order should be (no spaces around commas):
  *               drone_id,node_id,timestamp,latitude,longitude
  *
+ *               The file is memory-mapped and parsed in place. Large files are split at
+ *               newlines into one chunk per thread and the results spliced on in order.
+ *
  *    Params:  filename - the path/filename of the CSV file to load
+ *             num_threads - max threads to parse with, 0 = one per core
  *
- *    Returns: -1 if there was an issue reading the file, otherwise num read in
+ *    Returns: -1 if there was an issue reading the file or a row is malformed (nothing is
+ *             loaded), otherwise num read in
  *
  *****************************************************************************************/
 
-int DronePlotDB::loadCSVFile(const char *filename) {
+int DronePlotDB::loadCSVFile(const char *filename, unsigned int num_threads) {
+   FileFD infile(filename);
 
-   std::ifstream cfile;
+   if (!infile.openFile(FileFD::readfd))
+      return -1;
 
-   // Open our file stream with default read settings
-   cfile.open(filename);
-   if (cfile.fail())
+   if (!infile.mapFile())
       return -1;
-   
-   // Get line by line, parsing out our data
-   std::string buf, data;
-   int count = 0;
-   std::list<DronePlot>::iterator newplot;
-  
-   while (!cfile.eof()) {
-      std::getline(cfile, buf);
-
-      if (buf.size() == 0)
-         continue;
-      
-      // Add this to the end and get an iterator pointing to it
-      _dbdata.emplace_back(-1, -1, 0, 0.0, 0.0);
-      newplot = _dbdata.end();
-      newplot--;
-
-      if (newplot->readCSV(buf) == -1)
-         return -1;
+   infile.closeFD();
 
-      // Add it to the database 
-      count++;
+   const char *data = reinterpret_cast<const char *>(infile.getMap());
+   size_t size = infile.getMapSize();
+
+   if (num_threads == 0)
+      num_threads = std::max(1U, std::thread::hardware_concurrency());
+   num_threads = std::min<size_t>(num_threads, std::max<size_t>(1, size / min_csv_bytes_per_thread));
+
+   // Chunk boundaries, each moved forward to just past a newline so no row is split
+   std::vector<const char *> bounds(1, data);
+   for (unsigned int i=1; i<num_threads; i++) {
+      const char *target = std::max(bounds.back(), data + size / num_threads * i);
+      const char *eol = static_cast<const char *>(memchr(target, '\n', data + size - target));
+      bounds.push_back((eol == NULL) ? data + size : eol + 1);
+   }
+   bounds.push_back(data + size);
+
+   std::vector<plot_chunk> chunks(num_threads);
+   if (num_threads == 1) {
+      parseCSVRows(bounds[0], bounds[1], chunks[0]);
+   } else {
+      std::vector<std::thread> workers;
+      for (unsigned int i=0; i<num_threads; i++)
+         workers.emplace_back(parseCSVRows, bounds[i], bounds[i+1], std::ref(chunks[i]));
+      for (auto &worker : workers)
+         worker.join();
    }
-   cfile.close();
+
+   size_t count = 0;
+   for (auto &chunk : chunks) {
+      if (!chunk.ok)
+         return -1;
+      count += chunk.plots.size();
+   }
+
+   pthread_mutex_lock(&_mutex);
+   for (auto &chunk : chunks)
+      appendPlots(chunk.plots);
+   pthread_mutex_unlock(&_mutex);
+
    return count;
 }
 
+/*****************************************************************************************
+ * writeAll - writes a block to a file, continuing after partial writes
+ *
+ *    Returns: false on a write error
+ *****************************************************************************************/
+
+static bool writeAll(FileFD &outfile, const char *data, size_t len) {
+   while (len > 0) {
+      ssize_t written = outfile.writeFD(data, len);
+      if (written < 0) {
+         if (errno == EINTR)
+            continue;
+         return false;
+      }
+      data += written;
+      len -= written;
+   }
+   return true;
+}
+
 /*****************************************************************************************
  * writeCSVFile - writes the database in order to a CSV text file. The order is:
  *               drone_id,node_id,timestamp,latitude,longitude
@@ -299,105 +551,347 @@ int DronePlotDB::loadCSVFile(const char *filename) {
  *****************************************************************************************/
 
 int DronePlotDB::writeCSVFile(const char *filename) {
-   std::ofstream cfile;
+   FileFD outfile(filename);
    int count = 0;
 
-   cfile.open(filename);
-   if (cfile.fail())
+   if (!outfile.openFile(FileFD::writefd, true))
       return -1;
 
-   std::string buf;
-   std::list<DronePlot>::iterator lptr = _dbdata.begin();
+   // Rows go into one big buffer that is written out in blocks
+   std::vector<char> buf(write_buf_size);
+   char *pos = buf.data();
+   char *flush_at = buf.data() + buf.size() - DronePlot::max_csv_row;
+
+   plot_list::iterator lptr = _dbdata.begin();
    for ( ; lptr != _dbdata.end(); lptr++) {
-      lptr->writeCSV(buf);
-      cfile << buf;
+      pos = lptr->writeCSV(pos);
       count++;
+
+      if (pos >= flush_at) {
+         if (!writeAll(outfile, buf.data(), pos - buf.data()))
+            return -1;
+         pos = buf.data();
+      }
    }
 
-   cfile.close();
+   if (!writeAll(outfile, buf.data(), pos - buf.data()))
+      return -1;
+
+   outfile.closeFD();
    return count; 
 }
 
 
+
+/*****************************************************************************************
+ * writeArchive - encodes plots as a PlotArchive into an open file, through a buffer that is
+ *                written out whenever it fills
+ *
+ *    Returns: -1 if there was an issue writing, otherwise num written out
+ *
+ *****************************************************************************************/
+
+static int writeArchive(FileFD &outfile, const plot_list &plots) {
+   PlotArchiveWriter writer;
+   std::vector<uint8_t> buf;
+   buf.reserve(write_buf_size + DronePlot::getDataSize());
+   int count = 0;
+
+   for (auto &plot : plots) {
+      writer.addPlot(plot, buf);
+      count++;
+
+      if (buf.size() >= write_buf_size) {
+         if (!writeAll(outfile, (const char *) buf.data(), buf.size()))
+            return -1;
+         buf.clear();
+      }
+   }
+   writer.finish(buf);
+
+   if (!writeAll(outfile, (const char *) buf.data(), buf.size()))
+      return -1;
+   return count;
+}
+
 /*****************************************************************************************
- * writeBinaryFile - writes the contents of the database to a file in raw binary form with
- *                   no newlines
+ * writeBinaryFile - writes the contents of the database to a file in binary form: an indexed
+ *                   PlotArchive, or the legacy headerless records that older tools read
  *
  *    Params:  filename - the path/filename of the output file
+ *             legacy - write the legacy format
  *
- *    Returns: -1 if there was an issue opening the file, otherwise num written out
+ *    Returns: -1 if there was an issue opening or writing the file, otherwise num written out
  *
  *****************************************************************************************/
 
-int DronePlotDB::writeBinaryFile(const char *filename) {
+int DronePlotDB::writeBinaryFile(const char *filename, bool legacy) {
    FileFD outfile(filename);
    int count = 0;
 
    if (!outfile.openFile(FileFD::writefd, true))
       return -1;
 
-   // Prep our vector that will be storing our plotpt data with exactly the right size
-   std::vector<uint8_t> plot;
-   unsigned int ppsize = DronePlot::getDataSize() * _dbdata.size();
-   plot.reserve(ppsize);
+   if (legacy) {
+      // Prep our vector that will be storing our plotpt data with exactly the right size
+      std::vector<uint8_t> plot;
+      unsigned int ppsize = DronePlot::getDataSize() * _dbdata.size();
+      plot.reserve(ppsize);
 
-   // Loop through all data points and write them to our binary vector
-   std::list<DronePlot>::iterator lptr = _dbdata.begin();
-   for ( ; lptr != _dbdata.end(); lptr++) {
-      lptr->serialize(plot);
+      // Loop through all data points and write them to our binary vector
+      plot_list::iterator lptr = _dbdata.begin();
+      for ( ; lptr != _dbdata.end(); lptr++) {
+         lptr->serialize(plot);
 
-      count++;
+         count++;
+      }
+      // Write it to a file
+      std::cout << "Writing count: " << plot.size() << "\n";
+      outfile.writeBytes<uint8_t>(plot);
+
+      return count;
    }
-   // Write it to a file
-   std::cout << "Writing count: " << plot.size() << "\n";
-   outfile.writeBytes<uint8_t>(plot);
 
+   count = writeArchive(outfile, _dbdata);
+   outfile.closeFD();
    return count;
 }
 
 /*****************************************************************************************
- * loadBinaryFile - reads the contents of a binary dump of the data into the database
+ * decodePlots - deserializes a run of back-to-back plot records into a list
  *
- *    Params:  filename - the path/filename of the input file
+ *    Params:  data - the first record
+ *             count - number of records
+ *             chunk - decoded plots are appended to chunk.plots, and chunk.ok is set false
+ *                     if a record can't be stored
+ *
+ *****************************************************************************************/
+
+static void decodePlots(const uint8_t *data, size_t count, plot_chunk &chunk) {
+   size_t ppsize = DronePlot::getDataSize();
+   try {
+      for (size_t i=0; i<count; i++, data += ppsize) {
+         chunk.plots.emplace_back();
+         chunk.plots.back().deserialize(data);
+      }
+   } catch (plotdata_error &e) {
+      chunk.ok = false;
+   }
+}
+
+/*****************************************************************************************
+ * decodeArchiveBlocks - decodes a run of an archive's blocks into a list
  *
- *    Returns: -1 if there was an issue opening the file, otherwise num read in 
+ *    Params:  archive - the parsed archive
+ *             blocks - indexes of the blocks to decode
+ *             chunk - decoded plots are appended to chunk.plots, and chunk.ok is set false
+ *                     if a block is corrupt or a record can't be stored
  *
  *****************************************************************************************/
 
-int DronePlotDB::loadBinaryFile(const char *filename) {
-   std::vector<uint8_t> buf;
-   std::list<DronePlot>::iterator dptr;
+static void decodeArchiveBlocks(const PlotArchive *archive, std::vector<size_t> blocks,
+                                                           plot_chunk &chunk) {
+   try {
+      for (auto block : blocks)
+         archive->decodeBlock(block, chunk.plots);
+   } catch (std::runtime_error &e) {
+      chunk.ok = false;
+   }
+}
+
+/*****************************************************************************************
+ * loadBinaryFile - reads the contents of a binary dump of the data into the database. The
+ *                  file is memory-mapped and decoded in place. It may be a PlotArchive or
+ *                  the legacy headerless format. Large files are split into one chunk per
+ *                  thread (whole blocks for an archive), each decoded into its own list, and
+ *                  the lists are spliced on in file order.
+ *
+ *    Params:  filename - the path/filename of the input file
+ *             num_threads - max threads to decode with, 0 = one per core
+ *
+ *    Returns: -1 if there was an issue opening the file, an archive is corrupt, a legacy
+ *             file isn't a whole number of plots or a plot's timestamp won't fit in 32 bits
+ *             (nothing is loaded), otherwise num read in
+ *
+ *****************************************************************************************/
 
+int DronePlotDB::loadBinaryFile(const char *filename, unsigned int num_threads) {
    FileFD infile(filename);
-   int count = 0;
 
    if (!infile.openFile(FileFD::readfd))
       return -1;
 
-   // Loop through grabbing the bytes of each plotpt
-   unsigned int size = 0;
-   unsigned int ppsize = DronePlot::getDataSize();
-   while ((size = infile.readBytes<uint8_t>(buf, ppsize)) == ppsize) {
-      _dbdata.emplace_back();
-      dptr = _dbdata.end();
-      dptr--;
+   if (!infile.mapFile())
+      return -1;
+   infile.closeFD();
 
-      // Deserialize
-      dptr->deserialize(buf);
-      buf.clear();
+   const uint8_t *data = infile.getMap();
+   size_t size = infile.getMapSize();
+   size_t ppsize = DronePlot::getDataSize();
 
-      count++;
+   std::unique_ptr<PlotArchive> archive;
+   size_t count;
+   if (PlotArchive::isArchive(data, size)) {
+      try {
+         archive.reset(new PlotArchive(data, size));
+      } catch (std::runtime_error &e) {
+         return -1;
+      }
+      count = archive->getPlotCount();
+   } else {
+      // A partial record means a truncated or corrupted file
+      if (size % ppsize != 0)
+         return -1;
+      count = size / ppsize;
    }
-   
-   // Final read should be size = 0 or this may be a corrupted file
-   if (size != 0) {
-      return -1;
+
+   if (num_threads == 0)
+      num_threads = std::max(1U, std::thread::hardware_concurrency());
+   num_threads = std::min<size_t>(num_threads, std::max<size_t>(1, count / min_plots_per_thread));
+   if (archive)
+      num_threads = std::min<size_t>(num_threads, std::max<size_t>(1, archive->getBlocks().size()));
+
+   // Work out each thread's share: whole blocks of an archive, or a run of legacy records
+   std::vector<std::vector<size_t>> shares(num_threads);
+   std::vector<size_t> starts(num_threads + 1, 0);
+   for (unsigned int i=0; i<num_threads; i++) {
+      size_t share = count / num_threads + ((i < count % num_threads) ? 1 : 0);
+      starts[i+1] = starts[i] + share;
+   }
+   if (archive) {
+      size_t num_blocks = archive->getBlocks().size();
+      for (size_t block=0; block<num_blocks; block++)
+         shares[block * num_threads / num_blocks].push_back(block);
    }
 
-   infile.closeFD();
+   std::vector<plot_chunk> chunks(num_threads);
+   if (num_threads == 1) {
+      if (archive)
+         decodeArchiveBlocks(archive.get(), shares[0], chunks[0]);
+      else
+         decodePlots(data, count, chunks[0]);
+   } else {
+      std::vector<std::thread> workers;
+      for (unsigned int i=0; i<num_threads; i++) {
+         if (archive)
+            workers.emplace_back(decodeArchiveBlocks, archive.get(), shares[i], std::ref(chunks[i]));
+         else
+            workers.emplace_back(decodePlots, data + starts[i] * ppsize, starts[i+1] - starts[i],
+                                                                        std::ref(chunks[i]));
+      }
+      for (auto &worker : workers)
+         worker.join();
+   }
+
+   for (auto &chunk : chunks) {
+      if (!chunk.ok)
+         return -1;
+   }
+
+   pthread_mutex_lock(&_mutex);
+   for (auto &chunk : chunks)
+      appendPlots(chunk.plots);
+   pthread_mutex_unlock(&_mutex);
+
    return count; 
 }
 
+/*****************************************************************************************
+ * loadBinaryRange - loads just the plots in a time range, and optionally for one drone, from
+ *                   a binary file. For an archive, the index picks out the blocks that can
+ *                   hold matches and nothing else is read. A legacy file has no index, so
+ *                   every record is checked.
+ *
+ *    Params:  filename - the path/filename of the input file
+ *             t0, t1 - the time range, inclusive
+ *             drone_id - the drone to load, or -1 for all
+ *
+ *    Returns: -1 if there was an issue opening the file, it is corrupt or a plot's
+ *             timestamp won't fit in 32 bits (nothing is loaded), otherwise num loaded
+ *
+ *****************************************************************************************/
+
+int DronePlotDB::loadBinaryRange(const char *filename, time_t t0, time_t t1, int drone_id) {
+   FileFD infile(filename);
+
+   if (!infile.openFile(FileFD::readfd))
+      return -1;
+
+   if (!infile.mapFile())
+      return -1;
+   infile.closeFD();
+
+   const uint8_t *data = infile.getMap();
+   size_t size = infile.getMapSize();
+   plot_list plots;
+
+   if (PlotArchive::isArchive(data, size)) {
+      try {
+         PlotArchive archive(data, size);
+         for (auto block : archive.findBlocks(t0, t1, drone_id))
+            archive.decodeBlock(block, plots, t0, t1, drone_id);
+      } catch (std::runtime_error &e) {
+         return -1;
+      }
+   } else {
+      size_t ppsize = DronePlot::getDataSize();
+      if (size % ppsize != 0)
+         return -1;
+
+      DronePlot plot;
+      try {
+         for (size_t pos = 0; pos < size; pos += ppsize) {
+            plot.deserialize(data + pos);
+            if ((plot.timestamp >= t0) && (plot.timestamp <= t1) &&
+                ((drone_id < 0) || (plot.drone_id == static_cast<unsigned int>(drone_id))))
+               plots.push_back(plot);
+         }
+      } catch (plotdata_error &e) {
+         return -1;
+      }
+   }
+
+   int count = plots.size();
+
+   pthread_mutex_lock(&_mutex);
+   appendPlots(plots);
+   pthread_mutex_unlock(&_mutex);
+
+   return count;
+}
+
+/*****************************************************************************************
+ * appendPlots - moves a list of newly loaded plots onto the end of the database, logging
+ *               them if there is a write-ahead log. The caller holds the mutex.
+ *****************************************************************************************/
+
+void DronePlotDB::appendPlots(plot_list &plots) {
+   // An empty list's begin is its own end, which the index loop below would never reach
+   if (plots.empty())
+      return;
+
+   for (auto &plot : plots)
+      logPlot(op_add, plot);
+
+   // Splicing keeps the iterators, which now point into the database
+   auto first = plots.begin();
+   _dbdata.splice(_dbdata.end(), plots);
+   if (_indexed) {
+      for (auto dptr = first; dptr != _dbdata.end(); dptr++)
+         indexPlot(dptr);
+      publishLatest();
+   }
+
+   // Placing moves rows, so take them all before placing any
+   if (_segmented) {
+      std::vector<plot_list::iterator> rows;
+      for (auto dptr = first; dptr != _dbdata.end(); dptr++)
+         rows.push_back(dptr);
+      for (auto dptr : rows)
+         placeRow(dptr);
+   }
+}
+
 /*****************************************************************************************
  * popFront - removes the front element from the database 
  *
@@ -409,7 +903,14 @@ void DronePlotDB::popFront() {
    // First lock the mutex (blocking)
    pthread_mutex_lock(&_mutex);
 
+   logPlot(op_erase, _dbdata.front());
+   if (_indexed)
+      unindexPlot(_dbdata.begin());
+   if (_segmented)
+      unplaceRow(_dbdata.begin());
+   forgetInjectTime(_dbdata.front());
    _dbdata.pop_front();
+   publishLatest();
 
    // Unlock the mutex before we exit
    pthread_mutex_unlock(&_mutex);
@@ -428,13 +929,22 @@ void DronePlotDB::erase(unsigned int i) {
    // First lock the mutex (blocking)
    pthread_mutex_lock(&_mutex);
 
-   if (i > _dbdata.size())
+   if (i >= _dbdata.size()) {
+      pthread_mutex_unlock(&_mutex);
       throw std::runtime_error("erase function called with index out of scope for std::list.");
+   }
 
-   std::list<DronePlot>::iterator diter = _dbdata.begin();
+   plot_list::iterator diter = _dbdata.begin();
    for (unsigned int x=0; x<i; x++, diter++);
 
+   logPlot(op_erase, *diter);
+   if (_indexed)
+      unindexPlot(diter);
+   if (_segmented)
+      unplaceRow(diter);
+   forgetInjectTime(*diter);
    _dbdata.erase(diter);
+   publishLatest();
 
 
    // Unlock the mutex before we exit
@@ -450,34 +960,76 @@ void DronePlotDB::erase(unsigned int i) {
  *
  *****************************************************************************************/
 
-std::list<DronePlot>::iterator DronePlotDB::erase(std::list<DronePlot>::iterator dptr) {
+plot_list::iterator DronePlotDB::erase(plot_list::iterator dptr) {
    // First lock the mutex (blocking)
    pthread_mutex_lock(&_mutex);
 
-   return _dbdata.erase(dptr);
+   logPlot(op_erase, *dptr);
+   if (_indexed)
+      unindexPlot(dptr);
+   if (_segmented)
+      unplaceRow(dptr);
+   forgetInjectTime(*dptr);
+   auto next = _dbdata.erase(dptr);
+   publishLatest();
 
    // Unlock the mutex before we exit
    pthread_mutex_unlock(&_mutex);
 
+   return next;
 }
 
 // Removes all of a particular node (not for student use)
 void DronePlotDB::removeNodeID(unsigned int node_id) {
    pthread_mutex_lock(&_mutex);
 
+   std::vector<uint8_t> rec(1, op_remove_node);
+   rec.insert(rec.end(), (uint8_t *) &node_id, (uint8_t *) &node_id + sizeof(node_id));
+   logRecord(rec);
+
    auto del_iter = _dbdata.begin();
    while (del_iter != _dbdata.end()) {
-      if (del_iter->node_id == node_id)
+      if (del_iter->node_id == node_id) {
+         if (_indexed)
+            unindexPlot(del_iter);
+         if (_segmented)
+            unplaceRow(del_iter);
+         forgetInjectTime(*del_iter);
          del_iter = _dbdata.erase(del_iter);
-      else
+      } else
          del_iter++;
    }
+   publishLatest();
+
+   pthread_mutex_unlock(&_mutex);
+}
+
+// Removes all but a particular node (not for student use)
+void DronePlotDB::keepNodeID(unsigned int node_id) {
+   pthread_mutex_lock(&_mutex);
+
+   std::vector<uint8_t> rec(1, op_keep_node);
+   rec.insert(rec.end(), (uint8_t *) &node_id, (uint8_t *) &node_id + sizeof(node_id));
+   logRecord(rec);
+
+   for (auto iptr = _inject_times.begin(); iptr != _inject_times.end(); ) {
+      if (iptr->first->node_id != node_id)
+         iptr = _inject_times.erase(iptr);
+      else
+         iptr++;
+   }
+   _dbdata.remove_if([node_id](const DronePlot &plot) { return plot.node_id != node_id; });
+   if (_segmented)
+      buildSegments();
+   if (_indexed)
+      buildIndexes();
 
    pthread_mutex_unlock(&_mutex);
 }
 
 /*****************************************************************************************
- * sortByTime - sort the database from earliest timestamp to latest
+ * sortByTime - sort the database from earliest timestamp to latest. Not logged--a database
+ *              recovered from its write-ahead log may come back in insertion order.
  *
  *       Used by the simulator--students should not need to use this
  *****************************************************************************************/
@@ -485,6 +1037,8 @@ void DronePlotDB::sortByTime() {
    pthread_mutex_lock(&_mutex);
 
    _dbdata.sort(compare_plot);
+   if (_segmented)
+      buildSegments();
 
    pthread_mutex_unlock(&_mutex);
 }
@@ -494,7 +1048,1105 @@ void DronePlotDB::sortByTime() {
  *****************************************************************************************/
 
 void DronePlotDB::clear() {
+   pthread_mutex_lock(&_mutex);
+
+   std::vector<uint8_t> rec(1, op_clear);
+   logRecord(rec);
    _dbdata.clear();
+   _inject_times.clear();
+   clearSegments();
+   clearIndexes();
+   publishLatest();
+
+   pthread_mutex_unlock(&_mutex);
 }
 
+/*****************************************************************************************
+ * setRetention - sets the retention policy applied by enforceRetention
+ *
+ *    Params:  max_age - seconds behind the newest row to keep, 0 for no limit
+ *             max_rows - rows to keep, 0 for no limit
+ *             archive_dir - where to roll evicted rows to, NULL or "" to just drop them
+ *
+ *    Throws: runtime_error if archive_dir doesn't exist and can't be created
+ *
+ *****************************************************************************************/
+
+void DronePlotDB::setRetention(time_t max_age, size_t max_rows, const char *archive_dir) {
+   std::string dir = (archive_dir == NULL) ? "" : archive_dir;
+   if ((dir.size() > 0) && (mkdir(dir.c_str(), 0755) == -1) && (errno != EEXIST))
+      throw std::runtime_error(std::string("Unable to create archive directory ") + dir + ": " +
+                                                                         strerror(errno));
+
+   pthread_mutex_lock(&_mutex);
+   _max_age = (max_age > 0) ? max_age : 0;
+   _max_rows = max_rows;
+   _archive_dir = dir;
+
+   // Segments are only kept up while there's a policy to evict by
+   if ((_max_age > 0) || (_max_rows > 0)) {
+      if (!_segmented)
+         buildSegments();
+   } else if (_segmented) {
+      _segmented = false;
+      clearSegments();
+   }
+   pthread_mutex_unlock(&_mutex);
+}
 
+/*****************************************************************************************
+ * enforceRetention - evicts the time segments the retention policy no longer covers. The
+ *                    segments are runs at the front of the database in time order, so the
+ *                    ones to go are found from the segment table alone and come off in a
+ *                    single splice, logged as one record. Only the query indexes, if a query
+ *                    has built them, need to visit each evicted row. Writing the archive
+ *                    happens after unlocking, so ingest isn't held up by the disk.
+ *
+ *    Params:  cutoff - gets the timestamp rows were evicted below (unchanged if none were)
+ *
+ *    Returns: the number of rows evicted
+ *
+ *****************************************************************************************/
+
+size_t DronePlotDB::enforceRetention(time_t &cutoff) {
+   plot_list evicted;
+   std::string archive_dir;
+
+   pthread_mutex_lock(&_mutex);
+   if (!_segmented || _segments.empty()) {
+      pthread_mutex_unlock(&_mutex);
+      return 0;
+   }
+
+   // Oldest segments go while they are entirely too old or there are too many rows
+   size_t count = 0;
+   time_t limit = 0;
+   auto keep = _segments.begin();
+   for ( ; keep != _segments.end(); keep++) {
+      time_t seg_end = keep->first + retention_segment_secs;
+      bool too_old = (_max_age > 0) && (seg_end <= _newest - _max_age);
+      bool too_many = (_max_rows > 0) && (_dbdata.size() - count > _max_rows);
+      if (!too_old && !too_many)
+         break;
+
+      count += keep->second.rows;
+      limit = seg_end;
+   }
+
+   if (count == 0) {
+      pthread_mutex_unlock(&_mutex);
+      return 0;
+   }
+
+   int64_t limit64 = limit;
+   std::vector<uint8_t> rec(1, op_evict);
+   rec.insert(rec.end(), (uint8_t *) &limit64, (uint8_t *) &limit64 + sizeof(limit64));
+   logRecord(rec);
+
+   auto last = (keep == _segments.end()) ? _first_new : keep->second.first;
+   if (_indexed || !_inject_times.empty()) {
+      for (auto dptr = _dbdata.begin(); dptr != last; dptr++) {
+         if (_indexed)
+            unindexPlot(dptr);
+         forgetInjectTime(*dptr);
+      }
+   }
+   evicted.splice(evicted.end(), _dbdata, _dbdata.begin(), last);
+   _segments.erase(_segments.begin(), keep);
+   publishLatest();
+
+   archive_dir = _archive_dir;
+   pthread_mutex_unlock(&_mutex);
+
+   cutoff = limit;
+
+   if (archive_dir.size() > 0) {
+      // Segments come out in order, their rows in any order
+      evicted.sort(compare_plot);
+
+      std::string base = archive_dir + "/plots." + std::to_string(evicted.front().timestamp) + "-" +
+                                                   std::to_string(evicted.back().timestamp);
+      std::string filename = base + ".dpar";
+      for (unsigned int i=1; access(filename.c_str(), F_OK) == 0; i++)
+         filename = base + "." + std::to_string(i) + ".dpar";
+
+      FileFD outfile(filename.c_str());
+      if (!outfile.openFile(FileFD::writefd, true) || (writeArchive(outfile, evicted) < 0))
+         std::cerr << "Unable to write " << filename << "--" << evicted.size() <<
+                      " evicted plots were not archived\n";
+   }
+
+   return evicted.size();
+}
+
+/*****************************************************************************************
+ * setTimestamp - changes the timestamp of a stored plot
+ * clrFlags - disables the indicated flags on a stored plot
+ *
+ *    Params:  dptr - the plot's position in the database
+ *
+ *    Note: these lock the mutex and may block if it is already locked.
+ *
+ *****************************************************************************************/
+
+void DronePlotDB::setTimestamp(plot_list::iterator dptr, time_t timestamp) {
+   if (!DronePlot::fitsTimestamp(timestamp))
+      throw plotdata_error("Plot timestamp " + std::to_string(timestamp) + " won't fit in 32 bits");
+
+   pthread_mutex_lock(&_mutex);
+
+   int64_t ts = timestamp;
+   logPlot(op_retime, *dptr, (uint8_t *) &ts, sizeof(ts));
+   if (_indexed)
+      unindexPlot(dptr);
+   if (_segmented)
+      unplaceRow(dptr);
+   dptr->timestamp = timestamp;
+   if (_segmented)
+      placeRow(dptr);
+   if (_indexed) {
+      indexPlot(dptr);
+      publishLatest();
+   }
+
+   pthread_mutex_unlock(&_mutex);
+}
+
+void DronePlotDB::clrFlags(plot_list::iterator dptr, unsigned short flags) {
+   pthread_mutex_lock(&_mutex);
+
+   uint16_t new_flags = dptr->getFlags() & ~flags;
+   logPlot(op_flags, *dptr, (uint8_t *) &new_flags, sizeof(new_flags));
+
+   // A row leaving DBFLAG_NEW joins its time segment
+   bool replace = _segmented && (flags & DBFLAG_NEW) && dptr->isFlagSet(DBFLAG_NEW);
+   if (replace)
+      unplaceRow(dptr);
+   dptr->clrFlags(flags);
+   if (replace)
+      placeRow(dptr);
+
+   // The latest table holds a copy, flags and all
+   if (_indexed) {
+      auto drone = _by_drone.find(dptr->drone_id);
+      if ((drone != _by_drone.end()) && (drone->second.rbegin()->second == dptr)) {
+         updateLatest(dptr->drone_id);
+         publishLatest();
+      }
+   }
+
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * shiftNodeTimes - moves every plot of a node by the same amount, as when its clock
+ *                  correction changes. Plots flagged DBFLAG_NEW are left alone. Logged as
+ *                  one record rather than one per plot.
+ *
+ *    Params:  node_id - the node whose plots to shift
+ *             delta - seconds to add to each timestamp
+ *
+ *****************************************************************************************/
+
+void DronePlotDB::shiftNodeTimes(unsigned int node_id, time_t delta) {
+   pthread_mutex_lock(&_mutex);
+
+   int64_t delta64 = delta;
+   std::vector<uint8_t> rec(1, op_shift);
+   rec.insert(rec.end(), (uint8_t *) &node_id, (uint8_t *) &node_id + sizeof(node_id));
+   rec.insert(rec.end(), (uint8_t *) &delta64, (uint8_t *) &delta64 + sizeof(delta64));
+   logRecord(rec);
+
+   // Placing moves rows, so find them all before shifting any
+   std::vector<plot_list::iterator> rows;
+   for (auto dptr = _dbdata.begin(); dptr != _dbdata.end(); dptr++) {
+      if ((dptr->node_id == node_id) && !dptr->isFlagSet(DBFLAG_NEW))
+         rows.push_back(dptr);
+   }
+
+   for (auto dptr : rows) {
+      if (_indexed)
+         unindexPlot(dptr);
+      if (_segmented)
+         unplaceRow(dptr);
+      dptr->timestamp += delta;
+      if (_segmented)
+         placeRow(dptr);
+      if (_indexed)
+         indexPlot(dptr);
+   }
+   _node_shifts[node_id] += delta;
+   publishLatest();
+
+   pthread_mutex_unlock(&_mutex);
+}
+
+std::map<unsigned int, time_t> DronePlotDB::getNodeShifts() {
+   pthread_mutex_lock(&_mutex);
+
+   std::map<unsigned int, time_t> shifts = _node_shifts;
+
+   pthread_mutex_unlock(&_mutex);
+   return shifts;
+}
+
+/*****************************************************************************************
+ * plotsInTimeRange - finds every plot with t0 <= timestamp <= t1
+ * plotsForDrone - finds a drone's plots with t0 <= timestamp <= t1
+ *
+ *    Returns: iterators to the matching rows, in timestamp order
+ *
+ *    Note: these lock the mutex and may block if it is already locked.
+ *
+ *****************************************************************************************/
+
+std::vector<plot_list::iterator> DronePlotDB::plotsInTimeRange(time_t t0, time_t t1) {
+   std::vector<plot_list::iterator> found;
+
+   pthread_mutex_lock(&_mutex);
+   if (!_indexed)
+      buildIndexes();
+
+   if (t0 <= t1) {
+      auto last = _by_time.upper_bound(t1);
+      for (auto iptr = _by_time.lower_bound(t0); iptr != last; iptr++)
+         found.push_back(iptr->second);
+   }
+
+   pthread_mutex_unlock(&_mutex);
+   return found;
+}
+
+std::vector<plot_list::iterator> DronePlotDB::plotsForDrone(unsigned int drone_id,
+                                                                      time_t t0, time_t t1) {
+   std::vector<plot_list::iterator> found;
+
+   pthread_mutex_lock(&_mutex);
+   if (!_indexed)
+      buildIndexes();
+
+   auto dptr = _by_drone.find(drone_id);
+   if ((dptr != _by_drone.end()) && (t0 <= t1)) {
+      auto last = dptr->second.upper_bound(t1);
+      for (auto iptr = dptr->second.lower_bound(t0); iptr != last; iptr++)
+         found.push_back(iptr->second);
+   }
+
+   pthread_mutex_unlock(&_mutex);
+   return found;
+}
+
+/*****************************************************************************************
+ * latestPlot - gets the plot with the newest timestamp for a drone--where it is now
+ *
+ *    Params:  drone_id - the drone to look up
+ *             plot - gets a copy of the plot
+ *
+ *    Returns: false if the database holds no plots for the drone
+ *
+ *****************************************************************************************/
+
+bool DronePlotDB::latestPlot(unsigned int drone_id, DronePlot &plot) {
+   std::shared_ptr<const latest_map> latest = latestPositions();
+
+   auto lptr = latest->find(drone_id);
+   if (lptr == latest->end())
+      return false;
+
+   plot = lptr->second;
+   return true;
+}
+
+/*****************************************************************************************
+ * latestPositions - gets the current snapshot of each drone's latest plot. The snapshot only
+ *                   exists once the indexes are built, so the first call builds them.
+ *
+ *    Returns: the snapshot, keyed by drone ID
+ *
+ *****************************************************************************************/
+
+std::shared_ptr<const DronePlotDB::latest_map> DronePlotDB::latestPositions() {
+   std::shared_ptr<const latest_map> latest = std::atomic_load(&_latest_view);
+   if (latest)
+      return latest;
+
+   pthread_mutex_lock(&_mutex);
+   if (!_indexed)
+      buildIndexes();
+   pthread_mutex_unlock(&_mutex);
+
+   return std::atomic_load(&_latest_view);
+}
+
+/*****************************************************************************************
+ * holdLatest - starts a batch of changes that publishes its latest positions once, at the end
+ * releaseLatest - ends a batch, publishing the latest positions if it was the last one
+ *****************************************************************************************/
+
+void DronePlotDB::holdLatest() {
+   pthread_mutex_lock(&_mutex);
+   _latest_holds++;
+   pthread_mutex_unlock(&_mutex);
+}
+
+void DronePlotDB::releaseLatest() {
+   pthread_mutex_lock(&_mutex);
+   if (_latest_holds > 0)
+      _latest_holds--;
+   publishLatest();
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * plotsInBox - finds the plots inside a latitude/longitude box in a time window
+ * plotsInRadius - finds the plots within radius_m meters of a point in a time window
+ * nearestPlots - finds the k plots nearest a point in a time window
+ *
+ *    Returns: iterators to the matching rows
+ *
+ *    Note: these lock the mutex and may block if it is already locked.
+ *
+ *****************************************************************************************/
+
+std::vector<plot_list::iterator> DronePlotDB::plotsInBox(double lat0, double lon0,
+                                    double lat1, double lon1, time_t t0, time_t t1) {
+   std::vector<plot_list::iterator> found;
+
+   pthread_mutex_lock(&_mutex);
+   if (!_indexed)
+      buildIndexes();
+   _geo.findInBox(lat0, lon0, lat1, lon1, t0, t1, found);
+   pthread_mutex_unlock(&_mutex);
+
+   return found;
+}
+
+std::vector<plot_list::iterator> DronePlotDB::plotsInRadius(double lat, double lon,
+                                    double radius_m, time_t t0, time_t t1) {
+   std::vector<plot_list::iterator> found;
+
+   pthread_mutex_lock(&_mutex);
+   if (!_indexed)
+      buildIndexes();
+   _geo.findInRadius(lat, lon, radius_m, t0, t1, found);
+   pthread_mutex_unlock(&_mutex);
+
+   return found;
+}
+
+std::vector<plot_list::iterator> DronePlotDB::nearestPlots(double lat, double lon,
+                                    size_t k, time_t t0, time_t t1) {
+   std::vector<plot_list::iterator> found;
+
+   pthread_mutex_lock(&_mutex);
+   if (!_indexed)
+      buildIndexes();
+   _geo.findNearest(lat, lon, k, t0, t1, found);
+   pthread_mutex_unlock(&_mutex);
+
+   return found;
+}
+
+/*****************************************************************************************
+ * latestInBox, latestInRadius, nearestDrones - as above, but over each drone's latest plot
+ *
+ *    Returns: copies of the matching plots, nearest first for nearestDrones
+ *
+ *    Note: these lock the mutex and may block if it is already locked.
+ *
+ *****************************************************************************************/
+
+std::vector<DronePlot> DronePlotDB::latestInBox(double lat0, double lon0, double lat1,
+                                                                       double lon1) {
+   std::vector<plot_list::iterator> found;
+
+   pthread_mutex_lock(&_mutex);
+   if (!_indexed)
+      buildIndexes();
+   _latest_geo.findInBox(lat0, lon0, lat1, lon1, std::numeric_limits<time_t>::min(),
+                                          std::numeric_limits<time_t>::max(), found);
+   std::vector<DronePlot> plots;
+   for (auto dptr : found)
+      plots.push_back(*dptr);
+   pthread_mutex_unlock(&_mutex);
+
+   return plots;
+}
+
+std::vector<DronePlot> DronePlotDB::latestInRadius(double lat, double lon, double radius_m) {
+   std::vector<plot_list::iterator> found;
+
+   pthread_mutex_lock(&_mutex);
+   if (!_indexed)
+      buildIndexes();
+   _latest_geo.findInRadius(lat, lon, radius_m, std::numeric_limits<time_t>::min(),
+                                          std::numeric_limits<time_t>::max(), found);
+   std::vector<DronePlot> plots;
+   for (auto dptr : found)
+      plots.push_back(*dptr);
+   pthread_mutex_unlock(&_mutex);
+
+   return plots;
+}
+
+std::vector<DronePlot> DronePlotDB::nearestDrones(double lat, double lon, size_t k) {
+   std::vector<plot_list::iterator> found;
+
+   pthread_mutex_lock(&_mutex);
+   if (!_indexed)
+      buildIndexes();
+   _latest_geo.findNearest(lat, lon, k, std::numeric_limits<time_t>::min(),
+                                          std::numeric_limits<time_t>::max(), found);
+   std::vector<DronePlot> plots;
+   for (auto dptr : found)
+      plots.push_back(*dptr);
+   pthread_mutex_unlock(&_mutex);
+
+   return plots;
+}
+
+/*****************************************************************************************
+ * buildIndexes - indexes every row by timestamp, by drone and by position. Done once, on the first query,
+ *                so databases that are never queried (such as the simulator's source) don't
+ *                pay for the indexes.
+ * indexPlot - adds a row to the indexes. Rows usually arrive in time order, so the insert is
+ *             hinted at the end. A row newer than its drone's latest replaces it in the
+ *             latest-position index.
+ * unindexPlot - removes a row from the indexes using its current drone, position and
+ *               timestamp. If it was its drone's latest, the next newest takes its place.
+ *****************************************************************************************/
+
+void DronePlotDB::buildIndexes() {
+   clearIndexes();
+   for (auto dptr = _dbdata.begin(); dptr != _dbdata.end(); dptr++)
+      indexPlot(dptr);
+   _indexed = true;
+   publishLatest();
+}
+
+void DronePlotDB::clearIndexes() {
+   _by_time.clear();
+   _by_drone.clear();
+   _geo.clear();
+   _latest_geo.clear();
+   _latest.clear();
+   _latest_changed = true;
+}
+
+/*****************************************************************************************
+ * updateLatest - copies a drone's newest row into the working latest table, or drops the
+ *                drone if it has no rows left
+ * publishLatest - hands readers a copy of the working table if it changed. A copy per
+ *                 mutex'd call (not per row) keeps bulk loads cheap, and a latest_batch
+ *                 stretches that to a whole run of single-row calls.
+ *****************************************************************************************/
+
+void DronePlotDB::updateLatest(unsigned int drone_id) {
+   auto drone = _by_drone.find(drone_id);
+   if (drone == _by_drone.end())
+      _latest.erase(drone_id);
+   else
+      _latest[drone_id] = *drone->second.rbegin()->second;
+   _latest_changed = true;
+}
+
+void DronePlotDB::publishLatest() {
+   if (!_indexed || !_latest_changed)
+      return;
+
+   // Held for a batch--wait for its end, unless readers have no snapshot at all yet
+   if ((_latest_holds > 0) && std::atomic_load(&_latest_view))
+      return;
+
+   std::atomic_store(&_latest_view, std::shared_ptr<const latest_map>(new latest_map(_latest)));
+   _latest_changed = false;
+}
+
+void DronePlotDB::indexPlot(plot_list::iterator dptr) {
+   _by_time.emplace_hint(_by_time.end(), dptr->timestamp, dptr);
+
+   _geo.insert(dptr);
+
+   time_index &drone = _by_drone[dptr->drone_id];
+   bool had_latest = !drone.empty();
+   auto latest = had_latest ? drone.rbegin()->second : _dbdata.end();
+   drone.emplace_hint(drone.end(), dptr->timestamp, dptr);
+
+   if (drone.rbegin()->second != latest) {
+      if (had_latest)
+         _latest_geo.erase(latest);
+      _latest_geo.insert(dptr);
+      updateLatest(dptr->drone_id);
+   }
+}
+
+static void eraseIndexEntry(std::multimap<time_t, plot_list::iterator> &index,
+                                                      plot_list::iterator dptr) {
+   auto range = index.equal_range(dptr->timestamp);
+   for (auto iptr = range.first; iptr != range.second; iptr++) {
+      if (iptr->second == dptr) {
+         index.erase(iptr);
+         return;
+      }
+   }
+}
+
+void DronePlotDB::unindexPlot(plot_list::iterator dptr) {
+   eraseIndexEntry(_by_time, dptr);
+   _geo.erase(dptr);
+
+   auto drone = _by_drone.find(dptr->drone_id);
+   if (drone == _by_drone.end())
+      return;
+
+   bool was_latest = (drone->second.rbegin()->second == dptr);
+   eraseIndexEntry(drone->second, dptr);
+   if (was_latest) {
+      _latest_geo.erase(dptr);
+      if (!drone->second.empty())
+         _latest_geo.insert(drone->second.rbegin()->second);
+   }
+
+   if (drone->second.empty())
+      _by_drone.erase(drone);
+   if (was_latest)
+      updateLatest(dptr->drone_id);
+}
+
+/*****************************************************************************************
+ * buildSegments - groups every row into its time segment, the segments in time order and rows
+ *                 flagged DBFLAG_NEW after them all. Stable, so a time-sorted database stays
+ *                 sorted.
+ * clearSegments - empties the segment table, leaving _segmented as it is
+ * placeRow - puts a row at the front of its time segment's run, starting a segment if needed,
+ *            or at the back of the database if it is flagged DBFLAG_NEW
+ * unplaceRow - takes a row out of its segment or the new rows, using its current timestamp
+ *              and flags. The row stays where it is until the caller erases or places it.
+ *****************************************************************************************/
+
+static time_t segmentStart(time_t timestamp) {
+   time_t seg = timestamp / retention_segment_secs;
+   if (timestamp % retention_segment_secs < 0)
+      seg--;
+   return seg * retention_segment_secs;
+}
+
+void DronePlotDB::buildSegments() {
+   auto segmentOf = [](const DronePlot &plot) {
+      return (plot.getFlags() & DBFLAG_NEW) ? std::numeric_limits<time_t>::max() :
+                                              segmentStart(plot.timestamp);
+   };
+   _dbdata.sort([&](const DronePlot &pp1, const DronePlot &pp2) {
+                   return segmentOf(pp1) < segmentOf(pp2); });
+
+   clearSegments();
+   for (auto dptr = _dbdata.begin(); dptr != _dbdata.end(); dptr++) {
+      if (dptr->isFlagSet(DBFLAG_NEW)) {
+         _first_new = dptr;
+         break;
+      }
+
+      time_t start = segmentStart(dptr->timestamp);
+      if (_segments.empty() || (_segments.rbegin()->first != start))
+         _segments.emplace_hint(_segments.end(), start, time_segment{dptr, 0});
+      _segments.rbegin()->second.rows++;
+      _newest = std::max<time_t>(_newest, dptr->timestamp);
+   }
+   _segmented = true;
+}
+
+void DronePlotDB::clearSegments() {
+   _segments.clear();
+   _first_new = _dbdata.end();
+   _newest = std::numeric_limits<time_t>::min();
+}
+
+void DronePlotDB::placeRow(plot_list::iterator dptr) {
+   if (dptr->isFlagSet(DBFLAG_NEW)) {
+      _dbdata.splice(_dbdata.end(), _dbdata, dptr);
+      if (_first_new == _dbdata.end())
+         _first_new = dptr;
+      return;
+   }
+
+   time_t start = segmentStart(dptr->timestamp);
+   auto seg = _segments.lower_bound(start);
+   if ((seg != _segments.end()) && (seg->first == start)) {
+      _dbdata.splice(seg->second.first, _dbdata, dptr);
+      seg->second.first = dptr;
+      seg->second.rows++;
+   } else {
+      // A new segment goes in ahead of the next newer one, or of the new rows
+      _dbdata.splice((seg == _segments.end()) ? _first_new : seg->second.first, _dbdata, dptr);
+      _segments.emplace_hint(seg, start, time_segment{dptr, 1});
+   }
+   _newest = std::max<time_t>(_newest, dptr->timestamp);
+}
+
+void DronePlotDB::unplaceRow(plot_list::iterator dptr) {
+   if (dptr->isFlagSet(DBFLAG_NEW)) {
+      if (dptr == _first_new)
+         _first_new = std::next(dptr);
+      return;
+   }
+
+   auto seg = _segments.find(segmentStart(dptr->timestamp));
+   if (seg == _segments.end())
+      return;
+
+   if (--seg->second.rows == 0)
+      _segments.erase(seg);
+   else if (seg->second.first == dptr)
+      seg->second.first = std::next(dptr);
+}
+
+/*****************************************************************************************
+ * setMeta - stores a blob under a tag, replacing any earlier one
+ * getMeta - retrieves a blob
+ *
+ *    Returns: (getMeta) false if nothing is stored under the tag
+ *
+ *****************************************************************************************/
+
+void DronePlotDB::setMeta(uint8_t tag, const std::vector<uint8_t> &data) {
+   pthread_mutex_lock(&_mutex);
+
+   std::vector<uint8_t> rec = {op_meta, tag};
+   rec.insert(rec.end(), data.begin(), data.end());
+   logRecord(rec);
+   _meta[tag] = data;
+
+   pthread_mutex_unlock(&_mutex);
+}
+
+bool DronePlotDB::getMeta(uint8_t tag, std::vector<uint8_t> &data) {
+   pthread_mutex_lock(&_mutex);
+
+   auto mptr = _meta.find(tag);
+   bool found = (mptr != _meta.end());
+   if (found)
+      data = mptr->second;
+
+   pthread_mutex_unlock(&_mutex);
+   return found;
+}
+
+/*****************************************************************************************
+ * putWALPlot - appends a plot to a record or snapshot in the serialize() layout plus flags.
+ *              Unlike serialize(), any drone ID is allowed.
+ * getWALPlot - reads one back
+ *****************************************************************************************/
+
+static void putWALPlot(std::vector<uint8_t> &buf, const DronePlot &plot, uint16_t flags) {
+   int64_t ts = plot.timestamp;
+   size_t pos = buf.size();
+   buf.resize(pos + wal_plot_size);
+
+   uint8_t *dst = buf.data() + pos;
+   memcpy(dst, &plot.drone_id, 4);
+   memcpy(dst + 4, &plot.node_id, 4);
+   memcpy(dst + 8, &ts, 8);
+   memcpy(dst + 16, &plot.latitude, 4);
+   memcpy(dst + 20, &plot.longitude, 4);
+   memcpy(dst + 24, &flags, 2);
+}
+
+static void getWALPlot(const uint8_t *src, DronePlot &plot) {
+   int64_t ts;
+   uint16_t flags;
+
+   memcpy(&plot.drone_id, src, 4);
+   memcpy(&plot.node_id, src + 4, 4);
+   memcpy(&ts, src + 8, 8);
+   memcpy(&plot.latitude, src + 16, 4);
+   memcpy(&plot.longitude, src + 20, 4);
+   memcpy(&flags, src + 24, 2);
+   plot.timestamp = ts;
+   plot.clrFlags(0xFFFF);
+   plot.setFlags(flags);
+}
+
+/*****************************************************************************************
+ * logRecord - hands a record to the write-ahead log, if there is one
+ * logPlot - logs an op on a plot, identifying the plot by its current contents and flags
+ *
+ *    Note: the caller holds the mutex, so records land in the log in the order the changes
+ *          were made
+ *****************************************************************************************/
+
+void DronePlotDB::logRecord(std::vector<uint8_t> &rec) {
+   if (_wal)
+      _wal->append(rec);
+}
+
+void DronePlotDB::logPlot(uint8_t op, const DronePlot &plot, const uint8_t *extra, size_t extra_len) {
+   if (!_wal)
+      return;
+
+   std::vector<uint8_t> rec(1, op);
+   rec.reserve(1 + wal_plot_size + extra_len);
+   putWALPlot(rec, plot, plot.getFlags());
+   rec.insert(rec.end(), extra, extra + extra_len);
+   _wal->append(rec);
+}
+
+/*****************************************************************************************
+ * buildSnapshot - encodes the whole database. Layout (host byte order):
+ *
+ *    u64 plot count, then each plot (wal_plot_size bytes)
+ *    u32 node shift count, then each as u32 node, i64 shift
+ *    u32 meta count, then each as u8 tag, u32 length, data
+ *
+ * loadSnapshot - replaces the database contents with a decoded snapshot
+ *
+ *    Throws: walfile_error if the snapshot is malformed
+ *****************************************************************************************/
+
+void DronePlotDB::buildSnapshot(std::vector<uint8_t> &body) {
+   uint64_t count = _dbdata.size();
+   uint32_t num;
+
+   body.clear();
+   body.reserve(8 + count * wal_plot_size);
+   body.insert(body.end(), (uint8_t *) &count, (uint8_t *) &count + 8);
+   for (auto &plot : _dbdata)
+      putWALPlot(body, plot, plot.getFlags());
+
+   num = _node_shifts.size();
+   body.insert(body.end(), (uint8_t *) &num, (uint8_t *) &num + 4);
+   for (auto &shift : _node_shifts) {
+      int64_t delta = shift.second;
+      body.insert(body.end(), (uint8_t *) &shift.first, (uint8_t *) &shift.first + 4);
+      body.insert(body.end(), (uint8_t *) &delta, (uint8_t *) &delta + 8);
+   }
+
+   num = _meta.size();
+   body.insert(body.end(), (uint8_t *) &num, (uint8_t *) &num + 4);
+   for (auto &meta : _meta) {
+      uint32_t len = meta.second.size();
+      body.push_back(meta.first);
+      body.insert(body.end(), (uint8_t *) &len, (uint8_t *) &len + 4);
+      body.insert(body.end(), meta.second.begin(), meta.second.end());
+   }
+}
+
+void DronePlotDB::loadSnapshot(const std::vector<uint8_t> &body) {
+   const uint8_t *pos = body.data();
+   const uint8_t *end = body.data() + body.size();
+   uint64_t count;
+   uint32_t num;
+
+   auto need = [&](uint64_t bytes) {
+      if (bytes > static_cast<uint64_t>(end - pos))
+         throw walfile_error("Snapshot ended prematurely");
+   };
+
+   _dbdata.clear();
+   _inject_times.clear();
+   _node_shifts.clear();
+   _meta.clear();
+
+   // No snapshot has been written yet
+   if (body.empty())
+      return;
+
+   need(8);
+   memcpy(&count, pos, 8);
+   pos += 8;
+   need(count * wal_plot_size);
+   for (uint64_t i=0; i<count; i++, pos += wal_plot_size) {
+      _dbdata.emplace_back();
+      getWALPlot(pos, _dbdata.back());
+   }
+
+   need(4);
+   memcpy(&num, pos, 4);
+   pos += 4;
+   need(num * 12ULL);
+   for (uint32_t i=0; i<num; i++, pos += 12) {
+      unsigned int node_id;
+      int64_t delta;
+      memcpy(&node_id, pos, 4);
+      memcpy(&delta, pos + 4, 8);
+      _node_shifts[node_id] = delta;
+   }
+
+   need(4);
+   memcpy(&num, pos, 4);
+   pos += 4;
+   for (uint32_t i=0; i<num; i++) {
+      uint32_t len;
+      need(5);
+      uint8_t tag = pos[0];
+      memcpy(&len, pos + 1, 4);
+      pos += 5;
+      need(len);
+      _meta[tag].assign(pos, pos + len);
+      pos += len;
+   }
+
+   if (pos != end)
+      throw walfile_error("Snapshot has trailing data");
+}
+
+/*****************************************************************************************
+ * openWAL - makes the database persistent. Loads the latest snapshot, replays every change
+ *           logged after it, then starts logging. Plots named by an erase or retime record
+ *           are found through a hash of their contents, rebuilt whenever a bulk op (shift,
+ *           remove or keep node) changes many rows at once. If anything was replayed, a fresh
+ *           snapshot is written so the next restart starts from it.
+ *
+ *    Params:  dir - directory for the snapshot and log files (created if needed)
+ *
+ *    Returns: number of plots in the recovered database
+ *
+ *    Throws: walfile_error if the database isn't empty, or the files can't be used
+ *
+ *****************************************************************************************/
+
+size_t DronePlotDB::openWAL(const char *dir) {
+   typedef plot_list::iterator plot_iter;
+
+   pthread_mutex_lock(&_mutex);
+   if (_wal || !_dbdata.empty()) {
+      pthread_mutex_unlock(&_mutex);
+      throw walfile_error("openWAL requires an empty database without a log");
+   }
+
+   std::vector<uint8_t> snapshot;
+   bool loaded = false;
+   std::unordered_multimap<std::string, plot_iter> index;
+   bool index_valid = false;
+   size_t missing = 0;
+
+   auto plotKey = [](const uint8_t *rec) {
+      return std::string((const char *) rec, wal_plot_size);
+   };
+   auto plotKeyOf = [](const DronePlot &plot) {
+      std::vector<uint8_t> buf;
+      putWALPlot(buf, plot, plot.getFlags());
+      return std::string((const char *) buf.data(), buf.size());
+   };
+
+   // Finds the row a record refers to, building the index first if it is stale
+   auto findPlot = [&](const uint8_t *rec, plot_iter &found) {
+      if (!index_valid) {
+         index.clear();
+         for (auto dptr = _dbdata.begin(); dptr != _dbdata.end(); dptr++)
+            index.emplace(plotKeyOf(*dptr), dptr);
+         index_valid = true;
+      }
+
+      auto iptr = index.find(plotKey(rec));
+      if (iptr == index.end()) {
+         missing++;
+         return false;
+      }
+      found = iptr->second;
+      index.erase(iptr);
+      return true;
+   };
+
+   auto replay = [&](const uint8_t *rec, size_t len) {
+      // The snapshot is filled in before the first record is handed over
+      if (!loaded) {
+         loadSnapshot(snapshot);
+         loaded = true;
+      }
+
+      if (len == 0)
+         throw walfile_error("Empty write-ahead log record");
+
+      uint8_t op = rec[0];
+      rec++;
+      len--;
+
+      unsigned int node_id;
+      int64_t val64;
+      uint16_t flags;
+      plot_iter dptr;
+
+      switch (op) {
+      case op_add:
+         if (len != wal_plot_size)
+            break;
+         _dbdata.emplace_back();
+         getWALPlot(rec, _dbdata.back());
+         if (index_valid)
+            index.emplace(plotKey(rec), std::prev(_dbdata.end()));
+         return;
+
+      case op_erase:
+         if (len != wal_plot_size)
+            break;
+         if (findPlot(rec, dptr))
+            _dbdata.erase(dptr);
+         return;
+
+      case op_retime:
+      case op_flags:
+         if (len != wal_plot_size + ((op == op_retime) ? 8 : 2))
+            break;
+         if (findPlot(rec, dptr)) {
+            if (op == op_retime) {
+               memcpy(&val64, rec + wal_plot_size, 8);
+               dptr->timestamp = val64;
+            } else {
+               memcpy(&flags, rec + wal_plot_size, 2);
+               dptr->clrFlags(0xFFFF);
+               dptr->setFlags(flags);
+            }
+            index.emplace(plotKeyOf(*dptr), dptr);
+         }
+         return;
+
+      case op_shift:
+         if (len != 12)
+            break;
+         memcpy(&node_id, rec, 4);
+         memcpy(&val64, rec + 4, 8);
+         for (auto &plot : _dbdata) {
+            if ((plot.node_id == node_id) && !plot.isFlagSet(DBFLAG_NEW))
+               plot.timestamp += val64;
+         }
+         _node_shifts[node_id] += val64;
+         index_valid = false;
+         return;
+
+      case op_remove_node:
+      case op_keep_node:
+         if (len != 4)
+            break;
+         memcpy(&node_id, rec, 4);
+         _dbdata.remove_if([node_id, op](const DronePlot &plot) {
+                              return (plot.node_id == node_id) == (op == op_remove_node); });
+         index_valid = false;
+         return;
+
+      case op_clear:
+         _dbdata.clear();
+         index.clear();
+         return;
+
+      case op_meta:
+         if (len < 1)
+            break;
+         _meta[rec[0]].assign(rec + 1, rec + len);
+         return;
+
+      case op_evict:
+         if (len != 8)
+            break;
+         memcpy(&val64, rec, 8);
+         _dbdata.remove_if([val64](DronePlot &plot) {
+                              return (plot.timestamp < val64) && !plot.isFlagSet(DBFLAG_NEW); });
+         index_valid = false;
+         return;
+      }
+      throw walfile_error("Malformed write-ahead log record");
+   };
+
+   size_t records;
+   try {
+      std::unique_ptr<WriteAheadLog> wal(new WriteAheadLog());
+      records = wal->open(dir, snapshot, replay);
+      if (!loaded)
+         loadSnapshot(snapshot);
+      _wal = std::move(wal);
+   } catch (...) {
+      _dbdata.clear();
+      clearSegments();
+      clearIndexes();
+      publishLatest();
+      _node_shifts.clear();
+      _meta.clear();
+      pthread_mutex_unlock(&_mutex);
+      throw;
+   }
+
+   // Replay edits the rows directly
+   if (_segmented)
+      buildSegments();
+   if (_indexed)
+      buildIndexes();
+
+   size_t count = _dbdata.size();
+   pthread_mutex_unlock(&_mutex);
+
+   if (missing > 0)
+      std::cerr << "Write-ahead log replay: " << missing << " records named plots not found\n";
+
+   if (records > 0)
+      checkpoint();
+   return count;
+}
+
+/*****************************************************************************************
+ * checkpoint - captures the database and starts a new log epoch under the mutex, so the
+ *              snapshot lines up exactly with the log, then writes the snapshot outside it
+ *              so other threads aren't held up by the disk
+ *
+ *    Throws: walfile_error if the log or snapshot can't be written
+ *
+ *****************************************************************************************/
+
+void DronePlotDB::checkpoint() {
+   std::vector<uint8_t> body;
+   uint64_t epoch;
+
+   pthread_mutex_lock(&_mutex);
+   if (!_wal) {
+      pthread_mutex_unlock(&_mutex);
+      return;
+   }
+
+   buildSnapshot(body);
+   try {
+      epoch = _wal->rotate();
+   } catch (...) {
+      pthread_mutex_unlock(&_mutex);
+      throw;
+   }
+   pthread_mutex_unlock(&_mutex);
+
+   _wal->writeSnapshot(body, epoch);
+}
+
+/*****************************************************************************************
+ * checkpointIfDue - checkpoints once the log holds more than the snapshot would, so replay
+ *                   time and disk use stay proportional to the size of the database
+ *
+ *    Returns: true if a checkpoint was written
+ *
+ *****************************************************************************************/
+
+bool DronePlotDB::checkpointIfDue() {
+   if (!_wal)
+      return false;
+
+   if (_wal->getLogSize() <= std::max(min_checkpoint_log, _wal->getSnapshotSize()))
+      return false;
+
+   checkpoint();
+   return true;
+}
+
+void DronePlotDB::syncWAL() {
+   if (_wal)
+      _wal->sync();
+}
+
+/*****************************************************************************************
+ * closeWAL - checkpoints and closes the log. The database stays loaded.
+ *****************************************************************************************/
+
+void DronePlotDB::closeWAL() {
+   if (!_wal)
+      return;
+
+   checkpoint();
+
+   pthread_mutex_lock(&_mutex);
+   _wal.reset();
+   pthread_mutex_unlock(&_mutex);
+}
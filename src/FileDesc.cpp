@@ -5,6 +5,8 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "FileDesc.h"
@@ -12,7 +14,7 @@
 
 const unsigned int bufsize = 500;
 
-FileDesc::FileDesc() {
+FileDesc::FileDesc():_fd(-1) {
 
 }
 
@@ -143,10 +145,13 @@ bool FileDesc::isOpen() {
 }
 
 /***************************************************************************************
- * closeFD - closes the FD cleanly
+ * closeFD - closes the FD cleanly. Safe to call more than once--a stale FD number may
+ *           already belong to another connection
  ***************************************************************************************/
 void FileDesc::closeFD() {
-   close(_fd);
+   if (_fd >= 0)
+      close(_fd);
+   _fd = -1;
 }
 
 /****************************************************************************************
@@ -212,19 +217,24 @@ void SocketFD::bindFD(const char *ip_addr, short unsigned int port) {
  *
  *    Params:  ip_addr - the IP address string of the server to connect to in std format
  *             port - the port of the server to connect to
+ *             ms_timeout - how long to wait for the other end before giving up. A server
+ *                          that isn't accepting would otherwise block us for minutes
  *
  *    Returns: true if the connect worked, false otherwise
  *****************************************************************************************/
 
-bool SocketFD::connectTo(const char *ip_addr, unsigned short port) {
+bool SocketFD::connectTo(const char *ip_addr, unsigned short port, long ms_timeout) {
 
    unsigned long n_ip_addr;
 
    inet_pton(AF_INET, ip_addr, &n_ip_addr);
-   return connectTo(n_ip_addr, htons(port));
+   return connectTo(n_ip_addr, htons(port), ms_timeout);
 }
 
-bool SocketFD::connectTo(unsigned long ip_addr, unsigned short port) {
+bool SocketFD::connectTo(unsigned long ip_addr, unsigned short port, long ms_timeout) {
+   // Don't leak the socket made by the constructor or a previous attempt
+   closeFD();
+
    if ((_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
       throw socket_error("Socket creation failed.");
 
@@ -234,9 +244,34 @@ bool SocketFD::connectTo(unsigned long ip_addr, unsigned short port) {
    _fd_addr.sin_addr.s_addr = ip_addr;
    _fd_addr.sin_port = port;
 
-   if (connect(_fd, (struct sockaddr *) &_fd_addr, sizeof(_fd_addr)) != 0)
+   // Connect nonblocking so we can bound the wait, then put the socket back how it was
+   int flags = fcntl(_fd, F_GETFL);
+   if ((flags < 0) || (fcntl(_fd, F_SETFL, flags | O_NONBLOCK) < 0))
+      throw socket_error("Failed setting socket to nonblocking for connect.");
+
+   bool connected = (connect(_fd, (struct sockaddr *) &_fd_addr, sizeof(_fd_addr)) == 0);
+   if (!connected && (errno == EINPROGRESS)) {
+      fd_set write_fds;
+      timeval timeout;
+      timeout.tv_sec = ms_timeout / 1000;
+      timeout.tv_usec = (ms_timeout % 1000) * 1000;
+
+      FD_ZERO(&write_fds);
+      FD_SET(_fd, &write_fds);
+
+      int sock_err = 0;
+      socklen_t len = sizeof(sock_err);
+      if ((select(_fd+1, NULL, &write_fds, NULL, &timeout) == 1) &&
+          (getsockopt(_fd, SOL_SOCKET, SO_ERROR, &sock_err, &len) == 0) && (sock_err == 0))
+         connected = true;
+   }
+
+   if (!connected) {
+      closeFD();
       return false;
+   }
 
+   fcntl(_fd, F_SETFL, flags);
    return true;
 
 }
@@ -267,6 +302,7 @@ void SocketFD::listenFD(int backlog) {
 bool SocketFD::acceptFD(SocketFD &server) {
    socklen_t len = sizeof(_fd_addr);
 
+   closeFD();
    _fd = accept(server.getFD(), (struct sockaddr *) &_fd_addr, &len);
    if (_fd == -1)
       return false;
@@ -327,7 +363,7 @@ FileFD::FileFD(const char *filename):FileDesc(), _filename(filename) {
 }
 
 FileFD::~FileFD() {
-
+   unmapFile();
 }
 
 /******************************************************************************************
@@ -335,7 +371,7 @@ FileFD::~FileFD() {
  *
  *    Params:  ftype - the type FD - options are:
  *                   readfd - read only
- *                   writefd - write only
+ *                   writefd - write only, truncating the file if it already exists
  *                   appendfd - write only, moves pointer to the end
  *             create - if the file doesn't exist, setting this true will cause it to be
  *                      created
@@ -345,7 +381,7 @@ FileFD::~FileFD() {
  ******************************************************************************************/
 
 bool FileFD::openFile(fd_file_type ftype, bool create) {
-   int file_flags[] = {O_RDONLY, O_WRONLY, O_WRONLY | O_APPEND};
+   int file_flags[] = {O_RDONLY, O_WRONLY | O_TRUNC, O_WRONLY | O_APPEND};
 
    int flags = file_flags[ftype];
    if (create)
@@ -357,6 +393,47 @@ bool FileFD::openFile(fd_file_type ftype, bool create) {
    return true;
 }
 
+/******************************************************************************************
+ * mapFile - maps the entire file into memory read-only so it can be parsed in place without
+ *           a read() per record. The kernel is told we'll read it front to back.
+ *
+ *    Returns: false if the file isn't open or couldn't be mapped, true otherwise
+ *
+ ******************************************************************************************/
+
+bool FileFD::mapFile() {
+   unmapFile();
+
+   struct stat st;
+   if (fstat(_fd, &st) == -1)
+      return false;
+
+   if (st.st_size == 0)
+      return true;
+
+   void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, _fd, 0);
+   if (addr == MAP_FAILED)
+      return false;
+
+   madvise(addr, st.st_size, MADV_SEQUENTIAL);
+
+   _map = static_cast<const uint8_t *>(addr);
+   _map_size = st.st_size;
+   return true;
+}
+
+/******************************************************************************************
+ * unmapFile - releases the map from mapFile, if there is one
+ ******************************************************************************************/
+
+void FileFD::unmapFile() {
+   if (_map != NULL)
+      munmap(const_cast<uint8_t *>(_map), _map_size);
+
+   _map = NULL;
+   _map_size = 0;
+}
+
 /*****************************************************************************************
  * readStr - For a file FD, reads in characters until it hits a newline char. Not set up to
  *          work with sockets as it does not buffer and could lose data if partial data
@@ -0,0 +1,280 @@
+#include <cmath>
+#include <algorithm>
+#include "GeoIndex.h"
+#include "DronePlotDB.h"
+
+const double earth_radius_m = 6371008.8;
+const double deg_to_rad = M_PI / 180.0;
+const double unbounded = std::numeric_limits<double>::infinity();
+
+// Wraps a longitude into [-180, 180)
+static double wrapLon(double lon) {
+   double wrapped = std::fmod(lon + 180.0, 360.0);
+   if (wrapped < 0.0)
+      wrapped += 360.0;
+   return wrapped - 180.0;
+}
+
+/*********************************************************************************************
+ * GeoIndex (constructor)
+ *
+ *    Params:  cell_deg - width and height of a grid cell in degrees. Cells should hold a
+ *                        handful of plots each--much smaller and queries walk empty cells,
+ *                        much bigger and they filter rows outside the query.
+ *********************************************************************************************/
+GeoIndex::GeoIndex(double cell_deg):_cell_deg(cell_deg) {
+   if (!(_cell_deg > 0.0) || (_cell_deg > 180.0))
+      _cell_deg = default_cell_deg;
+   _lat_cells = static_cast<uint32_t>(std::ceil(180.0 / _cell_deg));
+   _lon_cells = static_cast<uint32_t>(std::ceil(360.0 / _cell_deg));
+}
+
+uint32_t GeoIndex::latCell(double lat) const {
+   if (!(lat > -90.0))        // Also catches NaN
+      return 0;
+   double cell = std::floor((lat + 90.0) / _cell_deg);
+   return (cell >= _lat_cells) ? _lat_cells - 1 : static_cast<uint32_t>(cell);
+}
+
+uint32_t GeoIndex::lonCell(double lon) const {
+   if (!std::isfinite(lon))
+      return 0;
+   double cell = std::floor((wrapLon(lon) + 180.0) / _cell_deg);
+   return (cell >= _lon_cells) ? _lon_cells - 1 : static_cast<uint32_t>(cell);
+}
+
+/*********************************************************************************************
+ * insert - adds a row under its current position and timestamp
+ * erase - removes a row, which must still have the position and timestamp it was added with
+ *********************************************************************************************/
+void GeoIndex::insert(plot_iter dptr) {
+   cell &bin = _cells[cellKey(latCell(dptr->latitude), lonCell(dptr->longitude))];
+   bin.emplace_hint(bin.end(), dptr->timestamp, dptr);
+   _count++;
+}
+
+void GeoIndex::erase(plot_iter dptr) {
+   auto cptr = _cells.find(cellKey(latCell(dptr->latitude), lonCell(dptr->longitude)));
+   if (cptr == _cells.end())
+      return;
+
+   auto range = cptr->second.equal_range(dptr->timestamp);
+   for (auto iptr = range.first; iptr != range.second; iptr++) {
+      if (iptr->second == dptr) {
+         cptr->second.erase(iptr);
+         _count--;
+         break;
+      }
+   }
+   if (cptr->second.empty())
+      _cells.erase(cptr);
+}
+
+void GeoIndex::clear() {
+   _cells.clear();
+   _count = 0;
+}
+
+/*********************************************************************************************
+ * forCells - visits the stored cells in a block of the grid. The longitude range runs from
+ *            lon_lo up through lon_hi, wrapping past the antimeridian if lon_lo > lon_hi.
+ *            When the block has more cells than are stored, it walks the stored cells instead
+ *            of looking up each one in the block.
+ *********************************************************************************************/
+template <typename F> void GeoIndex::forCells(uint32_t lat_lo, uint32_t lat_hi, uint32_t lon_lo,
+                                              uint32_t lon_hi, F visit) const {
+   uint64_t lon_span = (lon_lo <= lon_hi) ? lon_hi - lon_lo + 1 : _lon_cells - lon_lo + lon_hi + 1;
+   uint64_t block = (static_cast<uint64_t>(lat_hi) - lat_lo + 1) * lon_span;
+
+   if (block > _cells.size()) {
+      for (auto &stored : _cells) {
+         uint32_t lat_cell = stored.first / _lon_cells;
+         uint32_t lon_cell = stored.first % _lon_cells;
+         if ((lat_cell < lat_lo) || (lat_cell > lat_hi))
+            continue;
+         if ((lon_lo <= lon_hi) ? ((lon_cell < lon_lo) || (lon_cell > lon_hi)) :
+                                  ((lon_cell < lon_lo) && (lon_cell > lon_hi)))
+            continue;
+         visit(stored.second);
+      }
+      return;
+   }
+
+   for (uint32_t lat_cell = lat_lo; lat_cell <= lat_hi; lat_cell++) {
+      for (uint64_t i = 0; i < lon_span; i++) {
+         auto cptr = _cells.find(cellKey(lat_cell, (lon_lo + i) % _lon_cells));
+         if (cptr != _cells.end())
+            visit(cptr->second);
+      }
+   }
+}
+
+/*********************************************************************************************
+ * findInBox - finds the rows inside a latitude/longitude box in a time window
+ *
+ *    Params:  lat0, lat1 - southern and northern edges. Nothing matches if lat0 > lat1.
+ *             lon0, lon1 - western and eastern edges
+ *             t0, t1 - time window, inclusive
+ *             found - matching rows are appended here
+ *********************************************************************************************/
+void GeoIndex::findInBox(double lat0, double lon0, double lat1, double lon1, time_t t0, time_t t1,
+                                                   std::vector<plot_iter> &found) const {
+   if ((lat0 > lat1) || (t0 > t1) || std::isnan(lat0) || std::isnan(lat1) ||
+       !std::isfinite(lon0) || !std::isfinite(lon1))
+      return;
+
+   // Boxes 360 degrees or wider take every longitude, otherwise the edges are wrapped and a
+   // west edge east of the east edge means the box crosses the antimeridian
+   bool all_lon = (lon1 - lon0 >= 360.0);
+   double west = wrapLon(lon0), east = wrapLon(lon1);
+   bool wraps = !all_lon && (west > east);
+
+   uint32_t lon_lo = 0, lon_hi = _lon_cells - 1;
+   if (!all_lon) {
+      lon_lo = lonCell(west);
+      lon_hi = lonCell(east);
+      if (wraps && (lon_lo <= lon_hi)) {
+         lon_lo = 0;
+         lon_hi = _lon_cells - 1;
+      }
+   }
+
+   forCells(latCell(lat0), latCell(lat1), lon_lo, lon_hi, [&](const cell &bin) {
+      auto last = bin.upper_bound(t1);
+      for (auto iptr = bin.lower_bound(t0); iptr != last; iptr++) {
+         double lat = iptr->second->latitude;
+         double lon = wrapLon(iptr->second->longitude);
+         if ((lat < lat0) || (lat > lat1))
+            continue;
+         if (!all_lon && (wraps ? ((lon < west) && (lon > east)) : ((lon < west) || (lon > east))))
+            continue;
+         found.push_back(iptr->second);
+      }
+   });
+}
+
+/*********************************************************************************************
+ * findInRadius - finds the rows within a distance of a point in a time window. Searches the
+ *                box around the circle, then drops the rows in its corners.
+ *
+ *    Params:  lat, lon - the center
+ *             radius_m - the radius in meters
+ *             t0, t1 - time window, inclusive
+ *             found - matching rows are appended here
+ *********************************************************************************************/
+void GeoIndex::findInRadius(double lat, double lon, double radius_m, time_t t0, time_t t1,
+                                                   std::vector<plot_iter> &found) const {
+   if (!(radius_m >= 0.0) || std::isnan(lat) || !std::isfinite(lon))
+      return;
+
+   double angle = radius_m / earth_radius_m;
+   double dlat = angle / deg_to_rad;
+   double lat0 = lat - dlat, lat1 = lat + dlat;
+
+   // The widest longitude span of a circle is asin(sin(r) / cos(lat)) unless it takes in a pole
+   double lon0 = -180.0, lon1 = 180.0;
+   double reach = (angle < M_PI / 2.0) ? std::sin(angle) / std::cos(lat * deg_to_rad) : unbounded;
+   if ((lat0 > -90.0) && (lat1 < 90.0) && (reach < 1.0)) {
+      double dlon = std::asin(reach) / deg_to_rad;
+      lon0 = lon - dlon;
+      lon1 = lon + dlon;
+   }
+
+   size_t start = found.size();
+   findInBox(lat0, lon0, lat1, lon1, t0, t1, found);
+
+   found.erase(std::remove_if(found.begin() + start, found.end(), [&](plot_iter dptr) {
+                  return distance(lat, lon, dptr->latitude, dptr->longitude) > radius_m; }),
+               found.end());
+}
+
+/*********************************************************************************************
+ * findNearest - finds the k rows nearest a point in a time window. Searches rings of cells
+ *               outward from the point's cell until the kth nearest row found is closer than
+ *               anything outside the rings could be.
+ *
+ *    Params:  lat, lon - the point
+ *             k - how many rows to find
+ *             t0, t1 - time window, inclusive
+ *             found - the rows are appended here, nearest first (fewer than k if the index
+ *                     doesn't hold k in the window)
+ *********************************************************************************************/
+void GeoIndex::findNearest(double lat, double lon, size_t k, time_t t0, time_t t1,
+                                                   std::vector<plot_iter> &found) const {
+   if ((k == 0) || (t0 > t1) || (_count == 0) || std::isnan(lat) || !std::isfinite(lon))
+      return;
+
+   lon = wrapLon(lon);
+   std::vector<std::pair<double, plot_iter>> candidates;
+   auto addCell = [&](const cell &bin) {
+      auto last = bin.upper_bound(t1);
+      for (auto iptr = bin.lower_bound(t0); iptr != last; iptr++)
+         candidates.emplace_back(distance(lat, lon, iptr->second->latitude,
+                                          iptr->second->longitude), iptr->second);
+   };
+
+   int64_t clat = latCell(lat), clon = lonCell(lon);
+   for (int64_t r = 0; ; r++) {
+
+      // Past this point walking the rings costs more than just checking every stored cell
+      if ((2 * r + 1) * (2 * r + 1) > static_cast<int64_t>(_cells.size())) {
+         candidates.clear();
+         for (auto &stored : _cells)
+            addCell(stored.second);
+         break;
+      }
+
+      for (int64_t dy = -r; dy <= r; dy++) {
+         int64_t lat_cell = clat + dy;
+         if ((lat_cell < 0) || (lat_cell >= _lat_cells))
+            continue;
+         int64_t step = ((dy == -r) || (dy == r)) ? 1 : std::max<int64_t>(2 * r, 1);
+         for (int64_t dx = -r; dx <= r; dx += step) {
+            int64_t lon_cell = ((clon + dx) % _lon_cells + _lon_cells) % _lon_cells;
+            auto cptr = _cells.find(cellKey(lat_cell, lon_cell));
+            if (cptr != _cells.end())
+               addCell(cptr->second);
+         }
+      }
+
+      // Everything within bound meters of the point lies inside the rings searched so far
+      double gap_s = (clat - r <= 0) ? unbounded : lat - ((clat - r) * _cell_deg - 90.0);
+      double gap_n = (clat + r + 1 >= _lat_cells) ? unbounded : ((clat + r + 1) * _cell_deg - 90.0) - lat;
+      double gap_lon = unbounded;
+      if (2 * r + 1 < _lon_cells) {
+         double west = lon - ((clon - r) * _cell_deg - 180.0);
+         double east = ((clon + r + 1) * _cell_deg - 180.0) - lon;
+         double dlon = std::min(std::min(west, east), 90.0) * deg_to_rad;
+         gap_lon = std::asin(std::cos(lat * deg_to_rad) * std::sin(dlon)) / deg_to_rad;
+      }
+      double bound = std::min(std::min(gap_s, gap_n), gap_lon) * deg_to_rad * earth_radius_m;
+
+      if (bound == unbounded)
+         break;
+      if (candidates.size() >= k) {
+         std::nth_element(candidates.begin(), candidates.begin() + k - 1, candidates.end(),
+               [](const std::pair<double, plot_iter> &a, const std::pair<double, plot_iter> &b) {
+                  return a.first < b.first; });
+         if (candidates[k - 1].first <= bound)
+            break;
+      }
+   }
+
+   size_t keep = std::min(k, candidates.size());
+   std::partial_sort(candidates.begin(), candidates.begin() + keep, candidates.end(),
+               [](const std::pair<double, plot_iter> &a, const std::pair<double, plot_iter> &b) {
+                  return a.first < b.first; });
+   for (size_t i = 0; i < keep; i++)
+      found.push_back(candidates[i].second);
+}
+
+/*********************************************************************************************
+ * distance - great-circle distance between two points by the haversine formula
+ *********************************************************************************************/
+double GeoIndex::distance(double lat0, double lon0, double lat1, double lon1) {
+   double sin_dlat = std::sin((lat1 - lat0) * deg_to_rad / 2.0);
+   double sin_dlon = std::sin((lon1 - lon0) * deg_to_rad / 2.0);
+   double h = sin_dlat * sin_dlat +
+              std::cos(lat0 * deg_to_rad) * std::cos(lat1 * deg_to_rad) * sin_dlon * sin_dlon;
+   return 2.0 * earth_radius_m * std::asin(std::sqrt(std::min(1.0, h)));
+}
@@ -5,19 +5,32 @@
 #include <ostream>
 #include <string>
 #include <string.h>
+#include <chrono>
 #include "LogMgr.h"
 #include "strfuncts.h"
 #include "exceptions.h"
 
+// How long the writer sleeps when the ring is empty and nobody has woken it
+const unsigned int writer_idle_ms = 50;
 
 // Log manager, supports log_lvl for verbosity control
-LogMgr::LogMgr(const char *log_file, unsigned int log_lvl):_log_file(log_file),_log_lvl(log_lvl) {
+LogMgr::LogMgr(const char *log_file, unsigned int log_lvl):_log_file(log_file),_log_lvl(log_lvl),
+                                                           _ring(new slot[ring_slots]) {
+   for (size_t i=0; i<ring_slots; i++)
+      _ring[i].seq.store(i, std::memory_order_relaxed);
 
+   _writer = std::thread(&LogMgr::writerLoop, this);
 }
 
 
 LogMgr::~LogMgr() {
-   closeLog();
+   _exiting = true;
+   _wake.notify_one();
+   _writer.join();
+
+   std::lock_guard<std::mutex> lock(_file_mutex);
+   if (_lfptr != NULL)
+      fclose(_lfptr);
 }
 
 /***************************************************************************************************
@@ -37,10 +50,13 @@ void LogMgr::createTimestamp(std::string &buf) {
 }
 
 /***************************************************************************************************
- * writeLog - Writes a string to a log with the timestamp
+ * writeLog - Queues a string to be written to the log with the timestamp. The first entry after
+ *            the log is opened or renamed opens the file, so a bad path is still reported here.
  *
  *    Params:  str - string to write to the log in const char * or std::string format
  *             lvl - the "importance" of this log - can be used to set verbosity
+ *
+ *    Throws:  logfile_error if the log file can't be opened
  ***************************************************************************************************/
 
 void LogMgr::writeLog(const char *str, unsigned int lvl) {
@@ -50,24 +66,13 @@ void LogMgr::writeLog(const char *str, unsigned int lvl) {
       return;
 
    // If the file is not open yet, open it
-   if (_lfptr == NULL) {
-      if ((_lfptr = fopen(_log_file.c_str(), "a+")) == NULL) {
-         throw logfile_error("Unable to open log file to append.");
-      }
-   }
-
-   // Put together our timestamp and start the log with the stamp
-   std::string logstr;
-   createTimestamp(logstr);
-
-   // Now add on the text to log
-   logstr += " ";
-   logstr += str;
-   logstr += "\n";
-
-   fputs(logstr.c_str(), _lfptr);
-   fflush(_lfptr);
+   if (!_opened.load(std::memory_order_acquire))
+      openLog();
 
+   // The writer looks every writer_idle_ms anyway--only wake it early if the ring is filling up
+   if (push(str) && (_push_pos.load(std::memory_order_relaxed) -
+                     _written_pos.load(std::memory_order_relaxed) > ring_slots / 2))
+      _wake.notify_one();
 }
 
 void LogMgr::writeLog(std::string &str, unsigned int lvl) {
@@ -82,32 +87,187 @@ void LogMgr::writeLog(std::string &str, unsigned int lvl) {
  ***************************************************************************************************/
 
 void LogMgr::strerrLog(const char *str, unsigned int lvl) {
+   if (lvl > _log_lvl)
+      return;
+
    char strerr_buf[100];
    std::string logstr = str;
 
    logstr += " Reason: ";
-   if (strerror_r(errno, strerr_buf, 100) != 0) 
+   if (strerror_r(errno, strerr_buf, 100) != 0)
       throw std::runtime_error("Unexpected error writing to log when calling strerror_r");
 
    logstr += strerr_buf;
    return writeLog(logstr.c_str(), lvl);
 }
 
+/***************************************************************************************************
+ * push - copies an entry into the next free slot of the ring. Any number of threads may push at
+ *        once: each claims a position by advancing _push_pos and the slot's seq says whether it is
+ *        free for that position (seq == pos) or still holds an unwritten entry from a lap ago
+ *        (seq < pos, meaning the ring is full). Storing pos + 1 hands the slot to the writer.
+ *
+ *    Returns: false if the ring was full and the entry was dropped
+ ***************************************************************************************************/
+
+bool LogMgr::push(const char *str) {
+   size_t pos = _push_pos.load(std::memory_order_relaxed);
+   slot *sl;
+   while (true) {
+      sl = &_ring[pos & (ring_slots - 1)];
+      size_t seq = sl->seq.load(std::memory_order_acquire);
+      if (seq == pos) {
+         if (_push_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            break;
+      } else if (seq < pos) {
+         _dropped.fetch_add(1, std::memory_order_relaxed);
+         return false;
+      } else {
+         pos = _push_pos.load(std::memory_order_relaxed);
+      }
+   }
+
+   sl->when = time(NULL);
+   size_t len = strlen(str);
+   if (len > max_entry) {
+      len = max_entry;
+      memcpy(sl->text + max_entry - 3, "...", 3);
+      memcpy(sl->text, str, max_entry - 3);
+   } else {
+      memcpy(sl->text, str, len);
+   }
+   sl->len = len;
+
+   sl->seq.store(pos + 1, std::memory_order_release);
+   return true;
+}
+
+/***************************************************************************************************
+ * drain - formats every entry the writers have finished into batch and frees their slots. Stops
+ *         at the first slot still being filled, so entries go out in the order they were claimed.
+ ***************************************************************************************************/
+
+void LogMgr::drain(std::string &batch) {
+   size_t dropped = _dropped.exchange(0, std::memory_order_relaxed);
+   if (dropped > 0) {
+      createTimestamp(batch);
+      batch += " Log full--dropped " + std::to_string(dropped) + " entries.\n";
+   }
+
+   while (true) {
+      slot &sl = _ring[_pop_pos & (ring_slots - 1)];
+      if (sl.seq.load(std::memory_order_acquire) != _pop_pos + 1)
+         break;
+
+      if (sl.when != _stamp_time) {
+         char timestr[27];
+         if (ctime_r(&sl.when, timestr) == NULL)
+            throw std::runtime_error("ctime_r function failed unexpectedly");
+         _stamp = timestr;
+         clrNewlines(_stamp);
+         _stamp_time = sl.when;
+      }
+
+      batch += _stamp;
+      batch += ' ';
+      batch.append(sl.text, sl.len);
+      batch += '\n';
+
+      sl.seq.store(_pop_pos + ring_slots, std::memory_order_release);
+      _pop_pos++;
+   }
+}
+
+/***************************************************************************************************
+ * writerLoop - background thread that writes out whatever is in the ring as one batch, then sleeps
+ *              until woken or writer_idle_ms passes. On exit it writes anything still queued.
+ ***************************************************************************************************/
+
+void LogMgr::writerLoop() {
+   std::string batch;
+
+   while (true) {
+      bool exiting = _exiting.load();
+
+      batch.clear();
+      drain(batch);
+
+      if (!batch.empty()) {
+         std::lock_guard<std::mutex> lock(_file_mutex);
+         if (_lfptr == NULL)
+            _lfptr = fopen(_log_file.c_str(), "a+");
+         if (_lfptr != NULL) {
+            fwrite(batch.data(), 1, batch.size(), _lfptr);
+            fflush(_lfptr);
+         }
+      }
+
+      {
+         std::lock_guard<std::mutex> lock(_wake_mutex);
+         _written_pos.store(_pop_pos);
+      }
+      _flushed.notify_all();
+
+      if (!batch.empty())
+         continue;
+      if (exiting)
+         break;
+
+      std::unique_lock<std::mutex> lock(_wake_mutex);
+      _wake.wait_for(lock, std::chrono::milliseconds(writer_idle_ms));
+   }
+}
+
+/***************************************************************************************************
+ * openLog - opens the log file for the writer
+ *
+ *    Throws:  logfile_error if it can't be opened for append
+ ***************************************************************************************************/
+
+void LogMgr::openLog() {
+   std::lock_guard<std::mutex> lock(_file_mutex);
+   if (_lfptr == NULL) {
+      if ((_lfptr = fopen(_log_file.c_str(), "a+")) == NULL) {
+         throw logfile_error("Unable to open log file to append.");
+      }
+   }
+   _opened.store(true, std::memory_order_release);
+}
+
+/***************************************************************************************************
+ * flush - wakes the writer and waits for it to get everything logged up to now into the file
+ ***************************************************************************************************/
+
+void LogMgr::flush() {
+   size_t target = _push_pos.load();
+
+   std::unique_lock<std::mutex> lock(_wake_mutex);
+   _wake.notify_one();
+   _flushed.wait(lock, [this, target] { return _written_pos.load() >= target; });
+}
+
 // self-explanatory
 void LogMgr::closeLog() {
+   flush();
+
+   std::lock_guard<std::mutex> lock(_file_mutex);
    if (_lfptr != NULL) {
       fclose(_lfptr);
       _lfptr = NULL;
    }
+   _opened = false;
 }
 
 
 /***************************************************************************************************
- * changeFilename - Changes the filename the log file is set to write to
+ * changeFilename - Changes the filename the log file is set to write to. Entries logged before the
+ *                  change go to the old file.
  *
  ***************************************************************************************************/
 
 void LogMgr::changeFilename(const char *filename) {
    closeLog();
+
+   std::lock_guard<std::mutex> lock(_file_mutex);
    _log_file = filename;
 }
@@ -0,0 +1,371 @@
+#include <stdexcept>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <iostream>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "Metrics.h"
+#include "SimClock.h"
+
+// Exact buckets for 0..15, then sub_buckets per power of 2 up to 2^63
+const unsigned int sub_buckets = 8;
+const unsigned int hist_buckets = 16 + 60 * sub_buckets;
+
+// How often the socket thread looks to see if it has been stopped
+const int serve_poll_ms = 200;
+
+const char *counter_names[mc_count] = {
+   "plots_injected", "plots_local", "plots_replicated", "batches_queued", "batches_received",
+   "batches_dup", "batches_delivered", "conns_launched", "handshakes", "bytes_sent",
+   "bytes_received"
+};
+
+const char *hist_names[mh_count] = {
+   "repl_pass_us", "queue_new_us", "add_repl_us", "correction_us", "handshake_us", "queue_depth",
+   "e2e_latency_us"
+};
+
+const bool hist_is_time[mh_count] = {true, true, true, true, true, false, true};
+
+const char *gauge_names[mg_count] = {"queue_depth", "connections", "sim_pending"};
+
+// One thread's counters and histograms. Only the owning thread writes them; snapshot reads.
+struct hist_block {
+   std::atomic<uint64_t> buckets[hist_buckets];
+   std::atomic<uint64_t> count;
+   std::atomic<uint64_t> sum;
+   std::atomic<uint64_t> max;
+};
+
+struct thread_block {
+   std::atomic<uint64_t> counters[mc_count];
+   hist_block hists[mh_count];
+
+   // Per-origin latency, allocated the first time this thread sees each origin
+   std::atomic<hist_block *> latency[Metrics::max_latency_nodes];
+};
+
+// A histogram added up across threads
+struct hist_sums {
+   std::vector<uint64_t> buckets = std::vector<uint64_t>(hist_buckets, 0);
+   uint64_t count = 0;
+   uint64_t sum = 0;
+   uint64_t max = 0;
+
+   void add(const hist_block &hb);
+};
+
+// Every thread's block, kept after the thread exits so its counts stay in the totals. Never
+// destroyed--threads may still count during static destruction.
+struct metrics_state {
+   std::mutex mutex;
+   std::vector<thread_block *> blocks;
+   std::atomic<int64_t> gauges[mg_count];
+   int64_t start_ns;
+
+   // Report and socket threads
+   std::mutex run_mutex;
+   std::condition_variable stop_cv;
+   bool stopping = false;
+   std::thread reporter;
+   std::thread server;
+   std::string socket_path;
+};
+
+static metrics_state &getState() {
+   static metrics_state *state = [] {
+      metrics_state *s = new metrics_state;
+      for (unsigned int i=0; i<mg_count; i++)
+         s->gauges[i].store(0, std::memory_order_relaxed);
+      s->start_ns = Metrics::now();
+      return s;
+   }();
+   return *state;
+}
+
+static thread_block &localBlock() {
+   static thread_local thread_block *block = NULL;
+   if (block == NULL) {
+      block = new thread_block();
+      metrics_state &state = getState();
+      std::lock_guard<std::mutex> lock(state.mutex);
+      state.blocks.push_back(block);
+   }
+   return *block;
+}
+
+// Single writer, so a plain load and store does instead of a locked read-modify-write
+static void bump(std::atomic<uint64_t> &val, uint64_t n) {
+   val.store(val.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+static unsigned int bucketOf(uint64_t value) {
+   if (value < 2 * sub_buckets)
+      return value;
+   unsigned int msb = 63 - __builtin_clzll(value);
+   return 2 * sub_buckets + (msb - 4) * sub_buckets + ((value >> (msb - 3)) & (sub_buckets - 1));
+}
+
+// Largest value that lands in a bucket
+static uint64_t bucketTop(unsigned int bucket) {
+   if (bucket < 2 * sub_buckets)
+      return bucket;
+   unsigned int shift = (bucket - 2 * sub_buckets) / sub_buckets + 1;
+   uint64_t low = static_cast<uint64_t>(sub_buckets + (bucket % sub_buckets)) << shift;
+   return low + (static_cast<uint64_t>(1) << shift) - 1;
+}
+
+static void record(hist_block &hb, uint64_t value) {
+   bump(hb.buckets[bucketOf(value)], 1);
+   bump(hb.count, 1);
+   bump(hb.sum, value);
+   if (value > hb.max.load(std::memory_order_relaxed))
+      hb.max.store(value, std::memory_order_relaxed);
+}
+
+void hist_sums::add(const hist_block &hb) {
+   for (unsigned int b=0; b<hist_buckets; b++)
+      buckets[b] += hb.buckets[b].load(std::memory_order_relaxed);
+   count += hb.count.load(std::memory_order_relaxed);
+   sum += hb.sum.load(std::memory_order_relaxed);
+   max = std::max(max, hb.max.load(std::memory_order_relaxed));
+}
+
+/*********************************************************************************************
+ * formatHist - appends one histogram's line: count, mean and percentiles. A percentile is the
+ *              top of the bucket it falls in, capped at the largest value seen.
+ *********************************************************************************************/
+static void formatHist(std::string &out, const char *name, const hist_sums &hs, bool is_time) {
+   const double pcts[3] = {0.50, 0.90, 0.99};
+   uint64_t pvals[3] = {};
+   uint64_t total = 0, seen = 0;
+   for (unsigned int b=0; b<hist_buckets; b++)
+      total += hs.buckets[b];
+   unsigned int p = 0;
+   for (unsigned int b=0; (b<hist_buckets) && (p<3) && (total>0); b++) {
+      seen += hs.buckets[b];
+      while ((p < 3) && (seen >= pcts[p] * total))
+         pvals[p++] = std::min(bucketTop(b), hs.max);
+   }
+
+   char line[200];
+   double scale = is_time ? 1000.0 : 1.0;
+   double mean = (hs.count > 0) ? static_cast<double>(hs.sum) / hs.count : 0.0;
+   snprintf(line, sizeof(line), "%-20s n=%llu mean=%.1f p50=%.1f p90=%.1f p99=%.1f max=%.1f\n",
+                  name, static_cast<unsigned long long>(hs.count), mean / scale,
+                  pvals[0] / scale, pvals[1] / scale, pvals[2] / scale, hs.max / scale);
+   out += line;
+}
+
+int64_t Metrics::now() {
+   return SimClock::clockNs(CLOCK_MONOTONIC);
+}
+
+int64_t Metrics::wallNow() {
+   return SimClock::clockNs(CLOCK_REALTIME);
+}
+
+void Metrics::add(metric_counter counter, uint64_t n) {
+   bump(localBlock().counters[counter], n);
+}
+
+void Metrics::observe(metric_histogram hist, uint64_t value) {
+   record(localBlock().hists[hist], value);
+}
+
+void Metrics::observeLatency(unsigned int node_id, uint64_t ns) {
+   thread_block &tb = localBlock();
+   record(tb.hists[mh_e2e_latency], ns);
+   if (node_id >= max_latency_nodes)
+      return;
+
+   hist_block *hb = tb.latency[node_id].load(std::memory_order_relaxed);
+   if (hb == NULL) {
+      hb = new hist_block();
+      tb.latency[node_id].store(hb, std::memory_order_release);
+   }
+   record(*hb, ns);
+}
+
+void Metrics::set(metric_gauge gauge, int64_t value) {
+   getState().gauges[gauge].store(value, std::memory_order_relaxed);
+}
+
+/*********************************************************************************************
+ * snapshot - adds up every thread's counters and histograms and formats them, one per line
+ *
+ *    Params:  out - the text is appended here
+ *             since - the last snapshot's counter totals, for rates. Updated to this one.
+ *
+ *********************************************************************************************/
+void Metrics::snapshot(std::string &out, interval *since) {
+   metrics_state &state = getState();
+
+   uint64_t counts[mc_count] = {};
+   std::vector<hist_sums> hists(mh_count);
+   std::map<unsigned int, hist_sums> latency;
+   {
+      std::lock_guard<std::mutex> lock(state.mutex);
+      for (thread_block *tb : state.blocks) {
+         for (unsigned int i=0; i<mc_count; i++)
+            counts[i] += tb->counters[i].load(std::memory_order_relaxed);
+
+         for (unsigned int h=0; h<mh_count; h++)
+            hists[h].add(tb->hists[h]);
+
+         for (unsigned int n=0; n<max_latency_nodes; n++) {
+            hist_block *hb = tb->latency[n].load(std::memory_order_acquire);
+            if (hb != NULL)
+               latency[n].add(*hb);
+         }
+      }
+   }
+
+   int64_t when = now();
+   int64_t from = ((since != NULL) && (since->when != 0)) ? since->when : state.start_ns;
+   double secs = std::max(static_cast<double>(when - from) / 1e9, 1e-9);
+
+   char line[200];
+   snprintf(line, sizeof(line), "--- metrics at %.1fs ---\n",
+                                 static_cast<double>(when - state.start_ns) / 1e9);
+   out += line;
+
+   for (unsigned int i=0; i<mc_count; i++) {
+      uint64_t prev = (since != NULL) ? since->counts[i] : 0;
+      snprintf(line, sizeof(line), "%-20s %12llu %12.1f/s\n", counter_names[i],
+                     static_cast<unsigned long long>(counts[i]),
+                     static_cast<double>(counts[i] - prev) / secs);
+      out += line;
+   }
+
+   for (unsigned int i=0; i<mg_count; i++) {
+      snprintf(line, sizeof(line), "%-20s %12lld\n", gauge_names[i],
+                     static_cast<long long>(state.gauges[i].load(std::memory_order_relaxed)));
+      out += line;
+   }
+
+   for (unsigned int h=0; h<mh_count; h++)
+      formatHist(out, hist_names[h], hists[h], hist_is_time[h]);
+
+   for (auto &node : latency) {
+      snprintf(line, sizeof(line), "  from node %u", node.first);
+      formatHist(out, line, node.second, true);
+   }
+
+   if (since != NULL) {
+      since->when = when;
+      std::copy(counts, counts + mc_count, since->counts);
+   }
+}
+
+/*********************************************************************************************
+ * startReports - starts a thread that prints a snapshot every secs seconds until stop
+ *********************************************************************************************/
+void Metrics::startReports(unsigned int secs) {
+   metrics_state &state = getState();
+   std::lock_guard<std::mutex> lock(state.run_mutex);
+   if (state.reporter.joinable() || (secs == 0))
+      return;
+
+   state.reporter = std::thread([secs, &state] {
+      interval since;
+      std::unique_lock<std::mutex> lock(state.run_mutex);
+      while (!state.stop_cv.wait_for(lock, std::chrono::seconds(secs),
+                                     [&state] { return state.stopping; })) {
+         lock.unlock();
+         std::string text;
+         snapshot(text, &since);
+         std::cout << text << std::flush;
+         lock.lock();
+      }
+   });
+}
+
+/*********************************************************************************************
+ * serve - binds a Unix socket at path and starts a thread that writes a snapshot to each
+ *         client that connects, then hangs up. A stale socket file at path is replaced.
+ *
+ *    Throws: runtime_error if the socket can't be created, bound or listened on
+ *********************************************************************************************/
+void Metrics::serve(const char *path) {
+   metrics_state &state = getState();
+   std::lock_guard<std::mutex> lock(state.run_mutex);
+   if (state.server.joinable())
+      return;
+
+   struct sockaddr_un addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   if (strlen(path) >= sizeof(addr.sun_path))
+      throw std::runtime_error("Metrics socket path is too long");
+   strcpy(addr.sun_path, path);
+
+   int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (fd < 0)
+      throw std::runtime_error("Unable to create the metrics socket");
+
+   unlink(path);
+   if ((bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) || (listen(fd, 8) < 0)) {
+      close(fd);
+      throw std::runtime_error(std::string("Unable to listen for metrics on ") + path);
+   }
+   state.socket_path = path;
+
+   state.server = std::thread([fd, &state] {
+      interval since;
+      while (true) {
+         {
+            std::lock_guard<std::mutex> lock(state.run_mutex);
+            if (state.stopping)
+               break;
+         }
+
+         struct pollfd pfd = {fd, POLLIN, 0};
+         if (poll(&pfd, 1, serve_poll_ms) <= 0)
+            continue;
+
+         int client = accept(fd, NULL, NULL);
+         if (client < 0)
+            continue;
+
+         std::string text;
+         snapshot(text, &since);
+         size_t sent = 0;
+         while (sent < text.size()) {
+            ssize_t n = send(client, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+               break;
+            sent += n;
+         }
+         close(client);
+      }
+      close(fd);
+   });
+}
+
+void Metrics::stop() {
+   metrics_state &state = getState();
+   {
+      std::lock_guard<std::mutex> lock(state.run_mutex);
+      state.stopping = true;
+   }
+   state.stop_cv.notify_all();
+
+   if (state.reporter.joinable())
+      state.reporter.join();
+   if (state.server.joinable()) {
+      state.server.join();
+      unlink(state.socket_path.c_str());
+   }
+}
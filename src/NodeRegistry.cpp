@@ -0,0 +1,115 @@
+#include <fstream>
+#include <stdexcept>
+#include <arpa/inet.h>
+#include "NodeRegistry.h"
+#include "strfuncts.h"
+
+NodeRegistry::NodeRegistry() {
+
+}
+
+NodeRegistry::~NodeRegistry() {
+
+}
+
+/*********************************************************************************************
+ * loadFile - loads the list of replication servers from the file given in the parameter
+ *
+ *    Params:  filename - the path/filename to the server file in the following format:
+ *                   <server_id>, <ip_addr>, <port>
+ *
+ *    Returns: -1 for failure, # of servers loaded for success
+ *
+ *    Throws: runtime_error if a server ID or address is listed twice
+ *********************************************************************************************/
+int NodeRegistry::loadFile(const char *filename) {
+   std::ifstream sfile;
+   unsigned int count = 0;
+
+   sfile.open(filename, std::ifstream::in);
+   if (!sfile.is_open())
+      return -1;
+
+   std::string buf, left, right;
+   std::string svrid;
+   while (!sfile.eof()) {
+      std::getline(sfile, buf);
+      clrNewlines(buf);
+      if (buf.size() == 0)
+         break;
+
+      if (!split(buf, left, right, ','))
+         return -1;
+      clrSpaces(left);
+      svrid = left;
+
+      buf = right;
+      if (!split(buf, left, right, ','))
+         return -1;
+
+      clrSpaces(left);
+      clrSpaces(right);
+
+      in_addr ipaddr;
+      if (inet_pton(AF_INET, left.c_str(), &ipaddr) != 1)
+         return -1;
+
+      unsigned short port;
+      port = (unsigned short) strtol(right.c_str(), NULL, 10);
+      port = htons(port);
+
+      addNode(svrid.c_str(), ipaddr.s_addr, port);
+      count++;
+   }
+   return count;
+}
+
+/*********************************************************************************************
+ * addNode - registers a node and assigns it the next handle
+ *
+ *    Params:  server_id - the server's ID string
+ *             ip_addr - the server's IP address in network format
+ *             port - the server's port in network format
+ *
+ *    Returns: the new node's handle
+ *
+ *    Throws: runtime_error if the ID or the address/port is already registered
+ *********************************************************************************************/
+node_handle NodeRegistry::addNode(const char *server_id, unsigned long ip_addr, unsigned short port) {
+   node_handle node = _nodes.size();
+
+   if (!_by_id.emplace(server_id, node).second)
+      throw std::runtime_error("Server ID listed more than once in the server list.");
+
+   if (!_by_addr.emplace(addrKey(ip_addr, port), node).second) {
+      _by_id.erase(server_id);
+      throw std::runtime_error("Server address/port listed more than once in the server list.");
+   }
+
+   _nodes.push_back({server_id, ip_addr, port});
+   return node;
+}
+
+/*********************************************************************************************
+ * findByID - looks up a node's handle by its server ID string
+ *
+ *    Returns: the handle, or invalid_node if not found
+ *********************************************************************************************/
+node_handle NodeRegistry::findByID(const char *server_id) const {
+   auto found = _by_id.find(server_id);
+   if (found == _by_id.end())
+      return invalid_node;
+   return found->second;
+}
+
+/*********************************************************************************************
+ * findByAddr - looks up a node's handle by its IP address and port (both network format)
+ *
+ *    Returns: the handle, or invalid_node if not found
+ *********************************************************************************************/
+node_handle NodeRegistry::findByAddr(unsigned long ip_addr, unsigned short port) const {
+   auto found = _by_addr.find(addrKey(ip_addr, port));
+   if (found == _by_addr.end())
+      return invalid_node;
+   return found->second;
+}
@@ -0,0 +1,243 @@
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include "PlotArchive.h"
+#include "ByteOrder.h"
+
+const char archive_magic[4] = {'D', 'P', 'A', 'R'};
+const char index_magic[4] = {'D', 'P', 'I', 'X'};
+const uint16_t archive_version = 1;
+
+const size_t header_size = 16;
+const size_t record_size = 24;
+const size_t index_entry_size = 40;
+const size_t trailer_size = 32;
+
+/*********************************************************************************************
+ * Floats go through their bits with the ByteOrder helpers
+ *********************************************************************************************/
+static void putFloat(std::vector<uint8_t> &buf, float val) {
+   uint32_t bits;
+   memcpy(&bits, &val, sizeof(bits));
+   putLE(buf, bits, 4);
+}
+
+static float getFloat(const uint8_t *buf) {
+   uint32_t bits = getLE(buf, 4);
+   float val;
+   memcpy(&val, &bits, sizeof(val));
+   return val;
+}
+
+// 32 bit FNV-1a over the index, to catch a file truncated or overwritten in the middle
+static uint32_t checksum(const uint8_t *data, size_t len) {
+   uint32_t hash = 2166136261U;
+   for (size_t i=0; i<len; i++) {
+      hash ^= data[i];
+      hash *= 16777619U;
+   }
+   return hash;
+}
+
+/*********************************************************************************************
+ * isArchive - checks for the archive magic at the start of the data
+ *********************************************************************************************/
+bool PlotArchive::isArchive(const uint8_t *data, size_t size) {
+   return (size >= header_size) && (memcmp(data, archive_magic, sizeof(archive_magic)) == 0);
+}
+
+/*********************************************************************************************
+ * PlotArchive (constructor) - validates the header and trailer and loads the index. Block
+ *                             data is only read when a block is decoded.
+ *
+ *    Params:  data - the whole archive
+ *             size - its length in bytes
+ *
+ *    Throws: runtime_error if the archive is malformed, truncated or a newer version
+ *********************************************************************************************/
+PlotArchive::PlotArchive(const uint8_t *data, size_t size):_data(data) {
+   if (!isArchive(data, size) || (size < header_size + trailer_size))
+      throw std::runtime_error("Not a plot archive");
+
+   if ((getLE(data + 4, 2) != archive_version) || (getLE(data + 6, 2) != record_size))
+      throw std::runtime_error("Plot archive version not supported");
+
+   uint64_t block_plots = getLE(data + 8, 4);
+   if (block_plots == 0)
+      throw std::runtime_error("Plot archive header is corrupt");
+
+   const uint8_t *trailer = data + size - trailer_size;
+   uint64_t index_offset = getLE(trailer, 8);
+   _plot_count = getLE(trailer + 8, 8);
+   uint64_t num_blocks = getLE(trailer + 16, 4);
+   uint32_t index_sum = getLE(trailer + 20, 4);
+
+   if ((memcmp(trailer + 24, index_magic, sizeof(index_magic)) != 0) ||
+       (getLE(trailer + 28, 4) != archive_version))
+      throw std::runtime_error("Plot archive trailer is corrupt or the file is truncated");
+
+   if ((index_offset < header_size) || (index_offset > size - trailer_size) ||
+       (num_blocks * index_entry_size != size - trailer_size - index_offset))
+      throw std::runtime_error("Plot archive index does not fit the file");
+
+   const uint8_t *index = data + index_offset;
+   if (checksum(index, num_blocks * index_entry_size) != index_sum)
+      throw std::runtime_error("Plot archive index is corrupt");
+
+   _blocks.resize(num_blocks);
+   uint64_t total = 0;
+   for (uint64_t i=0; i<num_blocks; i++, index += index_entry_size) {
+      block_info &block = _blocks[i];
+      block.offset = getLE(index, 8);
+      block.count = getLE(index + 8, 4);
+      block.min_drone = getLE(index + 12, 4);
+      block.max_drone = getLE(index + 16, 4);
+      block.min_time = static_cast<int64_t>(getLE(index + 24, 8));
+      block.max_time = static_cast<int64_t>(getLE(index + 32, 8));
+
+      if ((block.count == 0) || (block.count > block_plots) || (block.offset < header_size) ||
+          (block.offset > index_offset) ||
+          (block.count * record_size > index_offset - block.offset))
+         throw std::runtime_error("Plot archive index entry is out of bounds");
+      total += block.count;
+   }
+
+   if (total != _plot_count)
+      throw std::runtime_error("Plot archive index does not match its plot count");
+}
+
+/*********************************************************************************************
+ * findBlocks - uses the index to pick out the blocks that may hold plots in [t0, t1] for the
+ *              drone. Blocks are only as selective as the data is ordered--a file written in
+ *              time order narrows a time range to a few blocks.
+ *
+ *    Returns: indexes of the matching blocks, in file order
+ *********************************************************************************************/
+std::vector<size_t> PlotArchive::findBlocks(time_t t0, time_t t1, int drone_id) const {
+   std::vector<size_t> found;
+   for (size_t i=0; i<_blocks.size(); i++) {
+      const block_info &block = _blocks[i];
+      if ((block.max_time < t0) || (block.min_time > t1))
+         continue;
+      if ((drone_id >= 0) && ((static_cast<uint32_t>(drone_id) < block.min_drone) ||
+                              (static_cast<uint32_t>(drone_id) > block.max_drone)))
+         continue;
+      found.push_back(i);
+   }
+   return found;
+}
+
+/*********************************************************************************************
+ * decodeBlock - decodes a block's records onto the end of a list
+ *
+ *    Params:  block - index of the block
+ *             plots - decoded plots are appended here
+ *             t0, t1, drone_id - only plots with t0 <= timestamp <= t1 from the drone (any
+ *                                drone if -1) are kept. By default, everything is.
+ *
+ *    Throws: plotdata_error if a kept plot's timestamp won't fit in 32 bits
+ *********************************************************************************************/
+void PlotArchive::decodeBlock(size_t block, plot_list &plots, time_t t0, time_t t1,
+                                                                          int drone_id) const {
+   const block_info &info = _blocks.at(block);
+   const uint8_t *rec = _data + info.offset;
+
+   for (uint32_t i=0; i<info.count; i++, rec += record_size) {
+      time_t timestamp = static_cast<int64_t>(getLE(rec + 8, 8));
+      uint32_t drone = getLE(rec, 4);
+      if ((timestamp < t0) || (timestamp > t1) ||
+          ((drone_id >= 0) && (drone != static_cast<uint32_t>(drone_id))))
+         continue;
+
+      if (!DronePlot::fitsTimestamp(timestamp))
+         throw plotdata_error("Archived plot timestamp " + std::to_string(timestamp) +
+                              " won't fit in 32 bits");
+
+      plots.emplace_back(drone, getLE(rec + 4, 4), 0, getFloat(rec + 16), getFloat(rec + 20));
+      plots.back().timestamp = timestamp;
+   }
+}
+
+/*********************************************************************************************
+ * PlotArchiveWriter (constructor)
+ *
+ *    Params:  block_plots - records per block. Smaller blocks make the index more selective
+ *                           at the cost of a bigger index.
+ *********************************************************************************************/
+PlotArchiveWriter::PlotArchiveWriter(uint32_t block_plots):_block_plots(block_plots) {
+   if (_block_plots == 0)
+      _block_plots = PlotArchive::default_block_plots;
+}
+
+void PlotArchiveWriter::putHeader(std::vector<uint8_t> &out) {
+   out.insert(out.end(), archive_magic, archive_magic + sizeof(archive_magic));
+   putLE(out, archive_version, 2);
+   putLE(out, record_size, 2);
+   putLE(out, _block_plots, 4);
+   putLE(out, 0, 4);
+   _written += header_size;
+   _started = true;
+}
+
+/*********************************************************************************************
+ * addPlot - encodes a plot, starting a new block in the index when the last one is full
+ *
+ *    Params:  plot - the plot to add
+ *             out - the header (first time) and record are appended here
+ *********************************************************************************************/
+void PlotArchiveWriter::addPlot(const DronePlot &plot, std::vector<uint8_t> &out) {
+   if (!_started)
+      putHeader(out);
+
+   if (_blocks.empty() || (_blocks.back().count == _block_plots)) {
+      _blocks.push_back({_written, 0, plot.drone_id, plot.drone_id, plot.timestamp,
+                                                                     plot.timestamp});
+   }
+
+   PlotArchive::block_info &block = _blocks.back();
+   block.count++;
+   block.min_drone = std::min(block.min_drone, plot.drone_id);
+   block.max_drone = std::max(block.max_drone, plot.drone_id);
+   block.min_time = std::min<time_t>(block.min_time, plot.timestamp);
+   block.max_time = std::max<time_t>(block.max_time, plot.timestamp);
+
+   putLE(out, plot.drone_id, 4);
+   putLE(out, plot.node_id, 4);
+   putLE(out, static_cast<int64_t>(plot.timestamp), 8);
+   putFloat(out, plot.latitude);
+   putFloat(out, plot.longitude);
+   _written += record_size;
+   _plot_count++;
+}
+
+/*********************************************************************************************
+ * finish - appends the block index and the trailer that points to it
+ *
+ *    Params:  out - the index and trailer (and the header, for an empty archive) go here
+ *********************************************************************************************/
+void PlotArchiveWriter::finish(std::vector<uint8_t> &out) {
+   if (!_started)
+      putHeader(out);
+
+   uint64_t index_offset = _written;
+   size_t index_start = out.size();
+   for (auto &block : _blocks) {
+      putLE(out, block.offset, 8);
+      putLE(out, block.count, 4);
+      putLE(out, block.min_drone, 4);
+      putLE(out, block.max_drone, 4);
+      putLE(out, 0, 4);
+      putLE(out, static_cast<int64_t>(block.min_time), 8);
+      putLE(out, static_cast<int64_t>(block.max_time), 8);
+   }
+
+   uint32_t index_sum = checksum(out.data() + index_start, out.size() - index_start);
+   putLE(out, index_offset, 8);
+   putLE(out, _plot_count, 8);
+   putLE(out, _blocks.size(), 4);
+   putLE(out, index_sum, 4);
+   out.insert(out.end(), index_magic, index_magic + sizeof(index_magic));
+   putLE(out, archive_version, 4);
+
+   _written += _blocks.size() * index_entry_size + trailer_size;
+}
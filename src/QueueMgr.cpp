@@ -1,13 +1,52 @@
 #include <fstream>
 #include <arpa/inet.h>
-#include <tuple>
 #include <sstream>
+#include <algorithm>
 #include <crypto++/osrng.h>
 #include <crypto++/filters.h>
 #include <crypto++/files.h>
 #include "strfuncts.h"
 #include "ReplServer.h"
 #include "TCPConn.h"
+#include "BufferPool.h"
+#include "TraceLog.h"
+#include "Metrics.h"
+
+// How many of the most recent batches to hold on to for answering gossip digests
+const unsigned int max_cached_batches = 256;
+
+// Seconds (real-world) between gossip digests to a random peer
+const time_t gossip_pull_interval = 3;
+
+const unsigned int msg_header_size = 7;
+
+// Little-endian helpers for the message header and digests
+static void putU16(std::vector<uint8_t> &buf, uint16_t val) {
+   buf.push_back(val & 0xFF);
+   buf.push_back(val >> 8);
+}
+
+static void putU32(std::vector<uint8_t> &buf, uint32_t val) {
+   for (unsigned int i=0; i<4; i++)
+      buf.push_back((val >> (8 * i)) & 0xFF);
+}
+
+static uint16_t getU16(const std::vector<uint8_t> &buf, size_t pos) {
+   return buf.at(pos) | (buf.at(pos + 1) << 8);
+}
+
+static uint32_t getU32(const std::vector<uint8_t> &buf, size_t pos) {
+   uint32_t val = 0;
+   for (unsigned int i=0; i<4; i++)
+      val |= static_cast<uint32_t>(buf.at(pos + i)) << (8 * i);
+   return val;
+}
+
+static void putHeader(std::vector<uint8_t> &buf, uint8_t type, node_handle origin, uint32_t seq) {
+   buf.push_back(type);
+   putU16(buf, origin);
+   putU32(buf, seq);
+}
 
 /********************************************************************************************
  * QueueMgr (constructor) - loads a hard-coded server.txt that contains a comma-separated list
@@ -15,10 +54,10 @@
  *
  ********************************************************************************************/
 
-QueueMgr::QueueMgr(unsigned int verbosity):TCPServer(verbosity)
-               
+QueueMgr::QueueMgr(unsigned int verbosity):TCPServer(verbosity),
+                                           _dissem(Disseminator::create(topo_mesh, 1))
 {
-   if (loadServerList("servers.txt") <= 0)
+   if (_nodes.loadFile("servers.txt") <= 0)
       throw std::runtime_error("Could not open server.txt file, or file was empty/corrupt.");
 
    loadAESKey("sharedkey.bin");
@@ -34,76 +73,20 @@ void QueueMgr::runServer() {
    throw std::runtime_error("runServer function used on QueueMgr object (should not be)");
 }
 
-/*********************************************************************************************
- * loadServerList - loads the list of other replication servers from the file given in
- *                  the parameter. Deconflicts the local server
- *
- *    Params:  filename - the path/filename to the server file in the following format:
- *                   <server_id>, <ip_addr>, <port>
- *
- *    Returns: -1 for failure, # of servers opened for success
- *
- *    Throws: socket_error for any network issues
- *********************************************************************************************/
-int QueueMgr::loadServerList(const char *filename) {
-   std::ifstream sfile;
-   unsigned int count = 0;
-
-   sfile.open(filename, std::ifstream::in);
-   if (!sfile.is_open())
-      return -1;
-
-   std::string buf, left, right;
-   std::string svrid;
-   while (!sfile.eof()) {
-      std::getline(sfile, buf);
-      clrNewlines(buf);
-      if (buf.size() == 0)
-         break;
-
-      if (!split(buf, left, right, ','))
-         return -1;
-      clrSpaces(left);
-      svrid = left;
-   
-      buf = right;   
-      if (!split(buf, left, right, ','))
-         return -1;
-
-      clrSpaces(left);
-      clrSpaces(right);
-   
-      in_addr ipaddr;
-      inet_pton(AF_INET, left.c_str(), &ipaddr);
-
-      unsigned short port;
-      port = (unsigned short) strtol(right.c_str(), NULL, 10);
-      port = htons(port);
-      
-      _server_list.push_back(std::tuple<std::string, unsigned long, 
-                                             unsigned long>(svrid, ipaddr.s_addr, port));
-      count++;     
-   }
-   return count;
-}
-
 /**********************************************************************************************
  * getClientID - Gets the server ID based on the IP address and port in the lookup table
  *
  *    Params:  ip_addr - host's IP address in network format
  *             port - host's port in network format
  *
- *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ *    Returns: the server ID string, or NULL if the address is not a listed server
  **********************************************************************************************/
 
 const char *QueueMgr::getClientID(unsigned long ip_addr, short unsigned int port) {
-   auto sl_iter = _server_list.begin();
-   for ( ; sl_iter != _server_list.end(); sl_iter++) {
-      if ((std::get<1>(*sl_iter) == ip_addr) && (std::get<2>(*sl_iter) == port)) {
-         return std::get<0>(*sl_iter).c_str();
-      }
-   }
-   return NULL;
+   node_handle node = _nodes.findByAddr(ip_addr, port);
+   if (node == invalid_node)
+      return NULL;
+   return _nodes.getID(node).c_str();
 }
 
 
@@ -117,28 +100,18 @@ const char *QueueMgr::getClientID(unsigned long ip_addr, short unsigned int port
 void QueueMgr::bindSvr(const char *ip_addr, short unsigned int port) {
    // Call the parent function
    TCPServer::bindSvr(ip_addr, port);
-   bool found = false;
 
-   // Now remove this server from the server list (if it's in there)
-   auto sliter = _server_list.begin();
-   while (sliter != _server_list.end()) {
-
-      // If we found our server, clear it from the list
-      if ((std::get<1>(*sliter) == getIPAddr()) && (std::get<2>(*sliter) == htons(getPort()))){
-         _server_ID = std::get<0>(*sliter);
-         sliter = _server_list.erase(sliter);
-         found = true;
-      }
-      else
-         sliter++;
-   }
+   // Find this server in the registry so we know who we are and can skip ourselves
+   _self = _nodes.findByAddr(getIPAddr(), htons(getPort()));
 
    // If we never found our server, that's a problem--crash out
-   if (!found) {
+   if (_self == invalid_node) {
       std::stringstream msg;
       msg << "Server at " << ip_addr << " port " << port << " not listed in servers.txt file.";
       throw std::runtime_error(msg.str().c_str());
    }
+   _server_ID = _nodes.getID(_self);
+   _seen.resize(_nodes.size());
 
    // Now re-open the server log with the server ID info
    std::string logname = getServerID();
@@ -148,6 +121,18 @@ void QueueMgr::bindSvr(const char *ip_addr, short unsigned int port) {
 }
 
 
+/*********************************************************************************************
+ * setTopology - changes how batches from sendToAll spread through the cluster. Every server
+ *               in the cluster should use the same topology and fanout.
+ *
+ *    Params:  topology - topo_mesh, topo_tree or topo_gossip
+ *             fanout - peers each server hands a batch to (ignored for full mesh)
+ *             seed - seed for gossip's random peer picks, 0 to seed from the clock
+ *********************************************************************************************/
+void QueueMgr::setTopology(topology_type topology, unsigned int fanout, unsigned long seed) {
+   _dissem.reset(Disseminator::create(topology, fanout, seed));
+}
+
 /*********************************************************************************************
  * handleQueue - runs through a cycle on the queue, accepting new connections and handling
  *               any data read from the connections, storing it in the connection buffer
@@ -166,6 +151,12 @@ void QueueMgr::handleQueue() {
    // Get data from input buffers on connections and add to the queue
    populateQueue();
 
+   // Gossip periodically swaps digests with a random peer to pull in anything it missed
+   if (_dissem->usesPull() && (_nodes.size() > 1) && (time(NULL) >= _next_pull)) {
+      sendDigest(_dissem->getPullPeer(_self, _nodes.size()));
+      _next_pull = time(NULL) + gossip_pull_interval;
+   }
+
 }
 
 /**********************************************************************************************
@@ -191,43 +182,304 @@ void QueueMgr::populateQueue() {
             throw std::runtime_error("TCPConn claimed replication data but none existed.");
          }
         
-         // Add this data to the queue
-         _queue.emplace(recv, (*conn_it)->getNodeID(), buf);
+         // Forward it as the topology dictates and, if it's new to us, add it to the queue
+         // (senders not in servers.txt get invalid_node)
+         node_handle from = _nodes.findByID((*conn_it)->getNodeID());
+         std::vector<uint8_t> payload;
+         BufferPool::take(payload, buf.size());
+         bool deliver = handleIncoming(from, buf, payload);
+         BufferPool::give(buf);
+         if (!deliver) {
+            BufferPool::give(payload);
+            continue;
+         }
+
+         size_t payload_size = payload.size();
+         _queue.emplace(recv, from, std::move(payload));
          if (_verbosity >= 3) {
             std::cout << "Replication info pulled off connection and placed into queue w/ " <<
-                              (buf.size()-4) / DronePlot::getDataSize() << " potential plots.\n";
+                              payload_size << " bytes.\n";
          }   
       }      
    }
 }
 
 /*********************************************************************************************
- * replToAll - places data into the queue for each server (calls replToServer). Replication 
-               will happen on its own
+ * sendToAll - starts a new batch from this server on its way to every other server. Which
+ *             servers we send to directly depends on the topology. Replication will happen
+ *             on its own
  *
- *    Params:  data - the data in binary form to send to the server
+ *    Params:  data - the data in binary form to send to the servers
  *
  *    Throws: socket_error for any network issues
  *********************************************************************************************/
 void QueueMgr::sendToAll(std::vector<uint8_t> &data) {
-   for (unsigned int i=0; i<_server_list.size(); i++) {
-      sendToServer(std::get<0>(_server_list[i]).c_str(), data);
+   uint32_t seq = _next_seq++;
+   _seen[_self].add(seq);
+
+   _recent.push_back({_self, seq, data});
+   if (_recent.size() > max_cached_batches)
+      _recent.pop_front();
+
+   forwardBatch(_self, seq, _self, data);
+}
+
+/*********************************************************************************************
+ * forwardBatch - wraps a batch in its header and queues it for each peer the topology picks
+ *
+ *    Params:  origin, seq - the server that created the batch and its sequence number there
+ *             from - who we got it from (ourselves if we created it)
+ *             payload - the batch contents
+ *********************************************************************************************/
+void QueueMgr::forwardBatch(node_handle origin, uint32_t seq, node_handle from,
+                                                         std::vector<uint8_t> &payload) {
+   std::vector<node_handle> targets;
+   _dissem->getTargets(_self, origin, from, _nodes.size(), targets);
+   if (targets.empty())
+      return;
+
+   std::vector<uint8_t> msg;
+   BufferPool::take(msg, msg_header_size + payload.size());
+   putHeader(msg, msg_batch, origin, seq);
+   msg.insert(msg.end(), payload.begin(), payload.end());
+
+   // Each target but the last gets a copy in a recycled buffer; the last gets the original
+   for (size_t i=0; i<targets.size() - 1; i++) {
+      std::vector<uint8_t> copy;
+      BufferPool::take(copy, msg.size());
+      copy.assign(msg.begin(), msg.end());
+      TraceLog::record(tr_batch_queued, targets[i], origin, seq, copy.size());
+      _queue.emplace(send, targets[i], std::move(copy));
+   }
+   TraceLog::record(tr_batch_queued, targets.back(), origin, seq, msg.size());
+   _queue.emplace(send, targets.back(), std::move(msg));
+   Metrics::add(mc_batches_queued, targets.size());
+}
+
+/*********************************************************************************************
+ * handleIncoming - strips the message header and deals with the message by type. New batches
+ *                  get forwarded and delivered, batches we've seen are dropped, direct
+ *                  messages are delivered, and digests are answered.
+ *
+ *    Params:  from - the peer this arrived from
+ *             msg - the full message as received
+ *             payload - gets the application data if there is any to deliver
+ *
+ *    Returns: true if payload should be handed to the application
+ *********************************************************************************************/
+bool QueueMgr::handleIncoming(node_handle from, std::vector<uint8_t> &msg,
+                                                std::vector<uint8_t> &payload) {
+   if (msg.size() < msg_header_size) {
+      _server_log.writeLog("Replication message too short for its header. Dropping.");
+      return false;
+   }
+
+   uint8_t type = msg[0];
+   node_handle origin = getU16(msg, 1);
+   uint32_t seq = getU32(msg, 3);
+   payload.assign(msg.begin() + msg_header_size, msg.end());
+
+   switch (type) {
+   case msg_direct:
+      return true;
+
+   case msg_digest:
+      if (from != invalid_node)
+         answerDigest(from, payload);
+      return false;
+
+   case msg_batch:
+      if (origin >= _nodes.size()) {
+         _server_log.writeLog("Replication batch from unknown origin. Dropping.");
+         return false;
+      }
+
+      // Each batch is only forwarded and delivered the first time we see it
+      if (!_seen[origin].add(seq)) {
+         TraceLog::record(tr_batch_dup, from, origin, seq);
+         Metrics::add(mc_batches_dup);
+         return false;
+      }
+      TraceLog::record(tr_batch_received, from, origin, seq, msg.size());
+      Metrics::add(mc_batches_received);
+
+      _recent.push_back({origin, seq, payload});
+      if (_recent.size() > max_cached_batches)
+         _recent.pop_front();
+
+      forwardBatch(origin, seq, from, payload);
+      return true;
+
+   default:
+      _server_log.writeLog("Replication message of unknown type. Dropping.");
+      return false;
    }
+}
 
+/*********************************************************************************************
+ * seen_set::add - records a sequence number, folding runs into the contiguous counter
+ *
+ *    Returns: true if this sequence number had not been seen before
+ *********************************************************************************************/
+bool QueueMgr::seen_set::add(uint32_t seq) {
+   if (has(seq))
+      return false;
+
+   above.insert(seq);
+   while (!above.empty() && (*above.begin() == contiguous + 1)) {
+      contiguous++;
+      above.erase(above.begin());
+   }
+   return true;
+}
+
+/*********************************************************************************************
+ * saveState - captures what a restarted server needs to carry on where it left off: the next
+ *             sequence number to send (so peers don't drop new batches as already seen) and
+ *             the seen sets (so it doesn't ask for or re-deliver old batches). Format: next
+ *             seq, origin count, then per origin: contiguous seq, count of seqs above it and
+ *             those seqs
+ *
+ *    Params:  state - cleared and loaded with the state
+ *********************************************************************************************/
+void QueueMgr::saveState(std::vector<uint8_t> &state) {
+   state.clear();
+   putU32(state, _next_seq);
+   putU16(state, _seen.size());
+   for (auto &seen : _seen) {
+      putU32(state, seen.contiguous);
+      putU32(state, seen.above.size());
+      for (auto seq : seen.above)
+         putU32(state, seq);
+   }
+}
+
+/*********************************************************************************************
+ * loadState - restores state from saveState. Call after bindSvr.
+ *
+ *    Returns: false (and changes nothing) if the state is malformed or was saved with a
+ *             different number of servers
+ *********************************************************************************************/
+bool QueueMgr::loadState(const std::vector<uint8_t> &state) {
+   std::vector<seen_set> seen_sets;
+   uint32_t next_seq;
+
+   try {
+      size_t pos = 0;
+      next_seq = getU32(state, pos);
+      uint16_t origins = getU16(state, pos + 4);
+      pos += 6;
+      if (origins != _seen.size())
+         return false;
+
+      seen_sets.resize(origins);
+      for (auto &seen : seen_sets) {
+         seen.contiguous = getU32(state, pos);
+         uint32_t num_above = getU32(state, pos + 4);
+         pos += 8;
+         if (num_above > (state.size() - pos) / 4)
+            return false;
+         for (uint32_t i=0; i<num_above; i++, pos += 4)
+            seen.above.insert(getU32(state, pos));
+      }
+      if (pos != state.size())
+         return false;
+   } catch (std::out_of_range &) {
+      return false;
+   }
+
+   _next_seq = next_seq;
+   _seen = std::move(seen_sets);
+   return true;
+}
+
+/*********************************************************************************************
+ * sendDigest - sends a peer a summary of every batch we've seen so it can send us what we are
+ *              missing. Format: origin count, then per origin: origin, contiguous seq,
+ *              count of seqs above it and those seqs
+ *********************************************************************************************/
+void QueueMgr::sendDigest(node_handle node) {
+   std::vector<uint8_t> msg;
+   putHeader(msg, msg_digest, _self, 0);
+
+   putU16(msg, _seen.size());
+   for (node_handle origin=0; origin<_seen.size(); origin++) {
+      putU16(msg, origin);
+      putU32(msg, _seen[origin].contiguous);
+      putU16(msg, std::min<size_t>(_seen[origin].above.size(), 0xFFFF));
+
+      unsigned int count = 0;
+      for (auto seq : _seen[origin].above) {
+         if (count++ == 0xFFFF)
+            break;
+         putU32(msg, seq);
+      }
+   }
+
+   _queue.emplace(send, node, std::move(msg));
+}
+
+/*********************************************************************************************
+ * answerDigest - sends a peer any batch in our recent cache that their digest says they lack
+ *********************************************************************************************/
+void QueueMgr::answerDigest(node_handle from, std::vector<uint8_t> &digest) {
+   std::vector<seen_set> theirs;
+
+   try {
+      size_t pos = 0;
+      unsigned int num_origins = getU16(digest, pos);
+      pos += 2;
+      for (unsigned int i=0; i<num_origins; i++) {
+         node_handle origin = getU16(digest, pos);
+         if (origin >= theirs.size())
+            theirs.resize(origin + 1);
+         theirs[origin].contiguous = getU32(digest, pos + 2);
+         unsigned int num_above = getU16(digest, pos + 6);
+         pos += 8;
+         for (unsigned int j=0; j<num_above; j++, pos += 4)
+            theirs[origin].above.insert(getU32(digest, pos));
+      }
+   } catch (std::out_of_range &e) {
+      _server_log.writeLog("Gossip digest truncated. Ignoring.");
+      return;
+   }
+
+   for (auto &batch : _recent) {
+      if ((batch.origin < theirs.size()) && theirs[batch.origin].has(batch.seq))
+         continue;
+
+      std::vector<uint8_t> msg;
+      putHeader(msg, msg_batch, batch.origin, batch.seq);
+      msg.insert(msg.end(), batch.payload.begin(), batch.payload.end());
+      _queue.emplace(send, from, std::move(msg));
+   }
 }
 
 /*********************************************************************************************
  * sendToServer - places data into the queue to be sent to the server indicated by
  *                server_id. Transmission will happen on its own
  *
- *    Params:  server_id - string of the server's name (will be mapped automatically to IP)
+ *    Params:  server_id - string of the server's name, or its node handle (mapped to IP in O(1))
  *             data - the data in binary form to send to the server
  *
  *    Throws: socket_error for any network issues
  *********************************************************************************************/
 void QueueMgr::sendToServer(const char *server_id, std::vector<uint8_t> &data) {
-   _queue.emplace(send, server_id, data);
+   node_handle node = _nodes.findByID(server_id);
+   if (node == invalid_node)
+      throw std::runtime_error("Attempt to send data to server ID not in the server list.");
+
+   sendToServer(node, data);
+}
 
+void QueueMgr::sendToServer(node_handle node, std::vector<uint8_t> &data) {
+   // Direct messages are delivered to that server only, never forwarded
+   std::vector<uint8_t> msg;
+   BufferPool::take(msg, msg_header_size + data.size());
+   putHeader(msg, msg_direct, _self, 0);
+   msg.insert(msg.end(), data.begin(), data.end());
+
+   _queue.emplace(send, node, std::move(msg));
 }
 
 /*********************************************************************************************
@@ -244,22 +496,30 @@ void QueueMgr::sendToServer(const char *server_id, std::vector<uint8_t> &data) {
  *    Throws: socket_error for any network issues
  *********************************************************************************************/
 bool QueueMgr::pop(std::string &sid, std::vector<uint8_t> &data) {
+   Metrics::set(mg_queue_depth, _queue.size());
+   Metrics::set(mg_connections, _connlist.size());
+   if (_queue.size() > 0)
+      Metrics::observe(mh_queue_depth, _queue.size());
+
    while (_queue.size() > 0) {
-      auto next_qe = _queue.front();
+      auto &next_qe = _queue.front();
 
       // If this a send item, create a connection and start sending
       if (next_qe.type == send) {
 
          // Set up the connection and attempt to establish link (will retry if failure)
-         launchDataConn(next_qe.server_id.c_str(), next_qe.data);
+         launchDataConn(next_qe.node, next_qe.data);
 
          _queue.pop();
          continue;  
       }
 
-      sid = next_qe.server_id;
+      // The caller is done with the last element's data by now, so recycle it
+      sid = (next_qe.node == invalid_node) ? "" : _nodes.getID(next_qe.node);
+      BufferPool::give(data);
       data = std::move(next_qe.data);
       _queue.pop();
+      Metrics::add(mc_batches_delivered);
       return true;
    }
    return false;
@@ -269,33 +529,28 @@ bool QueueMgr::pop(std::string &sid, std::vector<uint8_t> &data) {
  * launchDataConn - launches a connection and starts the process of sending the queue data to
  *                  the target server
  *
- *    Params:  sid - pop action places the first recv'd pop server id into this attribute
- *             data - data received gets loaded into this vector
+ *    Params:  node - handle of the destination server
+ *             data - data to send to it
  *
  *********************************************************************************************/
-void QueueMgr::launchDataConn(const char *sid, std::vector<uint8_t> &data) {
+void QueueMgr::launchDataConn(node_handle node, std::vector<uint8_t> &data) {
 
-   unsigned long ip_addr;
-   unsigned short port;
-
-   // Find the IP address of the destination server
-   unsigned int i;
-   for (i=0; i<_server_list.size(); i++) {
-      if (!std::get<0>(_server_list[i]).compare(sid)) {
-         ip_addr = std::get<1>(_server_list[i]);
-         port = std::get<2>(_server_list[i]);
-         break;
-      }
-   }
-
-   if (i==_server_list.size()) {
+   if (node >= _nodes.size()) {
       throw std::runtime_error("Attempt to send data to server ID not in the server list.");
    }
 
+   // Find the IP address of the destination server
+   const char *sid = _nodes.getID(node).c_str();
+   unsigned long ip_addr = _nodes.getIPAddr(node);
+   unsigned short port = _nodes.getPort(node);
+
    // Try to connect to the server and if there's an issue, delete and re-throw socket_error
    TCPConn *new_conn = new TCPConn(_server_log, _aes_key, _verbosity);
    new_conn->setNodeID(sid);
    new_conn->setSvrID(getServerID());
+   new_conn->setCompression(_compress);
+   TraceLog::record(tr_conn_launch, node, new_conn->getTraceID());
+   Metrics::add(mc_conns_launched);
 
    try {
       new_conn->connect(ip_addr, port);
@@ -1,36 +1,57 @@
 #include <iostream>
 #include <exception>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
 #include "ReplServer.h"
+#include "BatchCodec.h"
+#include "TraceLog.h"
+#include "Metrics.h"
 
-const time_t secs_between_repl = 20;
-const unsigned int max_servers = 10;
+// Default sim seconds between picking up new local plots for replication
+const double secs_between_repl = 20.0;
+
+// Copies of a plot from two nodes further apart than this are treated as separate plots
+const time_t max_clock_skew = 10;
+
+// How often (real seconds) to save the replication state when it has changed
+const time_t secs_between_saves = 1;
+
+// How often (real seconds) to apply the database's retention policy
+const time_t secs_between_retention = 1;
+
+// Sightings are kept this long past max_clock_skew and two replication intervals behind the
+// newest one, to cover a copy of a plot arriving a pass or two after the first
+const time_t sighting_margin = 30;
 
 /*********************************************************************************************
  * ReplServer (constructor) - creates our ReplServer. Initializes:
  *
  *    verbosity - passes this value into QueueMgr and local, plus each connection
- *    _time_mult - how fast to run the simulation - 2.0 = 2x faster
+ *    clock - the sim clock, shared with the antenna
  *    ip_addr - which ip address to bind the server to
  *    port - bind the server here
  *
  *********************************************************************************************/
-ReplServer::ReplServer(DronePlotDB &plotdb, float time_mult)
+ReplServer::ReplServer(DronePlotDB &plotdb, SimClock &clock)
                               :_queue(1),
                                _plotdb(plotdb),
                                _shutdown(false), 
-                               _time_mult(time_mult),
+                               _clock(clock),
+                               _repl_interval(secs_between_repl * SimClock::ns_per_sec),
                                _verbosity(1),
                                _ip_addr("127.0.0.1"),
                                _port(9999)
 {
 }
 
-ReplServer::ReplServer(DronePlotDB &plotdb, const char *ip_addr, unsigned short port, float time_mult,
+ReplServer::ReplServer(DronePlotDB &plotdb, const char *ip_addr, unsigned short port, SimClock &clock,
                                           unsigned int verbosity)
                                  :_queue(verbosity),
                                   _plotdb(plotdb),
                                   _shutdown(false), 
-                                  _time_mult(time_mult), 
+                                  _clock(clock),
+                                  _repl_interval(secs_between_repl * SimClock::ns_per_sec),
                                   _verbosity(verbosity),
                                   _ip_addr(ip_addr),
                                   _port(port)
@@ -43,15 +64,6 @@ ReplServer::~ReplServer() {
 }
 
 
-/**********************************************************************************************
- * getAdjustedTime - gets the time since the replication server started up in seconds, modified
- *                   by _time_mult to speed up or slow down
- **********************************************************************************************/
-
-time_t ReplServer::getAdjustedTime() {
-   return static_cast<time_t>((time(NULL) - _start_time) * _time_mult);
-}
-
 /**********************************************************************************************
  * replicate - the main function managing replication activities. Manages the QueueMgr and reads
  *             from the queue, deconflicting entries and populating the DronePlotDB object with
@@ -71,9 +83,8 @@ void ReplServer::replicate(const char *ip_addr, unsigned short port) {
 
 void ReplServer::replicate() {
 
-   // Track when we started the server
-   _start_time = time(NULL);
-   _last_repl = 0;
+   // The first replication is an interval after the server starts
+   _last_repl = _clock.now();
 
    // Set up our queue's listening socket
    _queue.bindSvr(_ip_addr.c_str(), _port);
@@ -82,23 +93,24 @@ void ReplServer::replicate() {
    if (_verbosity >= 2)
       std::cout << "Server bound to " << _ip_addr << ", port: " << _port << " and listening\n";
 
+   // Pick up where we left off if the database was recovered from disk
+   if (_plotdb.hasWAL())
+      restoreState();
+
   
    // Replicate until we get the shutdown signal
    while (!_shutdown) {
+      int64_t pass_start = Metrics::now();
 
       // Check for new connections, process existing connections, and populate the queue as applicable
       _queue.handleQueue();
 
-      //sdbTimeSync();       
-      //deleteDBduplicates(this->startTimeWasSet);     
-  
-      //deleteDBduplicates(this->startTimeWasSet);
       // See if it's time to replicate and, if so, go through the database, identifying new plots
       // that have not been replicated yet and adding them to the queue for replication
-      if (getAdjustedTime() - _last_repl > secs_between_repl) {
+      if (_clock.now() - _last_repl >= _repl_interval) {
 
          queueNewPlots();
-         _last_repl = getAdjustedTime();
+         _last_repl = _clock.now();
       }
         
       // Check the queue for updates and pop them until the queue is empty. The pop command only returns
@@ -109,14 +121,30 @@ void ReplServer::replicate() {
       while (_queue.pop(sid, data)) {
          // Incoming replication--add it to this server's local database
          addReplDronePlots(data);         
+         _state_dirty = true;
       }
-      dbTimeSync2();       
-      //deleteDBduplicates(this->startTimeWasSet);
 
+      // If the new plots refined any clock estimates, bring the stored rows in line
+      applyCorrectionChanges();
+
+      if (_state_dirty && (time(NULL) - _last_save >= secs_between_saves))
+         saveState();
+      if (time(NULL) - _last_retention >= secs_between_retention)
+         enforceRetention();
+      _plotdb.checkpointIfDue();
+
+      Metrics::observe(mh_repl_pass, Metrics::now() - pass_start);
       usleep(1000);
    }
-   dbTimeSync2();     
-   //deleteDBduplicatesFinal();   
+
+   // Stop listening so peers trying to reach us fail fast instead of waiting on the backlog
+   _queue.shutdown();
+
+   // Anything injected since the last replication still needs deconflicting before the DB is dumped
+   std::vector<uint8_t> unsent;
+   std::vector<int64_t> unsent_times;
+   ingestLocalPlots(unsent, unsent_times);
+   saveState();
 }
 
 /**********************************************************************************************
@@ -130,34 +158,54 @@ void ReplServer::replicate() {
 
 unsigned int ReplServer::queueNewPlots() {
    std::vector<uint8_t> marshall_data;
-   unsigned int count = 0;
 
    if (_verbosity >= 3)
       std::cout << "Replicating plots.\n";
 
-   // Loop through the drone plots, looking for new ones
-   std::list<DronePlot>::iterator dpit = _plotdb.begin();
-   for ( ; dpit != _plotdb.end(); dpit++) {
-
-      // If this is a new one, marshall it and clear the flag
-      if (dpit->isFlagSet(DBFLAG_NEW)) {
-         
-         dpit->serialize(marshall_data);
-         dpit->clrFlags(DBFLAG_NEW);
-
-         count++;
-      }
-      if (marshall_data.size() % DronePlot::getDataSize() != 0)
-         throw std::runtime_error("Issue with marshalling!");
-
-   }
-  
+   unsigned int count = makeReplBatch(marshall_data);
    if (count == 0) {
       if (_verbosity >= 3)
          std::cout << "No new plots found to replicate.\n";
 
       return 0;
    }
+
+   // Send to the queue manager
+   _queue.sendToAll(marshall_data);
+
+   // The new sequence number must be on disk before the batch goes out, or a restart could
+   // reuse it and peers would drop the next batch as one they've seen
+   if (_plotdb.hasWAL()) {
+      saveState();
+      _plotdb.syncWAL();
+   }
+
+   if (_verbosity >= 2) 
+      std::cout << "Queued up " << count << " plots to be replicated.\n";
+
+   return count;
+}
+
+/**********************************************************************************************
+ * makeReplBatch - picks up and deconflicts the new local plots, building the batch to
+ *                 replicate them: the count, the plots and their inject times, encoded if
+ *                 compression is on
+ *
+ *    Params:  marshall_data - gets the batch, or is left empty if there were no new plots
+ *
+ *    Returns: number of new plots in the batch
+ *
+ **********************************************************************************************/
+
+unsigned int ReplServer::makeReplBatch(std::vector<uint8_t> &marshall_data) {
+   Metrics::scoped_timer timer(mh_queue_new);
+   std::vector<int64_t> inject_times;
+
+   marshall_data.clear();
+   unsigned int count = ingestLocalPlots(marshall_data, inject_times);
+   Metrics::add(mc_plots_local, count);
+   if (count == 0)
+      return 0;
  
    // Add the count onto the front
    if (_verbosity >= 3)
@@ -166,14 +214,55 @@ unsigned int ReplServer::queueNewPlots() {
    uint8_t *ctptr_begin = (uint8_t *) &count;
    marshall_data.insert(marshall_data.begin(), ctptr_begin, ctptr_begin+sizeof(unsigned int));
 
-   // Send to the queue manager
-   if (marshall_data.size() > 0) {
-      _queue.sendToAll(marshall_data);
+   // When each plot came in off the antenna, so receivers can tell how long it took to reach them
+   BatchCodec::appendInjectTimes(marshall_data, inject_times);
+
+   if (_compress) {
+      std::vector<uint8_t> encoded;
+      BatchCodec::encodePlots(marshall_data, encoded);
+      marshall_data.swap(encoded);
    }
+   return count;
+}
 
-   if (_verbosity >= 2) 
-      std::cout << "Queued up " << count << " plots to be replicated.\n";
+/**********************************************************************************************
+ * ingestLocalPlots - finds plots the antenna has injected since the last pass, marshalls them
+ *                    with their raw timestamps and then deconflicts them into the database
+ *
+ *    Params:  marshall_data - serialized plots are appended here
+ *             inject_times - and the wall-clock ns each was injected (0 if not known) here
+ *
+ *    Returns: number of new plots found
+ *
+ **********************************************************************************************/
+
+unsigned int ReplServer::ingestLocalPlots(std::vector<uint8_t> &marshall_data,
+                                          std::vector<int64_t> &inject_times) {
+   DronePlotDB::latest_batch latest(_plotdb);
+
+   // Find the new plots first so their inject times can be taken all at once. Only this
+   // thread removes rows, so the iterators hold while the antenna keeps appending.
+   std::vector<plot_list::iterator> rows;
+   for (auto dpit = _plotdb.begin(); dpit != _plotdb.end(); dpit++) {
+      if (dpit->isFlagSet(DBFLAG_NEW))
+         rows.push_back(dpit);
+   }
+   _plotdb.takeInjectTimes(rows, inject_times);
+
+   for (auto dpit : rows) {
+      // Marshall it before the timestamp is corrected and clear the flag
+      dpit->serialize(marshall_data);
+      _plotdb.clrFlags(dpit, DBFLAG_NEW);
+
+      if (marshall_data.size() % DronePlot::getDataSize() != 0)
+         throw std::runtime_error("Issue with marshalling!");
 
+      // Duplicates of plots we already hold are dropped
+      ingestPlot(*dpit, dpit);
+   }
+
+   unsigned int count = rows.size();
+   applyCorrectionChanges();
    return count;
 }
 
@@ -182,33 +271,63 @@ unsigned int ReplServer::queueNewPlots() {
  *                     Deconflicts issues between plot points.
  * 
  * Params:  data - should start with the number of data points in a 32 bit unsigned integer, 
- *                 then a series of drone plot points
+ *                 then a series of drone plot points and optionally their inject times, or be
+ *                 a compact batch from BatchCodec
+ *
+ * A plot whose timestamp won't fit in 32 bits is skipped (the whole batch, if it is compact)
+ * so a bad peer can't slip in a wrapped time.
  *
  **********************************************************************************************/
 
 void ReplServer::addReplDronePlots(std::vector<uint8_t> &data) {
-   if (data.size() < 4) {
-      throw std::runtime_error("Not enough data passed into addReplDronePlots");
+   Metrics::scoped_timer timer(mh_add_repl);
+
+   if (BatchCodec::isEncoded(data)) {
+      std::vector<uint8_t> raw;
+      try {
+         BatchCodec::decodePlots(data, raw);
+      } catch (plotdata_error &e) {
+         std::cerr << "Dropping replicated batch: " << e.what() << "\n";
+         return;
+      }
+      data.swap(raw);
    }
 
-   if ((data.size() - 4) % DronePlot::getDataSize() != 0) {
-      throw std::runtime_error("Data passed into addReplDronePlots was not the right multiple of DronePlot size");
+   if (data.size() < 4) {
+      throw std::runtime_error("Not enough data passed into addReplDronePlots");
    }
 
    // Get the number of plot points
    unsigned int *numptr = (unsigned int *) data.data();
    unsigned int count = *numptr;
 
+   bool has_times = BatchCodec::hasInjectTimes(data);
+   if (!has_times && (data.size() - 4 != count * DronePlot::getDataSize())) {
+      throw std::runtime_error("Data passed into addReplDronePlots was not the right multiple of DronePlot size");
+   }
+
    // Store sub-vectors for efficiency
    std::vector<uint8_t> plot;
    auto dptr = data.begin() + sizeof(unsigned int);
 
+   // Readers see the batch's new positions all at once
+   DronePlotDB::latest_batch latest(_plotdb);
+
+   unsigned int rejected = 0;
    for (unsigned int i=0; i<count; i++) {
       plot.clear();
       plot.assign(dptr, dptr + DronePlot::getDataSize());
-      addSingleDronePlot(plot);
+      try {
+         addSingleDronePlot(plot, has_times ? BatchCodec::getInjectTime(data, i) : 0);
+      } catch (plotdata_error &e) {
+         rejected++;
+      }
       dptr += DronePlot::getDataSize();      
    }
+   if (rejected > 0)
+      std::cerr << "Skipped " << rejected << " replicated plots with out-of-range timestamps\n";
+   count -= rejected;
+   Metrics::add(mc_plots_replicated, count);
    if (_verbosity >= 2)
       std::cout << "Replicated in " << count << " plots\n";   
 }
@@ -216,616 +335,262 @@ void ReplServer::addReplDronePlots(std::vector<uint8_t> &data) {
 
 /**********************************************************************************************
  * addSingleDronePlot - Takes in binary serialized drone data and adds it to the database. 
+ *                      If the origin sent when its antenna injected the plot, records how
+ *                      long it took to get here.
+ *
+ *    Throws: plotdata_error if the plot's timestamp won't fit in 32 bits
  *
  **********************************************************************************************/
 
-void ReplServer::addSingleDronePlot(std::vector<uint8_t> &data) {
+void ReplServer::addSingleDronePlot(std::vector<uint8_t> &data, int64_t inject_ns) {
    DronePlot tmp_plot;
 
    tmp_plot.deserialize(data);
-   std::cout << "Adding DID: " << tmp_plot.drone_id << " NID: "  << tmp_plot.node_id << " TS: " << tmp_plot.timestamp << " LAT: "  << tmp_plot.latitude << " LONG: "  << tmp_plot.longitude << std::endl;
-
-   _plotdb.addPlot(tmp_plot.drone_id, tmp_plot.node_id, tmp_plot.timestamp, tmp_plot.latitude,
-                                                         tmp_plot.longitude);
-}
-
-void ReplServer::dbTimeSync2(){
-   _plotdb.sortByTime();
-
-   std::vector<int> foundTracking(static_cast<int>(_plotdb.size()), 0);
-
-   int overallReferenceTime = 0;
-
-   bool refTimeSet = false;
-   if (startTimeWasSet){
-      overallReferenceTime = this->masterStartTime;
-      refTimeSet = true;
-   }
-
-   for (unsigned int i = 0; i < _plotdb.size(); i++)
-   {
-      std::vector<std::list<DronePlot>::iterator> duplicatePts;
-      std::list<DronePlot>::iterator it = getDBIterator(i);
-
-
-      if (!it->isFlagSet(DBFLAG_NEW))
-      {      
- 
-         if ( it->checked ){
-            continue;
-         }
-         else{
-            duplicatePts.push_back(it);
-            it->checked = true;
-         }
-         
-
-         for (unsigned int j = i + 1; j < _plotdb.size(); j++)
-         {
-            std::list<DronePlot>::iterator it2 = getDBIterator(j);
-            
-            if(!it->isFlagSet(DBFLAG_NEW))
-            {
-               if ((it->drone_id == it2->drone_id) && (it->node_id != it2->node_id))
-               {
-                  if (it->latitude == it2->latitude && it->longitude == it2->longitude)
-                  {
-                     int tDiff = abs(it->timestamp - it2->timestamp);
-                     if (tDiff < 11)
-                     {
-                        if (it2 != _plotdb.end()){
-                           duplicatePts.push_back(it2);
-                           it2->checked = true;
-                        }
-                        
-                     }
-                  }
-               }
-            }
-         }
-
-
-         int largestTime = 0;
-         unsigned int tempMasterClockNode = 0;
-         //finds largest timestamp for all duplicate pts
-         for (unsigned int k = 0; k < duplicatePts.size(); k++)
-         {
-            if ( largestTime < duplicatePts.at(k)->timestamp )
-            {
-               largestTime = duplicatePts.at(k)->timestamp;
-            }
-         }
-
-         //make sure smaller time nodes can never be the masterclock
-         for (unsigned int k = 0; k < duplicatePts.size(); k++)
-         {
-            if ( largestTime != duplicatePts.at(k)->timestamp )
-            {
-               setStartTimeErrorCheckFlag(duplicatePts.at(k)->node_id);  
-            }
-         }
-
-         //check/set MasterStartTime
-         for (unsigned int k = 0; k < duplicatePts.size(); k++)
-         {
-            bool validCheck = startTimeCalcErrorCheck(duplicatePts.at(k)->node_id);
-            if (validCheck){
-               int tempStartTime = checkStartTimeRef(duplicatePts.at(k)->timestamp);
-               if (this->masterStartTime < tempStartTime){
-                  this->masterStartTime = tempStartTime;
-                  this->masterClockNode = duplicatePts.at(k)->node_id;
-                  this->startTimeWasSet = true;
-               }
-            }
-         }
-
-         if (refTimeSet){
-            if (largestTime > (overallReferenceTime + 13)){
-               //overallReferenceTime  += 20;
-               //when svr3 (-3) & svr2 (+3) & svr1 (0)
-               overallReferenceTime  += 6;
-               //when svr3 (-2) && svr2 (2) & svr1 (0)
-               //overallReferenceTime  += ;
-
-            }
-            else if (largestTime != overallReferenceTime){
-               largestTime = overallReferenceTime;
-            }
-         }
-
-         for (unsigned int m = 0; m < duplicatePts.size(); m++)
-         {
-            if ( largestTime != duplicatePts.at(m)->timestamp )
-            {
-               duplicatePts.at(m)->timestamp = largestTime;
-            }  
-         }
-
-         overallReferenceTime +=5;
-      }
-   }
-
-   for (unsigned int p = 0; p < _plotdb.size(); p++)
-   {
-      std::list<DronePlot>::iterator it = getDBIterator(p);
-      it->checked = false;
-   }
-}
-
-
-void ReplServer::syncDroneTimeSteps(int nodeId){
-
-
-}
-
-
-bool ReplServer::startTimeCalcErrorCheck(int nodeId){
-   switch(nodeId)
-   {
-      case 1:
-         return node1StartTimeFlag;
-         break;
-
-      case 2:
-         return node2StartTimeFlag;
-         break;
+   if (_verbosity >= 3)
+      std::cout << "Adding DID: " << tmp_plot.drone_id << " NID: "  << tmp_plot.node_id << " TS: " <<
+                   tmp_plot.timestamp << " LAT: "  << tmp_plot.latitude << " LONG: "  <<
+                   tmp_plot.longitude << "\n";
 
-      default:
-         return node3StartTimeFlag;
-         break;
-   }   
+   ingestPlot(tmp_plot, _plotdb.end());
 
+   // Clocks on different hosts can disagree, so an arrival "before" the inject counts as 0
+   if (inject_ns != 0)
+      Metrics::observeLatency(tmp_plot.node_id, std::max<int64_t>(_clock.wallNow() - inject_ns, 0));
 }
 
-void ReplServer::setStartTimeErrorCheckFlag(int nodeId){
-   switch(nodeId)
-   {
-      case 1:
-         node1StartTimeFlag = false;
-         break;
+/**********************************************************************************************
+ * plot_key_hash - hashes the drone ID and the raw bits of the coordinates
+ **********************************************************************************************/
 
-      case 2:
-         node2StartTimeFlag = false;
-         break;
+size_t ReplServer::plot_key_hash::operator()(const plot_key &key) const {
+   uint32_t lat, lon;
+   memcpy(&lat, &key.latitude, sizeof(lat));
+   memcpy(&lon, &key.longitude, sizeof(lon));
 
-      default:
-         node3StartTimeFlag = false;
-         break;
-   }
+   size_t h = key.drone_id;
+   h = h * 0x9e3779b97f4a7c15ULL + lat;
+   h = h * 0x9e3779b97f4a7c15ULL + lon;
+   return h ^ (h >> 29);
 }
 
-void ReplServer::dbTimeSync(){
-   //std::cout << "######IN DB SYNC#######" << std::endl;
-   _plotdb.sortByTime();
+/**********************************************************************************************
+ * ingestPlot - deconflicts a single plot as it enters the database. If another node already
+ *              reported the same position for the same drone within max_clock_skew seconds,
+ *              the pair becomes a clock skew sample and this copy is dropped. Otherwise the
+ *              plot is stored with its node's current clock correction applied. A plot the
+ *              same node already reported with the same timestamp is a repeat (such as the
+ *              antenna replaying its feed after a restart) and is dropped too.
+ *
+ *    Params:  plot - the plot with its raw timestamp as stamped by its node
+ *             row - the plot's row if it is already in the database, _plotdb.end() if not
+ *
+ *    Returns: true if the plot was kept, false if it was a duplicate
+ *
+ **********************************************************************************************/
 
-   int referenceTime = 0;
-   bool refTimeSet = false;
-   if (startTimeWasSet || tempStartTimeSet){
-      referenceTime = setStartTime;
-      refTimeSet = false;
-   }
+bool ReplServer::ingestPlot(DronePlot &plot, plot_list::iterator row) {
+   plot_key key = {plot.drone_id, plot.latitude, plot.longitude};
+   std::vector<sighting> &seen = _sightings[key];
 
-   for (unsigned int i = 0; i < _plotdb.size(); i++){
-      std::vector<std::list<DronePlot>::iterator> comparePts;
-      std::list<DronePlot>::iterator it = getDBIterator(i);
-      comparePts.push_back(it);
-      //std::cout << "starting i: " << i << std::endl;
-      //std::cout << "Pt1 DID: " << it->drone_id << " NID: "  << it->node_id << " TS: " << it->timestamp << " LAT: "  << it->latitude << " LONG: "  << it->longitude << std::endl;
-
-      for (unsigned int j = i + 1; j < _plotdb.size(); j++){
-         std::list<DronePlot>::iterator it2 = getDBIterator(j);
-         //std::cout << "Pt2 DID: " << it2->drone_id << " NID: "  << it2->node_id << " TS: " << it2->timestamp << " LAT: "  << it2->latitude << " LONG: "  << it2->longitude << std::endl;
-         //unsigned int tDiff = it->timestamp - it2->timestamp;
-
-         if ((it->drone_id == it2->drone_id))
-         {
-            
-            if (it->latitude == it2->latitude && it->longitude == it2->longitude)
-            {
-               //std::cout << "found same pts" << std::endl;
-               if (it->node_id != it2->node_id){
-                  comparePts.push_back(it2);
-               
-
-                  //if this is the last elenment in the database endloop
-                  //otherwise keep looking for duplicates
-                  if (j != _plotdb.size()-1){
-                  //if (j != _plotdb.size()){
-                     continue;
-                  }
-               }
-            }
-
-               if (it->timestamp > 10 && it->timestamp < 25 && ((debugFlag3 % 120) == 0) && (getAdjustedTime() < 120 ))
-                  std::cout << "Same Pts:" << std::endl;
-
-               int largestTime = 0;
-               unsigned int tempMasterClockNode = 0;
-               //finds the largest time/node
-               for (unsigned int k = 0; k < comparePts.size(); k++)
-               {
-                  if ( largestTime < comparePts.at(k)->timestamp )
-                  {
-                     largestTime = comparePts.at(k)->timestamp;
-                     tempMasterClockNode = comparePts.at(k)->node_id;
-
-                  }
-                  if (it->timestamp > 10 && it->timestamp < 25 && ((debugFlag3 % 120) == 0) && (getAdjustedTime() < 120 )){
-                     std::cout << "File DID: " << comparePts.at(k)->drone_id << " NID: "  << comparePts.at(k)->node_id << " TS: " << comparePts.at(k)->timestamp << " LAT: "  << comparePts.at(k)->latitude << " LONG: "  << comparePts.at(k)->longitude << std::endl;
-                  }
-                  debugFlag3++;
-                  if (debugFlag3 > 100000000)
-                     debugFlag3 = 0;
-               }
-
-               //finds master clock
-               if (comparePts.size() == 3){
-                  if (masterClockNode != tempMasterClockNode){
-                     masterClockNode = tempMasterClockNode;
-                     std::cout << "New masterClock: " << masterClockNode << std::endl;
-                  }
-                  if (referenceTime == 0){
-                     referenceTime = largestTime;
-                     refTimeSet = true;
-                     if (!startTimeWasSet)
-                     {
-                        setStartTimeRef(referenceTime);
-                        startTimeWasSet = true;
-                     }
-                  }
-               }
-               else{
-                  if (!startTimeWasSet){
-                     int tempST = checkStartTimeRef(largestTime);
-                     if (it->timestamp > 30 && it->timestamp < 50 && ((debugFlag3 % 120) == 0) && (getAdjustedTime() < 120 )){
-                           std::cout << "StartTime: " << setStartTime << ", tempSt: " << tempST << std::endl; 
-                     }
-                     if (this->setStartTime < tempST){
-                        this->setStartTime = tempST;
-                        this->tempStartTimeSet = true;
-                     }
-                  }
-               }
-
-               //tires to find offsets
-               for (unsigned int k = 0; k < comparePts.size(); k++)
-               {
-                  if (tempMasterClockNode != comparePts.at(k)->node_id){
-                     int caseResult = findOffsetCase(tempMasterClockNode, comparePts.at(k)->node_id);
-                     int tmpOffset = returnCaseOffset(caseResult);
-                     
-                     int calcOffset = largestTime - comparePts.at(k)->timestamp;
-
-                     if (tmpOffset < calcOffset){
-                        adjustCaseOffset(caseResult, calcOffset);
-                     }
-
-                  } 
-               }
-
-               //bool referenceReset = false;
-               //sets time to largest clock
-               for (unsigned int k = 0; k < comparePts.size(); k++)
-               {
-                  if (refTimeSet)
-                  {
-                     /*Before 769 Bug
-                     if (largestTime < referenceTime){
-                        std::cout << "Largest Time: " << largestTime << std::endl;
-                        std::cout << "Ref Time: " << largestTime << std::endl;
-                        largestTime = referenceTime;
-                     }
-                     else if (largestTime > (referenceTime + 15)){
-                        //std::cout << "Largest Time: " << largestTime << std::endl;
-                        //std::cout << "Ref Time: " << largestTime << std::endl;
-                        referenceTime = largestTime;
-                     }*/
-
-                     //After 769 bug //comment out 1st if to adjust for 415 bug
-                     
-                     if (largestTime > (referenceTime + 15)){
-                        if (debugFlag1 < 2){
-                           std::cout << "In major Time diff (+15): " << largestTime << std::endl;
-                           std::cout << "Largest Time: " << largestTime << std::endl;
-                           std::cout << "Ref Time: " << referenceTime << std::endl;
-                           std::cout << "Trigger DID: " << comparePts.at(k)->drone_id << " NID: "  << comparePts.at(k)->node_id << " TS: " << comparePts.at(k)->timestamp << " LAT: "  << comparePts.at(k)->latitude << " LONG: "  << comparePts.at(k)->longitude << std::endl;
-                        }
-                        //referenceReset = true;
-                        referenceTime += 20;
-                        if (debugFlag1 < 2){
-                           std::cout << "New Ref Time: " << referenceTime << std::endl;
-                           debugFlag1++;
-                        }
-                     }
-                     else if (largestTime != referenceTime){//*/
-                     //if (largestTime != referenceTime){ //removes 415 bug
-                        if (debugFlag2 < 2){
-                           std::cout << "Largest2 Time: " << largestTime << std::endl;
-                           std::cout << "Ref2 Time: " << referenceTime << std::endl;
-                           std::cout << "Trigger DID: " << comparePts.at(k)->drone_id << " NID: "  << comparePts.at(k)->node_id << " TS: " << comparePts.at(k)->timestamp << " LAT: "  << comparePts.at(k)->latitude << " LONG: "  << comparePts.at(k)->longitude << std::endl;
-                           debugFlag2++;
-                        }
-                        largestTime = referenceTime;
-                     }
-                     
-                  }
-                  if ( largestTime != comparePts.at(k)->timestamp )
-                  {
-                     std::cout << "Orig DID: " << comparePts.at(k)->drone_id << " NID: "  << comparePts.at(k)->node_id << " TS: " << comparePts.at(k)->timestamp << " LAT: "  << comparePts.at(k)->latitude << " LONG: "  << comparePts.at(k)->longitude << std::endl;
-                     std::cout << "Changing Time Stamp to: "<< largestTime << std::endl;
-                     comparePts.at(k)->timestamp = largestTime;
-                     comparePts.at(k)->adjusted = true;
-                  }
-                  //std::cout << "File DID: " << comparePts.at(k)->drone_id << " NID: "  << comparePts.at(k)->node_id << " TS: " << comparePts.at(k)->timestamp << " LAT: "  << comparePts.at(k)->latitude << " LONG: "  << comparePts.at(k)->longitude << std::endl;
-                  //comparePts.at(k)->setFlags(DBFLAG_USER1);
-                  
-               }
-
-               i = j-1;
-               //if (!referenceReset){
-                  referenceTime += 5;
-               //}
-               //std::cout << "new i: " << i << std::endl;
-               break;
-         }
+   for (auto &s : seen) {
+      if ((s.node_id == plot.node_id) && (s.timestamp == plot.timestamp)) {
+         TraceLog::record(tr_plot_repeat, plot.node_id, plot.drone_id, plot.timestamp);
+         if (row != _plotdb.end())
+            _plotdb.erase(row);
+         return false;
       }
    }
 
-}
-
-void ReplServer::deleteDBduplicates(bool StartTimeFlag){
-   _plotdb.sortByTime();
-
-   std::vector<int> duplicateIndex;
-
-   if (StartTimeFlag || (cycles > 99) ){
-      for (unsigned int i = 0; i < _plotdb.size(); i++)
-      {
-         std::vector<std::list<DronePlot>::iterator> duplicatePts;
-         std::list<DronePlot>::iterator it = getDBIterator(i);
-
-
-         if (!it->isFlagSet(DBFLAG_NEW))
-         {
-            
-            for (unsigned int j = i + 1; j < _plotdb.size(); j++)
-            {
-               std::list<DronePlot>::iterator it2 = getDBIterator(j);
-               
-               if(!it->isFlagSet(DBFLAG_NEW))
-               {
-                  if ((it->drone_id == it2->drone_id))
-                  {
-                     if (it->latitude == it2->latitude && it->longitude == it2->longitude)
-                     {
-                        int tDiff = abs(it->timestamp - it2->timestamp);
-                        if (tDiff < 7)
-                        {
-                           bool checkFound = checkIfAlreadyFound(duplicateIndex, j);
-                           if (!checkFound){
-                              duplicateIndex.push_back(j);
-                           }
-                        }
-                     }
-                  }
-               }
-            }
-         }     
-      }
-
-      while (!duplicateIndex.empty())
-      {
-         std::list<DronePlot>::iterator it = getDBIterator(duplicateIndex.at(duplicateIndex.size()-1));
-         std::cout << "Deleting DID: " << it->drone_id << " NID: "  << it->node_id << " TS: " << it->timestamp << " LAT: "  << it->latitude << " LONG: "  << it->longitude << std::endl;
-         //std::cout << "deleting INDEX pts" << std::endl;
-         //std::cout << "size of vector : " << duplicateIndex.size() << std::endl;
-         //std::cout << "delteing (at) index: " << duplicateIndex.size() - 1 << std::endl;
-         //std::cout << "delteing deref: " << duplicateIndex.at(duplicateIndex.size()-1) << std::endl;
-         _plotdb.erase(duplicateIndex.at(duplicateIndex.size()-1));
-         
-         duplicateIndex.pop_back();
+   bool duplicate = false;
+   for (auto &s : seen) {
+      if ((s.node_id != plot.node_id) && (std::abs(s.timestamp - plot.timestamp) <= max_clock_skew)) {
+         _skew.addSample(s.node_id, s.timestamp, plot.node_id, plot.timestamp);
+         TraceLog::record(tr_plot_merged, plot.node_id, plot.drone_id, plot.timestamp, s.node_id);
+         duplicate = true;
       }
    }
-   this->cycles++;
-   
-
-/*
-   if (this->cycles > 100 || StartTimeFlag){
-  //if (StartTimeFlag && (this->cycles > 100)){
-      
-      std::vector<int> duplicateIndex;
-      //int index1 = 0;
-      for (unsigned int i = 0; i < _plotdb.size(); i++)
-      {
-         std::list<DronePlot>::iterator it = getDBIterator(i);
-
-         for(unsigned int j = i+1; j < _plotdb.size(); j++)
-         {
-            std::list<DronePlot>::iterator it2 = getDBIterator(j);
-            if ( (it->drone_id == it2->drone_id) && (it->latitude == it2->latitude) && (it->longitude == it2->longitude) && (it->timestamp == it2->timestamp))
-            {
-               //if (it2->adjusted){
-                  std::cout << "In duplicate delete Funct, duplicateFound" << std::endl;
-                  duplicateIndex.push_back(j);
-               //}
-            }
-            else{
-               i = j - 1;
-               break;
-            }
-         }
+   seen.push_back({plot.node_id, plot.timestamp});
+
+   // Sweep out the old sightings once the newest has moved a whole window past the last sweep
+   time_t seen_at = plot.timestamp + ((plot.node_id < _applied_corr.size()) ? _applied_corr[plot.node_id] : 0);
+   if (seen_at > _newest_sighting) {
+      _newest_sighting = seen_at;
+      if (_newest_sighting - _last_sweep >= sightingWindow()) {
+         _last_sweep = _newest_sighting;
+         pruneSightings(_newest_sighting - sightingWindow());
       }
+   }
 
-
-      while (!duplicateIndex.empty())
-      {
-         std::list<DronePlot>::iterator it = getDBIterator(duplicateIndex.at(duplicateIndex.size()-1));
-         std::cout << "Deleting DID: " << it->drone_id << " NID: "  << it->node_id << " TS: " << it->timestamp << " LAT: "  << it->latitude << " LONG: "  << it->longitude << std::endl;
-         //std::cout << "deleting INDEX pts" << std::endl;
-         //std::cout << "size of vector : " << duplicateIndex.size() << std::endl;
-         //std::cout << "delteing (at) index: " << duplicateIndex.size() - 1 << std::endl;
-         //std::cout << "delteing deref: " << duplicateIndex.at(duplicateIndex.size()-1) << std::endl;
-         _plotdb.erase(duplicateIndex.at(duplicateIndex.size()-1));
-         
-         duplicateIndex.pop_back();
-      }
+   if (duplicate) {
+      if (row != _plotdb.end())
+         _plotdb.erase(row);
+      return false;
    }
-   this->cycles++;
-*/
 
+   // Correct it once, using whatever correction the rest of this node's rows carry
+   if (plot.node_id >= _applied_corr.size())
+      _applied_corr.resize(plot.node_id + 1, 0);
+   time_t corrected = plot.timestamp + _applied_corr[plot.node_id];
+   TraceLog::record(tr_plot_kept, plot.node_id, plot.drone_id, plot.timestamp, corrected);
+
+   if (row != _plotdb.end())
+      _plotdb.setTimestamp(row, corrected);
+   else
+      _plotdb.addPlot(plot.drone_id, plot.node_id, corrected, plot.latitude, plot.longitude);
+   return true;
 }
 
-bool ReplServer::checkIfAlreadyFound(std::vector<int> inputVector, int value){
-   for(auto v : inputVector){
-      if (v == value){
-         return true;
-      }
-   }
-
-   return false;
+/**********************************************************************************************
+ * applyCorrectionChanges - if the skew estimator has changed since we last looked, shifts the
+ *                          stored rows of each node whose correction moved. Once the estimates
+ *                          settle this does nothing, so rows are only rewritten while the
+ *                          estimator is converging.
+ *
+ **********************************************************************************************/
 
+void ReplServer::applyCorrectionChanges() {
+   if (_skew.getGeneration() == _applied_gen)
+      return;
+   _applied_gen = _skew.getGeneration();
+   Metrics::scoped_timer timer(mh_correction);
+
+   // Shift every node that moved. Rows still flagged new have not been ingested yet and carry
+   // raw timestamps, so the database leaves them alone.
+   for (unsigned int node=0; node < _applied_corr.size(); node++) {
+      int delta = _skew.getCorrection(node) - _applied_corr[node];
+      if (delta == 0)
+         continue;
+
+      _plotdb.shiftNodeTimes(node, delta);
+      _applied_corr[node] += delta;
+      TraceLog::record(tr_offset_change, node, 0, delta, _applied_corr[node]);
+      _state_dirty = true;
+      if (_verbosity >= 2)
+         std::cout << "Node " << node << " clock correction now " << _applied_corr[node] << " secs\n";
+   }
 }
 
+/**********************************************************************************************
+ * enforceRetention - evicts old rows per the database's retention policy, then drops the
+ *                    sightings that can only match evicted plots so deconfliction stays
+ *                    bounded too. Sightings are kept max_clock_skew past the cutoff so a copy
+ *                    of a plot near the cutoff still matches. A copy arriving later than that
+ *                    is stored and then evicted on the next pass.
+ *
+ **********************************************************************************************/
+
+void ReplServer::enforceRetention() {
+   _last_retention = time(NULL);
 
-void ReplServer::deleteDBduplicatesFinal(){
-   _plotdb.sortByTime();
-
-   //if (StartTimeFlag || (this->cycles > 10)){
-   //if (StartTimeFlag && (this->cycles > 100)){
-      std::vector<int> duplicateIndex;
-      //int index1 = 0;
-      for (unsigned int i = 0; i < _plotdb.size(); i++)
-      {
-         std::list<DronePlot>::iterator it = getDBIterator(i);
-
-         for(unsigned int j = i+1; j < _plotdb.size(); j++)
-         {
-            std::list<DronePlot>::iterator it2 = getDBIterator(j);
-            if ( (it->drone_id == it2->drone_id) && (it->latitude == it2->latitude) && (it->longitude == it2->longitude) && (it->timestamp == it2->timestamp))
-            {
-               //if (it2->isFlagSet(DBFLAG_USER1)){
-                  duplicateIndex.push_back(j);
-               //}
-            }
-            else{
-               i = j - 1;
-               break;
-            }
-         }
-      }
+   time_t cutoff;
+   size_t evicted = _plotdb.enforceRetention(cutoff);
+   if (evicted == 0)
+      return;
 
+   pruneSightings(cutoff - max_clock_skew);
 
-      while (!duplicateIndex.empty())
-      {
-         std::list<DronePlot>::iterator it = getDBIterator(duplicateIndex.at(duplicateIndex.size()-1));
-         std::cout << "Deleting DID: " << it->drone_id << " NID: "  << it->node_id << " TS: " << it->timestamp << " LAT: "  << it->latitude << " LONG: "  << it->longitude << std::endl;
-         //std::cout << "deleting INDEX pts" << std::endl;
-         //std::cout << "size of vector : " << duplicateIndex.size() << std::endl;
-         //std::cout << "delteing (at) index: " << duplicateIndex.size() - 1 << std::endl;
-         //std::cout << "delteing deref: " << duplicateIndex.at(duplicateIndex.size()-1) << std::endl;
-         _plotdb.erase(duplicateIndex.at(duplicateIndex.size()-1));
-         
-         duplicateIndex.pop_back();
-      }
-   //}
+   if (_verbosity >= 2)
+      std::cout << "Retention evicted " << evicted << " plots older than " << cutoff << "\n";
 }
 
-std::list<DronePlot>::iterator ReplServer::getDBIterator(unsigned int index){
-   std::list<DronePlot>::iterator retIt;
-   retIt = _plotdb.begin();
-   for (unsigned int i = 0; i < _plotdb.size(); i++){
-      if (index == i){
-         return retIt;
-      }
-      retIt = std::next(retIt);
-   }
+/**********************************************************************************************
+ * sightingWindow - how far behind the newest sighting (in seconds) a copy of a plot from
+ *                  another node may still turn up
+ *
+ **********************************************************************************************/
 
-   return _plotdb.end();
+time_t ReplServer::sightingWindow() const {
+   return max_clock_skew + sighting_margin + 2 * (_repl_interval / SimClock::ns_per_sec);
 }
 
-int ReplServer::findOffsetCase(unsigned int Node1, unsigned int Node2){
-   if (Node1 == 1 || Node2 == 1)
-   {
-      if (Node1 == 2 || Node2 == 2)
-      {
-         //case 1: offset12
-         return 1;
-      }
+/**********************************************************************************************
+ * pruneSightings - drops the sightings whose corrected timestamp is before cutoff, so the
+ *                  map stays bounded whether or not the database has a retention policy. A
+ *                  copy of a plot arriving after its sightings are gone is stored as a new
+ *                  plot.
+ *
+ *    Params:  cutoff - oldest corrected timestamp to keep
+ *
+ **********************************************************************************************/
+
+void ReplServer::pruneSightings(time_t cutoff) {
+   for (auto sptr = _sightings.begin(); sptr != _sightings.end(); ) {
+      std::vector<sighting> &seen = sptr->second;
+      seen.erase(std::remove_if(seen.begin(), seen.end(), [&](const sighting &s) {
+                     time_t corr = (s.node_id < _applied_corr.size()) ? _applied_corr[s.node_id] : 0;
+                     return s.timestamp + corr < cutoff; }),
+                 seen.end());
+
+      if (seen.empty())
+         sptr = _sightings.erase(sptr);
       else
-      {
-         //case 2: ofset13
-         return 2;
-      }
-   }
-   else{
-      //case 3: ofset23
-      return 3;
+         sptr++;
    }
 }
 
-void ReplServer::adjustCaseOffset(int inputCase, int inputOffset){
-   switch(inputCase)
-   {
-      case 1:
-         masterOffset12 = inputOffset;
-         break;
+/**********************************************************************************************
+ * saveState - stores the queue's sequence state and the skew estimator's samples in the
+ *             database, which logs them with the plots. The corrections already applied to
+ *             the rows are tracked by the database itself as node shifts, so they always
+ *             match the rows they were applied to.
+ *
+ **********************************************************************************************/
 
-      case 2:
-         masterOffset13 = inputOffset;
-         break;
+void ReplServer::saveState() {
+   if (!_plotdb.hasWAL())
+      return;
 
-      default:
-         masterOffset23 = inputOffset;
-         break;
-   }
-}
+   std::vector<uint8_t> state;
+   _queue.saveState(state);
+   _plotdb.setMeta(DBMETA_QUEUE, state);
+   _skew.saveState(state);
+   _plotdb.setMeta(DBMETA_SKEW, state);
 
-void ReplServer::setStartTimeRef(int referenceTime){
-   this->storedRefTime = referenceTime;
-   int tempNum = referenceTime;
-   while (tempNum > 8){
-      tempNum -= 5;
-   }
-   this->setStartTime = tempNum;
-   std::cout << "#######################START TIME SET ########################" << std::endl;
+   _state_dirty = false;
+   _last_save = time(NULL);
 }
 
-int ReplServer::checkStartTimeRef(int referenceTime){
-   int tempNum = referenceTime;
-   while (tempNum > 8){
-      tempNum -= 5;
-   }
-   return tempNum;
-}
+/**********************************************************************************************
+ * restoreState - after the database has been recovered, reloads the saved replication state
+ *                and rebuilds what can be derived from the stored rows: the corrections they
+ *                carry and the sightings used to spot duplicates. Call after bindSvr.
+ *
+ **********************************************************************************************/
 
+void ReplServer::restoreState() {
+   std::vector<uint8_t> state;
 
-int ReplServer::returnCaseOffset(int inputCase){
-   switch(inputCase)
-   {
-      case 1:
-         return masterOffset12;
-         break;
+   if (_plotdb.getMeta(DBMETA_QUEUE, state) && !_queue.loadState(state))
+      std::cerr << "Saved replication state does not match servers.txt--starting fresh\n";
+   if (_plotdb.getMeta(DBMETA_SKEW, state) && !_skew.loadState(state))
+      std::cerr << "Saved clock skew state is corrupt--starting fresh\n";
 
-      case 2:
-         return masterOffset13;
-         break;
+   for (auto &shift : _plotdb.getNodeShifts()) {
+      if (shift.first >= _applied_corr.size())
+         _applied_corr.resize(shift.first + 1, 0);
+      _applied_corr[shift.first] = shift.second;
+   }
 
-      default:
-         return masterOffset23;
-         break;
+   // Stored rows carry corrected timestamps--sightings are kept raw
+   unsigned int count = 0;
+   for (auto dpit = _plotdb.begin(); dpit != _plotdb.end(); dpit++) {
+      if (dpit->isFlagSet(DBFLAG_NEW))
+         continue;
+
+      time_t corr = (dpit->node_id < _applied_corr.size()) ? _applied_corr[dpit->node_id] : 0;
+      plot_key key = {dpit->drone_id, dpit->latitude, dpit->longitude};
+      _sightings[key].push_back({dpit->node_id, dpit->timestamp - corr});
+      count++;
    }
+
+   _last_save = time(NULL);
+   if (_verbosity >= 1)
+      std::cout << "Resumed with " << count << " stored plots\n";
 }
 
 void ReplServer::shutdown() {
-   //dbTimeSync();
-   //deleteDBduplicatesFinal();
-
-   std::cout << "Calc Start Time: " << this->masterStartTime << std::endl;
-   std::cout << "MasterClock: " << masterClockNode << std::endl;
-   std::cout << "offset 12: " << masterOffset12 << std::endl;
-   std::cout << "offset 23: " << masterOffset23 << std::endl;
-   std::cout << "offset 13: " << masterOffset13 << std::endl;   
+   if (_verbosity >= 1)
+      _skew.dumpEstimates();
 
    _shutdown = true;
-
 }
@@ -0,0 +1,70 @@
+#include <algorithm>
+#include <errno.h>
+#include <time.h>
+#include "SimClock.h"
+
+static int64_t monotonicNs() {
+   return SimClock::clockNs(CLOCK_MONOTONIC);
+}
+
+/*****************************************************************************************
+ * SimClock (constructor) - the clock doesn't run until start is called
+ *
+ *    Params:  time_mult - how fast sim time runs (2.0 = 2x faster than real time)
+ *****************************************************************************************/
+SimClock::SimClock(double time_mult):_time_mult(time_mult)
+{
+   _start_ns = monotonicNs();
+}
+
+void SimClock::start() {
+   _start_ns = monotonicNs();
+   _virtual_ns.store(0, std::memory_order_release);
+}
+
+int64_t SimClock::now() {
+   if (_virtual)
+      return _virtual_ns.load(std::memory_order_acquire);
+   return static_cast<int64_t>((monotonicNs() - _start_ns) * _time_mult);
+}
+
+int64_t SimClock::wallNow() {
+   if (_virtual)
+      return ns_per_sec + static_cast<int64_t>(now() / _time_mult);
+   return clockNs(CLOCK_REALTIME);
+}
+
+void SimClock::makeVirtual() {
+   if (_virtual)
+      return;
+   _virtual_ns.store(now(), std::memory_order_release);
+   _virtual = true;
+}
+
+void SimClock::advanceTo(int64_t sim_ns) {
+   if (sim_ns > _virtual_ns.load(std::memory_order_acquire))
+      _virtual_ns.store(sim_ns, std::memory_order_release);
+}
+
+/*****************************************************************************************
+ * sleepUntil - sleeps to a sim time, at most max_real_ns at a go
+ *
+ *    Returns: true if sim_ns has been reached, false if the sleep was cut short first
+ *****************************************************************************************/
+bool SimClock::sleepUntil(int64_t sim_ns, int64_t max_real_ns) {
+   if (_virtual)
+      return now() >= sim_ns;
+
+   int64_t wake_ns = _start_ns + static_cast<int64_t>(sim_ns / _time_mult);
+   int64_t real_now = monotonicNs();
+   if (real_now >= wake_ns)
+      return true;
+
+   int64_t until = std::min(wake_ns, real_now + max_real_ns);
+   struct timespec ts = {static_cast<time_t>(until / ns_per_sec),
+                         static_cast<long>(until % ns_per_sec)};
+   while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+      ;
+
+   return until == wake_ns;
+}
@@ -5,7 +5,12 @@
 #include <algorithm>
 #include <iostream>
 #include <sstream>
+#include <atomic>
 #include "TCPConn.h"
+#include "BatchCodec.h"
+#include "BufferPool.h"
+#include "TraceLog.h"
+#include "Metrics.h"
 #include "strfuncts.h"
 #include <crypto++/secblock.h>
 #include <crypto++/osrng.h>
@@ -23,9 +28,10 @@ const unsigned int iv_size = AES::BLOCKSIZE;
 const unsigned int key_size = AES::DEFAULT_KEYLENGTH;
 const unsigned int auth_size = 16;
 
+static std::atomic<uint32_t> next_trace_id{1};
+
 /**********************************************************************************************
- * TCPConn (constructor) - creates the connector and initializes - creates the command strings
- *                         to wrap around network commands
+ * TCPConn (constructor) - creates the connector and initializes
  *
  *    Params: key - reference to the pre-loaded AES key
  *            verbosity - stdout verbosity - 3 = max
@@ -38,45 +44,13 @@ TCPConn::TCPConn(LogMgr &server_log, CryptoPP::SecByteBlock &key, unsigned int v
                                     _verbosity(verbosity),
                                     _server_log(server_log)
 {
-   // prep some tools to search for command sequences in data
-   uint8_t slash = (uint8_t) '/';
-   c_rep.push_back((uint8_t) '<');
-   c_rep.push_back((uint8_t) 'R');
-   c_rep.push_back((uint8_t) 'E');
-   c_rep.push_back((uint8_t) 'P');
-   c_rep.push_back((uint8_t) '>');
-
-   c_endrep = c_rep;
-   c_endrep.insert(c_endrep.begin()+1, 1, slash);
-
-   c_ack.push_back((uint8_t) '<');
-   c_ack.push_back((uint8_t) 'A');
-   c_ack.push_back((uint8_t) 'C');
-   c_ack.push_back((uint8_t) 'K');
-   c_ack.push_back((uint8_t) '>');
-
-   c_auth.push_back((uint8_t) '<');
-   c_auth.push_back((uint8_t) 'A');
-   c_auth.push_back((uint8_t) 'U');
-   c_auth.push_back((uint8_t) 'T');
-   c_auth.push_back((uint8_t) '>');
-
-   c_endauth = c_auth;
-   c_endauth.insert(c_endauth.begin()+1, 1, slash);
-
-   c_sid.push_back((uint8_t) '<');
-   c_sid.push_back((uint8_t) 'S');
-   c_sid.push_back((uint8_t) 'I');
-   c_sid.push_back((uint8_t) 'D');
-   c_sid.push_back((uint8_t) '>');
-
-   c_endsid = c_sid;
-   c_endsid.insert(c_endsid.begin()+1, 1, slash);
+   _trace_id = next_trace_id++;
 }
 
 
 TCPConn::~TCPConn() {
-
+   BufferPool::give(_inputbuf);
+   BufferPool::give(_outputbuf);
 }
 
 /**********************************************************************************************
@@ -111,6 +85,7 @@ bool TCPConn::accept(SocketFD &server) {
 bool TCPConn::sendData(std::vector<uint8_t> &buf) {
    
    _connfd.writeBytes<uint8_t>(buf);
+   Metrics::add(mc_bytes_sent, buf.size());
    
    return true;
 }
@@ -233,13 +208,15 @@ void TCPConn::handleConnection() {
    
          // Client: Wait for acknowledgement that data sent was received before disconnecting
          case s_waitack:
-            std::cout << "In s_waitack state"<<std::endl;
+            if (_verbosity >= 3)
+               std::cout << "In s_waitack state"<<std::endl;
             awaitAck();
             break;
          
          // Server: Data received and conn disconnected, but waiting for the data to be retrieved
          case s_hasdata:
-            std::cout << "In s_hasData state"<<std::endl;
+            if (_verbosity >= 3)
+               std::cout << "In s_hasData state"<<std::endl;
             break;
 
          default:
@@ -263,7 +240,10 @@ void TCPConn::handleConnection() {
 void TCPConn::sendSID() {
    std::vector<uint8_t> buf(_svr_id.begin(), _svr_id.end());
    wrapCmd(buf, c_sid, c_endsid);
+   appendCaps(buf);
    sendData(buf);
+   TraceLog::record(tr_handshake_start, TraceLog::no_node, _trace_id, 0);
+   _handshake_start = Metrics::now();
 
    //_status = s_datatx; 
    _status = s_clientAuthResp;
@@ -284,6 +264,8 @@ void TCPConn::waitForSID() {
       if (!getData(buf))
          return;
 
+      readPeerCaps(buf);
+
       if (!getCmdData(buf, c_sid, c_endsid)) {
          std::stringstream msg;
          msg << "SID string from connecting client invalid format. Cannot authenticate.";
@@ -294,6 +276,8 @@ void TCPConn::waitForSID() {
 
       std::string node(buf.begin(), buf.end());
       setNodeID(node.c_str());
+      TraceLog::record(tr_handshake_start, TraceLog::no_node, _trace_id, 1);
+      _handshake_start = Metrics::now();
       std::cout << "Server, SID recieved: " << node << std::endl;
 
       // Send our Node ID
@@ -316,10 +300,18 @@ void TCPConn::waitForSID() {
 void TCPConn::transmitData() {
    //std::cout << "In transitData()" << std::endl;
 
+   // Compress if both ends can, then frame and encrypt the data
+   std::vector<uint8_t> buf;
+   uint8_t codec = _compress ? BatchCodec::pickCodec(_peer_caps) : 0;
+   BatchCodec::compressFrame(codec, _outputbuf, buf);
+   BufferPool::give(_outputbuf);
+   wrapCmd(buf, c_rep, c_endrep);
+
    //encrypts data
-   encryptData(_outputbuf);
+   encryptData(buf);
    // Send the replication data
-   sendData(_outputbuf);
+   sendData(buf);
+   TraceLog::record(tr_data_sent, TraceLog::no_node, _trace_id, 0, buf.size());
 
    if (_verbosity >= 3)
       std::cout << "Successfully authenticated connection with " << getNodeID() <<
@@ -357,13 +349,22 @@ void TCPConn::waitForData() {
          return;
       }
 
-      // Got the data, save it
-      _inputbuf = buf;
+      // Got the data, decompress and save it
+      try {
+         BatchCodec::decompressFrame(buf, _inputbuf);
+      } catch (std::runtime_error &e) {
+         std::stringstream msg;
+         msg << "Replication data from " << getNodeID() << " failed to decompress: " << e.what();
+         _server_log.writeLog(msg.str().c_str());
+         disconnect();
+         return;
+      }
       _data_ready = true;
 
       // Send the acknowledgement and disconnect
-      encryptData(c_ack);
-      sendData(c_ack);
+      std::vector<uint8_t> ack(c_ack.begin(), c_ack.end());
+      encryptData(ack);
+      sendData(ack);
 
       if (_verbosity >= 2)
          std::cout << "Successfully received replication data from " << getNodeID() << "\n";
@@ -399,6 +400,8 @@ void TCPConn::awaitAck() {
          std::stringstream msg;
          msg << "Awk expected from data send, received something else. Node:" << getNodeID() << "\n";
          _server_log.writeLog(msg.str().c_str());
+      } else {
+         TraceLog::record(tr_data_acked, TraceLog::no_node, _trace_id);
       }
   
       if (_verbosity >= 3)
@@ -443,6 +446,7 @@ bool TCPConn::getData(std::vector<uint8_t> &buf) {
       }
 
       buf.insert(buf.end(), readbuf.begin(), readbuf.end());
+      Metrics::add(mc_bytes_received, readbuf.size());
 
       // concat the data onto anything we've read before
 //      _inputbuf.insert(_inputbuf.end(), readbuf.begin(), readbuf.end());
@@ -510,11 +514,11 @@ bool TCPConn::getEncryptedData(std::vector<uint8_t> &buf) {
  *
  **********************************************************************************************/
 
-std::vector<uint8_t>::iterator TCPConn::findCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &cmd) {
+std::vector<uint8_t>::iterator TCPConn::findCmd(std::vector<uint8_t> &buf, const cmd_tag &cmd) {
    return std::search(buf.begin(), buf.end(), cmd.begin(), cmd.end());
 }
 
-bool TCPConn::hasCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &cmd) {
+bool TCPConn::hasCmd(std::vector<uint8_t> &buf, const cmd_tag &cmd) {
    return !(findCmd(buf, cmd) == buf.end());
 }
 
@@ -529,16 +533,19 @@ bool TCPConn::hasCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &cmd) {
  *
  **********************************************************************************************/
 
-bool TCPConn::getCmdData(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd, 
-                                                    std::vector<uint8_t> &endcmd) {
-   std::vector<uint8_t> temp = buf;
-   auto start = findCmd(temp, startcmd);
-   auto end = findCmd(temp, endcmd);
+bool TCPConn::getCmdData(std::vector<uint8_t> &buf, const cmd_tag &startcmd,
+                                                    const cmd_tag &endcmd) {
+   auto start = findCmd(buf, startcmd);
+   if (start == buf.end())
+      return false;
 
-   if ((start == temp.end()) || (end == temp.end()))
+   auto end = std::search(start + startcmd.size(), buf.end(), endcmd.begin(), endcmd.end());
+   if (end == buf.end())
       return false;
 
-   buf.assign(start + startcmd.size(), end);
+   // Trim in place rather than copying the data out
+   buf.erase(end, buf.end());
+   buf.erase(buf.begin(), start + startcmd.size());
    return true;
 }
 
@@ -551,15 +558,43 @@ bool TCPConn::getCmdData(std::vector<uint8_t> &buf, std::vector<uint8_t> &startc
  *
  **********************************************************************************************/
 
-void TCPConn::wrapCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd,
-                                                    std::vector<uint8_t> &endcmd) {
-   std::vector<uint8_t> temp = startcmd;
-   temp.insert(temp.end(), buf.begin(), buf.end());
-   temp.insert(temp.end(), endcmd.begin(), endcmd.end());
+void TCPConn::wrapCmd(std::vector<uint8_t> &buf, const cmd_tag &startcmd,
+                                                    const cmd_tag &endcmd) {
+   buf.reserve(buf.size() + startcmd.size() + endcmd.size());
+   buf.insert(buf.begin(), startcmd.begin(), startcmd.end());
+   buf.insert(buf.end(), endcmd.begin(), endcmd.end());
+}
+
 
-   buf = temp;
+/**********************************************************************************************
+ * appendCaps - adds a <CAP> block holding our codec capability bits to a handshake message.
+ *              The client sends it with its SID and the server with its auth string.
+ *
+ *    Params: buf = the message to append to
+ *
+ **********************************************************************************************/
+
+void TCPConn::appendCaps(std::vector<uint8_t> &buf) {
+   std::vector<uint8_t> caps(1, BatchCodec::localCaps());
+   wrapCmd(caps, c_cap, c_endcap);
+   buf.insert(buf.end(), caps.begin(), caps.end());
 }
 
+/**********************************************************************************************
+ * readPeerCaps - picks the other end's codec capabilities out of a handshake message, leaving
+ *                the message itself alone. No <CAP> block means no compression.
+ *
+ *    Params: buf = the handshake message
+ *
+ **********************************************************************************************/
+
+void TCPConn::readPeerCaps(std::vector<uint8_t> &buf) {
+   std::vector<uint8_t> caps = buf;
+
+   _peer_caps = 0;
+   if (getCmdData(caps, c_cap, c_endcap) && (caps.size() == 1))
+      _peer_caps = caps[0];
+}
 
 /**********************************************************************************************
  * getReplData - Returns the data received on the socket and marks the socket as done
@@ -573,7 +608,8 @@ void TCPConn::wrapCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd,
 void TCPConn::getInputData(std::vector<uint8_t> &buf) {
 
    // Returns the replication data off this connection, then prepares it to be removed
-   buf = _inputbuf;
+   buf.swap(_inputbuf);
+   _inputbuf.clear();
 
    _data_ready = false;
    _status = s_none;
@@ -623,10 +659,9 @@ void TCPConn::connect(unsigned long ip_addr, unsigned short port) {
 
 void TCPConn::assignOutgoingData(std::vector<uint8_t> &data) {
 
-   _outputbuf.clear();
-   _outputbuf = c_rep;
-   _outputbuf.insert(_outputbuf.end(), data.begin(), data.end());
-   _outputbuf.insert(_outputbuf.end(), c_endrep.begin(), c_endrep.end());
+   // Framed at transmitData, once the handshake has told us what the other end can decompress
+   _outputbuf.swap(data);
+   data.clear();
 }
  
 
@@ -693,6 +728,7 @@ void TCPConn::sendAuthenticationString() {
    
    //sends clear text authentication string
    wrapCmd(buf, c_auth, c_endauth);
+   appendCaps(buf);
    bool sendResult = sendData(buf);
    if (!sendResult){
       std::cout << "Error sending message" << std::endl;
@@ -723,6 +759,8 @@ void TCPConn::waitForAuthString(){
    if (!getData(buf))
       return;
 
+   readPeerCaps(buf);
+
    if (!getCmdData(buf, c_auth, c_endauth)) {
       std::cout << "Auth string from connecting client invalid format. Cannot authenticate" << std::endl;
       //Testing
@@ -804,6 +842,8 @@ void TCPConn::svrAuthRespProcess(){
 void TCPConn::svrAuthSendProcess(){
    sendAuthenticationResp();
    _status = s_datarx;
+   TraceLog::record(tr_handshake_end, TraceLog::no_node, _trace_id, 1);
+   handshakeDone();
 }
 
 
@@ -870,9 +910,17 @@ void TCPConn::finalAuthCheck(){
    if (_connfd.hasData()) {
       waitForEncryptAuthReply();
       _status = s_datatx; 
+      TraceLog::record(tr_handshake_end, TraceLog::no_node, _trace_id, 0);
+      handshakeDone();
    }
 }
 
+void TCPConn::handshakeDone() {
+   Metrics::add(mc_handshakes);
+   if (_handshake_start != 0)
+      Metrics::observe(mh_handshake, Metrics::now() - _handshake_start);
+}
+
 /**********************************************************************************
  * sendAuthenticationRespAndString - encrypts recieved authentication string and
  *    sends it back to the server.  Creates and new random number to send as an 
@@ -60,7 +60,7 @@ void TCPServer::bindSvr(const char *ip_addr, short unsigned int port) {
 
 // Simple function that simply starts the server listening
 void TCPServer::listenSvr() {
-   _sockfd.listenFD(5);
+   _sockfd.listenFD(64);
 
    std::string ipaddr_str;
    std::stringstream msg;
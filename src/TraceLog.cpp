@@ -0,0 +1,191 @@
+#include <stdexcept>
+#include <algorithm>
+#include <string>
+#include <memory>
+#include <time.h>
+#include <string.h>
+#include "TraceLog.h"
+#include "FileDesc.h"
+#include "SimClock.h"
+#include "ByteOrder.h"
+
+const uint8_t trace_magic[4] = {'D', 'P', 'T', 'R'};
+const uint16_t trace_version = 1;
+const size_t header_size = 44;
+const size_t record_size = 32;
+
+// Events go out to the file in chunks of this many
+const size_t write_chunk = 4096;
+
+// A ring slot, guarded by its own sequence number the way a seqlock is: odd while the slot is
+// being written for ring position (seq - 1) / 2, even once position seq / 2 - 1 is in it
+struct trace_slot {
+   std::atomic<uint64_t> seq{0};
+   TraceLog::event ev;
+};
+
+static std::unique_ptr<trace_slot[]> ring;
+static size_t ring_mask = 0;
+static std::atomic<uint64_t> next_pos{0};
+static int64_t start_mono_ns = 0;
+static int64_t start_wall_ns = 0;
+
+/*********************************************************************************************
+ * start - allocates the ring and turns recording on
+ *
+ *    Params:  slots - events the ring holds before the oldest are overwritten
+ *
+ *********************************************************************************************/
+void TraceLog::start(size_t slots) {
+   if (enabled())
+      return;
+
+   size_t size = 1;
+   while (size < slots)
+      size <<= 1;
+
+   ring.reset(new trace_slot[size]);
+   ring_mask = size - 1;
+   start_mono_ns = SimClock::clockNs(CLOCK_MONOTONIC);
+   start_wall_ns = SimClock::clockNs(CLOCK_REALTIME);
+   _enabled.store(true, std::memory_order_release);
+}
+
+/*********************************************************************************************
+ * add - claims the next ring position and writes the event into its slot
+ *********************************************************************************************/
+void TraceLog::add(trace_type type, uint16_t node, uint32_t a, int64_t b, int64_t c) {
+   uint64_t pos = next_pos.fetch_add(1, std::memory_order_relaxed);
+   trace_slot &slot = ring[pos & ring_mask];
+
+   slot.seq.store(2 * pos + 1, std::memory_order_relaxed);
+   std::atomic_thread_fence(std::memory_order_release);
+   slot.ev = {static_cast<uint64_t>(SimClock::clockNs(CLOCK_MONOTONIC)), type, node, a, b, c};
+   slot.seq.store(2 * pos + 2, std::memory_order_release);
+}
+
+/*********************************************************************************************
+ * dump - writes the header and every event still in the ring, oldest first. A slot that is
+ *        mid-write or has already been reused for a newer event is skipped.
+ *
+ *    Params:  filename - the file to create (or overwrite)
+ *
+ *    Returns: number of events written
+ *
+ *    Throws: runtime_error if tracing is off or the file can't be written
+ *********************************************************************************************/
+size_t TraceLog::dump(const char *filename) {
+   if (!enabled())
+      throw std::runtime_error("Trace dump requested but tracing was never started");
+
+   uint64_t end = next_pos.load(std::memory_order_acquire);
+   uint64_t begin = (end > ring_mask + 1) ? end - (ring_mask + 1) : 0;
+
+   std::vector<event> events;
+   events.reserve(end - begin);
+   for (uint64_t pos = begin; pos < end; pos++) {
+      trace_slot &slot = ring[pos & ring_mask];
+      uint64_t seq = slot.seq.load(std::memory_order_acquire);
+      if (seq != 2 * pos + 2)
+         continue;
+      event ev = slot.ev;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.seq.load(std::memory_order_relaxed) != seq)
+         continue;
+      events.push_back(ev);
+   }
+
+   FileFD outfile(filename);
+   if (!outfile.openFile(FileFD::writefd, true))
+      throw std::runtime_error(std::string("Unable to open trace file ") + filename);
+
+   std::vector<uint8_t> buf;
+   buf.insert(buf.end(), trace_magic, trace_magic + 4);
+   putLE(buf, trace_version, 2);
+   putLE(buf, record_size, 2);
+   putLE(buf, ring_mask + 1, 4);
+   putLE(buf, events.size(), 8);
+   putLE(buf, begin, 8);
+   putLE(buf, start_mono_ns, 8);
+   putLE(buf, start_wall_ns, 8);
+
+   for (size_t i=0; i<events.size(); i++) {
+      const event &ev = events[i];
+      putLE(buf, ev.ns, 8);
+      putLE(buf, ev.type, 2);
+      putLE(buf, ev.node, 2);
+      putLE(buf, ev.a, 4);
+      putLE(buf, ev.b, 8);
+      putLE(buf, ev.c, 8);
+
+      if (((i + 1) % write_chunk == 0) || (i + 1 == events.size())) {
+         if (outfile.writeBytes(buf) < 0)
+            throw std::runtime_error(std::string("Unable to write trace file ") + filename);
+         buf.clear();
+      }
+   }
+   if (!buf.empty() && (outfile.writeBytes(buf) < 0))
+      throw std::runtime_error(std::string("Unable to write trace file ") + filename);
+
+   outfile.closeFD();
+   return events.size();
+}
+
+/*********************************************************************************************
+ * readFile - loads a trace written by dump
+ *
+ *    Params:  filename - the trace file
+ *             info - gets the header fields
+ *             events - gets the events, oldest first
+ *
+ *    Throws: runtime_error if the file can't be read or isn't a trace
+ *********************************************************************************************/
+void TraceLog::readFile(const char *filename, file_info &info, std::vector<event> &events) {
+   FileFD infile(filename);
+   if (!infile.openFile(FileFD::readfd) || !infile.mapFile())
+      throw std::runtime_error(std::string("Unable to read trace file ") + filename);
+
+   const uint8_t *data = infile.getMap();
+   size_t size = infile.getMapSize();
+   if ((size < header_size) || !std::equal(trace_magic, trace_magic + 4, data))
+      throw std::runtime_error("Not a trace file");
+   if ((getLE(data + 4, 2) != trace_version) || (getLE(data + 6, 2) != record_size))
+      throw std::runtime_error("Trace file version not supported");
+
+   info.slots = getLE(data + 8, 4);
+   uint64_t count = getLE(data + 12, 8);
+   info.lost = getLE(data + 20, 8);
+   info.start_mono_ns = getLE(data + 28, 8);
+   info.start_wall_ns = getLE(data + 36, 8);
+   if (count != (size - header_size) / record_size)
+      throw std::runtime_error("Trace file is truncated");
+
+   events.clear();
+   events.reserve(count);
+   const uint8_t *rec = data + header_size;
+   for (uint64_t i=0; i<count; i++, rec += record_size) {
+      events.push_back({getLE(rec, 8), static_cast<uint16_t>(getLE(rec + 8, 2)),
+                        static_cast<uint16_t>(getLE(rec + 10, 2)),
+                        static_cast<uint32_t>(getLE(rec + 12, 4)),
+                        static_cast<int64_t>(getLE(rec + 16, 8)),
+                        static_cast<int64_t>(getLE(rec + 24, 8))});
+   }
+}
+
+const char *TraceLog::typeName(uint16_t type) {
+   switch (type) {
+   case tr_plot_kept:         return "plot_kept";
+   case tr_plot_merged:       return "plot_merged";
+   case tr_plot_repeat:       return "plot_repeat";
+   case tr_offset_change:     return "offset_change";
+   case tr_batch_queued:      return "batch_queued";
+   case tr_batch_received:    return "batch_received";
+   case tr_batch_dup:         return "batch_dup";
+   case tr_conn_launch:       return "conn_launch";
+   case tr_handshake_start:   return "handshake_start";
+   case tr_handshake_end:     return "handshake_end";
+   case tr_data_sent:         return "data_sent";
+   case tr_data_acked:        return "data_acked";
+   default:                   return "unknown";
+   }
+}
@@ -0,0 +1,454 @@
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "WriteAheadLog.h"
+
+// File headers: magic, format version, epoch
+const char snap_magic[4] = {'D', 'P', 'S', 'S'};
+const char log_magic[4] = {'D', 'P', 'W', 'L'};
+const uint32_t wal_version = 1;
+const size_t file_hdr_size = 16;
+
+// Each log record is framed by its length and checksum
+const size_t frame_hdr_size = 8;
+
+// Records bigger than this are treated as corruption
+const uint32_t max_record_size = 64 * 1024 * 1024;
+
+// Commit early, without waiting out the interval, once this much is pending
+const size_t early_commit_bytes = 4 * 1024 * 1024;
+
+/*********************************************************************************************
+ * checksum - 32 bit FNV-1a, enough to catch a torn or garbled record
+ *********************************************************************************************/
+static uint32_t checksum(const uint8_t *data, size_t len) {
+   uint32_t hash = 2166136261U;
+   for (size_t i=0; i<len; i++) {
+      hash ^= data[i];
+      hash *= 16777619U;
+   }
+   return hash;
+}
+
+static void putHeader(std::vector<uint8_t> &buf, const char *magic, uint64_t epoch) {
+   buf.insert(buf.end(), magic, magic + 4);
+   buf.insert(buf.end(), (const uint8_t *) &wal_version, (const uint8_t *) &wal_version + 4);
+   buf.insert(buf.end(), (const uint8_t *) &epoch, (const uint8_t *) &epoch + 8);
+}
+
+static bool checkHeader(const std::vector<uint8_t> &buf, const char *magic, uint64_t &epoch) {
+   uint32_t version;
+   if ((buf.size() < file_hdr_size) || (memcmp(buf.data(), magic, 4) != 0))
+      return false;
+   memcpy(&version, buf.data() + 4, 4);
+   memcpy(&epoch, buf.data() + 8, 8);
+   return version == wal_version;
+}
+
+static std::string errStr(const char *what, const std::string &path) {
+   return std::string(what) + " " + path + ": " + strerror(errno);
+}
+
+/*********************************************************************************************
+ * readFile - reads a whole file into buf
+ *
+ *    Returns: false if the file doesn't exist
+ *
+ *    Throws: walfile_error if it exists but can't be read
+ *********************************************************************************************/
+static bool readFile(const std::string &path, std::vector<uint8_t> &buf) {
+   int fd = ::open(path.c_str(), O_RDONLY);
+   if (fd == -1) {
+      if (errno == ENOENT)
+         return false;
+      throw walfile_error(errStr("Unable to open", path));
+   }
+
+   buf.clear();
+   uint8_t block[65536];
+   ssize_t got;
+   while ((got = read(fd, block, sizeof(block))) != 0) {
+      if (got < 0) {
+         if (errno == EINTR)
+            continue;
+         ::close(fd);
+         throw walfile_error(errStr("Unable to read", path));
+      }
+      buf.insert(buf.end(), block, block + got);
+   }
+   ::close(fd);
+   return true;
+}
+
+static bool writeAll(int fd, const uint8_t *data, size_t len) {
+   while (len > 0) {
+      ssize_t written = write(fd, data, len);
+      if (written < 0) {
+         if (errno == EINTR)
+            continue;
+         return false;
+      }
+      data += written;
+      len -= written;
+   }
+   return true;
+}
+
+// Makes renames and new files in a directory durable
+static void syncDir(const std::string &dir) {
+   int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+   if (fd != -1) {
+      fsync(fd);
+      ::close(fd);
+   }
+}
+
+// Epochs of the wal.<epoch> files in a directory, in order
+static std::vector<uint64_t> listLogs(const std::string &dir) {
+   std::vector<uint64_t> epochs;
+   DIR *dp = opendir(dir.c_str());
+   if (dp == NULL)
+      throw walfile_error(errStr("Unable to list", dir));
+
+   struct dirent *ent;
+   while ((ent = readdir(dp)) != NULL) {
+      const char *name = ent->d_name;
+      if ((strncmp(name, "wal.", 4) != 0) || (name[4] == '\0'))
+         continue;
+      if (strspn(name + 4, "0123456789") != strlen(name + 4))
+         continue;
+      epochs.push_back(strtoull(name + 4, NULL, 10));
+   }
+   closedir(dp);
+
+   std::sort(epochs.begin(), epochs.end());
+   return epochs;
+}
+
+/*********************************************************************************************
+ * WriteAheadLog (constructor)
+ *
+ *    Params:  commit_ms - how often the background thread commits appended records
+ *********************************************************************************************/
+WriteAheadLog::WriteAheadLog(unsigned int commit_ms):_commit_ms(commit_ms) {
+   if (_commit_ms == 0)
+      _commit_ms = 1;
+}
+
+WriteAheadLog::~WriteAheadLog() {
+   close();
+}
+
+std::string WriteAheadLog::logPath(uint64_t epoch) {
+   return _dir + "/wal." + std::to_string(epoch);
+}
+
+/*********************************************************************************************
+ * open - recovers the stored state and starts a new log epoch to append to. Logs older than
+ *        the snapshot are left over from a checkpoint that crashed before cleaning up, and
+ *        are deleted. Logs after a corrupt one can't be applied in order, so they are set
+ *        aside as wal.<epoch>.corrupt.
+ *
+ *    Params:  dir - directory holding the snapshot and logs
+ *             snapshot - loaded with the snapshot, empty if there is none yet
+ *             replay - called with every record logged after the snapshot, in order
+ *
+ *    Returns: number of records replayed
+ *
+ *    Throws: walfile_error if the directory can't be used or the snapshot is corrupt
+ *********************************************************************************************/
+size_t WriteAheadLog::open(const char *dir, std::vector<uint8_t> &snapshot,
+                           const std::function<void(const uint8_t *rec, size_t len)> &replay) {
+   if (isOpen())
+      throw walfile_error("Write-ahead log is already open");
+
+   _dir = dir;
+   if ((mkdir(dir, 0755) == -1) && (errno != EEXIST))
+      throw walfile_error(errStr("Unable to create", _dir));
+
+   // The snapshot is written atomically, so if it's there it must be whole
+   uint64_t snap_epoch = 0;
+   std::vector<uint8_t> file;
+   snapshot.clear();
+   if (readFile(_dir + "/snapshot", file)) {
+      uint64_t body_len;
+      uint32_t sum;
+      if (!checkHeader(file, snap_magic, snap_epoch) || (file.size() < file_hdr_size + 12))
+         throw walfile_error("Snapshot file is corrupt");
+
+      memcpy(&body_len, file.data() + file_hdr_size, 8);
+      if (body_len != file.size() - file_hdr_size - 12)
+         throw walfile_error("Snapshot file is corrupt");
+
+      const uint8_t *body = file.data() + file_hdr_size + 8;
+      memcpy(&sum, body + body_len, 4);
+      if (sum != checksum(body, body_len))
+         throw walfile_error("Snapshot file is corrupt");
+
+      snapshot.assign(body, body + body_len);
+      _snapshot_size = file.size();
+   }
+
+   // Replay the logs written since
+   size_t count = 0;
+   bool clean = true;
+   uint64_t next_epoch = snap_epoch;
+   for (uint64_t epoch : listLogs(_dir)) {
+      if (epoch < snap_epoch) {
+         unlink(logPath(epoch).c_str());
+         continue;
+      }
+
+      next_epoch = epoch + 1;
+      std::string path = logPath(epoch);
+      if (!clean) {
+         rename(path.c_str(), (path + ".corrupt").c_str());
+         continue;
+      }
+
+      // Cut a torn tail off so the log replays cleanly next time too
+      size_t valid_end;
+      clean = replayLog(epoch, replay, count, valid_end);
+      if (!clean && (valid_end < file_hdr_size))
+         unlink(path.c_str());
+      else if (!clean && (truncate(path.c_str(), valid_end) == -1))
+         throw walfile_error(errStr("Unable to truncate", path));
+   }
+
+   startLog(next_epoch);
+   _stopping = false;
+   _flusher = std::thread(&WriteAheadLog::flusher, this);
+   return count;
+}
+
+/*********************************************************************************************
+ * replayLog - reads a log and replays its records until the end or the first bad record
+ *
+ *    Params:  valid_end - set to the offset just past the last good record
+ *
+ *    Returns: false if it stopped at a bad record (a torn write, normally)
+ *********************************************************************************************/
+bool WriteAheadLog::replayLog(uint64_t epoch,
+                              const std::function<void(const uint8_t *, size_t)> &replay,
+                              size_t &count, size_t &valid_end) {
+   std::vector<uint8_t> log;
+   uint64_t hdr_epoch;
+
+   valid_end = 0;
+   if (!readFile(logPath(epoch), log) || !checkHeader(log, log_magic, hdr_epoch) ||
+                                                                  (hdr_epoch != epoch))
+      return false;
+
+   valid_end = file_hdr_size;
+   while (valid_end < log.size()) {
+      uint32_t len, sum;
+      size_t pos = valid_end + frame_hdr_size;
+      if (pos > log.size())
+         return false;
+      memcpy(&len, log.data() + valid_end, 4);
+      memcpy(&sum, log.data() + valid_end + 4, 4);
+
+      if ((len > max_record_size) || (pos + len > log.size()) ||
+                                     (checksum(log.data() + pos, len) != sum))
+         return false;
+
+      replay(log.data() + pos, len);
+      valid_end = pos + len;
+      count++;
+   }
+   return true;
+}
+
+/*********************************************************************************************
+ * startLog - creates the log file for an epoch, with its header synced to disk
+ *
+ *    Throws: walfile_error if the file can't be created
+ *********************************************************************************************/
+void WriteAheadLog::startLog(uint64_t epoch) {
+   std::string path = logPath(epoch);
+   int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+   if (fd == -1)
+      throw walfile_error(errStr("Unable to create", path));
+
+   std::vector<uint8_t> hdr;
+   putHeader(hdr, log_magic, epoch);
+   if (!writeAll(fd, hdr.data(), hdr.size()) || (fdatasync(fd) == -1)) {
+      ::close(fd);
+      throw walfile_error(errStr("Unable to write", path));
+   }
+   syncDir(_dir);
+
+   if (_log_fd != -1)
+      ::close(_log_fd);
+   _log_fd = fd;
+   _epoch = epoch;
+
+   std::lock_guard<std::mutex> lock(_buf_mutex);
+   _log_size = hdr.size();
+}
+
+/*********************************************************************************************
+ * append - frames a record and adds it to the pending buffer. Never blocks on disk I/O.
+ *********************************************************************************************/
+void WriteAheadLog::append(const uint8_t *rec, size_t len) {
+   uint32_t len32 = len;
+   uint32_t sum = checksum(rec, len);
+
+   std::lock_guard<std::mutex> lock(_buf_mutex);
+   if (_failed)
+      return;
+
+   _pending.insert(_pending.end(), (uint8_t *) &len32, (uint8_t *) &len32 + 4);
+   _pending.insert(_pending.end(), (uint8_t *) &sum, (uint8_t *) &sum + 4);
+   _pending.insert(_pending.end(), rec, rec + len);
+   _appended += frame_hdr_size + len;
+
+   if (_pending.size() >= early_commit_bytes)
+      _commit_cv.notify_one();
+}
+
+/*********************************************************************************************
+ * commitPending - writes the pending buffer to the current log and syncs it. A failed write
+ *                 leaves the log unusable, so it's reported once and sync() throws after.
+ *********************************************************************************************/
+void WriteAheadLog::commitPending() {
+   std::vector<uint8_t> batch;
+   uint64_t target;
+   {
+      std::lock_guard<std::mutex> lock(_buf_mutex);
+      if ((_pending.size() == 0) || _failed)
+         return;
+      batch.swap(_pending);
+      target = _appended;
+   }
+
+   bool ok = writeAll(_log_fd, batch.data(), batch.size()) && (fdatasync(_log_fd) == 0);
+
+   std::lock_guard<std::mutex> lock(_buf_mutex);
+   if (ok) {
+      _committed = target;
+      _log_size += batch.size();
+   } else {
+      std::cerr << errStr("Write-ahead log commit failed for", logPath(_epoch)) << "\n";
+      _failed = true;
+   }
+   _synced_cv.notify_all();
+}
+
+/*********************************************************************************************
+ * flusher - background thread, commits whatever has been appended every _commit_ms
+ *********************************************************************************************/
+void WriteAheadLog::flusher() {
+   std::unique_lock<std::mutex> lock(_buf_mutex);
+   while (!_stopping) {
+      _commit_cv.wait_for(lock, std::chrono::milliseconds(_commit_ms));
+      lock.unlock();
+      {
+         std::lock_guard<std::mutex> io_lock(_io_mutex);
+         commitPending();
+      }
+      lock.lock();
+   }
+}
+
+/*********************************************************************************************
+ * sync - commits everything appended so far on the calling thread
+ *
+ *    Throws: walfile_error if the log can no longer be written
+ *********************************************************************************************/
+void WriteAheadLog::sync() {
+   {
+      std::lock_guard<std::mutex> io_lock(_io_mutex);
+      commitPending();
+   }
+
+   std::lock_guard<std::mutex> lock(_buf_mutex);
+   if (_failed)
+      throw walfile_error("Write-ahead log can no longer be written");
+}
+
+/*********************************************************************************************
+ * rotate - commits the current log and starts the next epoch's. The caller must not append
+ *          concurrently, so the rotation lines up exactly with the state it snapshots.
+ *
+ *    Returns: the new epoch, to pass to writeSnapshot
+ *********************************************************************************************/
+uint64_t WriteAheadLog::rotate() {
+   std::lock_guard<std::mutex> io_lock(_io_mutex);
+   commitPending();
+   startLog(_epoch + 1);
+   return _epoch;
+}
+
+/*********************************************************************************************
+ * writeSnapshot - writes the snapshot to a temp file, syncs it and renames it into place, then
+ *                 deletes the logs it covers. Can run while appends continue.
+ *
+ *    Params:  snapshot - the owner's state as of the start of epoch
+ *             epoch - returned by the rotate() done when the state was captured
+ *
+ *    Throws: walfile_error if the snapshot can't be written (the old one stays in effect)
+ *********************************************************************************************/
+void WriteAheadLog::writeSnapshot(const std::vector<uint8_t> &snapshot, uint64_t epoch) {
+   std::vector<uint8_t> file;
+   uint64_t body_len = snapshot.size();
+   uint32_t sum = checksum(snapshot.data(), snapshot.size());
+
+   file.reserve(file_hdr_size + 12 + snapshot.size());
+   putHeader(file, snap_magic, epoch);
+   file.insert(file.end(), (uint8_t *) &body_len, (uint8_t *) &body_len + 8);
+   file.insert(file.end(), snapshot.begin(), snapshot.end());
+   file.insert(file.end(), (uint8_t *) &sum, (uint8_t *) &sum + 4);
+
+   std::string path = _dir + "/snapshot";
+   std::string tmp = path + ".tmp";
+   int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd == -1)
+      throw walfile_error(errStr("Unable to create", tmp));
+
+   if (!writeAll(fd, file.data(), file.size()) || (fdatasync(fd) == -1)) {
+      ::close(fd);
+      throw walfile_error(errStr("Unable to write", tmp));
+   }
+   ::close(fd);
+
+   if (rename(tmp.c_str(), path.c_str()) == -1)
+      throw walfile_error(errStr("Unable to rename", tmp));
+   syncDir(_dir);
+   _snapshot_size = file.size();
+
+   for (uint64_t old : listLogs(_dir)) {
+      if (old < epoch)
+         unlink(logPath(old).c_str());
+   }
+}
+
+size_t WriteAheadLog::getLogSize() {
+   std::lock_guard<std::mutex> lock(_buf_mutex);
+   return _log_size + _pending.size();
+}
+
+/*********************************************************************************************
+ * close - stops the commit thread, commits what's left and closes the log
+ *********************************************************************************************/
+void WriteAheadLog::close() {
+   if (!isOpen())
+      return;
+
+   {
+      std::lock_guard<std::mutex> lock(_buf_mutex);
+      _stopping = true;
+   }
+   _commit_cv.notify_one();
+   _flusher.join();
+
+   std::lock_guard<std::mutex> io_lock(_io_mutex);
+   commitPending();
+   ::close(_log_fd);
+   _log_fd = -1;
+}
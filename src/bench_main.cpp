@@ -0,0 +1,355 @@
+/****************************************************************************************
+ * bench_main - microbenchmarks of the hot paths (Google Benchmark). Build with
+ *              "make bench" and run from the directory repsvr runs in--the deconfliction
+ *              benchmarks need servers.txt and sharedkey.bin, and are skipped without
+ *              them. Usual Google Benchmark flags apply, e.g. --benchmark_filter=CSV
+ *
+ ****************************************************************************************/
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <unistd.h>
+#include <benchmark/benchmark.h>
+#include <crypto++/secblock.h>
+#include <crypto++/osrng.h>
+#include "DronePlotDB.h"
+#include "ReplServer.h"
+#include "TCPConn.h"
+#include "LogMgr.h"
+
+// Files the load benchmarks write their data to (in /tmp, removed after)
+const char *bench_bin = "/tmp/repsvr_bench.bin";
+const char *bench_csv = "/tmp/repsvr_bench.csv";
+
+// Database sizes for the benchmarks that scale with it
+const int64_t small_rows = 1000, mid_rows = 10000, large_rows = 100000;
+
+/*****************************************************************************************
+ * makePlots - a repeatable set of plots that looks like a recording: a few drones, a few
+ *             nodes, one plot per drone per second, each drone wandering from its start
+ *****************************************************************************************/
+
+static std::vector<DronePlot> makePlots(size_t count, unsigned int node_id = 1) {
+   std::vector<DronePlot> plots;
+   plots.reserve(count);
+
+   uint32_t rnd = 12345;
+   float lat[10], lon[10];
+   for (unsigned int d=0; d<10; d++) {
+      lat[d] = 38.0f + d * 0.01f;
+      lon[d] = -77.0f - d * 0.01f;
+   }
+
+   for (size_t i=0; i<count; i++) {
+      unsigned int drone = i % 10;
+      rnd = rnd * 1103515245 + 12345;
+      lat[drone] += ((rnd >> 16) % 200 - 100) * 1e-6f;
+      lon[drone] += ((rnd >> 8) % 200 - 100) * 1e-6f;
+      plots.emplace_back(drone + 1, node_id, 1000000 + static_cast<int>(i / 10), lat[drone],
+                                                                                 lon[drone]);
+   }
+   return plots;
+}
+
+static void fillDB(DronePlotDB &db, const std::vector<DronePlot> &plots, unsigned short flags = 0) {
+   for (auto &plot : plots)
+      db.addPlot(plot.drone_id, plot.node_id, plot.timestamp, plot.latitude, plot.longitude, flags);
+}
+
+// A replication batch as ReplServer marshalls it: count, then the serialized plots
+static std::vector<uint8_t> makeBatch(std::vector<DronePlot> &plots) {
+   uint32_t count = plots.size();
+   std::vector<uint8_t> batch(sizeof(count));
+   memcpy(batch.data(), &count, sizeof(count));
+   for (auto &plot : plots)
+      plot.serialize(batch);
+   return batch;
+}
+
+/*****************************************************************************************
+ * Plot encoding
+ *****************************************************************************************/
+
+static void BM_Serialize(benchmark::State &state) {
+   std::vector<DronePlot> plots = makePlots(1000);
+   std::vector<uint8_t> buf;
+   buf.reserve(plots.size() * DronePlot::getDataSize());
+
+   for (auto _ : state) {
+      buf.clear();
+      for (auto &plot : plots)
+         plot.serialize(buf);
+      benchmark::DoNotOptimize(buf.data());
+   }
+   state.SetItemsProcessed(state.iterations() * plots.size());
+}
+BENCHMARK(BM_Serialize);
+
+static void BM_Deserialize(benchmark::State &state) {
+   std::vector<DronePlot> plots = makePlots(1000);
+   std::vector<uint8_t> buf;
+   for (auto &plot : plots)
+      plot.serialize(buf);
+
+   DronePlot plot;
+   for (auto _ : state) {
+      for (size_t i=0; i<plots.size(); i++) {
+         plot.deserialize(buf.data() + i * DronePlot::getDataSize());
+         benchmark::DoNotOptimize(plot);
+      }
+   }
+   state.SetItemsProcessed(state.iterations() * plots.size());
+}
+BENCHMARK(BM_Deserialize);
+
+static void BM_WriteCSV(benchmark::State &state) {
+   std::vector<DronePlot> plots = makePlots(1000);
+   char buf[DronePlot::max_csv_row];
+
+   for (auto _ : state) {
+      for (auto &plot : plots) {
+         plot.writeCSV(buf);
+         benchmark::DoNotOptimize(buf);
+      }
+   }
+   state.SetItemsProcessed(state.iterations() * plots.size());
+}
+BENCHMARK(BM_WriteCSV);
+
+static void BM_ReadCSV(benchmark::State &state) {
+   std::vector<DronePlot> plots = makePlots(1000);
+   std::vector<std::string> rows(plots.size());
+   for (size_t i=0; i<plots.size(); i++)
+      plots[i].writeCSV(rows[i]);
+
+   DronePlot plot;
+   for (auto _ : state) {
+      for (auto &row : rows) {
+         plot.readCSV(row.data(), row.size());
+         benchmark::DoNotOptimize(plot);
+      }
+   }
+   state.SetItemsProcessed(state.iterations() * rows.size());
+}
+BENCHMARK(BM_ReadCSV);
+
+/*****************************************************************************************
+ * Whole-file loads. Args are rows and threads (0 = one per core).
+ *****************************************************************************************/
+
+static void BM_LoadBinaryFile(benchmark::State &state) {
+   {
+      DronePlotDB src;
+      fillDB(src, makePlots(state.range(0)));
+      src.writeBinaryFile(bench_bin);
+   }
+
+   for (auto _ : state) {
+      DronePlotDB db;
+      if (db.loadBinaryFile(bench_bin, state.range(1)) != state.range(0)) {
+         state.SkipWithError("Binary load came up short");
+         break;
+      }
+   }
+   state.SetItemsProcessed(state.iterations() * state.range(0));
+   unlink(bench_bin);
+}
+BENCHMARK(BM_LoadBinaryFile)->Args({mid_rows, 1})->Args({large_rows, 1})->Args({large_rows, 0})
+                            ->Unit(benchmark::kMillisecond);
+
+static void BM_LoadCSVFile(benchmark::State &state) {
+   {
+      DronePlotDB src;
+      fillDB(src, makePlots(state.range(0)));
+      src.writeCSVFile(bench_csv);
+   }
+
+   for (auto _ : state) {
+      DronePlotDB db;
+      if (db.loadCSVFile(bench_csv, state.range(1)) != state.range(0)) {
+         state.SkipWithError("CSV load came up short");
+         break;
+      }
+   }
+   state.SetItemsProcessed(state.iterations() * state.range(0));
+   unlink(bench_csv);
+}
+BENCHMARK(BM_LoadCSVFile)->Args({mid_rows, 1})->Args({large_rows, 1})->Args({large_rows, 0})
+                         ->Unit(benchmark::kMillisecond);
+
+/*****************************************************************************************
+ * Connection encryption and framing, on messages of state.range(0) bytes
+ *****************************************************************************************/
+
+// Opens up TCPConn's framing helpers
+class bench_conn : public TCPConn {
+public:
+   bench_conn(LogMgr &log, CryptoPP::SecByteBlock &key):TCPConn(log, key, 0) {};
+   using TCPConn::wrapCmd;
+   using TCPConn::getCmdData;
+};
+
+static LogMgr &benchLog() {
+   static LogMgr log("/dev/null", 0);
+   return log;
+}
+
+static CryptoPP::SecByteBlock &benchKey() {
+   static CryptoPP::SecByteBlock key(CryptoPP::AES::DEFAULT_KEYLENGTH);
+   static bool generated = false;
+   if (!generated) {
+      CryptoPP::AutoSeededRandomPool rng;
+      rng.GenerateBlock(key, key.size());
+      generated = true;
+   }
+   return key;
+}
+
+static void BM_EncryptData(benchmark::State &state) {
+   TCPConn conn(benchLog(), benchKey(), 0);
+   std::vector<uint8_t> msg(state.range(0), 'x');
+   std::vector<uint8_t> buf;
+
+   for (auto _ : state) {
+      buf = msg;
+      conn.encryptData(buf);
+      benchmark::DoNotOptimize(buf.data());
+   }
+   state.SetBytesProcessed(state.iterations() * msg.size());
+}
+BENCHMARK(BM_EncryptData)->Arg(1024)->Arg(64 * 1024)->Arg(1024 * 1024);
+
+static void BM_DecryptData(benchmark::State &state) {
+   TCPConn conn(benchLog(), benchKey(), 0);
+   std::vector<uint8_t> encrypted(state.range(0), 'x');
+   conn.encryptData(encrypted);
+   std::vector<uint8_t> buf;
+
+   for (auto _ : state) {
+      buf = encrypted;
+      conn.decryptData(buf);
+      benchmark::DoNotOptimize(buf.data());
+   }
+   state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_DecryptData)->Arg(1024)->Arg(64 * 1024)->Arg(1024 * 1024);
+
+static void BM_CmdFraming(benchmark::State &state) {
+   static constexpr cmd_tag start = {"<REP>", 5}, end = {"</REP>", 6};
+   bench_conn conn(benchLog(), benchKey());
+   std::vector<uint8_t> msg(state.range(0), 'x');
+   std::vector<uint8_t> buf;
+
+   for (auto _ : state) {
+      buf = msg;
+      conn.wrapCmd(buf, start, end);
+      if (!conn.getCmdData(buf, start, end)) {
+         state.SkipWithError("Framed data did not unwrap");
+         break;
+      }
+      benchmark::DoNotOptimize(buf.data());
+   }
+   state.SetBytesProcessed(state.iterations() * msg.size());
+}
+BENCHMARK(BM_CmdFraming)->Arg(1024)->Arg(64 * 1024)->Arg(1024 * 1024);
+
+/*****************************************************************************************
+ * Database upkeep at 1k/10k/100k rows
+ *****************************************************************************************/
+
+static void BM_AddPlot(benchmark::State &state) {
+   std::vector<DronePlot> plots = makePlots(state.range(0));
+
+   for (auto _ : state) {
+      DronePlotDB db;
+      fillDB(db, plots);
+      benchmark::DoNotOptimize(db.size());
+   }
+   state.SetItemsProcessed(state.iterations() * plots.size());
+}
+BENCHMARK(BM_AddPlot)->Arg(small_rows)->Arg(mid_rows)->Arg(large_rows)
+                     ->Unit(benchmark::kMillisecond);
+
+static void BM_SortByTime(benchmark::State &state) {
+   // Nodes report out of step with each other, so interleave three nodes' plots
+   std::vector<DronePlot> plots;
+   for (unsigned int node=1; node<=3; node++) {
+      std::vector<DronePlot> node_plots = makePlots(state.range(0) / 3, node);
+      plots.insert(plots.end(), node_plots.begin(), node_plots.end());
+   }
+
+   for (auto _ : state) {
+      state.PauseTiming();
+      DronePlotDB db;
+      fillDB(db, plots);
+      state.ResumeTiming();
+
+      db.sortByTime();
+   }
+   state.SetItemsProcessed(state.iterations() * plots.size());
+}
+BENCHMARK(BM_SortByTime)->Arg(small_rows)->Arg(mid_rows)->Arg(large_rows)
+                        ->Unit(benchmark::kMillisecond);
+
+/*****************************************************************************************
+ * Deconfliction passes at 1k/10k/100k rows. ReplServer needs servers.txt and the key.
+ *****************************************************************************************/
+
+// Deconflicts a batch from node 2 against the same plots, 2 seconds off, already in from node 1
+static void BM_DeconflictReplicated(benchmark::State &state) {
+   std::vector<DronePlot> first = makePlots(state.range(0), 1);
+   std::vector<DronePlot> second = makePlots(state.range(0), 2);
+   for (auto &plot : second)
+      plot.timestamp += 2;
+   std::vector<uint8_t> first_batch = makeBatch(first);
+   std::vector<uint8_t> second_batch = makeBatch(second);
+
+   try {
+      for (auto _ : state) {
+         state.PauseTiming();
+         DronePlotDB db;
+         SimClock clock;
+         ReplServer repl(db, clock);
+         std::vector<uint8_t> data = first_batch;
+         repl.addReplDronePlots(data);
+         data = second_batch;
+         state.ResumeTiming();
+
+         repl.addReplDronePlots(data);
+      }
+   } catch (std::runtime_error &e) {
+      state.SkipWithError(e.what());
+   }
+   state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_DeconflictReplicated)->Arg(small_rows)->Arg(mid_rows)->Arg(large_rows)
+                                  ->Unit(benchmark::kMillisecond);
+
+// Picks up and deconflicts a database full of plots the antenna just added
+static void BM_DeconflictLocal(benchmark::State &state) {
+   std::vector<DronePlot> plots = makePlots(state.range(0), 1);
+
+   try {
+      for (auto _ : state) {
+         state.PauseTiming();
+         DronePlotDB db;
+         fillDB(db, plots, DBFLAG_NEW);
+         SimClock clock;
+         ReplServer repl(db, clock);
+         std::vector<uint8_t> marshall_data;
+         std::vector<int64_t> inject_times;
+         state.ResumeTiming();
+
+         repl.ingestLocalPlots(marshall_data, inject_times);
+      }
+   } catch (std::runtime_error &e) {
+      state.SkipWithError(e.what());
+   }
+   state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_DeconflictLocal)->Arg(small_rows)->Arg(mid_rows)->Arg(large_rows)
+                             ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,392 @@
+/****************************************************************************************
+ * clusterbench_main - end-to-end replication benchmark on loopback. Generates a synthetic
+ *                     drone trace for each of N nodes, runs N repsvr processes against them
+ *                     in a work directory and reports throughput, replication lag, CPU and
+ *                     peak RSS per node, and whether every node injected its whole trace and
+ *                     ended with the same database
+ *
+ ****************************************************************************************/
+
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <set>
+#include <tuple>
+#include <map>
+#include <cstring>
+#include <cmath>
+#include <getopt.h>
+#include <signal.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "FileDesc.h"
+#include "DronePlotDB.h"
+#include "SimClock.h"
+
+using namespace std;
+
+// How long past the end of the sim the nodes get to finish before they're killed (real secs)
+const unsigned int grace_secs = 60;
+
+// Sim seconds the nodes run past the end of the trace: the antenna's startup delay and clock
+// offset (up to 3 secs each) plus two replication rounds (20 secs each) to share the last plots
+const unsigned int run_tail_secs = 50;
+
+// Longest run repsvr takes (sim secs)
+const unsigned int max_run_secs = 1000;
+
+// A metrics interval long enough that repsvr only prints its snapshot at exit
+const char *exit_only_metrics = "86400";
+
+struct node_run {
+   pid_t pid = -1;
+   unsigned short port;
+   bool killed = false;
+   int status = 0;
+   struct rusage usage;
+
+   // From the node's final metrics snapshot
+   std::map<std::string, double> counters;
+   double lag_p50 = -1, lag_p90 = -1, lag_p99 = -1, lag_max = -1;
+
+   size_t rows = 0;
+};
+
+void displayHelp(const char *execname) {
+   std::cout << execname << " [options] [-- <extra repsvr args>]\n";
+   std::cout << "   n: number of nodes (default: 3, max 64)\n";
+   std::cout << "   D: number of drones (default: 10)\n";
+   std::cout << "   r: plots per drone per sim second (default: 1)\n";
+   std::cout << "   d: sim seconds of trace to run (default: 120, max " << max_run_secs - run_tail_secs
+             << ")\n";
+   std::cout << "   t: time multiplier for every node (default: 10)\n";
+   std::cout << "   p: port of the first node, the others count down from it (default: 9999)\n";
+   std::cout << "   w: work directory for the traces, configs and results (default: cluster_run)\n";
+   std::cout << "   x: repsvr binary (default: ./repsvr)\n";
+}
+
+/*****************************************************************************************
+ * writeTrace - every node sees every drone. Drones start spread around a point and wander,
+ *              reporting rate times each sim second from second 1 to duration.
+ *
+ *    Returns: plots written per node
+ *****************************************************************************************/
+
+size_t writeTrace(const std::string &dir, unsigned int nodes, unsigned int drones,
+                  unsigned int rate, unsigned int duration) {
+   std::vector<double> lat(drones), lon(drones);
+   srand48(4242);
+   for (unsigned int d=0; d<drones; d++) {
+      lat[d] = 38.80 + drand48() * 0.2;
+      lon[d] = -77.20 + drand48() * 0.2;
+   }
+
+   std::vector<DronePlot> track;
+   track.reserve(static_cast<size_t>(drones) * rate * duration);
+   for (unsigned int sec=1; sec<=duration; sec++) {
+      for (unsigned int r=0; r<rate; r++) {
+         for (unsigned int d=0; d<drones; d++) {
+            lat[d] += (drand48() - 0.5) * 0.0005;
+            lon[d] += (drand48() - 0.5) * 0.0005;
+            track.emplace_back(d + 1, 0, sec, static_cast<float>(lat[d]),
+                                                static_cast<float>(lon[d]));
+         }
+      }
+   }
+
+   for (unsigned int n=1; n<=nodes; n++) {
+      DronePlotDB db;
+      for (auto &plot : track)
+         db.addPlot(plot.drone_id, n, plot.timestamp, plot.latitude, plot.longitude);
+
+      std::string file = dir + "/trace" + std::to_string(n) + ".bin";
+      if (db.writeBinaryFile(file.c_str()) < 0)
+         throw std::runtime_error("Unable to write trace file " + file);
+   }
+   return track.size();
+}
+
+/*****************************************************************************************
+ * writeConfig - servers.txt for the cluster, a whitelist for loopback and a fresh key
+ *****************************************************************************************/
+
+void writeConfig(const std::string &dir, std::vector<node_run> &runs) {
+   std::ofstream servers(dir + "/servers.txt");
+   for (unsigned int n=0; n<runs.size(); n++)
+      servers << "DS" << (n + 1) << ", 127.0.0.1, " << runs[n].port << "\n";
+   if (!servers)
+      throw std::runtime_error("Unable to write servers.txt in " + dir);
+
+   std::ofstream whitelist(dir + "/whitelist");
+   whitelist << "127.0.0.1\n";
+
+   FileFD urandom("/dev/urandom");
+   std::vector<uint8_t> key;
+   if (!urandom.openFile(FileFD::readfd) || (urandom.readBytes<uint8_t>(key, 16) != 16))
+      throw std::runtime_error("Unable to read a key from /dev/urandom");
+
+   FileFD keyfile((dir + "/sharedkey.bin").c_str());
+   if (!keyfile.openFile(FileFD::writefd, true) || (keyfile.writeBytes<uint8_t>(key) != 16))
+      throw std::runtime_error("Unable to write sharedkey.bin in " + dir);
+}
+
+/*****************************************************************************************
+ * readMetrics - pulls the counters and the end-to-end lag out of the last metrics snapshot
+ *               in a node's output
+ *****************************************************************************************/
+
+void readMetrics(const std::string &logfile, node_run &run) {
+   std::ifstream log(logfile);
+   std::string line;
+   while (std::getline(log, line)) {
+      std::istringstream fields(line);
+      std::string name;
+      fields >> name;
+
+      if (name == "e2e_latency_us") {
+         std::string field;
+         while (fields >> field) {
+            size_t eq = field.find('=');
+            if (eq == std::string::npos)
+               continue;
+            double val = strtod(field.c_str() + eq + 1, NULL) / 1000.0;
+            std::string key = field.substr(0, eq);
+            if (key == "p50") run.lag_p50 = val;
+            else if (key == "p90") run.lag_p90 = val;
+            else if (key == "p99") run.lag_p99 = val;
+            else if (key == "max") run.lag_max = val;
+         }
+         continue;
+      }
+
+      double val;
+      if (!name.empty() && (name.find_first_of("=:-") == std::string::npos) && (fields >> val))
+         run.counters[name] = val;
+   }
+}
+
+// A stored plot as compared between nodes
+typedef std::tuple<unsigned int, int32_t, float, float> plot_id;
+
+std::set<plot_id> loadResult(const std::string &file) {
+   DronePlotDB db;
+   std::set<plot_id> plots;
+   if (db.loadCSVFile(file.c_str(), 1) < 0)
+      return plots;
+
+   for (auto &plot : db)
+      plots.insert(plot_id(plot.drone_id, plot.timestamp, plot.latitude, plot.longitude));
+   return plots;
+}
+
+double cpuSecs(const struct rusage &usage) {
+   return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+          usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+
+   unsigned int nodes = 3;
+   unsigned int drones = 10;
+   unsigned int rate = 1;
+   unsigned int duration = 120;
+   double time_mult = 10.0;
+   unsigned long base_port = 9999;
+   std::string work_dir = "cluster_run";
+   std::string repsvr = "./repsvr";
+
+   int c;
+   while ((c = getopt(argc, argv, "n:D:r:d:t:p:w:x:")) != -1) {
+      switch (c) {
+         case 'n':
+            nodes = strtoul(optarg, NULL, 10);
+            break;
+         case 'D':
+            drones = strtoul(optarg, NULL, 10);
+            break;
+         case 'r':
+            rate = strtoul(optarg, NULL, 10);
+            break;
+         case 'd':
+            duration = strtoul(optarg, NULL, 10);
+            break;
+         case 't':
+            time_mult = strtod(optarg, NULL);
+            break;
+         case 'p':
+            base_port = strtoul(optarg, NULL, 10);
+            break;
+         case 'w':
+            work_dir = optarg;
+            break;
+         case 'x':
+            repsvr = optarg;
+            break;
+         default:
+            displayHelp(argv[0]);
+            exit(0);
+      }
+   }
+
+   if ((nodes < 1) || (nodes > 64) || (drones < 1) || (rate < 1) || (duration < 2) ||
+       (duration + run_tail_secs > max_run_secs) || (time_mult <= 0.0) || (base_port < nodes) || (base_port > 65535)) {
+      std::cerr << "Invalid option value.\n";
+      displayHelp(argv[0]);
+      exit(0);
+   }
+
+   // repsvr runs in the work directory, so it needs an absolute path
+   char resolved[PATH_MAX];
+   if (realpath(repsvr.c_str(), resolved) == NULL) {
+      std::cerr << "Can't find the repsvr binary at " << repsvr << "\n";
+      exit(-1);
+   }
+   repsvr = resolved;
+
+   std::vector<std::string> extra_args(argv + optind, argv + argc);
+
+   std::vector<node_run> runs(nodes);
+   for (unsigned int n=0; n<nodes; n++)
+      runs[n].port = base_port - n;
+
+   size_t trace_plots;
+   try {
+      mkdir(work_dir.c_str(), 0755);
+      writeConfig(work_dir, runs);
+      std::cout << "Writing traces to " << work_dir << "\n";
+      trace_plots = writeTrace(work_dir, nodes, drones, rate, duration);
+   } catch (std::runtime_error &e) {
+      std::cerr << e.what() << "\n";
+      exit(-1);
+   }
+   std::cout << nodes << " nodes, " << drones << " drones, " << trace_plots << " plots per node over "
+             << duration << " sim secs at " << time_mult << "x" << std::endl;
+
+   // Launch the cluster (stdout was flushed above so the children don't repeat it). Each node
+   // runs long enough for its antenna to get through the whole trace and share the last plots.
+   unsigned int run_secs = duration + run_tail_secs;
+   std::string tmult_str = std::to_string(time_mult);
+   std::string dur_str = std::to_string(run_secs);
+   double start = SimClock::realSecs();
+   for (unsigned int n=0; n<nodes; n++) {
+      std::string num = std::to_string(n + 1);
+      std::vector<std::string> args = {repsvr, "-p", std::to_string(runs[n].port), "-t", tmult_str,
+                        "-d", dur_str, "-o", "out" + num + ".csv", "-M", exit_only_metrics};
+      args.insert(args.end(), extra_args.begin(), extra_args.end());
+      args.push_back("trace" + num + ".bin");
+
+      pid_t pid = fork();
+      if (pid < 0) {
+         std::cerr << "Unable to fork node " << num << "\n";
+         exit(-1);
+      }
+
+      if (pid == 0) {
+         std::string logfile = "node" + num + ".log";
+         if ((chdir(work_dir.c_str()) < 0) || (freopen(logfile.c_str(), "w", stdout) == NULL) ||
+             (dup2(fileno(stdout), fileno(stderr)) < 0))
+            _exit(127);
+
+         std::vector<char *> cargs;
+         for (auto &arg : args)
+            cargs.push_back(const_cast<char *>(arg.c_str()));
+         cargs.push_back(NULL);
+         execv(cargs[0], cargs.data());
+         _exit(127);
+      }
+      runs[n].pid = pid;
+   }
+
+   // Wait for them, killing any that hang well past the end of the sim
+   double deadline = start + run_secs / time_mult + grace_secs;
+   unsigned int running = nodes;
+   while (running > 0) {
+      for (auto &run : runs) {
+         if (run.pid < 0)
+            continue;
+         pid_t done = wait4(run.pid, &run.status, WNOHANG, &run.usage);
+         if (done == run.pid) {
+            run.pid = -1;
+            running--;
+         } else if (SimClock::realSecs() > deadline) {
+            kill(run.pid, SIGKILL);
+            run.killed = true;
+         }
+      }
+      if (running > 0)
+         usleep(50000);
+   }
+   double elapsed = SimClock::realSecs() - start;
+
+   // Gather the results
+   std::vector<std::set<plot_id>> results(nodes);
+   std::set<plot_id> all_plots;
+   for (unsigned int n=0; n<nodes; n++) {
+      std::string num = std::to_string(n + 1);
+      readMetrics(work_dir + "/node" + num + ".log", runs[n]);
+      results[n] = loadResult(work_dir + "/out" + num + ".csv");
+      runs[n].rows = results[n].size();
+      all_plots.insert(results[n].begin(), results[n].end());
+   }
+
+   char line[256];
+   std::cout << "\n";
+   snprintf(line, sizeof(line), "%-5s %6s %10s %10s %8s %8s %9s %9s %9s %9s %9s  %s\n", "node",
+                  "port", "injected", "replicated", "rows", "cpu_s", "rss_mb", "lag_p50", "lag_p90",
+                  "lag_p99", "lag_max", "exit");
+   std::cout << line;
+
+   double total_repl = 0, total_inject = 0, worst_p99 = 0;
+   for (unsigned int n=0; n<nodes; n++) {
+      node_run &run = runs[n];
+      std::string exit_str = run.killed ? "killed" :
+                             WIFEXITED(run.status) ? std::to_string(WEXITSTATUS(run.status)) :
+                             "signal " + std::to_string(WTERMSIG(run.status));
+      snprintf(line, sizeof(line),
+                  "DS%-3u %6u %10.0f %10.0f %8zu %8.2f %9.1f %9.1f %9.1f %9.1f %9.1f  %s\n",
+                  n + 1, run.port, run.counters["plots_injected"], run.counters["plots_replicated"],
+                  run.rows, cpuSecs(run.usage), run.usage.ru_maxrss / 1024.0, run.lag_p50,
+                  run.lag_p90, run.lag_p99, run.lag_max, exit_str.c_str());
+      std::cout << line;
+
+      total_inject += run.counters["plots_injected"];
+      total_repl += run.counters["plots_replicated"];
+      worst_p99 = std::max(worst_p99, run.lag_p99);
+   }
+
+   std::cout << "\nLag is antenna inject on the origin to insert on the receiver, in ms.\n";
+   snprintf(line, sizeof(line), "Wall time %.1f s, injected %.0f plots/s, replicated in %.0f plots/s, "
+                  "worst node p99 lag %.1f ms\n", elapsed, total_inject / elapsed,
+                  total_repl / elapsed, worst_p99);
+   std::cout << line;
+
+   // Every node should end up holding the same plots
+   unsigned int matching = 0;
+   for (unsigned int n=0; n<nodes; n++) {
+      if (results[n] == all_plots)
+         matching++;
+   }
+   std::cout << "Consistency: " << matching << " of " << nodes << " nodes hold all " << all_plots.size()
+             << " distinct plots" << ((matching == nodes) ? " (consistent)\n" : "\n");
+
+   // Nodes agreeing means little if they stopped before their antennas got through the trace
+   unsigned int truncated = 0;
+   for (unsigned int n=0; n<nodes; n++) {
+      double injected = runs[n].counters["plots_injected"];
+      if (injected < trace_plots) {
+         std::cout << "Truncated: DS" << (n + 1) << " injected " << injected << " of its "
+                   << trace_plots << " trace plots\n";
+         truncated++;
+      }
+   }
+
+   return ((matching == nodes) && (truncated == 0)) ? 0 : 1;
+}
@@ -8,6 +8,7 @@
 
 #include <stdexcept>
 #include <iostream>
+#include <getopt.h>
 #include "FileDesc.h"
 #include "DronePlotDB.h"
 #include "strfuncts.h"
@@ -15,7 +16,8 @@
 using namespace std; 
 
 void displayHelp(const char *execname) {
-   std::cout << execname << " <input file> <output file> <NodeID>\n";
+   std::cout << execname << " [-l] <input file> <output file> <NodeID>\n";
+   std::cout << "   l: write the legacy headerless format instead of an indexed archive\n";
 //   std::cout << "   t: maximum number of threads to use\n";
 //   std::cout << "   n: calculate primes up to the given range\n";
 //   std::cout << "   s: only run in single process mode\n";
@@ -26,17 +28,32 @@ void displayHelp(const char *execname) {
 
 int main(int argc, char *argv[]) {
 
+   bool legacy = false;
+
    // Check the command line input
-   if (argc < 4) {
+   int c;
+   while ((c = getopt(argc, argv, "l")) != -1) {
+      switch (c) {
+         case 'l':
+            legacy = true;
+            break;
+
+         default:
+            displayHelp(argv[0]);
+            exit(0);
+      }
+   }
+
+   if (argc - optind < 3) {
       displayHelp(argv[0]);
       exit(0);
    }
 
    // Get the filenames for the input and output file
-   std::string input_file(argv[1]);
-   std::string output_file(argv[2]);
+   std::string input_file(argv[optind]);
+   std::string output_file(argv[optind + 1]);
    
-   unsigned long node_id = strtol(argv[3], NULL, 10);
+   unsigned long node_id = strtol(argv[optind + 2], NULL, 10);
 
    std::cout << "Filtering to only node: " << node_id << "\n";
 
@@ -50,10 +67,7 @@ int main(int argc, char *argv[]) {
    }
 
    // Filter by NodeID
-   for (unsigned int i=1; i<=3; i++) {
-      if (i != node_id)
-         db.removeNodeID(i);
-   }
+   db.keepNodeID(node_id);
 
    if (count == 0) {
       std::cout << "No data points in the file. Exiting without writing to output file.\n";
@@ -64,7 +78,7 @@ int main(int argc, char *argv[]) {
    std::cout << "Size: " << db.size() << "\n";
 
    std::cout << "Writing to: " << output_file.c_str() << "\n";
-   if (db.writeBinaryFile(output_file.c_str()) < 0) {
+   if (db.writeBinaryFile(output_file.c_str(), legacy) < 0) {
       std::cerr << "Unable to open output file for writing.\n";
       exit(-1);
    }
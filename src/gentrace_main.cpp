@@ -0,0 +1,330 @@
+/****************************************************************************************
+ * gentrace_main - generates synthetic drone traces for load testing. Drones fly around a
+ *                 strip of ground split into one cell per node and each node's antenna sees
+ *                 the drones over its cell, plus however far its coverage reaches into its
+ *                 neighbours'. Each node gets its own clock skew and drops a share of its
+ *                 detections. Plots are written as they're generated, one CSV and/or binary
+ *                 archive per node, so a trace can be far bigger than memory.
+ *
+ ****************************************************************************************/
+
+#include <stdexcept>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <random>
+#include <limits>
+#include <cmath>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include "FileDesc.h"
+#include "DronePlotDB.h"
+#include "PlotArchive.h"
+
+using namespace std;
+
+// The strip starts here and runs east, one cell per node
+const double origin_lat = 39.70;
+const double origin_lon = -84.20;
+const double cell_m = 5000.0;
+const double strip_depth_m = 5000.0;
+
+const double meters_per_deg_lat = 111320.0;
+
+// Drones cruise at a speed picked between these (m/s) and wander off course by about this
+// many radians per sqrt(second)
+const double min_speed = 5.0;
+const double max_speed = 25.0;
+const double turn_rate = 0.3;
+
+// Each output buffers this much before writing
+const size_t out_buf_size = 256 * 1024;
+
+/*****************************************************************************************
+ * node_output - a node's antenna: its coverage, clock and the files its plots go to
+ *****************************************************************************************/
+struct node_output {
+   double min_x, max_x;          // Coverage along the strip, in meters from the origin
+   int skew;                     // Added to every timestamp this node writes
+   uint64_t written = 0;
+   uint64_t lost = 0;
+
+   std::unique_ptr<FileFD> csv_file;
+   std::vector<char> csv_buf;
+   size_t csv_used = 0;
+
+   std::unique_ptr<FileFD> bin_file;
+   std::vector<uint8_t> bin_buf;
+   PlotArchiveWriter archive;
+};
+
+struct drone_state {
+   double x, y;                  // Meters from the origin
+   double heading;
+   double speed;
+};
+
+void displayHelp(const char *execname) {
+   std::cout << execname << " [options] <output prefix>\n";
+   std::cout << "   Writes <prefix>N<node>.csv and/or <prefix>N<node>.bin for each node\n";
+   std::cout << "   n: number of nodes (default: 3)\n";
+   std::cout << "   D: number of drones (default: 10)\n";
+   std::cout << "   r: updates per drone per second, may be fractional (default: 0.2)\n";
+   std::cout << "   d: seconds of trace, timestamps start at 1 (default: 300)\n";
+   std::cout << "   o: coverage overlap in cells past a node's own; 0 means each point is seen by\n";
+   std::cout << "      one node, 1 by two, 2 * (nodes - 1) or more by all of them (default: 1)\n";
+   std::cout << "   s: maximum clock skew of a node in seconds, node 1 is always exact (default: 0)\n";
+   std::cout << "   l: percent of detections each node loses (default: 0)\n";
+   std::cout << "   f: output format, csv, bin or both (default: both)\n";
+   std::cout << "   S: random seed (default: 1)\n";
+}
+
+/*****************************************************************************************
+ * writeAll - writes a block to a file, continuing after partial writes
+ *
+ *    Throws: runtime_error on a write error
+ *****************************************************************************************/
+
+void writeAll(FileFD &outfile, const void *data, size_t len) {
+   const char *pos = static_cast<const char *>(data);
+   while (len > 0) {
+      ssize_t written = outfile.writeFD(pos, len);
+      if (written < 0) {
+         if (errno == EINTR)
+            continue;
+         throw std::runtime_error(std::string("Write failed: ") + strerror(errno));
+      }
+      pos += written;
+      len -= written;
+   }
+}
+
+/*****************************************************************************************
+ * emitPlot - formats a plot into a node's buffers, writing them out as they fill
+ *****************************************************************************************/
+
+void emitPlot(node_output &node, DronePlot &plot) {
+   if (node.csv_file) {
+      node.csv_used = plot.writeCSV(node.csv_buf.data() + node.csv_used) - node.csv_buf.data();
+      if (node.csv_used + DronePlot::max_csv_row > node.csv_buf.size()) {
+         writeAll(*node.csv_file, node.csv_buf.data(), node.csv_used);
+         node.csv_used = 0;
+      }
+   }
+
+   if (node.bin_file) {
+      node.archive.addPlot(plot, node.bin_buf);
+      if (node.bin_buf.size() >= out_buf_size) {
+         writeAll(*node.bin_file, node.bin_buf.data(), node.bin_buf.size());
+         node.bin_buf.clear();
+      }
+   }
+   node.written++;
+}
+
+/*****************************************************************************************
+ * finishNode - writes out what's left in a node's buffers and the archive's index
+ *****************************************************************************************/
+
+void finishNode(node_output &node) {
+   if (node.csv_file) {
+      writeAll(*node.csv_file, node.csv_buf.data(), node.csv_used);
+      node.csv_file->closeFD();
+   }
+
+   if (node.bin_file) {
+      node.archive.finish(node.bin_buf);
+      writeAll(*node.bin_file, node.bin_buf.data(), node.bin_buf.size());
+      node.bin_file->closeFD();
+   }
+}
+
+std::unique_ptr<FileFD> openOutput(const std::string &filename) {
+   std::unique_ptr<FileFD> file(new FileFD(filename.c_str()));
+   if (!file->openFile(FileFD::writefd, true))
+      throw std::runtime_error("Unable to open output file " + filename);
+   return file;
+}
+
+int main(int argc, char *argv[]) {
+
+   unsigned int nodes = 3;
+   unsigned int drones = 10;
+   double rate = 0.2;
+   unsigned long duration = 300;
+   double overlap = 1.0;
+   unsigned int max_skew = 0;
+   double loss_pct = 0.0;
+   bool write_csv = true, write_bin = true;
+   unsigned long seed = 1;
+
+   int c;
+   while ((c = getopt(argc, argv, "n:D:r:d:o:s:l:f:S:")) != -1) {
+      switch (c) {
+         case 'n':
+            nodes = strtoul(optarg, NULL, 10);
+            break;
+         case 'D':
+            drones = strtoul(optarg, NULL, 10);
+            break;
+         case 'r':
+            rate = strtod(optarg, NULL);
+            break;
+         case 'd':
+            duration = strtoul(optarg, NULL, 10);
+            break;
+         case 'o':
+            overlap = strtod(optarg, NULL);
+            break;
+         case 's':
+            max_skew = strtoul(optarg, NULL, 10);
+            break;
+         case 'l':
+            loss_pct = strtod(optarg, NULL);
+            break;
+         case 'f':
+            if (strcmp(optarg, "csv") == 0)
+               write_bin = false;
+            else if (strcmp(optarg, "bin") == 0)
+               write_csv = false;
+            else if (strcmp(optarg, "both") != 0) {
+               std::cerr << "Unknown output format " << optarg << "\n";
+               exit(-1);
+            }
+            break;
+         case 'S':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+         default:
+            displayHelp(argv[0]);
+            exit(0);
+      }
+   }
+
+   if (argc - optind < 1) {
+      displayHelp(argv[0]);
+      exit(0);
+   }
+   std::string prefix(argv[optind]);
+
+   // Timestamps are 32 bits in the CSV and the database
+   const unsigned long max_time = std::numeric_limits<int32_t>::max() - max_skew - 1;
+   if ((nodes < 1) || (drones < 1) || (rate <= 0.0) || (duration < 1) || (duration > max_time) ||
+       (overlap < 0.0) || (loss_pct < 0.0) || (loss_pct >= 100.0)) {
+      std::cerr << "Invalid option value.\n";
+      displayHelp(argv[0]);
+      exit(0);
+   }
+
+   std::mt19937_64 rng(seed);
+   std::uniform_real_distribution<double> unit(0.0, 1.0);
+   std::normal_distribution<double> normal(0.0, 1.0);
+
+   // Set up each node's coverage, clock and files
+   double strip_len = cell_m * nodes;
+   double reach = cell_m * (1.0 + overlap) / 2.0;
+   std::uniform_int_distribution<int> skew_dist(-static_cast<int>(max_skew), max_skew);
+
+   std::vector<node_output> outputs(nodes);
+   try {
+      for (unsigned int n=0; n<nodes; n++) {
+         node_output &node = outputs[n];
+         double center = cell_m * (n + 0.5);
+         node.min_x = center - reach;
+         node.max_x = center + reach;
+         node.skew = (n == 0) ? 0 : skew_dist(rng);
+
+         std::string base = prefix + "N" + std::to_string(n + 1);
+         if (write_csv) {
+            node.csv_file = openOutput(base + ".csv");
+            node.csv_buf.resize(out_buf_size);
+         }
+         if (write_bin) {
+            node.bin_file = openOutput(base + ".bin");
+            node.bin_buf.reserve(out_buf_size + DronePlot::getDataSize());
+         }
+      }
+   } catch (std::runtime_error &e) {
+      std::cerr << e.what() << "\n";
+      exit(-1);
+   }
+
+   // Drones start anywhere on the strip heading anywhere
+   std::vector<drone_state> fleet(drones);
+   for (auto &drone : fleet) {
+      drone.x = unit(rng) * strip_len;
+      drone.y = unit(rng) * strip_depth_m;
+      drone.heading = unit(rng) * 2.0 * M_PI;
+      drone.speed = min_speed + unit(rng) * (max_speed - min_speed);
+   }
+
+   double dt = 1.0 / rate;
+   double turn_sd = turn_rate * sqrt(dt);
+   double loss = loss_pct / 100.0;
+   double meters_per_deg_lon = meters_per_deg_lat * cos(origin_lat * M_PI / 180.0);
+   uint64_t steps = static_cast<uint64_t>(ceil(duration * rate));
+   uint64_t report_every = std::max<uint64_t>(steps / 10, 1);
+
+   std::cout << "Generating " << steps << " updates of " << drones << " drones over " << duration
+             << " secs for " << nodes << " nodes\n";
+
+   try {
+      for (uint64_t step=0; step<steps; step++) {
+         int32_t timestamp = 1 + static_cast<int32_t>(step * dt);
+
+         for (unsigned int d=0; d<drones; d++) {
+            drone_state &drone = fleet[d];
+
+            // Wander, bouncing off the edges of the strip
+            drone.heading += normal(rng) * turn_sd;
+            drone.x += cos(drone.heading) * drone.speed * dt;
+            drone.y += sin(drone.heading) * drone.speed * dt;
+            if ((drone.x < 0.0) || (drone.x > strip_len)) {
+               drone.x = std::min(std::max(drone.x, 0.0), strip_len);
+               drone.heading = M_PI - drone.heading;
+            }
+            if ((drone.y < 0.0) || (drone.y > strip_depth_m)) {
+               drone.y = std::min(std::max(drone.y, 0.0), strip_depth_m);
+               drone.heading = -drone.heading;
+            }
+
+            float lat = static_cast<float>(origin_lat + drone.y / meters_per_deg_lat);
+            float lon = static_cast<float>(origin_lon + drone.x / meters_per_deg_lon);
+
+            for (unsigned int n=0; n<nodes; n++) {
+               node_output &node = outputs[n];
+               if ((drone.x < node.min_x) || (drone.x > node.max_x))
+                  continue;
+               if ((loss > 0.0) && (unit(rng) < loss)) {
+                  node.lost++;
+                  continue;
+               }
+               DronePlot plot(d + 1, n + 1, timestamp + node.skew, lat, lon);
+               emitPlot(node, plot);
+            }
+         }
+
+         if ((step + 1) % report_every == 0)
+            std::cout << "   " << (step + 1) * 100 / steps << "% (t=" << timestamp << ")\n";
+      }
+
+      for (auto &node : outputs)
+         finishNode(node);
+
+   } catch (std::runtime_error &e) {
+      std::cerr << e.what() << "\n";
+      exit(-1);
+   }
+
+   uint64_t total = 0;
+   for (unsigned int n=0; n<nodes; n++) {
+      std::cout << "Node " << (n + 1) << ": " << outputs[n].written << " plots, "
+                << outputs[n].lost << " lost, skew " << outputs[n].skew << "s\n";
+      total += outputs[n].written;
+   }
+   std::cout << "Wrote " << total << " plots\n";
+
+   return 0;
+}
@@ -0,0 +1,276 @@
+/****************************************************************************************
+ * replay_main - runs a whole cluster in one process on virtual time, as fast as the CPU
+ *               allows. Each trace file is one node's antenna. Injects, replication passes
+ *               and batch deliveries are events on a shared SimClock that jumps straight to
+ *               the next one, so there's no sleeping and the same inputs always give the
+ *               same databases. The network is a full mesh with a fixed delay.
+ *
+ *               It is a model for deconfliction and clock skew only: each node's DronePlotDB
+ *               and ReplServer ingest path are the real ones, but the antennas are stand-ins
+ *               for AntennaSim, and batches go straight from one ReplServer to another
+ *               without QueueMgr, TCPConn or a Disseminator. Use repsvr (or clusterbench)
+ *               to exercise those.
+ *
+ ****************************************************************************************/
+
+#include <stdexcept>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <queue>
+#include <memory>
+#include <random>
+#include <getopt.h>
+#include <time.h>
+#include "FileDesc.h"
+#include "DronePlotDB.h"
+#include "ReplServer.h"
+#include "SimClock.h"
+#include "Metrics.h"
+
+using namespace std;
+
+// A node: its database, replication server and what its antenna has left to inject
+struct replay_node {
+   DronePlotDB db;
+   std::unique_ptr<ReplServer> repl;
+   std::vector<DronePlot> injects;
+   size_t next = 0;
+};
+
+enum event_type { ev_inject, ev_repl, ev_deliver };
+
+// Events at the same sim time run in the order they were scheduled
+struct sim_event {
+   int64_t when;
+   uint64_t seq;
+   event_type type;
+   unsigned int node;
+   std::shared_ptr<const std::vector<uint8_t>> batch;
+
+   bool operator>(const sim_event &other) const {
+      return (when != other.when) ? (when > other.when) : (seq > other.seq);
+   }
+};
+
+typedef std::priority_queue<sim_event, std::vector<sim_event>, std::greater<sim_event>> event_queue;
+
+void displayHelp(const char *execname) {
+   std::cout << execname << " [options] <node 1 trace> <node 2 trace> ...\n";
+   std::cout << "   Models deconfliction only: the antennas are stand-ins and the network is direct\n";
+   std::cout << "   delivery between ReplServers, skipping AntennaSim, QueueMgr and TCPConn\n";
+   std::cout << "   Run where repsvr runs--the servers need servers.txt and sharedkey.bin\n";
+   std::cout << "   d: duration - seconds in \"sim time\" to run the sim (default: 900)\n";
+   std::cout << "   i: sim seconds between replications, may be fractional (default: 20)\n";
+   std::cout << "   l: network delay in sim milliseconds (default: 1)\n";
+   std::cout << "   t: time multiplier the latency metrics are scaled to (default: 1)\n";
+   std::cout << "   s: maximum antenna clock offset in seconds, drawn per node (default: 0)\n";
+   std::cout << "   S: random seed for the offsets (default: 1)\n";
+   std::cout << "   z: send compact plot batches\n";
+   std::cout << "   o: prefix of the per-node DB dump CSVs (default: replay)\n";
+   std::cout << "   M: print a metrics snapshot at the end\n";
+}
+
+/*****************************************************************************************
+ * injectDue - adds every plot the node's antenna has due by now, a stand-in for
+ *             AntennaSim::injectDue (which sleeps on its clock), and schedules the node's
+ *             next inject
+ *****************************************************************************************/
+
+void injectDue(replay_node &node, unsigned int n, SimClock &clock, event_queue &events,
+               uint64_t &seq) {
+   int64_t now = clock.now();
+   size_t first = node.next;
+   while ((node.next < node.injects.size()) &&
+          (node.injects[node.next].timestamp * SimClock::ns_per_sec <= now))
+      node.next++;
+
+   node.db.addPlots(&node.injects[first], node.next - first, DBFLAG_NEW, clock.wallNow());
+   Metrics::add(mc_plots_injected, node.next - first);
+
+   if (node.next < node.injects.size()) {
+      int64_t due = node.injects[node.next].timestamp * SimClock::ns_per_sec;
+      events.push({due, seq++, ev_inject, n, nullptr});
+   }
+}
+
+int main(int argc, char *argv[]) {
+
+   unsigned long sim_time = 900;
+   double repl_interval = 20.0;
+   double delay_ms = 1.0;
+   double time_mult = 1.0;
+   unsigned int max_offset = 0;
+   unsigned long seed = 1;
+   bool compress = false;
+   std::string out_prefix = "replay";
+   bool print_metrics = false;
+
+   int c;
+   while ((c = getopt(argc, argv, "d:i:l:t:s:S:zo:M")) != -1) {
+      switch (c) {
+         case 'd':
+            sim_time = strtoul(optarg, NULL, 10);
+            break;
+         case 'i':
+            repl_interval = strtod(optarg, NULL);
+            break;
+         case 'l':
+            delay_ms = strtod(optarg, NULL);
+            break;
+         case 't':
+            time_mult = strtod(optarg, NULL);
+            break;
+         case 's':
+            max_offset = strtoul(optarg, NULL, 10);
+            break;
+         case 'S':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+         case 'z':
+            compress = true;
+            break;
+         case 'o':
+            out_prefix = optarg;
+            break;
+         case 'M':
+            print_metrics = true;
+            break;
+         default:
+            displayHelp(argv[0]);
+            exit(0);
+      }
+   }
+
+   if ((argc - optind < 1) || (sim_time < 1) || (repl_interval <= 0.0) || (delay_ms < 0.0) ||
+       (time_mult <= 0.0)) {
+      displayHelp(argv[0]);
+      exit(0);
+   }
+
+   // Sim time stays at 0 until the event loop moves it
+   SimClock clock(time_mult);
+   clock.makeVirtual();
+   clock.start();
+
+   std::mt19937_64 rng(seed);
+   std::uniform_int_distribution<int> offset_dist(-static_cast<int>(max_offset), max_offset);
+
+   std::vector<std::unique_ptr<replay_node>> nodes;
+   try {
+      for (int i=optind; i<argc; i++) {
+         std::unique_ptr<replay_node> node(new replay_node);
+
+         DronePlotDB source;
+         if (source.loadBinaryFile(argv[i]) <= 0)
+            throw std::runtime_error(std::string("Trace ") + argv[i] + " could not be opened or was empty.");
+         source.sortByTime();
+         node->injects.assign(source.begin(), source.end());
+
+         int offset = offset_dist(rng);
+         for (auto &plot : node->injects)
+            plot.timestamp += offset;
+
+         node->repl.reset(new ReplServer(node->db, clock));
+         node->repl->setCompression(compress);
+
+         std::cout << "Node " << nodes.size() + 1 << ": " << node->injects.size() << " plots from "
+                   << argv[i] << ", antenna offset " << offset << " secs\n";
+         nodes.push_back(std::move(node));
+      }
+   } catch (std::runtime_error &e) {
+      std::cerr << e.what() << "\n";
+      exit(-1);
+   }
+
+   // Every antenna and replication server starts at sim time 0, like a cluster launched at once
+   event_queue events;
+   uint64_t seq = 0;
+   int64_t interval = static_cast<int64_t>(repl_interval * SimClock::ns_per_sec);
+   int64_t delay = static_cast<int64_t>(delay_ms * 1000000.0);
+   for (unsigned int n=0; n<nodes.size(); n++) {
+      if (!nodes[n]->injects.empty()) {
+         int64_t due = std::max<int64_t>(nodes[n]->injects[0].timestamp * SimClock::ns_per_sec, 0);
+         events.push({due, seq++, ev_inject, n, nullptr});
+      }
+      events.push({interval, seq++, ev_repl, n, nullptr});
+   }
+
+   double start = SimClock::realSecs();
+   int64_t end_ns = static_cast<int64_t>(sim_time) * SimClock::ns_per_sec;
+   uint64_t handled = 0;
+
+   try {
+      while (!events.empty() && (events.top().when <= end_ns)) {
+         sim_event ev = events.top();
+         events.pop();
+         clock.advanceTo(ev.when);
+         handled++;
+
+         replay_node &node = *nodes[ev.node];
+         switch (ev.type) {
+         case ev_inject:
+            injectDue(node, ev.node, clock, events, seq);
+            break;
+
+         // Pick up the new local plots and send them to every other node
+         case ev_repl: {
+            std::vector<uint8_t> batch;
+            if (node.repl->makeReplBatch(batch) > 0) {
+               std::shared_ptr<const std::vector<uint8_t>> shared(
+                                             new std::vector<uint8_t>(std::move(batch)));
+               for (unsigned int peer=0; peer<nodes.size(); peer++) {
+                  if (peer != ev.node)
+                     events.push({ev.when + delay, seq++, ev_deliver, peer, shared});
+               }
+            }
+            events.push({ev.when + interval, seq++, ev_repl, ev.node, nullptr});
+            break;
+         }
+
+         case ev_deliver: {
+            std::vector<uint8_t> batch(*ev.batch);
+            node.repl->addReplDronePlots(batch);
+            node.repl->applyCorrectionChanges();
+            Metrics::add(mc_batches_delivered);
+            break;
+         }
+         }
+      }
+      clock.advanceTo(end_ns);
+
+      // As at shutdown, plots injected since the last pass are deconflicted locally and
+      // batches still in flight are lost
+      for (auto &node : nodes) {
+         std::vector<uint8_t> unsent;
+         std::vector<int64_t> unsent_times;
+         node->repl->ingestLocalPlots(unsent, unsent_times);
+      }
+   } catch (std::runtime_error &e) {
+      std::cerr << "Replay failed at sim time " << clock.seconds() << ": " << e.what() << "\n";
+      exit(-1);
+   }
+   double elapsed = SimClock::realSecs() - start;
+
+   std::cout << "Replayed " << sim_time << " sim secs (" << handled << " events) in " << elapsed
+             << " secs, " << sim_time / std::max(elapsed, 1e-9) << "x real time\n";
+
+   if (print_metrics) {
+      std::string final_metrics;
+      Metrics::snapshot(final_metrics);
+      std::cout << final_metrics;
+   }
+
+   for (unsigned int n=0; n<nodes.size(); n++) {
+      std::string outfile = out_prefix + std::to_string(n + 1) + ".csv";
+      nodes[n]->db.sortByTime();
+      if (nodes[n]->db.writeCSVFile(outfile.c_str()) < 0) {
+         std::cerr << "Unable to write " << outfile << "\n";
+         exit(-1);
+      }
+      std::cout << "Node " << (n + 1) << ": " << nodes[n]->db.size() << " plots written to "
+                << outfile << "\n";
+   }
+
+   return 0;
+}
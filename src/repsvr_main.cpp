@@ -16,8 +16,12 @@
 #include "FileDesc.h"
 #include "DronePlotDB.h"
 #include "AntennaSim.h"
+#include "SimClock.h"
 #include "strfuncts.h"
 #include "ReplServer.h"
+#include "Dissemination.h"
+#include "TraceLog.h"
+#include "Metrics.h"
 
 using namespace std; 
 
@@ -64,7 +68,19 @@ void displayHelp(const char *execname) {
    std::cout << "   t: time multiplier - t=2.0 runs the sim at 2x speed\n";
    std::cout << "   o: the file to write the DB dump CSV to (default: replication_db.cv)\n";
    std::cout << "   d: duration - seconds in \"sim time\" to run the sim\n";
+   std::cout << "   i: sim seconds between replications, may be fractional (default: 20)\n";
    std::cout << "   v: verbosity - how much information to send to stdout (0-3, 3=max)\n";
+   std::cout << "   m: replication topology - mesh, tree or gossip (default: mesh)\n";
+   std::cout << "   f: fanout - peers each server forwards to for tree/gossip (default: 2)\n";
+   std::cout << "   S: seed for gossip's random peer picks, best unique per server (default: from clock)\n";
+   std::cout << "   z: send compact plot batches, compressed where both servers support it\n";
+   std::cout << "   w: directory to keep the DB in--recovered from it at startup, kept up to date\n";
+   std::cout << "   r: retention - evict plots more than this many sim seconds older than the newest\n";
+   std::cout << "   R: retention - keep at most this many plots, evicting the oldest\n";
+   std::cout << "   A: directory to roll evicted plots into as archive files (default: drop them)\n";
+   std::cout << "   T: record a binary trace of replication events and dump it to this file at exit\n";
+   std::cout << "   M: print a metrics snapshot every this many seconds (real time) and at exit\n";
+   std::cout << "   U: serve metrics snapshots on a Unix socket at this path\n";
 }
 
 
@@ -75,8 +91,20 @@ int main(int argc, char *argv[]) {
    float time_mult = 1.0;
    int verbosity = 0;
    int sim_time = 900; // Default 900 seconds
+   double repl_interval = 20.0;
    std::string ip_addr = "127.0.0.1";
    unsigned short port = 9999;
+   topology_type topology = topo_mesh;
+   unsigned int fanout = 2;
+   unsigned long gossip_seed = 0;
+   bool compress = false;
+   std::string wal_dir;
+   time_t max_age = 0;
+   size_t max_rows = 0;
+   std::string archive_dir;
+   std::string trace_file;
+   unsigned int metrics_secs = 0;
+   std::string metrics_socket;
 
    // Filename to write the replication output
    std::string outfile("replication_db.csv");
@@ -87,7 +115,7 @@ int main(int argc, char *argv[]) {
    // will appear in case 1
    unsigned long portval;
    int c = 0;
-   while ((c = getopt(argc, argv, "-o:t:v:d:p:a:")) != -1) {
+   while ((c = getopt(argc, argv, "-o:t:v:d:i:p:a:m:f:S:zw:r:R:A:T:M:U:")) != -1) {
       switch (c) {
 
       // The inject database file specified in the command line
@@ -143,6 +171,85 @@ int main(int argc, char *argv[]) {
          outfile = optarg;
          break;
 
+      // How replication batches spread through the cluster
+      case 'm':
+         if (!Disseminator::parseTopology(optarg, topology)) {
+            std::cerr << "Invalid topology. Options: mesh, tree, gossip\n";
+            exit(0);
+         }
+         break;
+
+      // Peers each server forwards a batch to
+      case 'f':
+         fanout = (unsigned int) strtol(optarg, NULL, 10);
+         if ((fanout < 1) || (fanout > 64)) {
+            std::cerr << "Invalid fanout. Range: 1 to 64\n";
+            exit(0);
+         }
+         break;
+
+      // Seed for gossip, so a run can be repeated
+      case 'S':
+         gossip_seed = strtoul(optarg, NULL, 10);
+         break;
+
+      // Compact, compressed replication batches
+      case 'z':
+         compress = true;
+         break;
+
+      // Persist the database with a write-ahead log
+      case 'w':
+         wal_dir = optarg;
+         break;
+
+      // Retention limits and where evicted plots go
+      case 'r':
+         max_age = (time_t) strtol(optarg, NULL, 10);
+         if (max_age < 1) {
+            std::cerr << "Invalid retention age. Must be at least 1 second\n";
+            exit(0);
+         }
+         break;
+
+      case 'R':
+         max_rows = (size_t) strtoul(optarg, NULL, 10);
+         if (max_rows < 1) {
+            std::cerr << "Invalid retention row count. Must be at least 1\n";
+            exit(0);
+         }
+         break;
+
+      case 'A':
+         archive_dir = optarg;
+         break;
+
+      // Trace replication events (read the dump with trcdump)
+      case 'T':
+         trace_file = optarg;
+         break;
+
+      // Periodic metrics and where to serve them
+      case 'M':
+         metrics_secs = (unsigned int) strtoul(optarg, NULL, 10);
+         if (metrics_secs < 1) {
+            std::cerr << "Invalid metrics interval. Must be at least 1 second\n";
+            exit(0);
+         }
+         break;
+
+      case 'U':
+         metrics_socket = optarg;
+         break;
+
+      case 'i':
+         repl_interval = strtod(optarg, NULL);
+         if (repl_interval <= 0.0) {
+            std::cerr << "Invalid replication interval. Must be > 0.\n";
+            exit(0);
+         }
+         break;
+
       case '?':
               displayHelp(argv[0]);
               break;
@@ -163,9 +270,44 @@ int main(int argc, char *argv[]) {
 
    DronePlotDB db;
 
+   // Recover the database from a previous run before anything else touches it
+   if (wal_dir.size() > 0) {
+      try {
+         size_t recovered = db.openWAL(wal_dir.c_str());
+         std::cout << "Recovered " << recovered << " plots from " << wal_dir << "\n";
+      } catch (walfile_error &e) {
+         std::cerr << "Unable to open the database in " << wal_dir << ": " << e.what() << "\n";
+         exit(0);
+      }
+   }
+
+   try {
+      db.setRetention(max_age, max_rows, archive_dir.c_str());
+   } catch (std::runtime_error &e) {
+      std::cerr << e.what() << "\n";
+      exit(0);
+   }
+
+   if (trace_file.size() > 0)
+      TraceLog::start();
+
+   Metrics::startReports(metrics_secs);
+   if (metrics_socket.size() > 0) {
+      try {
+         Metrics::serve(metrics_socket.c_str());
+      } catch (std::runtime_error &e) {
+         std::cerr << e.what() << "\n";
+         exit(0);
+      }
+   }
+
    // Kick off the simulation thread by creating the sim management object
    // This will raise a runtime_exception if the simdata database load fails
-   AntennaSim sim(db, simdata_file.c_str(), time_mult, verbosity);
+   SimClock clock(time_mult);
+   AntennaSim sim(db, simdata_file.c_str(), clock, verbosity);
+
+   // Sim time starts as the threads do
+   clock.start();
 
    // Launch the thread
    pthread_t simthread;
@@ -173,14 +315,18 @@ int main(int argc, char *argv[]) {
       throw std::runtime_error("Unable to create simulator thread");
 
    // Start the replication server
-   ReplServer repl_server(db, ip_addr.c_str(), port, time_mult, verbosity); 
+   ReplServer repl_server(db, ip_addr.c_str(), port, clock, verbosity); 
+   repl_server.setTopology(topology, fanout, gossip_seed);
+   repl_server.setCompression(compress);
+   repl_server.setReplInterval(repl_interval);
 
    pthread_t replthread;
    if (pthread_create(&replthread, NULL, t_replserver, (void *) &repl_server) != 0)
       throw std::runtime_error("Unable to create replication server thread");
 
    // Sleep the duration of the simulation
-   sleep(sim_time / time_mult);
+   while (!clock.sleepUntil(static_cast<int64_t>(sim_time) * SimClock::ns_per_sec))
+      ;
 
    // Stop the replication server
    repl_server.shutdown();
@@ -192,6 +338,25 @@ int main(int argc, char *argv[]) {
    pthread_join(simthread, NULL);
    pthread_join(replthread, NULL);
 
+   // Leave a fresh snapshot so the next start doesn't need to replay the log
+   db.closeWAL();
+
+   Metrics::stop();
+   if (metrics_secs > 0) {
+      std::string final_metrics;
+      Metrics::snapshot(final_metrics);
+      std::cout << final_metrics;
+   }
+
+   if (trace_file.size() > 0) {
+      try {
+         size_t events = TraceLog::dump(trace_file.c_str());
+         std::cout << "Wrote " << events << " trace events to: " << trace_file << "\n";
+      } catch (std::runtime_error &e) {
+         std::cerr << e.what() << "\n";
+      }
+   }
+
    // Write the replication database to a CSV file
    std::cout << "Writing results to: " << outfile << "\n";
    db.sortByTime();
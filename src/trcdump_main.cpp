@@ -0,0 +1,86 @@
+/****************************************************************************************
+ * trcdump_main - decodes a binary replication trace written by repsvr -T into CSV or
+ *                JSON (one object per line) on stdout
+ *
+ ****************************************************************************************/
+
+#include <stdexcept>
+#include <iostream>
+#include <string>
+#include <getopt.h>
+#include <string.h>
+#include "TraceLog.h"
+
+using namespace std;
+
+void displayHelp(const char *execname) {
+   std::cout << execname << " [-j] [-e <event>] <trace file>\n";
+   std::cout << "   j: write JSON lines instead of CSV\n";
+   std::cout << "   e: only show events of this type (e.g. batch_queued)\n";
+}
+
+
+int main(int argc, char *argv[]) {
+
+   bool json = false;
+   std::string only;
+
+   int c;
+   while ((c = getopt(argc, argv, "je:")) != -1) {
+      switch (c) {
+         case 'j':
+            json = true;
+            break;
+
+         case 'e':
+            only = optarg;
+            break;
+
+         default:
+            displayHelp(argv[0]);
+            exit(0);
+      }
+   }
+
+   if (argc - optind < 1) {
+      displayHelp(argv[0]);
+      exit(0);
+   }
+
+   TraceLog::file_info info;
+   std::vector<TraceLog::event> events;
+   try {
+      TraceLog::readFile(argv[optind], info, events);
+   } catch (std::runtime_error &e) {
+      std::cerr << e.what() << "\n";
+      exit(-1);
+   }
+
+   std::cerr << events.size() << " events, " << info.lost << " lost to the ring (" << info.slots <<
+                " slots)\n";
+
+   // Times are shown in ns since tracing started and as wall-clock ns since the epoch
+   if (!json)
+      std::cout << "ns,wall_ns,event,node,a,b,c\n";
+
+   for (auto &ev : events) {
+      const char *name = TraceLog::typeName(ev.type);
+      if (!only.empty() && (only != name))
+         continue;
+
+      int64_t rel = static_cast<int64_t>(ev.ns) - info.start_mono_ns;
+      int64_t wall = info.start_wall_ns + rel;
+      int node = (ev.node == TraceLog::no_node) ? -1 : ev.node;
+
+      if (json) {
+         std::cout << "{\"ns\":" << rel << ",\"wall_ns\":" << wall << ",\"event\":\"" << name <<
+                      "\",\"node\":" << node << ",\"a\":" << ev.a << ",\"b\":" << ev.b <<
+                      ",\"c\":" << ev.c << "}\n";
+      } else {
+         std::cout << rel << "," << wall << "," << name << "," << node << "," << ev.a << "," <<
+                      ev.b << "," << ev.c << "\n";
+      }
+   }
+
+   return 0;
+}